@@ -0,0 +1,148 @@
+﻿#include "Bench.h"
+#include "Allocator.h"
+#include "PoolOfBuffers.h"
+#include <memory>
+#include <vector>
+
+// Allocator and PoolOfBuffers : what every frame and every datagram pays
+// to get its memory, alone and with worker threads competing for it.
+
+namespace {
+
+	using tftplib::Allocator;
+
+	constexpr size_t ArenaSize = 0x400000;
+
+	bench::Body AllocFree(size_t size)
+	{
+		return [=](bench::State& state) {
+			Allocator allocator{ ArenaSize };
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				void* p = allocator.allocate(size);
+				bench::DoNotOptimize(p);
+				allocator.free(p);
+			}
+		};
+	}
+
+	// Many blocks live at once, released in allocation order.
+	bench::Body AllocBurst(size_t size, size_t burst)
+	{
+		return [=](bench::State& state) {
+			Allocator allocator{ ArenaSize };
+			std::vector<void*> blocks(burst);
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				for (void*& p : blocks)
+				{
+					p = allocator.allocate(size);
+				}
+				for (void* p : blocks)
+				{
+					allocator.free(p);
+				}
+			}
+		};
+	}
+
+	bench::Body AllocContended(size_t size)
+	{
+		auto shared = std::make_shared<bench::Shared<Allocator>>();
+		return [=](bench::State& state) {
+			Allocator& allocator = shared->Setup(state, ArenaSize);
+
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				void* p = allocator.allocate(size);
+				bench::DoNotOptimize(p);
+				allocator.free(p);
+			}
+
+			shared->Teardown(state);
+		};
+	}
+
+	using Pool = tftplib::PoolOfBuffers<0x800>;
+
+	bench::Body PoolAllocFree(size_t poolSize)
+	{
+		return [=](bench::State& state) {
+			Pool pool{ poolSize };
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				char* p = pool.Alloc();
+				bench::DoNotOptimize(p);
+				pool.Free(p);
+			}
+		};
+	}
+
+	// Every buffer but one in use : each Alloc() scans the whole pool.
+	bench::Body PoolNearlyFull(size_t poolSize)
+	{
+		return [=](bench::State& state) {
+			Pool pool{ poolSize };
+			std::vector<char*> held;
+			for (size_t i = 0; i + 1 < poolSize; ++i)
+			{
+				held.push_back(pool.Alloc());
+			}
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				char* p = pool.Alloc();
+				bench::DoNotOptimize(p);
+				pool.Free(p);
+			}
+			state.StopTimer();
+
+			for (char* p : held)
+			{
+				pool.Free(p);
+			}
+		};
+	}
+
+	bench::Body PoolContended(size_t poolSize)
+	{
+		auto shared = std::make_shared<bench::Shared<Pool>>();
+		return [=](bench::State& state) {
+			Pool& pool = shared->Setup(state, poolSize);
+
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				char* p = pool.Alloc();
+				bench::DoNotOptimize(p);
+				if (p)
+				{
+					pool.Free(p);
+				}
+			}
+
+			shared->Teardown(state);
+		};
+	}
+}
+
+BENCHMARK("allocator/alloc-free/16", AllocFree(16));
+BENCHMARK("allocator/alloc-free/516", AllocFree(516));
+BENCHMARK("allocator/alloc-free/1432", AllocFree(1432));
+BENCHMARK("allocator/alloc-free/65536", AllocFree(65536));
+BENCHMARK("allocator/burst-64/516", AllocBurst(516, 64));
+BENCHMARK("allocator/burst-64/1432", AllocBurst(1432, 64));
+BENCHMARK_THREADS("allocator/contended/516", AllocContended(516), 1, 2, 4, 8);
+
+BENCHMARK("pool/alloc-free/64", PoolAllocFree(64));
+BENCHMARK("pool/alloc-free/4096", PoolAllocFree(4096));
+BENCHMARK("pool/nearly-full/64", PoolNearlyFull(64));
+BENCHMARK("pool/nearly-full/1024", PoolNearlyFull(1024));
+BENCHMARK("pool/nearly-full/4096", PoolNearlyFull(4096));
+BENCHMARK_THREADS("pool/contended/256", PoolContended(256), 1, 2, 4, 8);
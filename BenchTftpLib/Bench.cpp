@@ -0,0 +1,237 @@
+﻿#include "Bench.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+// Count every global heap allocation, so benchmarks can report them.
+static std::atomic<uint64_t> allocations{ 0 };
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size == 0 ? 1 : size);
+	if (p == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace bench {
+
+	static int64_t NowNs()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count();
+	}
+
+	void State::Sync()
+	{
+		if (_barrier)
+		{
+			_barrier->arrive_and_wait();
+		}
+	}
+
+	void State::ResetTimer()
+	{
+		_allocStart = AllocationCount();
+		_stop = -1;
+		_start = NowNs();
+	}
+
+	void State::StopTimer()
+	{
+		_stop = NowNs();
+		_allocStop = AllocationCount();
+	}
+
+	uint64_t State::Allocations() const
+	{
+		return (_stop < 0 ? AllocationCount() : _allocStop) - _allocStart;
+	}
+
+	uint64_t AllocationCount()
+	{
+		return allocations.load(std::memory_order_relaxed);
+	}
+
+	int64_t State::ElapsedNs() const
+	{
+		return (_stop < 0 ? NowNs() : _stop) - _start;
+	}
+
+	std::vector<Case>& Registry()
+	{
+		static std::vector<Case> cases;
+		return cases;
+	}
+
+	static const void* volatile sink = nullptr;
+
+	void Consume(const void* p)
+	{
+		sink = p;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+	}
+
+	struct Run {
+		int64_t elapsed{ 0 };
+		uint64_t bytes{ 0 };
+		uint64_t allocs{ 0 };
+		std::string label{};
+	};
+
+	// Run a case once on all its threads. Allocations and bytes add up,
+	// elapsed is the slowest thread's.
+	static Run RunOnce(Case& c, uint64_t iterations)
+	{
+		if (c.threads <= 1)
+		{
+			State state{ iterations };
+			state.ResetTimer();
+			c.body(state);
+			return Run{ state.ElapsedNs(), state.BytesProcessed(), state.Allocations(),
+				state.Label() };
+		}
+
+		std::barrier<> barrier{ c.threads };
+		std::vector<Run> runs(c.threads);
+		std::vector<std::thread> threads;
+		for (uint32_t i = 0; i < c.threads; i++)
+		{
+			threads.emplace_back([&, i] {
+				State state{ iterations, c.threads, i, &barrier };
+				state.Sync();
+				state.ResetTimer();
+				c.body(state);
+				runs[i] = Run{ state.ElapsedNs(), state.BytesProcessed(),
+					state.Allocations(), state.Label() };
+			});
+		}
+
+		Run total{};
+		for (uint32_t i = 0; i < c.threads; i++)
+		{
+			threads[i].join();
+			total.elapsed = std::max(total.elapsed, runs[i].elapsed);
+			total.bytes += runs[i].bytes;
+		}
+
+		// Every thread sees the global allocation counter.
+		total.allocs = runs[0].allocs;
+		total.label = runs[0].label;
+		return total;
+	}
+
+	static void PrintHeader(Format format)
+	{
+		switch (format)
+		{
+			case Format::TABLE:
+				printf("%-56s %14s %14s %12s %12s  %s\n",
+					"benchmark", "iterations", "ns/op", "allocs/op", "MiB/s", "label");
+				break;
+
+			case Format::CSV:
+				printf("name,threads,iterations,ns_per_op,allocs_per_op,mib_per_s,label\n");
+				break;
+
+			case Format::JSON:
+				printf("{\n  \"benchmarks\": [");
+				break;
+		}
+	}
+
+	static void PrintResult(Format format, const Case& c, uint64_t iterations,
+		double nsPerOp, double allocsPerOp, double mibPerSec,
+		const std::string& label, bool first)
+	{
+		switch (format)
+		{
+			case Format::TABLE:
+				printf("%-56s %14llu %14.2f %12.2f %12.1f  %s\n", c.name.c_str(),
+					(unsigned long long)iterations, nsPerOp, allocsPerOp, mibPerSec,
+					label.c_str());
+				break;
+
+			case Format::CSV:
+				printf("\"%s\",%u,%llu,%.3f,%.3f,%.3f,\"%s\"\n", c.name.c_str(), c.threads,
+					(unsigned long long)iterations, nsPerOp, allocsPerOp, mibPerSec,
+					label.c_str());
+				break;
+
+			case Format::JSON:
+				printf("%s\n    { \"name\": \"%s\", \"threads\": %u, \"iterations\": %llu, "
+					"\"ns_per_op\": %.3f, \"allocs_per_op\": %.3f, \"mib_per_s\": %.3f, "
+					"\"label\": \"%s\" }",
+					first ? "" : ",", c.name.c_str(), c.threads,
+					(unsigned long long)iterations, nsPerOp, allocsPerOp, mibPerSec,
+					label.c_str());
+				break;
+		}
+
+		fflush(stdout);
+	}
+
+	size_t RunAll(const std::string& filter, Format format)
+	{
+		constexpr int64_t MinRunNs = 200'000'000;
+		constexpr uint64_t MaxIterations = 1ull << 34;
+
+		size_t count = 0;
+		PrintHeader(format);
+
+		for (Case& c : Registry())
+		{
+			if (c.name.find(filter) == std::string::npos)
+			{
+				continue;
+			}
+
+			uint64_t iterations = 1;
+			Run run{};
+			while (true)
+			{
+				run = RunOnce(c, iterations);
+				if (run.elapsed >= MinRunNs || iterations >= MaxIterations)
+				{
+					break;
+				}
+				iterations *= 2;
+			}
+
+			double nsPerOp = double(run.elapsed) / double(iterations);
+			double mibPerSec = run.bytes == 0 ? 0.0
+				: (double(run.bytes) / (1024.0 * 1024.0)) / (double(run.elapsed) / 1e9);
+
+			double allocsPerOp = double(run.allocs) / double(iterations);
+
+			PrintResult(format, c, iterations, nsPerOp, allocsPerOp, mibPerSec,
+				run.label, count == 0);
+			count++;
+		}
+
+		if (format == Format::JSON)
+		{
+			printf("\n  ]\n}\n");
+		}
+
+		return count;
+	}
+}
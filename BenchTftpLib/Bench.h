@@ -0,0 +1,153 @@
+﻿#pragma once
+
+#include <barrier>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+	// **********************************************************************
+	// Minimal micro benchmark harness.
+	//	A case runs its body for State::Iterations() iterations. The runner
+	//	doubles the iteration count until a run lasts long enough, then
+	//	reports time per iteration, heap allocations per iteration,
+	//	throughput when bytes are set and thread 0's label.
+	//
+	//	Threaded cases run the body on every thread at once, each thread
+	//	doing Iterations() iterations. Thread 0 sets up and tears down what
+	//	the threads share, with Sync() around it. Time per iteration is the
+	//	slowest thread's.
+	// **********************************************************************
+	class State
+	{
+	public:
+		explicit State(uint64_t iterations, uint32_t threads = 1,
+			uint32_t threadIndex = 0, std::barrier<>* barrier = nullptr)
+			: _iterations{ iterations }
+			, _threads{ threads }
+			, _threadIndex{ threadIndex }
+			, _barrier{ barrier } {}
+
+		uint64_t Iterations() const { return _iterations; }
+		uint32_t Threads() const { return _threads; }
+		uint32_t ThreadIndex() const { return _threadIndex; }
+
+		// Wait for every thread of the case.
+		void Sync();
+
+		// Bytes moved by the whole run, for throughput.
+		void SetBytesProcessed(uint64_t bytes) { _bytes = bytes; }
+		uint64_t BytesProcessed() const { return _bytes; }
+
+		// Free text printed after the figures, e.g. a latency the case
+		// measured itself.
+		void SetLabel(std::string label) { _label = std::move(label); }
+		const std::string& Label() const { return _label; }
+
+		// Exclude setup and teardown from the measurement.
+		void ResetTimer();
+		void StopTimer();
+		int64_t ElapsedNs() const;
+		uint64_t Allocations() const;
+
+	private:
+		uint64_t _iterations;
+		uint32_t _threads;
+		uint32_t _threadIndex;
+		std::barrier<>* _barrier;
+		uint64_t _bytes{ 0 };
+		std::string _label{};
+		int64_t _start{ 0 };
+		int64_t _stop{ -1 };
+		uint64_t _allocStart{ 0 };
+		uint64_t _allocStop{ 0 };
+	};
+
+	using Body = std::function<void(State&)>;
+
+	struct Case {
+		std::string name;
+		Body body;
+		uint32_t threads{ 1 };
+	};
+
+	std::vector<Case>& Registry();
+
+	struct Registrar {
+		Registrar(const char* name, Body body) {
+			Registry().push_back(Case{ name, std::move(body) });
+		}
+
+		// One case per thread count, named name/threads:N.
+		Registrar(const char* name, Body body,
+			std::initializer_list<uint32_t> threads) {
+			for (uint32_t n : threads) {
+				Registry().push_back(Case{
+					std::string{ name } + "/threads:" + std::to_string(n), body, n });
+			}
+		}
+	};
+
+	enum class Format {
+		TABLE,
+		CSV,
+		JSON
+	};
+
+	// Run every case whose name contains filter. Returns the number run.
+	size_t RunAll(const std::string& filter, Format format = Format::TABLE);
+
+	// Global operator new calls since program start.
+	uint64_t AllocationCount();
+
+	// Keep the compiler from discarding a result.
+	void Consume(const void* p);
+
+	template <typename T>
+	void DoNotOptimize(const T& value) {
+		Consume(&value);
+	}
+
+	// Object shared by the threads of a case : thread 0 builds it in
+	// Setup() and destroys it in Teardown(), which also stops the timer.
+	template <typename T>
+	class Shared
+	{
+	public:
+		template <typename... Args>
+		T& Setup(State& state, Args&&... args) {
+			if (state.ThreadIndex() == 0) {
+				_object = std::make_unique<T>(std::forward<Args>(args)...);
+			}
+			state.Sync();
+			state.ResetTimer();
+			return *_object;
+		}
+
+		void Teardown(State& state) {
+			state.StopTimer();
+			state.Sync();
+			if (state.ThreadIndex() == 0) {
+				_object.reset();
+			}
+		}
+
+	private:
+		std::unique_ptr<T> _object{};
+	};
+}
+
+#define BENCH_CONCAT_(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT_(a, b)
+
+#define BENCHMARK(name, body) \
+	static bench::Registrar BENCH_CONCAT(registrar_, __LINE__) { name, body }
+
+// BENCHMARK_THREADS(name, body, 1, 2, 4...) : one case per thread count.
+#define BENCHMARK_THREADS(name, body, ...) \
+	static bench::Registrar BENCH_CONCAT(registrar_, __LINE__) { name, body, { __VA_ARGS__ } }
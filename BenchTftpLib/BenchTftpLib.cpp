@@ -0,0 +1,53 @@
+﻿// BenchTftpLib.cpp : micro benchmarks of tftplib building blocks.
+//	Usage : BenchTftpLib [--csv|--json] [filter]
+//	Runs every benchmark whose name contains filter. Results go to stdout
+//	as a table, or as CSV / JSON for regression tracking.
+//
+//	Usage : BenchTftpLib load [filter] [key=value...]
+//	Runs the end to end load scenarios against a loopback Server.
+//	Keys : clients, rrq, blksize, windowsize, duration, port, threads,
+//	sizes (bytes:weight,...), and impairment : loss, dup, reorder (%),
+//	delay, jitter (ms), bandwidth (Mbit/s), seed. memory=1 serves the files
+//	from memory instead of the disk.
+//
+
+#include "Bench.h"
+#include "LoadGenerator.h"
+#include <cstdio>
+#include <string>
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && std::string{ argv[1] } == "load")
+	{
+		return bench::LoadMain(argc - 2, argv + 2);
+	}
+
+	std::string filter;
+	bench::Format format = bench::Format::TABLE;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--csv")
+		{
+			format = bench::Format::CSV;
+		}
+		else if (arg == "--json")
+		{
+			format = bench::Format::JSON;
+		}
+		else
+		{
+			filter = arg;
+		}
+	}
+
+	size_t count = bench::RunAll(filter, format);
+	if (count == 0)
+	{
+		printf("No benchmark matches '%s'\n", filter.c_str());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+﻿#include "Bench.h"
+#include "DatagramFactory.h"
+#include <cstring>
+
+// Cost of building, sharing and releasing one datagram : what every
+// transferred block pays for its DATA and again for its ACK.
+
+namespace {
+
+	const uint8_t Ack[4] = { 0, 4, 0, 1 };
+
+	void AssembleRelease(bench::State& state)
+	{
+		auto factory = tftplib::DatagramFactory::Instantiate(16);
+
+		state.ResetTimer();
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto assembly = factory->StartAssembly();
+			assembly.SetDestinationAddress("192.168.100.200")
+				.SetDestinationPort(49152);
+
+			memcpy(assembly.GetDataBuffer(), Ack, sizeof(Ack));
+			assembly.SetDataSize(sizeof(Ack));
+
+			auto datagram = assembly.Finalize();
+			auto shared = datagram;
+			bench::DoNotOptimize(shared);
+		}
+	}
+
+	void BuildResponse(bench::State& state)
+	{
+		auto factory = tftplib::DatagramFactory::Instantiate(16);
+
+		auto assembly = factory->StartAssembly();
+		assembly.SetSourceAddress("fe80::1c2d:3e4f:5a6b:7c8d")
+			.SetSourcePort(49152);
+		auto request = assembly.Finalize();
+
+		state.ResetTimer();
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto response = factory->BuildResponse(Ack, sizeof(Ack), *request);
+			bench::DoNotOptimize(response);
+		}
+	}
+}
+
+BENCHMARK("datagram/assemble-release", AssembleRelease);
+BENCHMARK("datagram/build-response-ipv6", BuildResponse);
@@ -0,0 +1,59 @@
+﻿#include "Bench.h"
+#include "FileWriter.h"
+#include "HaloBuffer.h"
+#include <filesystem>
+#include <vector>
+
+// Netascii uploads : FileWriter::WriteBlock rewriting line endings
+// through BufferOut, swept over line lengths, against the octet path
+// writing blocks as they come. Both end in the same temporary file,
+// deleted when the writer goes away without Finalize().
+
+namespace {
+
+	using tftplib::FileWriter;
+
+	constexpr size_t BlockSize = 512;
+
+	// One block of text with LF every lineLength bytes, 0 for none.
+	std::vector<uint8_t> TextBlock(size_t lineLength)
+	{
+		std::vector<uint8_t> block(BlockSize, 'a');
+		for (size_t i = lineLength; lineLength != 0 && i <= BlockSize; i += lineLength)
+		{
+			block[i - 1] = '\n';
+		}
+		return block;
+	}
+
+	bench::Body WriteBlocks(size_t lineLength, FileWriter::ForceNativeEOL eol)
+	{
+		return [=](bench::State& state) {
+			auto path = std::filesystem::temp_directory_path() / "tftplib-bench-writer.txt";
+			tftplib::HaloBuffer buffer{ 0x020000 };
+			std::vector<uint8_t> block = TextBlock(lineLength);
+
+			FileWriter writer{ path, &buffer, eol };
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				writer.WriteBlock(block.data(), block.size());
+			}
+			state.StopTimer();
+
+			state.SetBytesProcessed(BlockSize * state.Iterations());
+		};
+	}
+}
+
+BENCHMARK("filewriter/octet/512",
+	WriteBlocks(0, FileWriter::ForceNativeEOL::NO));
+BENCHMARK("filewriter/netascii/line-8",
+	WriteBlocks(8, FileWriter::ForceNativeEOL::YES));
+BENCHMARK("filewriter/netascii/line-80",
+	WriteBlocks(80, FileWriter::ForceNativeEOL::YES));
+BENCHMARK("filewriter/netascii/line-256",
+	WriteBlocks(256, FileWriter::ForceNativeEOL::YES));
+BENCHMARK("filewriter/netascii/no-eol",
+	WriteBlocks(0, FileWriter::ForceNativeEOL::YES));
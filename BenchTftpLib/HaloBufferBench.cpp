@@ -0,0 +1,96 @@
+﻿#include "Bench.h"
+#include "HaloBuffer.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Wrap-free copies through a HaloBuffer against a plain ring that splits
+// copies crossing its end in two. Chunk sizes don't divide the ring size,
+// so the plain ring regularly wraps.
+
+namespace {
+
+	// Plain ring of the same capacity, copies split at the end.
+	class TwoSegmentRing
+	{
+	public:
+		explicit TwoSegmentRing(size_t size) : _data(size) {}
+
+		void Write(const uint8_t* src, size_t count)
+		{
+			size_t at = _produced % _data.size();
+			size_t first = std::min(count, _data.size() - at);
+			memcpy(&_data[at], src, first);
+			memcpy(&_data[0], src + first, count - first);
+			_produced += count;
+		}
+
+		void Read(uint8_t* dst, size_t count)
+		{
+			size_t at = _consumed % _data.size();
+			size_t first = std::min(count, _data.size() - at);
+			memcpy(dst, &_data[at], first);
+			memcpy(dst + first, &_data[0], count - first);
+			_consumed += count;
+		}
+
+	private:
+		std::vector<uint8_t> _data;
+		size_t _produced{ 0 };
+		size_t _consumed{ 0 };
+	};
+
+	bench::Body HaloCopy(size_t ringSize, size_t chunk,
+		tftplib::Arena::Pages pages = tftplib::Arena::Pages::NORMAL)
+	{
+		return [=](bench::State& state) {
+			tftplib::HaloBuffer ring{ ringSize, pages };
+			std::vector<uint8_t> src(chunk, 0x5A);
+			std::vector<uint8_t> dst(chunk);
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				memcpy(ring.WritePtr(), src.data(), chunk);
+				ring.Commit(chunk);
+
+				memcpy(dst.data(), ring.ReadPtr(), chunk);
+				ring.Release(chunk);
+				bench::DoNotOptimize(dst[0]);
+			}
+
+			state.SetBytesProcessed(2 * chunk * state.Iterations());
+		};
+	}
+
+	bench::Body SplitCopy(size_t ringSize, size_t chunk)
+	{
+		return [=](bench::State& state) {
+			TwoSegmentRing ring{ ringSize };
+			std::vector<uint8_t> src(chunk, 0x5A);
+			std::vector<uint8_t> dst(chunk);
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				ring.Write(src.data(), chunk);
+				ring.Read(dst.data(), chunk);
+				bench::DoNotOptimize(dst[0]);
+			}
+
+			state.SetBytesProcessed(2 * chunk * state.Iterations());
+		};
+	}
+}
+
+BENCHMARK("halo/wrapfree/1MiB/512", HaloCopy(0x100000, 512));
+BENCHMARK("halo/wrapfree/1MiB/1428", HaloCopy(0x100000, 1428));
+BENCHMARK("halo/wrapfree/4MiB/1428", HaloCopy(0x400000, 1428));
+BENCHMARK("halo/wrapfree/4MiB/65464", HaloCopy(0x400000, 65464));
+BENCHMARK("halo/wrapfree-huge/4MiB/65464",
+	HaloCopy(0x400000, 65464, tftplib::Arena::Pages::HUGE_PAGES));
+
+BENCHMARK("halo/split/1MiB/512", SplitCopy(0x100000, 512));
+BENCHMARK("halo/split/1MiB/1428", SplitCopy(0x100000, 1428));
+BENCHMARK("halo/split/4MiB/1428", SplitCopy(0x400000, 1428));
+BENCHMARK("halo/split/4MiB/65464", SplitCopy(0x400000, 65464));
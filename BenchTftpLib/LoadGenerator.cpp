@@ -0,0 +1,1122 @@
+﻿#include "LoadGenerator.h"
+#include "Server.h"
+#include "Poller.h"
+#include "Signal.h"
+#include "UdpSocketWindows.h"
+#include "DatagramFactory.h"
+#include "tftp_messages.h"
+#include "Impairment.h"
+#include "MemoryFileSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace bench {
+
+	using Clock = std::chrono::steady_clock;
+	using tftplib::OpCode;
+
+	static constexpr auto ClientTimeout = std::chrono::milliseconds{ 1000 };
+	static constexpr uint32_t ClientRetries = 5;
+
+	// In flight transfers get this long to finish once the run is over.
+	static constexpr auto DrainGrace = std::chrono::seconds{ 3 };
+
+	// Multicast sessions of the server under load.
+	static constexpr const char* MulticastGroup = "239.255.42.1";
+
+	// Clients per generator thread, bounded by what a Poller can watch.
+	static constexpr size_t ClientsPerThread =
+		std::min<size_t>(tftplib::Poller::MaxWatched, 256);
+
+	static double ProcessCpuSeconds()
+	{
+#if defined(_WIN32)
+		FILETIME creation, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		{
+			return 0.0;
+		}
+
+		auto ticks = [](const FILETIME& ft) {
+			return (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+		};
+		return double(ticks(kernel) + ticks(user)) / 1e7;
+#else
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+		return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+			+ double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+	}
+
+	static std::string ReadFileName(uint64_t size)
+	{
+		return "load-rrq-" + std::to_string(size) + ".bin";
+	}
+
+	static std::string WriteFileName(uint32_t client)
+	{
+		return "load-wrq-" + std::to_string(client) + ".bin";
+	}
+
+	static uint16_t GetU16(const char* at)
+	{
+		auto bytes = reinterpret_cast<const uint8_t*>(at);
+		return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+	}
+
+	// **********************************************************************
+	// One simulated TFTP client.
+	//	Blocks are counted from the start of the transfer, so block numbers
+	//	wrapping on the wire don't matter.
+	// **********************************************************************
+	struct Client {
+		uint32_t id{ 0 };
+		std::unique_ptr<tftplib::UdpSocketWindows> socket{};
+
+		bool active{ false };
+		bool read{ true };
+		uint64_t fileSize{ 0 };
+
+		// Replies only come from the server's transfer socket.
+		uint16_t serverPort{ 0 };
+		uint16_t previousServerPort{ 0 };
+		tftplib::SocketAddress server{};
+
+		// Parameters in effect, once the server answered.
+		uint16_t blockSize{ tftplib::defaults::BlockSize };
+		uint16_t windowSize{ 1 };
+
+		uint64_t delivered{ 0 };			// RRQ received, WRQ acknowledged
+		uint64_t sent{ 0 };					// WRQ only
+		uint64_t lastBlock{ 0 };			// WRQ only
+		uint64_t bytes{ 0 };
+
+		Clock::time_point started{};
+		Clock::time_point deadline{};
+		uint32_t retries{ 0 };
+
+		// Last forward step, and whether a timeout fired since.
+		Clock::time_point progressAt{};
+		bool stalled{ false };
+
+		// RFC 2090 : blocks come from the group, in any order, and are
+		// ACKed while master.
+		std::unique_ptr<tftplib::UdpSocketWindows> group{};
+		uint16_t groupPort{ 0 };
+		bool multicast{ false };
+		bool master{ false };
+		std::vector<bool> have{};
+		uint64_t contiguous{ 0 };
+	};
+
+	// **********************************************************************
+	// Generator thread : runs a slice of the clients over one Poller.
+	// **********************************************************************
+	class ClientThread
+	{
+	public:
+		ClientThread(const LoadProfile& profile, uint32_t firstClient,
+			uint32_t count, Clock::time_point endAt,
+			std::shared_ptr<tftplib::Impairment> impairment)
+			: _profile{ profile }
+			, _endAt{ endAt }
+			, _factory{ tftplib::DatagramFactory::Instantiate(count * 2 + 16) }
+			, _random{ firstClient + 1 }
+			, _clients( count )
+		{
+			uint64_t total = 0;
+			for (const SizeWeight& size : _profile.sizes)
+			{
+				total += size.weight;
+			}
+			_totalWeight = std::max<uint64_t>(total, 1);
+
+			memset(_payload, 0x5A, sizeof(_payload));
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				Client& c = _clients[i];
+				c.id = firstClient + i;
+				c.socket = std::make_unique<tftplib::UdpSocketWindows>();
+				c.socket->SetImpairment(impairment);
+				if (c.socket->Bind("127.0.0.1", 0))
+				{
+					_poller.Watch(c.socket->GetNativeHandle(), i);
+				}
+			}
+		}
+
+		void Start() {
+			_thread = std::thread(&ClientThread::Run, this);
+		}
+
+		void Join() {
+			_thread.join();
+		}
+
+		const LoadReport& Report() const { return _report; }
+
+	private:
+		void Run()
+		{
+			for (Client& c : _clients)
+			{
+				StartTransfer(c);
+			}
+
+			auto nextScan = Clock::now();
+			while (true)
+			{
+				auto now = Clock::now();
+				bool ending = now >= _endAt;
+				if (ending && (now >= _endAt + DrainGrace || ActiveCount() == 0))
+				{
+					break;
+				}
+
+				_poller.Wait(std::chrono::milliseconds{ 10 }, _ready);
+				for (uint64_t token : _ready)
+				{
+					if (token < _clients.size())
+					{
+						ReceiveAll(_clients[token]);
+					}
+					else if (token < 2 * _clients.size())
+					{
+						ReceiveGroup(_clients[token - _clients.size()]);
+					}
+				}
+
+				now = Clock::now();
+				if (now >= nextScan)
+				{
+					for (Client& c : _clients)
+					{
+						if (c.active && c.deadline <= now)
+						{
+							Timeout(c);
+						}
+					}
+					nextScan = now + std::chrono::milliseconds{ 10 };
+				}
+			}
+		}
+
+		size_t ActiveCount() const
+		{
+			return std::count_if(_clients.begin(), _clients.end(),
+				[](const Client& c) { return c.active; });
+		}
+
+		/* ***************************************************
+		 *  Transfers
+		 * ***************************************************/
+		void StartTransfer(Client& c)
+		{
+			if (Clock::now() >= _endAt || !c.socket->IsBound())
+			{
+				c.active = false;
+				return;
+			}
+
+			c.active = true;
+			c.read = (_random() % 100) < _profile.rrqPercent;
+			c.fileSize = PickSize();
+			c.previousServerPort = c.serverPort;
+			c.serverPort = 0;
+			c.server = {};
+			c.blockSize = tftplib::defaults::BlockSize;
+			c.windowSize = 1;
+			c.delivered = 0;
+			c.sent = 0;
+			c.lastBlock = 0;
+			c.bytes = 0;
+			c.retries = 0;
+			c.started = Clock::now();
+			c.progressAt = c.started;
+			c.stalled = false;
+			c.multicast = false;
+			c.master = false;
+			c.have.clear();
+			c.contiguous = 0;
+
+			SendRequest(c);
+		}
+
+		void Complete(Client& c)
+		{
+			auto now = Clock::now();
+			if (now <= _endAt)
+			{
+				_report.transfers++;
+				_report.bytes += c.read ? c.bytes : c.fileSize;
+				_report.latencyUs.Record(uint64_t(
+					std::chrono::duration_cast<std::chrono::microseconds>(
+						now - c.started).count()));
+			}
+
+			StartTransfer(c);
+		}
+
+		void Fail(Client& c)
+		{
+			if (Clock::now() <= _endAt)
+			{
+				_report.failures++;
+			}
+
+			StartTransfer(c);
+		}
+
+		void Timeout(Client& c)
+		{
+			// Members wait for their turn : only the master is expected
+			// to hear from the server.
+			if (c.multicast && !c.master)
+			{
+				c.deadline = Clock::now() + ClientTimeout;
+				return;
+			}
+
+			if (++c.retries > ClientRetries)
+			{
+				Fail(c);
+				return;
+			}
+
+			_report.retransmits++;
+			c.stalled = true;
+			if (c.serverPort == 0)
+			{
+				SendRequest(c);
+			}
+			else if (c.multicast)
+			{
+				SendAck(c, c.contiguous);
+			}
+			else if (c.read)
+			{
+				SendAck(c, c.delivered);
+			}
+			else
+			{
+				// Go back to the first unacknowledged block.
+				c.sent = c.delivered;
+				SendWindow(c);
+			}
+		}
+
+		/* ***************************************************
+		 *  Receive path
+		 * ***************************************************/
+		void ReceiveAll(Client& c)
+		{
+			while (c.socket->HasDatagram())
+			{
+				tftplib::DatagramRef datagram = c.socket->Receive(*_factory);
+				if (!datagram)
+				{
+					return;
+				}
+
+				if (c.active)
+				{
+					Process(c, *datagram);
+				}
+			}
+		}
+
+		void Process(Client& c, const tftplib::Datagram& datagram)
+		{
+			uint16_t port = datagram.GetSourcePort();
+			if (c.serverPort == 0)
+			{
+				// Late datagrams of the previous transfer.
+				if (port == c.previousServerPort)
+				{
+					return;
+				}
+
+				// The listening socket only answers to turn a request down.
+				if (port == _profile.port)
+				{
+					Fail(c);
+					return;
+				}
+
+				c.serverPort = port;
+				c.server = datagram.GetSourceSocketAddress();
+				Progress(c);
+				c.blockSize = tftplib::defaults::BlockSize;
+				c.windowSize = 1;
+			}
+			else if (port != c.serverPort)
+			{
+				return;
+			}
+
+			if (datagram.GetDataSize() < 4)
+			{
+				return;
+			}
+
+			const char* data = datagram.GetData();
+			OpCode op = *reinterpret_cast<const OpCode*>(data);
+			uint16_t number = GetU16(data + 2);
+
+			c.retries = 0;
+			c.deadline = Clock::now() + ClientTimeout;
+
+			switch (op)
+			{
+				case OpCode::OACK:
+					ParseOptions(c, data + 2, datagram.GetDataSize() - 2);
+					if (c.multicast)
+					{
+						OnMulticastTurn(c);
+					}
+					else if (c.read)
+					{
+						SendAck(c, 0);
+					}
+					else
+					{
+						StartWriting(c);
+					}
+					break;
+
+				case OpCode::DATA:
+					if (c.read)
+					{
+						OnData(c, number, datagram.GetDataSize() - 4u);
+					}
+					break;
+
+				case OpCode::ACK:
+					if (!c.read)
+					{
+						OnAck(c, number);
+					}
+					break;
+
+				default:
+					// ERROR, or garbage.
+					Fail(c);
+					break;
+			}
+		}
+
+		// Time lost to a stall : from the last step forward to the one
+		// that follows the timeout.
+		void Progress(Client& c)
+		{
+			auto now = Clock::now();
+			if (c.stalled && now <= _endAt)
+			{
+				_report.recoveryUs.Record(uint64_t(
+					std::chrono::duration_cast<std::chrono::microseconds>(
+						now - c.progressAt).count()));
+			}
+
+			c.stalled = false;
+			c.progressAt = now;
+		}
+
+		void OnData(Client& c, uint16_t number, size_t payload)
+		{
+			if (number != static_cast<uint16_t>(c.delivered + 1))
+			{
+				// Lost or reordered : restart the window after what we have.
+				SendAck(c, c.delivered);
+				return;
+			}
+
+			c.delivered++;
+			c.bytes += payload;
+			Progress(c);
+
+			if (payload < c.blockSize)
+			{
+				SendAck(c, c.delivered);
+				Complete(c);
+			}
+			else if (c.delivered % c.windowSize == 0)
+			{
+				SendAck(c, c.delivered);
+			}
+		}
+
+		void OnAck(Client& c, uint16_t number)
+		{
+			if (c.lastBlock == 0)
+			{
+				// ACK 0 : the server took the request without options.
+				if (number == 0)
+				{
+					StartWriting(c);
+				}
+				return;
+			}
+
+			uint64_t acked = c.delivered
+				+ static_cast<uint16_t>(number - static_cast<uint16_t>(c.delivered));
+			if (acked <= c.delivered || acked > c.sent)
+			{
+				return;
+			}
+
+			c.delivered = acked;
+			Progress(c);
+			if (c.delivered == c.lastBlock)
+			{
+				Complete(c);
+				return;
+			}
+
+			SendWindow(c);
+		}
+
+		void ParseOptions(Client& c, const char* options, size_t size)
+		{
+			const char* end = options + size;
+			while (options < end)
+			{
+				const char* name = options;
+				const char* value = name + strnlen(name, end - name) + 1;
+				if (value >= end)
+				{
+					break;
+				}
+				options = value + strnlen(value, end - value) + 1;
+
+				unsigned long number = strtoul(value, nullptr, 10);
+				if (IsOption(name, "blksize") && number >= 8 && number <= 65464)
+				{
+					c.blockSize = static_cast<uint16_t>(number);
+				}
+				else if (IsOption(name, "windowsize") && number >= 1 && number <= 65535)
+				{
+					c.windowSize = static_cast<uint16_t>(number);
+				}
+				else if (IsOption(name, "multicast"))
+				{
+					ParseMulticast(c, value);
+				}
+			}
+		}
+
+		/* ***************************************************
+		 *  Multicast (RFC 2090)
+		 * ***************************************************/
+
+		// "address,port,mc" : mc is 1 for the master.
+		void ParseMulticast(Client& c, const char* value)
+		{
+			std::string text = value;
+			size_t first = text.find(',');
+			size_t second = first == std::string::npos
+				? std::string::npos : text.find(',', first + 1);
+			if (second == std::string::npos)
+			{
+				return;
+			}
+
+			std::string address = text.substr(0, first);
+			std::string port = text.substr(first + 1, second - first - 1);
+			c.master = text.substr(second + 1) == "1";
+			if (!c.multicast)
+			{
+				c.multicast = true;
+				c.have.assign(size_t(c.fileSize / c.blockSize + 1), false);
+			}
+
+			if (!address.empty() && !port.empty())
+			{
+				JoinGroup(c, address, uint16_t(std::stoul(port)));
+			}
+		}
+
+		void JoinGroup(Client& c, const std::string& address, uint16_t port)
+		{
+			if (c.group && c.groupPort == port)
+			{
+				return;
+			}
+
+			uint64_t token = _clients.size() + (&c - _clients.data());
+			if (c.group)
+			{
+				_poller.Unwatch(c.group->GetNativeHandle());
+			}
+
+			c.group = std::make_unique<tftplib::UdpSocketWindows>();
+			c.group->SetReuseAddress(true);
+			if (c.group->Bind("0.0.0.0", port)
+				&& c.group->JoinGroup(address.c_str(), "127.0.0.1"))
+			{
+				c.groupPort = port;
+				_poller.Watch(c.group->GetNativeHandle(), token);
+			}
+			else
+			{
+				c.group = nullptr;
+				c.groupPort = 0;
+			}
+		}
+
+		// Made master : ACK what we have in sequence, the server sends
+		// what follows.
+		void OnMulticastTurn(Client& c)
+		{
+			if (!c.master)
+			{
+				return;
+			}
+
+			SendAck(c, c.contiguous);
+			if (c.contiguous == c.have.size())
+			{
+				Complete(c);
+			}
+		}
+
+		void ReceiveGroup(Client& c)
+		{
+			while (c.group && c.group->HasDatagram())
+			{
+				tftplib::DatagramRef datagram = c.group->Receive(*_factory);
+				if (!datagram)
+				{
+					return;
+				}
+
+				if (c.active && c.multicast && datagram->GetDataSize() >= 4)
+				{
+					const char* data = datagram->GetData();
+					if (*reinterpret_cast<const OpCode*>(data) == OpCode::DATA)
+					{
+						OnGroupData(c, GetU16(data + 2), datagram->GetDataSize() - 4u);
+					}
+				}
+			}
+		}
+
+		void OnGroupData(Client& c, uint16_t number, size_t payload)
+		{
+			if (number == 0 || number > c.have.size())
+			{
+				return;
+			}
+
+			if (!c.have[number - 1])
+			{
+				c.have[number - 1] = true;
+				c.bytes += payload;
+				Progress(c);
+				while (c.contiguous < c.have.size() && c.have[c.contiguous])
+				{
+					c.contiguous++;
+				}
+			}
+
+			if (c.master)
+			{
+				c.retries = 0;
+				c.deadline = Clock::now() + ClientTimeout;
+				OnMulticastTurn(c);
+			}
+		}
+
+		static bool IsOption(const char* name, const char* option)
+		{
+			for (; *name && *option; ++name, ++option)
+			{
+				if (tolower(static_cast<unsigned char>(*name)) != *option)
+				{
+					return false;
+				}
+			}
+			return *name == *option;
+		}
+
+		/* ***************************************************
+		 *  Send path
+		 * ***************************************************/
+		void SendRequest(Client& c)
+		{
+			auto assembly = _factory->StartAssembly();
+			if (!assembly.IsValid())
+			{
+				c.deadline = Clock::now() + ClientTimeout;
+				return;
+			}
+
+			std::string file = c.read ? ReadFileName(c.fileSize) : WriteFileName(c.id);
+			char* buffer = assembly.GetDataBuffer();
+			size_t capacity = assembly.GetDataBufferSize();
+
+			size_t size = tftplib::encode<tftplib::MessageRequest>(buffer, capacity,
+				c.read ? OpCode::RRQ : OpCode::WRQ, file.c_str(),
+				tftplib::mode::Mode::OCTET);
+
+			if (_profile.blockSize != tftplib::defaults::BlockSize)
+			{
+				size += AppendOption(buffer + size, "blksize", _profile.blockSize);
+			}
+			if (_profile.windowSize != 1)
+			{
+				size += AppendOption(buffer + size, "windowsize", _profile.windowSize);
+			}
+			if (_profile.multicast && c.read)
+			{
+				memcpy(buffer + size, "multicast\0", 11);
+				size += 11;
+			}
+
+			assembly.SetDestinationAddress("127.0.0.1")
+				.SetDestinationPort(_profile.port)
+				.SetDataSize(static_cast<uint16_t>(size));
+
+			c.socket->Send(assembly.Finalize());
+			c.deadline = Clock::now() + ClientTimeout;
+		}
+
+		static size_t AppendOption(char* at, const char* name, uint16_t value)
+		{
+			std::string option = std::string{ name } + '\0' + std::to_string(value) + '\0';
+			memcpy(at, option.data(), option.size());
+			return option.size();
+		}
+
+		void SendAck(Client& c, uint64_t block)
+		{
+			uint8_t ack[tftplib::MessageAck::EncodedSize];
+			tftplib::encode<tftplib::MessageAck>(ack, sizeof(ack),
+				static_cast<uint16_t>(block));
+			c.socket->SendTo(ack, sizeof(ack), c.server);
+		}
+
+		void StartWriting(Client& c)
+		{
+			c.lastBlock = c.fileSize / c.blockSize + 1;
+			SendWindow(c);
+		}
+
+		void SendWindow(Client& c)
+		{
+			while (c.sent < c.lastBlock && c.sent - c.delivered < c.windowSize)
+			{
+				c.sent++;
+				size_t payload = c.sent == c.lastBlock
+					? size_t(c.fileSize - (c.lastBlock - 1) * c.blockSize)
+					: c.blockSize;
+
+				size_t size = tftplib::encode<tftplib::MessageData>(_payload,
+					sizeof(_payload), static_cast<uint16_t>(c.sent),
+					static_cast<uint16_t>(payload));
+				c.socket->SendTo(_payload, size, c.server);
+			}
+		}
+
+		uint64_t PickSize()
+		{
+			uint64_t pick = _random() % _totalWeight;
+			for (const SizeWeight& size : _profile.sizes)
+			{
+				if (pick < size.weight)
+				{
+					return size.bytes;
+				}
+				pick -= size.weight;
+			}
+			return _profile.sizes.back().bytes;
+		}
+
+	private:
+		const LoadProfile& _profile;
+		const Clock::time_point _endAt;
+
+		std::shared_ptr<tftplib::DatagramFactory> _factory;
+		tftplib::Signal _signal{};
+		tftplib::Poller _poller{ _signal };
+		std::vector<uint64_t> _ready{};
+
+		std::mt19937_64 _random;
+		uint64_t _totalWeight{ 1 };
+		uint8_t _payload[0x10000 + 4];
+
+		std::vector<Client> _clients;
+		LoadReport _report{};
+		std::thread _thread{};
+	};
+
+	/* *********************************************************************
+	 * Runner
+	 * *********************************************************************/
+	static bool PrepareRoot(const std::filesystem::path& root,
+		const LoadProfile& profile)
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(root, ec);
+		if (ec)
+		{
+			return false;
+		}
+
+		std::vector<char> chunk(0x100000, 'x');
+		for (const SizeWeight& size : profile.sizes)
+		{
+			auto path = root / ReadFileName(size.bytes);
+			if (std::filesystem::exists(path)
+				&& std::filesystem::file_size(path) == size.bytes)
+			{
+				continue;
+			}
+
+			std::ofstream out{ path, std::ios::binary | std::ios::trunc };
+			for (uint64_t left = size.bytes; left > 0; )
+			{
+				size_t n = size_t(std::min<uint64_t>(left, chunk.size()));
+				out.write(chunk.data(), n);
+				left -= n;
+			}
+			if (!out)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	LoadReport RunLoad(const LoadProfile& profile)
+	{
+		LoadReport report{};
+		if (profile.sizes.empty() || profile.clients == 0)
+		{
+			return report;
+		}
+
+		auto root = std::filesystem::temp_directory_path() / "tftplib-load";
+		if (!PrepareRoot(root, profile))
+		{
+			printf("Could not prepare %s\n", root.string().c_str());
+			return report;
+		}
+
+		// Enough workers for every client to get a transaction.
+		uint32_t threads = profile.serverThreads != 0 ? profile.serverThreads
+			: std::max(1u, std::thread::hardware_concurrency() / 2);
+		threads = std::max<uint32_t>(threads, uint32_t(
+			(profile.clients + tftplib::Poller::MaxWatched - 1)
+				/ tftplib::Poller::MaxWatched));
+
+		tftplib::Server server;
+		server.SetRootDirectory(root)
+			.SetHost("127.0.0.1")
+			.SetPort(profile.port)
+			.SetThreadCount(threads)
+			.SetMaxTransactions(profile.clients + 16)
+			.SetImpairment(profile.impairment);
+		if (profile.multicast)
+		{
+			server.SetMulticast(MulticastGroup, uint16_t(profile.port + 1));
+		}
+		if (profile.memory)
+		{
+			// Uploads land there too.
+			auto files = std::make_shared<tftplib::MemoryFileSystem>();
+			files->SetWritable(true);
+			for (const SizeWeight& size : profile.sizes)
+			{
+				files->Put(ReadFileName(size.bytes),
+					std::vector<uint8_t>(size_t(size.bytes), 'x'));
+			}
+			server.Mount("", files);
+		}
+		server.Start();
+
+		std::shared_ptr<tftplib::Impairment> impairment = nullptr;
+		if (profile.impairment.IsActive())
+		{
+			tftplib::ImpairmentProfile clients = profile.impairment;
+			clients.seed += 1;
+			impairment = std::make_shared<tftplib::Impairment>(clients);
+		}
+
+		// Multicast clients watch a group socket too.
+		uint32_t perThread = uint32_t(profile.multicast
+			? ClientsPerThread / 2 : ClientsPerThread);
+
+		auto endAt = Clock::now() + profile.duration;
+		std::vector<std::unique_ptr<ClientThread>> generators;
+		for (uint32_t first = 0; first < profile.clients; first += perThread)
+		{
+			uint32_t count = std::min<uint32_t>(perThread,
+				profile.clients - first);
+			generators.push_back(
+				std::make_unique<ClientThread>(profile, first, count, endAt,
+					impairment));
+		}
+
+		double cpuStart = ProcessCpuSeconds();
+		auto start = Clock::now();
+		for (auto& generator : generators)
+		{
+			generator->Start();
+		}
+
+		std::this_thread::sleep_until(endAt);
+		double cpuEnd = ProcessCpuSeconds();
+		report.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		report.cpuSeconds = cpuEnd - cpuStart;
+
+		for (auto& generator : generators)
+		{
+			generator->Join();
+
+			const LoadReport& part = generator->Report();
+			report.transfers += part.transfers;
+			report.failures += part.failures;
+			report.retransmits += part.retransmits;
+			report.bytes += part.bytes;
+			report.latencyUs.Merge(part.latencyUs);
+			report.recoveryUs.Merge(part.recoveryUs);
+		}
+
+		generators.clear();
+		report.dropped = server.GetImpairmentStats().dropped
+			+ (impairment ? impairment->GetStats().dropped : 0);
+		server.Stop();
+		return report;
+	}
+
+	static void PrintHeader()
+	{
+		printf("%-24s %8s %5s %7s %6s %10s %8s %10s %8s %9s %9s %9s %10s %9s %11s\n",
+			"scenario", "clients", "rrq%", "blksize", "window",
+			"transfers", "failed", "req/s", "Gbit/s",
+			"p50 ms", "p99 ms", "p999 ms", "cpu s/GiB",
+			"dropped", "recov p99 ms");
+	}
+
+	static void PrintReport(const LoadProfile& profile, const LoadReport& report)
+	{
+		double seconds = std::max(report.seconds, 1e-9);
+		double gib = double(report.bytes) / double(1ull << 30);
+		auto ms = [&](double p) {
+			return double(report.latencyUs.ValueAtPercentile(p)) / 1000.0;
+		};
+
+		printf("%-24s %8u %5u %7u %6u %10llu %8llu %10.1f %8.3f %9.2f %9.2f %9.2f %10.2f %9llu %11.2f\n",
+			profile.name.c_str(), profile.clients, profile.rrqPercent,
+			profile.blockSize, profile.windowSize,
+			(unsigned long long)report.transfers,
+			(unsigned long long)report.failures,
+			double(report.transfers) / seconds,
+			double(report.bytes) * 8.0 / seconds / 1e9,
+			ms(50.0), ms(99.0), ms(99.9),
+			gib > 0.0 ? report.cpuSeconds / gib : 0.0,
+			(unsigned long long)report.dropped,
+			double(report.recoveryUs.ValueAtPercentile(99.0)) / 1000.0);
+	}
+
+	std::vector<LoadProfile>& LoadSuite()
+	{
+		static std::vector<LoadProfile> suite = [] {
+			std::vector<LoadProfile> s;
+
+			LoadProfile small{};
+			small.name = "rrq/small";
+			small.clients = 256;
+			small.sizes = { { 0x1000, 1 } };
+			s.push_back(small);
+
+			LoadProfile mixed{};
+			mixed.name = "rrq/mixed";
+			mixed.clients = 1024;
+			mixed.blockSize = 1428;
+			mixed.sizes = { { 0x4000, 70 }, { 0x100000, 25 }, { 0x1000000, 5 } };
+			s.push_back(mixed);
+
+			LoadProfile upload{};
+			upload.name = "wrq/mixed";
+			upload.clients = 256;
+			upload.rrqPercent = 0;
+			upload.blockSize = 1428;
+			upload.sizes = { { 0x10000, 80 }, { 0x100000, 20 } };
+			s.push_back(upload);
+
+			LoadProfile crowd{};
+			crowd.name = "mix/4k-clients";
+			crowd.clients = 4096;
+			crowd.rrqPercent = 80;
+			crowd.blockSize = 1428;
+			crowd.windowSize = 4;
+			crowd.sizes = { { 0x10000, 60 }, { 0x100000, 35 }, { 0x1000000, 5 } };
+			s.push_back(crowd);
+
+			// Goodput and recovery under loss, both directions.
+			for (double loss : { 0.001, 0.01, 0.1 })
+			{
+				LoadProfile lossy{};
+				lossy.name = "loss/" + std::to_string(loss * 100.0).substr(0, 4) + "%";
+				lossy.clients = 256;
+				lossy.blockSize = 1428;
+				lossy.sizes = { { 0x10000, 80 }, { 0x100000, 20 } };
+				lossy.impairment.loss = loss;
+				s.push_back(lossy);
+			}
+
+			// Boot storm : everyone reads the same image.
+			LoadProfile storm{};
+			storm.name = "multicast/boot-storm";
+			storm.clients = 256;
+			storm.multicast = true;
+			storm.sizes = { { 0x800000, 1 } };
+			s.push_back(storm);
+
+			LoadProfile wan{};
+			wan.name = "wan/20ms-100mbit";
+			wan.clients = 64;
+			wan.blockSize = 1428;
+			wan.sizes = { { 0x100000, 1 } };
+			wan.impairment.delay = std::chrono::milliseconds{ 10 };
+			wan.impairment.jitter = std::chrono::milliseconds{ 2 };
+			wan.impairment.reorder = 0.01;
+			wan.impairment.loss = 0.001;
+			wan.impairment.bandwidthBps = 100'000'000;
+			s.push_back(wan);
+
+			return s;
+		}();
+
+		return suite;
+	}
+
+	// sizes=bytes:weight,bytes:weight...
+	static bool ParseSizes(const std::string& text, std::vector<SizeWeight>& sizes)
+	{
+		sizes.clear();
+		size_t at = 0;
+		while (at < text.size())
+		{
+			size_t end = text.find(',', at);
+			std::string item = text.substr(at, end == std::string::npos
+				? std::string::npos : end - at);
+
+			size_t colon = item.find(':');
+			SizeWeight size{};
+			size.bytes = std::stoull(item.substr(0, colon));
+			size.weight = colon == std::string::npos ? 1
+				: uint32_t(std::stoul(item.substr(colon + 1)));
+			sizes.push_back(size);
+
+			if (end == std::string::npos)
+			{
+				break;
+			}
+			at = end + 1;
+		}
+
+		return !sizes.empty();
+	}
+
+	static bool ApplyOverride(LoadProfile& profile, const std::string& arg)
+	{
+		size_t eq = arg.find('=');
+		std::string key = arg.substr(0, eq);
+		std::string value = arg.substr(eq + 1);
+
+		try
+		{
+			if (key == "clients") profile.clients = uint32_t(std::stoul(value));
+			else if (key == "rrq") profile.rrqPercent = std::min(100u, uint32_t(std::stoul(value)));
+			else if (key == "blksize") profile.blockSize = uint16_t(std::stoul(value));
+			else if (key == "windowsize") profile.windowSize = uint16_t(std::max(1ul, std::stoul(value)));
+			else if (key == "duration") profile.duration = std::chrono::seconds{ std::stoul(value) };
+			else if (key == "port") profile.port = uint16_t(std::stoul(value));
+			else if (key == "threads") profile.serverThreads = uint32_t(std::stoul(value));
+			else if (key == "sizes") return ParseSizes(value, profile.sizes);
+			else if (key == "loss") profile.impairment.loss = std::stod(value) / 100.0;
+			else if (key == "dup") profile.impairment.duplicate = std::stod(value) / 100.0;
+			else if (key == "reorder") profile.impairment.reorder = std::stod(value) / 100.0;
+			else if (key == "delay") profile.impairment.delay = std::chrono::milliseconds{ std::stoul(value) };
+			else if (key == "jitter") profile.impairment.jitter = std::chrono::milliseconds{ std::stoul(value) };
+			else if (key == "bandwidth") profile.impairment.bandwidthBps = std::stoull(value) * 1'000'000;
+			else if (key == "seed") profile.impairment.seed = std::stoull(value);
+			else if (key == "multicast") profile.multicast = value == "1";
+			else if (key == "memory") profile.memory = value == "1";
+			else return false;
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	int LoadMain(int argc, char** argv)
+	{
+		std::string filter;
+		std::vector<std::string> overrides;
+		for (int i = 0; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg.find('=') != std::string::npos)
+			{
+				overrides.push_back(arg);
+			}
+			else
+			{
+				filter = arg;
+			}
+		}
+
+		size_t count = 0;
+		PrintHeader();
+		for (LoadProfile profile : LoadSuite())
+		{
+			if (profile.name.find(filter) == std::string::npos)
+			{
+				continue;
+			}
+
+			for (const std::string& arg : overrides)
+			{
+				if (!ApplyOverride(profile, arg))
+				{
+					printf("Invalid option '%s'\n", arg.c_str());
+					return 1;
+				}
+			}
+
+			PrintReport(profile, RunLoad(profile));
+			count++;
+		}
+
+		if (count == 0)
+		{
+			printf("No load scenario matches '%s'\n", filter.c_str());
+			return 1;
+		}
+
+		return 0;
+	}
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "HdrHistogram.h"
+#include "Impairment.h"
+
+namespace bench {
+
+	// A file size and its share of the transfers.
+	struct SizeWeight {
+		uint64_t bytes;
+		uint32_t weight;
+	};
+
+	// **********************************************************************
+	// End to end load scenario.
+	//	Closed loop : every simulated client owns a socket and starts its
+	//	next transfer as soon as the previous one ends. blksize and
+	//	windowsize are requested as options ; a server that doesn't
+	//	acknowledge them is run at 512 bytes, one block per ACK.
+	//
+	//	An active impairment applies to what the server and the clients
+	//	send alike, each side with its own seed.
+	//
+	//	Multicast clients ask for RFC 2090 and collect DATA from the
+	//	group on loopback, ACKing only when the server makes them master.
+	// **********************************************************************
+	struct LoadProfile {
+		std::string name;
+		uint32_t clients{ 256 };
+		uint32_t rrqPercent{ 100 };			// The rest are WRQ
+		uint16_t blockSize{ 512 };
+		uint16_t windowSize{ 1 };
+		std::vector<SizeWeight> sizes{ { 0x1000, 1 } };
+		std::chrono::seconds duration{ 10 };
+		uint16_t port{ 6969 };
+		uint32_t serverThreads{ 0 };			// 0 : half the cores
+		bool multicast{ false };
+		bool memory{ false };					// MemoryFileSystem, no disk
+		tftplib::ImpairmentProfile impairment{};
+	};
+
+	struct LoadReport {
+		uint64_t transfers{ 0 };
+		uint64_t failures{ 0 };
+		uint64_t retransmits{ 0 };
+		uint64_t bytes{ 0 };					// File bytes moved
+		uint64_t dropped{ 0 };					// By the impairment, both ways
+		double seconds{ 0.0 };
+		double cpuSeconds{ 0.0 };				// Whole process : server and clients
+		tftplib::HdrHistogram latencyUs{};		// Request sent to last block
+		tftplib::HdrHistogram recoveryUs{};		// Last progress to progress after a timeout
+	};
+
+	// Start an in-process Server on loopback and drive it with profile.
+	LoadReport RunLoad(const LoadProfile& profile);
+
+	// The regression suite.
+	std::vector<LoadProfile>& LoadSuite();
+
+	// BenchTftpLib load [filter] [key=value...]
+	int LoadMain(int argc, char** argv);
+}
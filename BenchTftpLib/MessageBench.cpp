@@ -0,0 +1,147 @@
+﻿#include "Bench.h"
+#include "tftp_messages.h"
+#include <string>
+
+// Message construction, per message type : create() through its
+// std::function allocator, as before, against the typed encode<T>.
+// Both write into the same datagram sized buffer. Request validation,
+// run on every incoming RRQ / WRQ, is swept over filename lengths.
+
+namespace {
+
+	using namespace tftplib;
+
+	struct Buffer {
+		alignas(64) uint8_t bytes[0x10000];
+	};
+
+	Buffer buffer;
+
+	void* Into(size_t) {
+		return buffer.bytes;
+	}
+
+	void CreateAck(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto msg = MessageAck::create(static_cast<uint16_t>(i),
+				[](size_t sz) { return Into(sz); });
+			bench::DoNotOptimize(msg);
+		}
+	}
+
+	void EncodeAck(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			size_t size = encode<MessageAck>(buffer.bytes, sizeof(buffer.bytes),
+				static_cast<uint16_t>(i));
+			bench::DoNotOptimize(size);
+		}
+	}
+
+	void CreateData(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto msg = MessageData::create(static_cast<uint16_t>(i), 1428,
+				[](size_t sz) { return Into(sz); });
+			bench::DoNotOptimize(msg);
+		}
+	}
+
+	void EncodeData(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			size_t size = encode<MessageData>(buffer.bytes, sizeof(buffer.bytes),
+				static_cast<uint16_t>(i), uint16_t{ 1428 });
+			bench::DoNotOptimize(size);
+		}
+	}
+
+	void CreateError(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto msg = MessageError::create(ErrorCode::FILE_NOT_FOUND,
+				[](size_t sz) { return Into(sz); });
+			bench::DoNotOptimize(msg);
+		}
+	}
+
+	void EncodeError(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			size_t size = encode<MessageError>(buffer.bytes, sizeof(buffer.bytes),
+				ErrorCode::FILE_NOT_FOUND);
+			bench::DoNotOptimize(size);
+		}
+	}
+
+	void CreateRequest(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			auto msg = MessageRequest::createReadRequest("images/boot.img",
+				mode::Mode::OCTET,
+				[](size_t sz) { return Into(sz); });
+			bench::DoNotOptimize(msg);
+		}
+	}
+
+	void EncodeRequest(bench::State& state)
+	{
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			size_t size = encode<MessageRequest>(buffer.bytes,
+				sizeof(buffer.bytes), OpCode::RRQ, "images/boot.img",
+				mode::Mode::OCTET);
+			bench::DoNotOptimize(size);
+		}
+	}
+
+	// A request for a filename of the given length, or one whose mode
+	// runs to the end of the datagram unterminated.
+	bench::Body ValidateRequest(size_t filenameLength, bool terminated = true)
+	{
+		return [=](bench::State& state) {
+			Buffer request{};
+			std::string filename(filenameLength, 'f');
+			uint16_t size = static_cast<uint16_t>(encode<MessageRequest>(
+				request.bytes, sizeof(request.bytes), OpCode::RRQ,
+				filename.c_str(), mode::Mode::OCTET));
+			if (!terminated)
+			{
+				size -= 1;
+			}
+
+			auto msg = reinterpret_cast<const MessageRequest*>(request.bytes);
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				bool valid = msg->Validate(size);
+				bench::DoNotOptimize(valid);
+			}
+
+			state.SetBytesProcessed(uint64_t{ size } * state.Iterations());
+		};
+	}
+}
+
+BENCHMARK("messages/ack/create", CreateAck);
+BENCHMARK("messages/ack/encode", EncodeAck);
+BENCHMARK("messages/data/create", CreateData);
+BENCHMARK("messages/data/encode", EncodeData);
+BENCHMARK("messages/error/create", CreateError);
+BENCHMARK("messages/error/encode", EncodeError);
+BENCHMARK("messages/rrq/create", CreateRequest);
+BENCHMARK("messages/rrq/encode", EncodeRequest);
+BENCHMARK("messages/rrq/validate/8", ValidateRequest(8));
+BENCHMARK("messages/rrq/validate/64", ValidateRequest(64));
+BENCHMARK("messages/rrq/validate/255", ValidateRequest(255));
+BENCHMARK("messages/rrq/validate/1024", ValidateRequest(1024));
+BENCHMARK("messages/rrq/validate-malformed/255", ValidateRequest(255, false));
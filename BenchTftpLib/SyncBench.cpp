@@ -0,0 +1,259 @@
+﻿#include "Bench.h"
+#include "FileLockTable.h"
+#include "RingBuffer.h"
+#include "RWInterlock.h"
+#include "Signal.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+// Cross thread primitives : RingBuffer hand-off, RWInterlock and file
+// locking and Signal wakeups, uncontended and under contention.
+
+namespace {
+
+	using Ring = tftplib::RingBuffer<uint64_t>;
+
+	bench::Body RingWriteRead(size_t size)
+	{
+		return [=](bench::State& state) {
+			Ring ring{ size };
+
+			state.ResetTimer();
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				ring.Write(i);
+				uint64_t v = ring.Read();
+				bench::DoNotOptimize(v);
+			}
+		};
+	}
+
+	// Thread 0 produces, thread 1 consumes ; both spin on full / empty.
+	bench::Body RingSpsc(size_t size)
+	{
+		auto shared = std::make_shared<bench::Shared<Ring>>();
+		return [=](bench::State& state) {
+			Ring& ring = shared->Setup(state, size);
+
+			if (state.ThreadIndex() == 0)
+			{
+				for (uint64_t i = 0; i < state.Iterations(); ++i)
+				{
+					while (!ring.Write(i))
+					{
+					}
+				}
+			}
+			else
+			{
+				for (uint64_t i = 0; i < state.Iterations(); ++i)
+				{
+					while (ring.IsEmpty())
+					{
+					}
+					uint64_t v = ring.Read();
+					bench::DoNotOptimize(v);
+				}
+			}
+
+			shared->Teardown(state);
+		};
+	}
+
+	void RWLockRead(bench::State& state)
+	{
+		tftplib::RWInterlock lock;
+
+		state.ResetTimer();
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			if (lock.TryLockRead())
+			{
+				lock.UnlockRead();
+			}
+		}
+	}
+
+	void RWLockWrite(bench::State& state)
+	{
+		tftplib::RWInterlock lock;
+
+		state.ResetTimer();
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			if (lock.TryLockWrite())
+			{
+				lock.UnlockWrite();
+			}
+		}
+	}
+
+	// Every thread reads, or thread 0 writes while the others read.
+	bench::Body RWLockContended(bool writer)
+	{
+		auto shared = std::make_shared<bench::Shared<tftplib::RWInterlock>>();
+		return [=](bench::State& state) {
+			tftplib::RWInterlock& lock = shared->Setup(state);
+			bool write = writer && state.ThreadIndex() == 0;
+
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				if (write)
+				{
+					if (lock.TryLockWrite())
+					{
+						lock.UnlockWrite();
+					}
+				}
+				else if (lock.TryLockRead())
+				{
+					lock.UnlockRead();
+				}
+			}
+
+			shared->Teardown(state);
+		};
+	}
+
+	// Blocking locks : thread 0 writes while the others read, everyone
+	// asleep until their turn.
+	bench::Body RWLockBlocking()
+	{
+		auto shared = std::make_shared<bench::Shared<tftplib::RWInterlock>>();
+		return [=](bench::State& state) {
+			tftplib::RWInterlock& lock = shared->Setup(state);
+			constexpr auto wait = std::chrono::milliseconds{ 1000 };
+
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				if (state.ThreadIndex() == 0)
+				{
+					if (lock.LockWrite(wait))
+					{
+						lock.UnlockWrite();
+					}
+				}
+				else if (lock.LockRead(wait))
+				{
+					lock.UnlockRead();
+				}
+			}
+
+			shared->Teardown(state);
+		};
+	}
+
+	// Each thread read locks and unlocks its own file, or all of them
+	// the same one : transfer admissions of different files, or of one
+	// boot image.
+	bench::Body FileLocks(bool same)
+	{
+		auto shared = std::make_shared<bench::Shared<tftplib::FileLockTable>>();
+		return [=](bench::State& state) {
+			uint32_t file = same ? 0 : state.ThreadIndex();
+			std::filesystem::path path = "C:/tftp/images/file"
+				+ std::to_string(file) + ".bin";
+			uint64_t hash = tftplib::FileLockTable::Hash(path);
+
+			tftplib::FileLockTable& table = shared->Setup(state);
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				if (table.LockRead(hash, path))
+				{
+					table.UnlockRead(hash, path);
+				}
+			}
+
+			shared->Teardown(state);
+		};
+	}
+
+	void SignalEmitConsume(bench::State& state)
+	{
+		tftplib::Signal signal;
+
+		state.ResetTimer();
+		for (uint64_t i = 0; i < state.Iterations(); ++i)
+		{
+			signal.EmitSignal();
+			bool consumed = signal.Consume();
+			bench::DoNotOptimize(consumed);
+		}
+	}
+
+	// Emission to wakeup, both directions merged.
+	std::string WakeLatencyLabel(const tftplib::Signal& a, const tftplib::Signal& b)
+	{
+		tftplib::Signal::WakeLatency la = a.GetWakeLatency();
+		tftplib::Signal::WakeLatency lb = b.GetWakeLatency();
+		uint64_t wakeups = la.wakeups + lb.wakeups;
+		if (wakeups == 0)
+		{
+			return {};
+		}
+
+		double meanUs = double((la.total + lb.total).count()) / double(wakeups) / 1e3;
+		double maxUs = double(std::max(la.max, lb.max).count()) / 1e3;
+
+		char label[64];
+		snprintf(label, sizeof(label), "wake avg %.2fus max %.2fus", meanUs, maxUs);
+		return label;
+	}
+
+	// Round trip : thread 0 wakes thread 1, which wakes it back.
+	struct PingPong {
+		tftplib::Signal ping;
+		tftplib::Signal pong;
+	};
+
+	bench::Body SignalPingPong()
+	{
+		auto shared = std::make_shared<bench::Shared<PingPong>>();
+		return [=](bench::State& state) {
+			PingPong& signals = shared->Setup(state);
+
+			for (uint64_t i = 0; i < state.Iterations(); ++i)
+			{
+				if (state.ThreadIndex() == 0)
+				{
+					signals.ping.EmitSignal();
+					signals.pong.WaitForSignal();
+				}
+				else
+				{
+					signals.ping.WaitForSignal();
+					signals.pong.EmitSignal();
+				}
+			}
+
+			// Thread 1 recorded its last ping wakeup before the last pong.
+			if (state.ThreadIndex() == 0)
+			{
+				state.SetLabel(WakeLatencyLabel(signals.ping, signals.pong));
+			}
+
+			shared->Teardown(state);
+		};
+	}
+}
+
+BENCHMARK("ring/write-read/16", RingWriteRead(16));
+BENCHMARK("ring/write-read/4096", RingWriteRead(4096));
+BENCHMARK_THREADS("ring/spsc/16", RingSpsc(16), 2);
+BENCHMARK_THREADS("ring/spsc/1024", RingSpsc(1024), 2);
+BENCHMARK_THREADS("ring/spsc/65536", RingSpsc(65536), 2);
+
+BENCHMARK("rwlock/read", RWLockRead);
+BENCHMARK("rwlock/write", RWLockWrite);
+BENCHMARK_THREADS("rwlock/readers", RWLockContended(false), 2, 4, 8);
+BENCHMARK_THREADS("rwlock/writer-readers", RWLockContended(true), 2, 4, 8);
+BENCHMARK_THREADS("rwlock/blocking", RWLockBlocking(), 2, 4, 8);
+BENCHMARK_THREADS("filelock/distinct", FileLocks(false), 1, 8, 64);
+BENCHMARK_THREADS("filelock/same", FileLocks(true), 1, 8, 64);
+
+BENCHMARK("signal/emit-consume", SignalEmitConsume);
+BENCHMARK_THREADS("signal/ping-pong", SignalPingPong(), 2);
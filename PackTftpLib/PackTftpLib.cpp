@@ -0,0 +1,33 @@
+﻿// PackTftpLib.cpp : builds pack archives for Server::SetPackArchive.
+//	Usage : PackTftpLib <directory> <pack>
+//	Packs every regular file under directory, named by its path relative
+//	to it, then maps the pack back to check it.
+//
+
+#include "PackArchive.h"
+#include <cstdio>
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+	if (argc != 3)
+	{
+		printf("Usage : PackTftpLib <directory> <pack>\n");
+		return 1;
+	}
+
+	if (!tftplib::PackArchive::Build(argv[1], argv[2], std::cerr))
+	{
+		return 1;
+	}
+
+	auto pack = tftplib::PackArchive::Open(argv[2]);
+	if (!pack)
+	{
+		printf("Cannot load %s back\n", argv[2]);
+		return 1;
+	}
+
+	printf("%u files packed in %s\n", pack->Count(), argv[2]);
+	return 0;
+}
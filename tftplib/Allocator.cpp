@@ -5,19 +5,19 @@
 
 namespace tftplib {
 
-	Allocator::Allocator(size_t bufSz)
+	Allocator::Allocator(size_t bufSz, uint32_t node, Arena::Pages pages)
 	{
 		if (bufSz < MinBlockSize) {
 			bufSz = MinBlockSize;
 		}
+		_arena = Arena(bufSz, node, pages);
 		_bufferSize = bufSz;
-		_buffer = new uint8_t[bufSz];
+		_buffer = static_cast<uint8_t*>(_arena.Data());
 		_cursor = 0;
 	}
 
 	Allocator::~Allocator()
 	{
-		delete[] _buffer;
 	}
 
 	Allocator::Allocator(Allocator&& rhs) noexcept
@@ -27,9 +27,11 @@ namespace tftplib {
 
 	Allocator& Allocator::operator=(Allocator&& rhs) noexcept
 	{
+		std::swap(_arena, rhs._arena);
 		std::swap(_buffer, rhs._buffer);
 		std::swap(_bufferSize, rhs._bufferSize);
 		std::swap(_cursor, rhs._cursor);
+		std::swap(_metrics, rhs._metrics);
 		for (size_t i = 0; i < CacheSize; i++) {
 			std::swap(_freeLists[i], rhs._freeLists[i]);
 		}
@@ -39,22 +41,28 @@ namespace tftplib {
 
 	void* Allocator::allocate(size_t sz)
 	{
-		std::lock_guard<std::mutex> lg {_mutex};
-
 		if (sz == 0) {
 			return nullptr;
 		}
 
-		sz += 8; // Add space for sz and alignment
-		size_t bs = blockSize(sz);
+		void* ptr = nullptr;
+		{
+			std::lock_guard<std::mutex> lg {_mutex};
 
-		if (bs == 0) {
-			return nullptr;
+			sz += 8; // Add space for sz and alignment
+			size_t bs = blockSize(sz);
+
+			if (bs != 0) {
+				ptr = allocFromCache(bs);
+				if (ptr == nullptr) {
+					ptr = allocFromBuffer(bs);
+				}
+			}
 		}
 
-		void* ptr = allocFromCache(sz);
-		if (ptr == nullptr) {
-			ptr = allocFromBuffer(sz);
+		// Counted outside the lock.
+		if (ptr == nullptr && _metrics != nullptr) {
+			_metrics->Add(Counter::ALLOCATOR_EXHAUSTED);
 		}
 
 		return ptr;
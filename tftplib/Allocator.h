@@ -3,6 +3,8 @@
 #include <mutex>
 #include <cstdint>
 #include <bit>
+#include "Arena.h"
+#include "Metrics.h"
 
 namespace tftplib {
 	class Allocator
@@ -15,7 +17,9 @@ namespace tftplib {
 			1 + std::bit_width(MaxBlockSize) - std::bit_width(MinBlockSize);
 
 	public:
-		Allocator(size_t bufSz);
+		Allocator(size_t bufSz,
+			uint32_t node = Numa::AnyNode,
+			Arena::Pages pages = Arena::Pages::NORMAL);
 		~Allocator();
 		Allocator(Allocator&&) noexcept;
 		Allocator& operator=(Allocator&&) noexcept;
@@ -26,6 +30,9 @@ namespace tftplib {
 		void* allocate(size_t sz);
 		void free(void* ptr);
 
+		// Failed allocations are counted as ALLOCATOR_EXHAUSTED.
+		void setMetrics(Metrics* metrics) { _metrics = metrics; }
+
 	private:
 		size_t blockSize(size_t sz) const;
 		void* allocFromCache(size_t bs);
@@ -33,9 +40,11 @@ namespace tftplib {
 
 	private:
 		void* _freeLists[CacheSize] = {0};
+		Arena _arena;
 		uint8_t *_buffer {nullptr};
 		size_t _bufferSize{ 0 };
 		size_t _cursor{ 0 };
+		Metrics* _metrics{ nullptr };
 		
 		std::mutex _mutex;
 	};
@@ -0,0 +1,136 @@
+﻿#include "pch.h"
+#include "Arena.h"
+#include <utility>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cstdint>
+#include <sys/mman.h>
+#include <linux/mman.h>
+#endif
+
+namespace tftplib {
+
+	static size_t RoundUp(size_t size, size_t align)
+	{
+		return (size + align - 1) & ~(align - 1);
+	}
+
+	Arena::Arena(size_t size, uint32_t node, Pages pages)
+	{
+		if (pages == Pages::HUGE_PAGES && AllocateHuge(size, node))
+		{
+			return;
+		}
+
+		_data = Numa::AllocateOnNode(size, node);
+		_size = size;
+		_mappedSize = size;
+		_backing = Backing::NORMAL;
+	}
+
+	Arena::~Arena()
+	{
+		Free();
+	}
+
+	Arena::Arena(Arena&& rhs) noexcept
+	{
+		*this = std::move(rhs);
+	}
+
+	Arena& Arena::operator=(Arena&& rhs) noexcept
+	{
+		std::swap(_data, rhs._data);
+		std::swap(_size, rhs._size);
+		std::swap(_mappedSize, rhs._mappedSize);
+		std::swap(_backing, rhs._backing);
+		return *this;
+	}
+
+	void Arena::Free()
+	{
+		Numa::Free(_data, _mappedSize);
+
+		_data = nullptr;
+		_size = 0;
+		_mappedSize = 0;
+		_backing = Backing::NONE;
+	}
+
+#if defined(_WIN32)
+	bool Arena::AllocateHuge(size_t size, uint32_t node)
+	{
+		// Needs SeLockMemoryPrivilege. Fails cleanly without it.
+		size_t largePage = GetLargePageMinimum();
+		if (largePage == 0)
+		{
+			return false;
+		}
+
+		size_t rounded = RoundUp(size, largePage);
+		DWORD flags = MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES;
+		void* ptr = (node == Numa::AnyNode)
+			? VirtualAlloc(nullptr, rounded, flags, PAGE_READWRITE)
+			: VirtualAllocExNuma(GetCurrentProcess(), nullptr, rounded,
+				flags, PAGE_READWRITE, node);
+
+		if (ptr == nullptr)
+		{
+			return false;
+		}
+
+		_data = ptr;
+		_size = rounded;
+		_mappedSize = rounded;
+		_backing = Backing::HUGE_PAGES;
+		return true;
+	}
+#else
+	bool Arena::AllocateHuge(size_t size, uint32_t node)
+	{
+		size_t rounded = RoundUp(size, HugePageSize);
+
+		// Explicit huge pages, from the reserved hugetlb pool.
+		void* ptr = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (ptr != MAP_FAILED)
+		{
+			Numa::PreferNode(ptr, rounded, node);
+
+			_data = ptr;
+			_size = rounded;
+			_mappedSize = rounded;
+			_backing = Backing::HUGE_PAGES;
+			return true;
+		}
+
+		// Transparent huge pages : needs a huge page aligned range, so
+		// over map and trim both ends.
+		size_t span = rounded + HugePageSize;
+		uint8_t* raw = static_cast<uint8_t*>(mmap(nullptr, span,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (raw == MAP_FAILED)
+		{
+			return false;
+		}
+
+		uint8_t* aligned = reinterpret_cast<uint8_t*>(
+			RoundUp(reinterpret_cast<uintptr_t>(raw), HugePageSize));
+		size_t head = aligned - raw;
+		size_t tail = span - head - rounded;
+		if (head > 0) munmap(raw, head);
+		if (tail > 0) munmap(aligned + rounded, tail);
+
+		madvise(aligned, rounded, MADV_HUGEPAGE);
+		Numa::PreferNode(aligned, rounded, node);
+
+		_data = aligned;
+		_size = rounded;
+		_mappedSize = rounded;
+		_backing = Backing::TRANSPARENT_HUGE_PAGES;
+		return true;
+	}
+#endif
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "Numa.h"
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Block of memory backing pools and allocators.
+	//	With Pages::HUGE_PAGES the block is rounded up to HugePageSize and
+	//	backed by explicit huge pages when the system has some reserved. On
+	//	Linux it falls back to transparent huge pages, then to normal pages.
+	//	GetBacking() tells what was actually obtained.
+	// **********************************************************************
+	class Arena
+	{
+	public:
+		enum class Pages {
+			NORMAL,
+			HUGE_PAGES
+		};
+
+		enum class Backing {
+			NONE,
+			NORMAL,
+			HUGE_PAGES,					// MAP_HUGETLB / MEM_LARGE_PAGES
+			TRANSPARENT_HUGE_PAGES		// Normal mapping advised for THP
+		};
+
+		static constexpr size_t HugePageSize = 0x200000;
+
+	public:
+		Arena() = default;
+		Arena(size_t size,
+			uint32_t node = Numa::AnyNode,
+			Pages pages = Pages::NORMAL);
+
+		~Arena();
+		Arena(Arena&&) noexcept;
+		Arena& operator=(Arena&&) noexcept;
+
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		void* Data() const { return _data; }
+		size_t Size() const { return _size; }
+		Backing GetBacking() const { return _backing; }
+
+	private:
+		bool AllocateHuge(size_t size, uint32_t node);
+		void Free();
+
+	private:
+		void* _data{ nullptr };
+		size_t _size{ 0 };					// Usable size
+		size_t _mappedSize{ 0 };			// Size to release
+		Backing _backing{ Backing::NONE };
+	};
+}
@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace tftplib {
+
+	// Produces one file, a piece at a time, as the transfer asks for it.
+	class ContentGenerator
+	{
+	public:
+		virtual ~ContentGenerator() = default;
+
+		// Up to size more bytes of the file. 0 at the end, -1 when the
+		// file can't be made after all.
+		virtual size_t Generate(uint8_t* buffer, size_t size) = 0;
+	};
+
+	// **********************************************************************
+	// Makes the files whose names match the pattern it's registered with
+	//	(Server::AddContentProvider), e.g. a boot config per MAC address.
+	//	Names are normalized (VirtualFileSystem::Normalize).
+	//
+	//	Called from the server workers, concurrently.
+	// **********************************************************************
+	class ContentProvider
+	{
+	public:
+		virtual ~ContentProvider() = default;
+
+		// Files with the same key have the same content : one is cached
+		// for all.
+		virtual std::string Key(std::string_view name) const
+		{
+			return std::string{ name };
+		}
+
+		// nullptr : no such file.
+		virtual std::unique_ptr<ContentGenerator> Open(std::string_view name) = 0;
+	};
+}
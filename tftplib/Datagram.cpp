@@ -4,40 +4,12 @@
 #include <bit>
 namespace tftplib {
 	
-	Datagram::Datagram(Datagram&& rhs) noexcept
+	void Datagram::Release()
 	{
-		*this = std::move(rhs);
-	}
-
-	Datagram& Datagram::operator=(Datagram&& rhs) noexcept
-	{
-		std::swap(_valid, rhs._valid);
-		std::swap(_isBroadcast, rhs._isBroadcast);
-		std::swap(_sourceAddress, rhs._sourceAddress);
-		std::swap(_destAddress, rhs._destAddress);
-		std::swap(_sourcePort, rhs._sourcePort);
-		std::swap(_destPort, rhs._destPort);
-		std::swap(_data, rhs._data);
-		std::swap(_dataSize, rhs._dataSize);
-		std::swap(_dataBufferSize, rhs._dataBufferSize);
-		std::swap(_controlBuffer, rhs._controlBuffer);
-		std::swap(_controlSize, rhs._controlSize);
-		std::swap(_controlBufferSize, rhs._controlBufferSize);
-		std::swap(_reclaimer, rhs._reclaimer);
-
-		return *this;
-	}
-
-	
-
-	Datagram::~Datagram() 
-	{
-		std::shared_ptr<DatagramFactory> reclaimer = _reclaimer.lock();
-		if (!reclaimer) {
-			return;
+		if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			_factory->Reclaim(*this);
 		}
-
-		reclaimer->Reclaim(*this);
 	}
 
 	bool Datagram::IsValid() const 
@@ -45,17 +17,22 @@ namespace tftplib {
 		return _valid;
 	}
 
+	Datagram::Clock::time_point Datagram::GetReceiveTime() const
+	{
+		return _receivedAt;
+	}
+
 	bool Datagram::IsBroadcast() const
 	{
 		return _isBroadcast;
 	}
 
-	const std::string &Datagram::GetSourceAddress() const
+	const char* Datagram::GetSourceAddress() const
 	{
 		return _sourceAddress;
 	}
 
-	const std::string &Datagram::GetDestAddress() const
+	const char* Datagram::GetDestAddress() const
 	{
 		return _destAddress;
 	}
@@ -70,6 +47,16 @@ namespace tftplib {
 		return _destPort;
 	}
 
+	const SocketAddress& Datagram::GetSourceSocketAddress() const
+	{
+		return _source;
+	}
+
+	const SocketAddress& Datagram::GetDestSocketAddress() const
+	{
+		return _dest;
+	}
+
 	const char* Datagram::GetData() const
 	{
 		return _data;
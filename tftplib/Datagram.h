@@ -1,33 +1,69 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <string>
-#include <memory>
+#include <utility>
 
 namespace tftplib
 {
 	class DatagramFactory;
 	class DatagramAssembly;
+	class DatagramRef;
 
+	// **********************************************************************
+	// Raw socket address, as handed over by the OS.
+	//	Large enough for a sockaddr_in6. Kept alongside the printable
+	//	address so replies go out without parsing it back.
+	// **********************************************************************
+	struct SocketAddress
+	{
+		static constexpr size_t Capacity = 28;
+
+		alignas(8) uint8_t bytes[Capacity]{};
+		uint8_t size{ 0 };
+
+		bool IsSet() const { return size != 0; }
+	};
+
+	// **********************************************************************
+	// A datagram lives in the header of its pool slot, its control and
+	//	data buffers right behind it. It is reference counted in place and
+	//	handed around through DatagramRef : receiving, sharing and
+	//	releasing one never touches the heap.
+	//
+	//	The factory must outlive its datagrams. The Server guarantees it by
+	//	releasing its factories only once every worker is gone.
+	// **********************************************************************
 	class Datagram
 	{
 	public:
-		
-		// Copy does not make sense.
+		using Clock = std::chrono::steady_clock;
+
+		// Fits any printable IPv4 or IPv6 address (INET6_ADDRSTRLEN).
+		static constexpr size_t AddressLength = 46;
+
+		// A datagram is bound to its pool slot.
 		Datagram(const Datagram&) = delete;
 		Datagram& operator=(const Datagram&) = delete;
-		
-		// Move does make sense
-		Datagram(Datagram&&) noexcept;
-		Datagram& operator=(Datagram&&) noexcept;
-		~Datagram();
+		Datagram(Datagram&&) = delete;
+		Datagram& operator=(Datagram&&) = delete;
 
 		bool IsValid() const;
 		bool IsBroadcast() const;
-		const std::string &GetSourceAddress() const;
-		const std::string &GetDestAddress() const;
+		const char* GetSourceAddress() const;
+		const char* GetDestAddress() const;
 		uint16_t GetSourcePort() const;
 		uint16_t GetDestPort() const;
+
+		// Raw addresses. Unset unless the OS or the builder provided them.
+		const SocketAddress& GetSourceSocketAddress() const;
+		const SocketAddress& GetDestSocketAddress() const;
+
+		// When the socket handed the datagram over. Unset for datagrams
+		// built locally.
+		Clock::time_point GetReceiveTime() const;
 		
 		const char* GetData() const;
 		uint16_t GetDataSize() const;
@@ -40,14 +76,27 @@ namespace tftplib
 	private:
 		// Delegate construction to factory class.
 		Datagram() = default;
+		~Datagram() = default;
+
+		void AddRef() {
+			_refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Release();
 
 	private:
+		std::atomic<uint32_t> _refs{ 1 };
+		DatagramFactory* _factory{ nullptr };
+
 		bool _valid{ false };
 		bool _isBroadcast{ false };
-		std::string _sourceAddress {};
-		std::string _destAddress{};
+		char _sourceAddress[AddressLength]{};
+		char _destAddress[AddressLength]{};
 		uint16_t _sourcePort{ 0 };
 		uint16_t _destPort{ 0 };
+		SocketAddress _source{};
+		SocketAddress _dest{};
+		Clock::time_point _receivedAt{};
 
 		char* _data{ nullptr };
 		uint16_t _dataSize{ 0 };
@@ -56,10 +105,9 @@ namespace tftplib
 		uint16_t _controlSize{ 0 };
 		uint16_t _controlBufferSize{ 0 };
 
-		std::weak_ptr<DatagramFactory>_reclaimer {};
-
 		friend class DatagramFactory;
 		friend class DatagramAssembly;
+		friend class DatagramRef;
 
 	public:
 		Datagram& Write(const void* data, size_t size);
@@ -74,6 +122,51 @@ namespace tftplib
 		Datagram& operator<<(int64_t value);
 		Datagram& operator<<(const char* value);
 	};
+
+	// **********************************************************************
+	// Intrusive handle on a Datagram. Same use as a shared_ptr, but the
+	//	count lives in the datagram and the last release returns the slot
+	//	to its factory.
+	// **********************************************************************
+	class DatagramRef
+	{
+	public:
+		DatagramRef() = default;
+		DatagramRef(std::nullptr_t) {}
+
+		DatagramRef(const DatagramRef& rhs) : _datagram{ rhs._datagram } {
+			if (_datagram) _datagram->AddRef();
+		}
+
+		DatagramRef(DatagramRef&& rhs) noexcept
+			: _datagram{ std::exchange(rhs._datagram, nullptr) } {}
+
+		DatagramRef& operator=(DatagramRef rhs) noexcept {
+			std::swap(_datagram, rhs._datagram);
+			return *this;
+		}
+
+		~DatagramRef() { Reset(); }
+
+		void Reset() {
+			if (_datagram) std::exchange(_datagram, nullptr)->Release();
+		}
+
+		Datagram* get() const { return _datagram; }
+		Datagram* operator->() const { return _datagram; }
+		Datagram& operator*() const { return *_datagram; }
+		explicit operator bool() const { return _datagram != nullptr; }
+		bool operator==(std::nullptr_t) const { return _datagram == nullptr; }
+
+	private:
+		// Adopts the reference the factory created the datagram with.
+		explicit DatagramRef(Datagram* adopted) : _datagram{ adopted } {}
+
+	private:
+		Datagram* _datagram{ nullptr };
+
+		friend class DatagramAssembly;
+	};
 }
 
 
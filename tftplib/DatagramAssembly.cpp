@@ -1,92 +1,123 @@
 ﻿#include "pch.h"
 #include "DatagramAssembly.h"
 #include "DatagramFactory.h"
+#include <algorithm>
+#include <cstring>
 
 namespace tftplib {
 	// **********************************************************************
 	// Assembly impl
 	// **********************************************************************
 
-	DatagramAssembly::DatagramAssembly(
-		std::weak_ptr<DatagramFactory> parent)
-		: _parent{ parent }
-		, _datagram{ new Datagram{} }
+	DatagramAssembly::DatagramAssembly(Datagram* datagram)
+		: _datagram{ datagram }
+		, _isValid{ datagram != nullptr }
 	{
-		_isValid = _parent->InitializeDatagramBuffers(*_datagram);
+	}
+
+	static void CopyAddress(char (&to)[Datagram::AddressLength],
+		std::string_view addr)
+	{
+		size_t len = std::min(addr.size(), Datagram::AddressLength - 1);
+		memcpy(to, addr.data(), len);
+		to[len] = '\0';
 	}
 
 	DatagramAssembly&
 	DatagramAssembly::SetBroadcast(bool broadcast)
 	{
-		_datagram->_isBroadcast = broadcast;
+		if (_datagram) _datagram->_isBroadcast = broadcast;
 		return *this;
 	}
 
 	DatagramAssembly&
-	DatagramAssembly::SetSourceAddress(std::string addr)
+	DatagramAssembly::SetReceiveTime(Datagram::Clock::time_point time)
 	{
-		_datagram->_sourceAddress = addr;
+		if (_datagram) _datagram->_receivedAt = time;
 		return *this;
 	}
 
 	DatagramAssembly&
-	DatagramAssembly::SetDestinationAddress(std::string addr)
+	DatagramAssembly::SetSourceAddress(std::string_view addr)
 	{
-		_datagram->_destAddress = addr;
+		if (_datagram) CopyAddress(_datagram->_sourceAddress, addr);
+		return *this;
+	}
+
+	DatagramAssembly&
+	DatagramAssembly::SetDestinationAddress(std::string_view addr)
+	{
+		if (_datagram) CopyAddress(_datagram->_destAddress, addr);
 		return *this;
 	}
 
 	DatagramAssembly&
 	DatagramAssembly::SetSourcePort(uint16_t port)
 	{
-		_datagram->_sourcePort = port;
+		if (_datagram) _datagram->_sourcePort = port;
 		return *this;
 	}
 
 	DatagramAssembly&
 	DatagramAssembly::SetDestinationPort(uint16_t port)
 	{
-		_datagram->_destPort = port;
+		if (_datagram) _datagram->_destPort = port;
+		return *this;
+	}
+
+	DatagramAssembly&
+	DatagramAssembly::SetSource(const SocketAddress& addr)
+	{
+		if (_datagram) _datagram->_source = addr;
+		return *this;
+	}
+
+	DatagramAssembly&
+	DatagramAssembly::SetDestination(const SocketAddress& addr)
+	{
+		if (_datagram) _datagram->_dest = addr;
 		return *this;
 	}
 
 	char*
 	DatagramAssembly::GetDataBuffer()
 	{
-		return _datagram->GetDataBuffer();
+		return _datagram ? _datagram->GetDataBuffer() : nullptr;
 	}
 
 	uint16_t
 	DatagramAssembly::GetDataBufferSize()
 	{
-		return _datagram->_dataBufferSize;
+		return _datagram ? _datagram->_dataBufferSize : 0;
 	}
 
 	char*
 	DatagramAssembly::GetControlBuffer()
 	{
-		return _datagram->GetControlBuffer();
+		return _datagram ? _datagram->GetControlBuffer() : nullptr;
 	}
 
 	uint16_t
 	DatagramAssembly::GetControlBufferSize()
 	{
-		return _datagram->_controlBufferSize;
+		return _datagram ? _datagram->_controlBufferSize : 0;
 	}
 
 	DatagramAssembly&
 	DatagramAssembly::SetDataSize(uint16_t size)
 	{
-		_datagram->_dataSize = size;
+		if (_datagram) _datagram->_dataSize = size;
 		return *this;
 	}
 
-	std::shared_ptr<tftplib::Datagram> DatagramAssembly::Finalize()
+	DatagramRef DatagramAssembly::Finalize()
 	{
-		std::shared_ptr<tftplib::Datagram> finalized {nullptr};
-		std::swap(finalized, _datagram);
+		DatagramRef finalized{ std::move(_datagram) };
 
-		finalized->_valid = true;
+		if (finalized)
+		{
+			finalized->_valid = true;
+		}
 		return finalized;
 	}
 }
\ No newline at end of file
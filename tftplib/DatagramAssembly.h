@@ -1,25 +1,27 @@
 ﻿#pragma once
 
-#include <memory>
-#include <string>
+#include <string_view>
 #include <cstdint>
+#include "Datagram.h"
 
 namespace tftplib {
 
 	class DatagramFactory;
-	class Datagram;
 
 	class DatagramAssembly
 	{
 	private:
-		DatagramAssembly(std::weak_ptr<DatagramFactory> parent);
+		DatagramAssembly(Datagram* datagram);
 
 	public:
 		DatagramAssembly& SetBroadcast(bool broadcast);
-		DatagramAssembly& SetSourceAddress(std::string addr);
-		DatagramAssembly& SetDestinationAddress(std::string addr);
+		DatagramAssembly& SetSourceAddress(std::string_view addr);
+		DatagramAssembly& SetDestinationAddress(std::string_view addr);
 		DatagramAssembly& SetSourcePort(uint16_t port);
 		DatagramAssembly& SetDestinationPort(uint16_t port);
+		DatagramAssembly& SetSource(const SocketAddress& addr);
+		DatagramAssembly& SetDestination(const SocketAddress& addr);
+		DatagramAssembly& SetReceiveTime(Datagram::Clock::time_point time);
 
 		char* GetDataBuffer();
 		uint16_t GetDataBufferSize();
@@ -29,13 +31,12 @@ namespace tftplib {
 
 		DatagramAssembly& SetDataSize(uint16_t size);
 
-		std::shared_ptr<tftplib::Datagram> Finalize();
+		DatagramRef Finalize();
 
 		bool IsValid() const { return _isValid; }
 
 	private:
-		std::shared_ptr<DatagramFactory> _parent;
-		std::shared_ptr<tftplib::Datagram> _datagram;
+		DatagramRef _datagram;
 
 		bool _isValid {false};
 
@@ -1,5 +1,6 @@
 ﻿#include "pch.h"
 #include "DatagramFactory.h"
+#include <new>
 
 namespace tftplib {
 
@@ -8,19 +9,16 @@ namespace tftplib {
 	// **********************************************************************
 
 	std::shared_ptr<DatagramFactory>
-	DatagramFactory::Instantiate(size_t poolSize)
+	DatagramFactory::Instantiate(size_t poolSize, uint32_t node,
+		Arena::Pages pages)
 	{
-		std::shared_ptr<DatagramFactory> factory(
-			new DatagramFactory(poolSize) );
-
-		factory->_self = factory;
-
-		return factory;
+		return std::shared_ptr<DatagramFactory>(
+			new DatagramFactory(poolSize, node, pages) );
 	}
 
-	DatagramFactory::DatagramFactory(size_t poolSize)
-		: _poolOfDatagram(poolSize)
-		, _poolOfControlData(poolSize)
+	DatagramFactory::DatagramFactory(size_t poolSize, uint32_t node,
+		Arena::Pages pages)
+		: _slots(poolSize, node, pages)
 	{
 	}
 
@@ -31,10 +29,32 @@ namespace tftplib {
 	DatagramAssembly
 	DatagramFactory::StartAssembly()
 	{
-		return DatagramAssembly{_self};
+		char* slot = _slots.Alloc();
+		if (slot == nullptr)
+		{
+			if (_metrics)
+			{
+				_metrics->Add(Counter::DATAGRAM_POOL_EXHAUSTED);
+			}
+			return DatagramAssembly{ nullptr };
+		}
+
+		if (_metrics)
+		{
+			_metrics->Add(Gauge::DATAGRAMS_IN_USE, 1);
+		}
+
+		Datagram* datagram = new (slot) Datagram{};
+		datagram->_factory = this;
+		datagram->_controlBuffer = slot + HeaderSize;
+		datagram->_controlBufferSize = ControlBufferSize;
+		datagram->_data = slot + HeaderSize + ControlBufferSize;
+		datagram->_dataBufferSize = DataBufferSize;
+
+		return DatagramAssembly{ datagram };
 	}
 
-	std::shared_ptr<Datagram>
+	DatagramRef
 	DatagramFactory::BuildResponse(const uint8_t *data,
 			uint16_t len,
 			const Datagram& respondTo)
@@ -43,6 +63,7 @@ namespace tftplib {
 
 		txAssembly.SetDestinationAddress(respondTo.GetSourceAddress());
 		txAssembly.SetDestinationPort(respondTo.GetSourcePort());
+		txAssembly.SetDestination(respondTo.GetSourceSocketAddress());
 		
 		if (len > txAssembly.GetDataBufferSize())
 		{
@@ -57,22 +78,13 @@ namespace tftplib {
 	void 
 	DatagramFactory::Reclaim(Datagram& datagram)
 	{
-		_poolOfDatagram.Free(datagram.GetDataBuffer());
-		_poolOfControlData.Free(datagram.GetControlBuffer());
-	}
+		datagram.~Datagram();
+		_slots.Free(reinterpret_cast<char*>(&datagram));
 
-	bool
-	DatagramFactory::InitializeDatagramBuffers(Datagram& datagram)
-	{
-		datagram._dataBufferSize = 
-			static_cast<uint16_t>(_poolOfDatagram.BufferSize());
-		datagram._controlBufferSize = 
-			static_cast<uint16_t>(_poolOfControlData.BufferSize());
-		datagram._data = _poolOfDatagram.Alloc();
-		datagram._controlBuffer = _poolOfControlData.Alloc();
-		datagram._reclaimer = _self;
-
-		return (datagram._data && datagram._controlBuffer);
+		if (_metrics)
+		{
+			_metrics->Add(Gauge::DATAGRAMS_IN_USE, -1);
+		}
 	}
 
 }
@@ -3,36 +3,62 @@
 #include "Datagram.h"
 #include "PoolOfBuffers.h"
 #include "DatagramAssembly.h"
+#include "Metrics.h"
+#include <memory>
 
 namespace tftplib
 {
 	class Datagram;
 
+	// **********************************************************************
+	// Hands out datagrams from a pool of fixed size slots :
+	//	[ Datagram header | control buffer | data buffer ]
+	// Alloc and Reclaim may be called from any thread.
+	// **********************************************************************
 	class DatagramFactory
 	{
 	public:
-		static std::shared_ptr<DatagramFactory> Instantiate(size_t poolSize = 16);
+		static constexpr size_t ControlBufferSize = 0x0080;
+		static constexpr size_t DataBufferSize = 0xFFFF;
+
+	private:
+		// Slots and the buffers in them stay cache line aligned.
+		static constexpr size_t HeaderSize =
+			(sizeof(Datagram) + 63) & ~size_t{ 63 };
+		static constexpr size_t SlotSize =
+			(HeaderSize + ControlBufferSize + DataBufferSize + 63) & ~size_t{ 63 };
+
+	public:
+		static std::shared_ptr<DatagramFactory> Instantiate(size_t poolSize = 16,
+			uint32_t node = Numa::AnyNode,
+			Arena::Pages pages = Arena::Pages::NORMAL);
 
 	public:
 		~DatagramFactory();
 
 		DatagramAssembly StartAssembly();
-		std::shared_ptr<Datagram> BuildResponse(const uint8_t *data, 
+		DatagramRef BuildResponse(const uint8_t *data, 
 			uint16_t len, 
 			const Datagram &respondTo);
 	
+		// Called by the last DatagramRef release.
 		void Reclaim(Datagram &datagram);
 
-	private:
-		DatagramFactory(size_t poolSize = 16);
+		// Pool exhaustion and datagrams in use are reported to metrics.
+		void SetMetrics(Metrics* metrics) {
+			_metrics = metrics;
+		}
 
-		bool InitializeDatagramBuffers(Datagram& datagram);
+		// What actually backs the datagram buffers.
+		Arena::Backing GetBacking() const {
+			return _slots.GetBacking();
+		}
 
 	private:
-		tftplib::PoolOfBuffers<0xFFFF> _poolOfDatagram;
-		tftplib::PoolOfBuffers<0x0080> _poolOfControlData;
-		std::weak_ptr<DatagramFactory> _self {};
+		DatagramFactory(size_t poolSize, uint32_t node, Arena::Pages pages);
 
-		friend class DatagramAssembly;
+	private:
+		tftplib::PoolOfBuffers<SlotSize> _slots;
+		Metrics* _metrics{ nullptr };
 	};
 }
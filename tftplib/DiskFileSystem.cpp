@@ -0,0 +1,372 @@
+﻿#include "pch.h"
+#include "DiskFileSystem.h"
+#include "FileReader.h"
+#include "FileWriter.h"
+#include "HaloBuffer.h"
+#include <functional>
+
+namespace tftplib {
+
+	namespace {
+
+		class DiskReader : public VfsReader
+		{
+		public:
+			using ReturnBuffer = std::function<void(std::unique_ptr<HaloBuffer>)>;
+
+			DiskReader(FileSecurityHandler& security, std::filesystem::path path,
+				uint64_t lockHash)
+				: _security{ security }
+				, _path{ std::move(path) }
+				, _lockHash{ lockHash }
+			{
+			}
+
+			~DiskReader()
+			{
+				// Readers first : they hold the file.
+				_stream = nullptr;
+				_reader = nullptr;
+				if (_buffer)
+				{
+					_return(std::move(_buffer));
+				}
+				_security.UnlockFileForRead(_path, _lockHash);
+			}
+
+			void Share(std::unique_ptr<SharedFileStream::Reader> stream)
+			{
+				_stream = std::move(stream);
+			}
+
+			bool IsShared() const
+			{
+				return _stream != nullptr;
+			}
+
+			void Open(bool netascii, std::unique_ptr<HaloBuffer> buffer,
+				ReturnBuffer giveBack)
+			{
+				auto eolMode = netascii
+					? FileReader::ForceNativeEOL::YES
+					: FileReader::ForceNativeEOL::NO;
+
+				// Read ahead : one file read serves many DATA blocks.
+				_buffer = std::move(buffer);
+				_return = std::move(giveBack);
+				_reader = std::make_unique<FileReader>(_path, _buffer.get(), eolMode);
+			}
+
+			size_t ReadBlock(uint8_t* buffer, size_t bufferSize) override
+			{
+				return _stream
+					? _stream->ReadBlock(buffer, bufferSize)
+					: _reader->ReadBlock(buffer, bufferSize);
+			}
+
+		private:
+			FileSecurityHandler& _security;
+			const std::filesystem::path _path;
+			const uint64_t _lockHash;
+
+			std::unique_ptr<SharedFileStream::Reader> _stream{ nullptr };
+			std::unique_ptr<HaloBuffer> _buffer{ nullptr };
+			ReturnBuffer _return{};
+			std::unique_ptr<FileReader> _reader{ nullptr };
+		};
+
+		class DiskWriter : public VfsWriter
+		{
+		public:
+			DiskWriter(FileSecurityHandler& security, PathCache& paths,
+				std::filesystem::path path, uint64_t lockHash, bool netascii)
+				: _security{ security }
+				, _paths{ paths }
+				, _path{ std::move(path) }
+				, _lockHash{ lockHash }
+			{
+				auto eolMode = netascii
+					? FileWriter::ForceNativeEOL::YES
+					: FileWriter::ForceNativeEOL::NO;
+
+				// Only netascii uploads go through the staging buffer.
+				if (netascii)
+				{
+					_buffer = std::make_unique<HaloBuffer>(0x020000);
+				}
+
+				_writer = std::make_unique<FileWriter>(_path, _buffer.get(), eolMode);
+			}
+
+			~DiskWriter()
+			{
+				_writer = nullptr;
+
+				// Readers can't have the file before it's forgotten.
+				_paths.Invalidate(_path);
+				_security.UnlockFileForWrite(_path, _lockHash);
+			}
+
+			bool Preallocate(uint64_t size) override
+			{
+				std::error_code ec;
+				auto space = std::filesystem::space(_path.parent_path(), ec);
+				if (!ec && size > space.available)
+				{
+					return false;
+				}
+
+				// Reserved in one piece when the volume allows it.
+				_writer->Preallocate(size);
+				return true;
+			}
+
+			void WriteBlock(const uint8_t* buffer, size_t bufferSize) override
+			{
+				_writer->WriteBlock(buffer, bufferSize);
+			}
+
+			void Commit() override
+			{
+				_writer->Finalize();
+			}
+
+		private:
+			FileSecurityHandler& _security;
+			PathCache& _paths;
+			const std::filesystem::path _path;
+			const uint64_t _lockHash;
+
+			std::unique_ptr<HaloBuffer> _buffer{ nullptr };
+			std::unique_ptr<FileWriter> _writer{ nullptr };
+		};
+
+		class DiskWriteTicket : public VfsWriteTicket
+		{
+		public:
+			DiskWriteTicket(FileSecurityHandler& security, PathCache& paths,
+				std::filesystem::path path, uint64_t lockHash)
+				: _security{ security }
+				, _paths{ paths }
+				, _path{ std::move(path) }
+				, _lockHash{ lockHash }
+			{
+			}
+
+			~DiskWriteTicket()
+			{
+				if (_queued)
+				{
+					_security.DequeueFileForWrite(_path, _lockHash);
+				}
+			}
+
+			VirtualFileSystem::Result TryOpen(bool netascii,
+				std::unique_ptr<VfsWriter>& writer) override
+			{
+				using Result = VirtualFileSystem::Result;
+
+				// Spent : the writer has the file.
+				if (!_queued)
+				{
+					return Result::INVALID_FILE_LOCKED;
+				}
+
+				Result result = _security.IsFileValidForWrite(_path);
+				if (result != Result::VALID)
+				{
+					return result;
+				}
+
+				if (!_security.LockQueuedFileForWrite(_path, _lockHash))
+				{
+					return Result::INVALID_FILE_LOCKED;
+				}
+
+				_queued = false;
+				writer = std::make_unique<DiskWriter>(_security, _paths, _path,
+					_lockHash, netascii);
+				return Result::VALID;
+			}
+
+		private:
+			FileSecurityHandler& _security;
+			PathCache& _paths;
+			const std::filesystem::path _path;
+			const uint64_t _lockHash;
+			bool _queued{ true };
+		};
+	}
+
+	DiskFileSystem::DiskFileSystem(FileSecurityHandler& security, Metrics& metrics)
+		: _security{ security }
+		, _streams{ metrics }
+		, _paths{ metrics }
+	{
+	}
+
+	DiskFileSystem& DiskFileSystem::SetSharedReads(bool enable)
+	{
+		_sharedReads = enable;
+		return *this;
+	}
+
+	DiskFileSystem& DiskFileSystem::SetPathCache(bool enable)
+	{
+		if (enable)
+		{
+			_paths.Watch(_security.GetRootDirectory());
+		}
+		return *this;
+	}
+
+	DiskFileSystem::Result
+	DiskFileSystem::StatPath(const std::filesystem::path& path, VfsStat& stat) const
+	{
+		Result result = _security.IsFileValidForRead(path);
+		if (result != Result::VALID)
+		{
+			return result;
+		}
+
+		// Size class of the transfer timings, and tsize.
+		std::error_code ec;
+		uintmax_t size = std::filesystem::file_size(path, ec);
+		stat.size = ec ? 0 : size;
+
+		auto modified = std::filesystem::last_write_time(path, ec);
+		stat.modified = ec ? std::filesystem::file_time_type{} : modified;
+		return Result::VALID;
+	}
+
+	std::unique_ptr<HaloBuffer> DiskFileSystem::TakeReadAhead()
+	{
+		{
+			std::lock_guard guard{ _readAheadLock };
+			if (!_readAheads.empty())
+			{
+				auto buffer = std::move(_readAheads.back());
+				_readAheads.pop_back();
+				return buffer;
+			}
+		}
+
+		return std::make_unique<HaloBuffer>(ReadAheadSize);
+	}
+
+	void DiskFileSystem::ReturnReadAhead(std::unique_ptr<HaloBuffer> buffer)
+	{
+		std::lock_guard guard{ _readAheadLock };
+		if (_readAheads.size() < MaxIdleReadAheads)
+		{
+			_readAheads.push_back(std::move(buffer));
+		}
+	}
+
+	PathCache::EntryPtr DiskFileSystem::Lookup(std::string_view name)
+	{
+		uint64_t generation = 0;
+		PathCache::EntryPtr cached = _paths.Find(name, generation);
+		if (cached)
+		{
+			return cached;
+		}
+
+		PathCache::Entry entry{};
+		entry.path = _security.AbsoluteFromServerRoot(name);
+		entry.lockHash = FileSecurityHandler::LockHash(entry.path);
+		_paths.Track(entry);
+		entry.result = StatPath(entry.path, entry.stat);
+		return _paths.Store(name, std::move(entry), generation);
+	}
+
+	DiskFileSystem::Result
+	DiskFileSystem::Stat(std::string_view name, VfsStat& stat)
+	{
+		PathCache::EntryPtr entry = Lookup(name);
+		if (entry->result == Result::VALID)
+		{
+			stat = entry->stat;
+		}
+		return entry->result;
+	}
+
+	DiskFileSystem::Result
+	DiskFileSystem::OpenReader(std::string_view name, bool netascii,
+		VfsStat& stat, std::unique_ptr<VfsReader>& reader)
+	{
+		PathCache::EntryPtr entry = Lookup(name);
+		if (entry->result != Result::VALID)
+		{
+			return entry->result;
+		}
+
+		const std::filesystem::path& path = entry->path;
+		stat = entry->stat;
+		if (!_security.LockFileForRead(path, entry->lockHash))
+		{
+			return Result::INVALID_FILE_LOCKED;
+		}
+
+		auto disk = std::make_unique<DiskReader>(_security, path, entry->lockHash);
+
+		// Downloads of the same file, as it is now, read it once.
+		if (_sharedReads && !netascii
+			&& stat.modified != std::filesystem::file_time_type{})
+		{
+			disk->Share(_streams.Open(path, stat.size, stat.modified));
+		}
+
+		if (!disk->IsShared())
+		{
+			disk->Open(netascii, TakeReadAhead(),
+				[this](std::unique_ptr<HaloBuffer> buffer) {
+					ReturnReadAhead(std::move(buffer));
+				});
+		}
+
+		reader = std::move(disk);
+		return Result::VALID;
+	}
+
+	DiskFileSystem::Result
+	DiskFileSystem::OpenWriter(std::string_view name, bool netascii,
+		std::unique_ptr<VfsWriter>& writer)
+	{
+		std::filesystem::path path = _security.AbsoluteFromServerRoot(name);
+		Result result = _security.IsFileValidForWrite(path);
+		if (result != Result::VALID)
+		{
+			return result;
+		}
+
+		uint64_t lockHash = FileSecurityHandler::LockHash(path);
+		if (!_security.LockFileForWrite(path, lockHash))
+		{
+			return Result::INVALID_FILE_LOCKED;
+		}
+
+		writer = std::make_unique<DiskWriter>(_security, _paths, path,
+			lockHash, netascii);
+		return Result::VALID;
+	}
+
+	std::unique_ptr<VfsWriteTicket>
+	DiskFileSystem::QueueWriter(std::string_view name)
+	{
+		std::filesystem::path path = _security.AbsoluteFromServerRoot(name);
+		if (_security.IsFileValidForWrite(path) != Result::VALID)
+		{
+			return nullptr;
+		}
+
+		uint64_t lockHash = FileSecurityHandler::LockHash(path);
+		if (!_security.QueueFileForWrite(path, lockHash))
+		{
+			return nullptr;
+		}
+
+		return std::make_unique<DiskWriteTicket>(_security, _paths,
+			std::move(path), lockHash);
+	}
+}
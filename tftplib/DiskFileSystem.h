@@ -0,0 +1,68 @@
+﻿#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "HaloBuffer.h"
+#include "VirtualFileSystem.h"
+#include "SharedFileStream.h"
+#include "PathCache.h"
+
+namespace tftplib {
+
+	class Metrics;
+
+	// **********************************************************************
+	// The server's root directory. Paths are checked against the root by
+	//	the FileSecurityHandler, which also locks them : readers share a
+	//	file, a writer has it alone.
+	//
+	//	Octet downloads of the same file share one read of it
+	//	(SharedFileStream), the others read it through their own buffer.
+	//	Those buffers are kept for the next downloads : mapping one costs
+	//	more than a small transfer.
+	//
+	//	What a read request finds on disk is kept by name (PathCache) :
+	//	repeated requests don't ask the disk again until the file changes.
+	// **********************************************************************
+	class DiskFileSystem : public VirtualFileSystem
+	{
+	public:
+		static constexpr size_t ReadAheadSize = 0x040000;
+		static constexpr size_t MaxIdleReadAheads = 64;
+
+	public:
+		DiskFileSystem(FileSecurityHandler& security, Metrics& metrics);
+
+		// Setup, before serving.
+		DiskFileSystem& SetSharedReads(bool enable);
+		DiskFileSystem& SetPathCache(bool enable);
+
+		Result Stat(std::string_view name, VfsStat& stat) override;
+
+		Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) override;
+
+		Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) override;
+
+		std::unique_ptr<VfsWriteTicket> QueueWriter(std::string_view name) override;
+
+	private:
+		Result StatPath(const std::filesystem::path& path, VfsStat& stat) const;
+		PathCache::EntryPtr Lookup(std::string_view name);
+
+		// Read ahead buffers, from and back to the idle ones.
+		std::unique_ptr<HaloBuffer> TakeReadAhead();
+		void ReturnReadAhead(std::unique_ptr<HaloBuffer> buffer);
+
+	private:
+		FileSecurityHandler& _security;
+		SharedFileStreams _streams;
+		PathCache _paths;
+		bool _sharedReads{ true };
+
+		std::mutex _readAheadLock{};
+		std::vector<std::unique_ptr<HaloBuffer>> _readAheads{};
+	};
+}
@@ -0,0 +1,102 @@
+﻿#include "pch.h"
+#include "Executor.h"
+#include "ServerWorker.h"
+
+namespace tftplib {
+
+	void Executor::Attach(
+		const std::vector<std::shared_ptr<ServerWorker>>& workers)
+	{
+		_workers.clear();
+		for (auto& worker : workers)
+		{
+			_workers.push_back(worker.get());
+		}
+	}
+
+	void Executor::Detach()
+	{
+		_workers.clear();
+	}
+
+	Transaction* Executor::Steal(const ServerWorker& thief)
+	{
+		Transaction* transaction = Steal(thief, true);
+		if (transaction == nullptr)
+		{
+			transaction = Steal(thief, false);
+		}
+		return transaction;
+	}
+
+	Transaction* Executor::Steal(const ServerWorker& thief, bool sameNode)
+	{
+		size_t count = _workers.size();
+		if (count < 2)
+		{
+			return nullptr;
+		}
+
+		// Rotate the first victim so thieves don't all hammer the same queue.
+		size_t start = _nextVictim.fetch_add(1, std::memory_order_relaxed);
+		for (size_t i = 0; i < count; ++i)
+		{
+			ServerWorker* victim = _workers[(start + i) % count];
+			if (victim == &thief
+				|| (victim->Node() == thief.Node()) != sameNode)
+			{
+				continue;
+			}
+
+			Transaction* transaction = victim->Steal();
+			if (transaction != nullptr)
+			{
+				_steals.fetch_add(1, std::memory_order_relaxed);
+				if (!sameNode)
+				{
+					_crossNodeSteals.fetch_add(1, std::memory_order_relaxed);
+				}
+				return transaction;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void Executor::NotifyWork(const ServerWorker& origin)
+	{
+		if (!Wake(origin, true))
+		{
+			Wake(origin, false);
+		}
+	}
+
+	bool Executor::Wake(const ServerWorker& origin, bool sameNode)
+	{
+		for (ServerWorker* worker : _workers)
+		{
+			if (worker == &origin
+				|| (worker->Node() == origin.Node()) != sameNode)
+			{
+				continue;
+			}
+
+			if (worker->WakeIfIdle())
+			{
+				_wakeups.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	Executor::Stats Executor::GetStats() const
+	{
+		Stats stats{};
+		stats.steals = _steals.load(std::memory_order_relaxed);
+		stats.crossNodeSteals = _crossNodeSteals.load(std::memory_order_relaxed);
+		stats.wakeups = _wakeups.load(std::memory_order_relaxed);
+		return stats;
+	}
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace tftplib {
+	class ServerWorker;
+	class Transaction;
+
+	// **********************************************************************
+	// Work stealing executor shared by the server workers.
+	//	Each worker owns a run queue of ready transaction continuations.
+	//	A transaction's socket stays watched by its home worker : only the
+	//	continuation moves when an idle worker steals it.
+	//
+	//	Workers must be attached before they start and detached after
+	//	they all stopped.
+	// **********************************************************************
+	class Executor
+	{
+	public:
+		struct Stats {
+			uint64_t steals{ 0 };
+			uint64_t crossNodeSteals{ 0 };
+			uint64_t wakeups{ 0 };
+		};
+
+	public:
+		Executor() = default;
+		Executor(const Executor&) = delete;
+		Executor& operator=(const Executor&) = delete;
+
+		void Attach(const std::vector<std::shared_ptr<ServerWorker>>& workers);
+		void Detach();
+
+		// Take a ready continuation from another worker's run queue.
+		// Workers on the thief's NUMA node are tried first.
+		Transaction* Steal(const ServerWorker& thief);
+
+		// Wake one idle worker other than origin so it can steal,
+		// preferably one on origin's NUMA node.
+		void NotifyWork(const ServerWorker& origin);
+
+		Stats GetStats() const;
+
+	private:
+		Transaction* Steal(const ServerWorker& thief, bool sameNode);
+		bool Wake(const ServerWorker& origin, bool sameNode);
+
+	private:
+		std::vector<ServerWorker*> _workers{};
+		std::atomic<size_t> _nextVictim{ 0 };
+
+		std::atomic<uint64_t> _steals{ 0 };
+		std::atomic<uint64_t> _crossNodeSteals{ 0 };
+		std::atomic<uint64_t> _wakeups{ 0 };
+	};
+}
@@ -99,6 +99,16 @@ namespace tftplib {
 		_handle = 0;
 	}
 
+	bool File::Preallocate(uint64_t size)
+	{
+		// Clusters are reserved in one run, what ends up unused is
+		// released when the handle closes.
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+		return SetFileInformationByHandle(_handle, FileAllocationInfo,
+			&info, sizeof(info)) != 0;
+	}
+
 	void File::Write(const uint8_t* buffer, size_t sz)
 	{
 		WriteFile(_handle, buffer, sz, nullptr, nullptr);
@@ -113,4 +123,18 @@ namespace tftplib {
 
 		return read;
 	}
+
+	size_t File::ReadAt(uint64_t offset, uint8_t* buffer, size_t bufSz)
+	{
+		OVERLAPPED at{};
+		at.Offset = static_cast<DWORD>(offset);
+		at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+		DWORD read{0};
+		if( !ReadFile(_handle, buffer, bufSz, &read, &at) ){
+			return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+		}
+
+		return read;
+	}
 }
\ No newline at end of file
@@ -41,9 +41,15 @@ namespace tftplib
 		void DeleteOnClose();
 		void Commit();
 
+		// Reserve disk space for size bytes, the end of file stays.
+		bool Preallocate(uint64_t size);
+
 		void Write(const uint8_t* buffer, size_t sz);
 		size_t Read(uint8_t*  buffer, size_t bufSz);
 
+		// Read at offset, whatever was read before.
+		size_t ReadAt(uint64_t offset, uint8_t* buffer, size_t bufSz);
+
 	private:
 		Handle _handle{ 0 };
 	};
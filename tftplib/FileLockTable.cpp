@@ -0,0 +1,197 @@
+﻿#include "pch.h"
+#include "FileLockTable.h"
+#include <algorithm>
+#include <thread>
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * FileLockTable::Guard
+	 * *********************************************************************/
+	FileLockTable::Guard::Guard(Shard& shard)
+		: _shard{ shard }
+	{
+		// Held for a few instructions : spin, then let the holder run.
+		while (_shard.busy.exchange(true, std::memory_order_acquire))
+		{
+			while (_shard.busy.load(std::memory_order_relaxed))
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	FileLockTable::Guard::~Guard()
+	{
+		_shard.busy.store(false, std::memory_order_release);
+	}
+
+	/* *********************************************************************
+	 * FileLockTable
+	 * *********************************************************************/
+	uint64_t FileLockTable::Hash(const std::filesystem::path& path)
+	{
+		// FNV-1a, over the native string.
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (auto c : path.native())
+		{
+			hash ^= static_cast<uint64_t>(c);
+			hash *= 0x100000001b3ull;
+		}
+
+		return hash;
+	}
+
+	FileLockTable::Shard& FileLockTable::ShardOf(uint64_t hash)
+	{
+		// FNV's low bits are its weakest.
+		return _shards[(hash ^ (hash >> 32)) % Shards];
+	}
+
+	FileLockTable::Entry*
+	FileLockTable::Find(Shard& shard, uint64_t hash, const std::filesystem::path& path)
+	{
+		for (Entry* entry : shard.entries)
+		{
+			if (entry->hash == hash && entry->path.native() == path.native())
+			{
+				return entry;
+			}
+		}
+
+		return nullptr;
+	}
+
+	FileLockTable::Entry*
+	FileLockTable::Acquire(Shard& shard, uint64_t hash, const std::filesystem::path& path)
+	{
+		Guard guard{ shard };
+		Entry* entry = Find(shard, hash, path);
+		if (!entry)
+		{
+			if (shard.free.empty())
+			{
+				shard.pool.push_back(std::make_unique<Entry>());
+				shard.free.push_back(shard.pool.back().get());
+			}
+
+			entry = shard.free.back();
+			shard.free.pop_back();
+			entry->hash = hash;
+			entry->path = path;
+			shard.entries.push_back(entry);
+		}
+
+		entry->users++;
+		return entry;
+	}
+
+	void FileLockTable::Release(Shard& shard, Entry* entry)
+	{
+		Guard guard{ shard };
+		if (--entry->users > 0)
+		{
+			return;
+		}
+
+		auto it = std::find(shard.entries.begin(), shard.entries.end(), entry);
+		*it = shard.entries.back();
+		shard.entries.pop_back();
+		shard.free.push_back(entry);
+	}
+
+	template <typename Op>
+	bool FileLockTable::Lock(uint64_t hash, const std::filesystem::path& path, Op op)
+	{
+		// The entry is kept while it's tried, the shard isn't.
+		Shard& shard = ShardOf(hash);
+		Entry* entry = Acquire(shard, hash, path);
+		if (op(entry->lock))
+		{
+			return true;
+		}
+
+		Release(shard, entry);
+		return false;
+	}
+
+	template <typename Op>
+	bool FileLockTable::Unlock(uint64_t hash, const std::filesystem::path& path, Op op)
+	{
+		Shard& shard = ShardOf(hash);
+		Entry* entry = nullptr;
+		{
+			Guard guard{ shard };
+			entry = Find(shard, hash, path);
+		}
+
+		if (!entry)
+		{
+			return false;
+		}
+
+		// Ours until released : the unlock makes it no one's.
+		op(entry->lock);
+		Release(shard, entry);
+		return true;
+	}
+
+	bool FileLockTable::LockRead(uint64_t hash, const std::filesystem::path& path,
+		std::chrono::milliseconds wait)
+	{
+		return Lock(hash, path, [wait](RWInterlock& lock) {
+			return wait.count() > 0 ? lock.LockRead(wait) : lock.TryLockRead();
+		});
+	}
+
+	bool FileLockTable::LockWrite(uint64_t hash, const std::filesystem::path& path,
+		std::chrono::milliseconds wait)
+	{
+		return Lock(hash, path, [wait](RWInterlock& lock) {
+			return wait.count() > 0 ? lock.LockWrite(wait) : lock.TryLockWrite();
+		});
+	}
+
+	bool FileLockTable::QueueWrite(uint64_t hash, const std::filesystem::path& path)
+	{
+		return Lock(hash, path, [](RWInterlock& lock) { return lock.QueueWrite(); });
+	}
+
+	bool FileLockTable::LockQueuedWrite(uint64_t hash, const std::filesystem::path& path)
+	{
+		// The queue's hold on the entry becomes the writer's.
+		Shard& shard = ShardOf(hash);
+		Entry* entry = nullptr;
+		{
+			Guard guard{ shard };
+			entry = Find(shard, hash, path);
+		}
+
+		return entry && entry->lock.TryLockQueuedWrite();
+	}
+
+	void FileLockTable::DequeueWrite(uint64_t hash, const std::filesystem::path& path)
+	{
+		Unlock(hash, path, [](RWInterlock& lock) { lock.DequeueWrite(); });
+	}
+
+	bool FileLockTable::UnlockRead(uint64_t hash, const std::filesystem::path& path)
+	{
+		return Unlock(hash, path, [](RWInterlock& lock) { lock.UnlockRead(); });
+	}
+
+	bool FileLockTable::UnlockWrite(uint64_t hash, const std::filesystem::path& path)
+	{
+		return Unlock(hash, path, [](RWInterlock& lock) { lock.UnlockWrite(); });
+	}
+
+	void FileLockTable::Clear()
+	{
+		for (Shard& shard : _shards)
+		{
+			shard.entries.clear();
+			shard.free.clear();
+			shard.pool.clear();
+		}
+	}
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include "RWInterlock.h"
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Reader / writer locks of the files being transferred, by path.
+	//	Paths are spread over shards by their hash, each shard behind its
+	//	own spinlock : transfers of different files rarely meet, and a
+	//	shard is only held to find or drop an entry, never while locking
+	//	the file itself.
+	//
+	//	Hashes are computed once per file by the caller (Hash) ; paths are
+	//	only compared when hashes match. Entries are pooled per shard and
+	//	reused, so locking a file doesn't allocate once the pool is warm.
+	// **********************************************************************
+	class FileLockTable
+	{
+	public:
+		static constexpr size_t Shards = 64;
+
+		static uint64_t Hash(const std::filesystem::path& path);
+
+	public:
+		FileLockTable() = default;
+		FileLockTable(const FileLockTable&) = delete;
+		FileLockTable& operator=(const FileLockTable&) = delete;
+
+		// Waits up to wait for the file, the calling thread asleep. 0 :
+		// fails at once.
+		bool LockRead(uint64_t hash, const std::filesystem::path& path,
+			std::chrono::milliseconds wait = {});
+		bool LockWrite(uint64_t hash, const std::filesystem::path& path,
+			std::chrono::milliseconds wait = {});
+
+		// A writer waiting its turn without sleeping : readers stay out
+		// from QueueWrite until the file is locked by LockQueuedWrite, or
+		// DequeueWrite. The entry is held meanwhile.
+		bool QueueWrite(uint64_t hash, const std::filesystem::path& path);
+		bool LockQueuedWrite(uint64_t hash, const std::filesystem::path& path);
+		void DequeueWrite(uint64_t hash, const std::filesystem::path& path);
+
+		// False when the file wasn't locked.
+		bool UnlockRead(uint64_t hash, const std::filesystem::path& path);
+		bool UnlockWrite(uint64_t hash, const std::filesystem::path& path);
+
+		// Not thread safe : forgets every lock.
+		void Clear();
+
+	private:
+		struct Entry {
+			uint64_t hash{ 0 };
+			std::filesystem::path path{};
+			RWInterlock lock{};
+			uint32_t users{ 0 };			// Lock holders and lockers
+		};
+
+		struct alignas(64) Shard {
+			std::atomic<bool> busy{ false };
+			std::vector<Entry*> entries{};	// In use
+			std::vector<Entry*> free{};
+			std::vector<std::unique_ptr<Entry>> pool{};
+		};
+
+		// Holds the shard for the duration of a scope.
+		class Guard
+		{
+		public:
+			explicit Guard(Shard& shard);
+			~Guard();
+
+		private:
+			Shard& _shard;
+		};
+
+		Shard& ShardOf(uint64_t hash);
+		static Entry* Find(Shard& shard, uint64_t hash, const std::filesystem::path& path);
+
+		Entry* Acquire(Shard& shard, uint64_t hash, const std::filesystem::path& path);
+		void Release(Shard& shard, Entry* entry);
+
+		template <typename Op>
+		bool Lock(uint64_t hash, const std::filesystem::path& path, Op op);
+
+		template <typename Op>
+		bool Unlock(uint64_t hash, const std::filesystem::path& path, Op op);
+
+	private:
+		std::array<Shard, Shards> _shards{};
+	};
+}
@@ -1,6 +1,9 @@
 ﻿#include "pch.h"
 #include "FileReader.h"
 #include "File.h"
+#include "HaloBuffer.h"
+#include <algorithm>
+#include <cstring>
 
 namespace tftplib {
 
@@ -17,12 +20,57 @@ namespace tftplib {
 		, _buffer {buffer}
 		, _file { File::Open(_path, File::OpenForRead) }
 	{
+		if (_buffer != nullptr)
+		{
+			_buffer->ResetCursors();
+		}
 	}
 
 	FileReader::~FileReader() { }
 
 	size_t FileReader::ReadBlock(uint8_t* buffer, size_t bufferSize)
 	{
-		return _file->Read(buffer, bufferSize);
+		if (_buffer == nullptr)
+		{
+			return _file->Read(buffer, bufferSize);
+		}
+
+		Fill(bufferSize);
+		if (_failed)
+		{
+			return static_cast<size_t>(-1);
+		}
+
+		size_t count = std::min(bufferSize, _buffer->Readable());
+		memcpy(buffer, _buffer->ReadPtr(), count);
+		_buffer->Release(count);
+
+		return count;
+	}
+
+	void FileReader::Fill(size_t wanted)
+	{
+		while (!_eof && _buffer->Readable() < wanted)
+		{
+			size_t room = _buffer->Writable();
+			if (room == 0)
+			{
+				return;
+			}
+
+			size_t read = _file->Read(_buffer->WritePtr(), room);
+			if (read == static_cast<size_t>(-1))
+			{
+				_failed = true;
+				return;
+			}
+
+			if (read == 0)
+			{
+				_eof = true;
+			}
+
+			_buffer->Commit(read);
+		}
 	}
 }
\ No newline at end of file
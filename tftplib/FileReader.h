@@ -29,14 +29,21 @@ namespace tftplib {
 		FileReader(const FileReader& rhs) = delete;
 		FileReader& operator=(const FileReader& rhs) = delete;
 
+		// Reads are staged through the HaloBuffer when one is given :
+		// the file is read in buffer sized chunks and blocks are served
+		// from it with a single copy. -1 once the file can't be read.
 		size_t ReadBlock(uint8_t* buffer, size_t bufferSize);
 
+	private:
+		void Fill(size_t wanted);
+
 	private:
 		std::unique_ptr<Os> _os;
 		std::filesystem::path _path;
 		ForceNativeEOL _eolOpt;
 
-		size_t _buffered{0};
+		bool _eof{false};
+		bool _failed{false};
 
 		HaloBuffer* _buffer;
 		std::unique_ptr<File> _file;
@@ -32,7 +32,7 @@ namespace tftplib {
 		_canCreateFile = false;
 		_canOverwriteFile = false;
 		_rootDirectory = "";
-		_locks.clear();
+		_locks.Clear();
 
 		return *this;
 	}
@@ -41,6 +41,12 @@ namespace tftplib {
 	 *	Security handling API
 	 * ***************************************************/
 
+	const std::filesystem::path&
+	FileSecurityHandler::GetRootDirectory() const
+	{
+		return _rootDirectory;
+	}
+
 	std::filesystem::path
 	FileSecurityHandler::AbsoluteFromServerRoot(std::filesystem::path file) const
 	{
@@ -74,18 +80,22 @@ namespace tftplib {
 	FileSecurityHandler::ValidationResult 
 	FileSecurityHandler::IsFileValidForWrite(std::filesystem::path path) const
 	{
-		if (!std::filesystem::exists(path) && !_canCreateFile )
+		// One query for all the checks.
+		std::error_code ec;
+		auto status = std::filesystem::status(path, ec);
+
+		if (!std::filesystem::exists(status) && !_canCreateFile )
 		{ 
 			return ValidationResult::INVALID_CANT_CREATE_FILE;
 		}
 
-		if (std::filesystem::exists(path) &&
-			!std::filesystem::is_regular_file(path) )
+		if (std::filesystem::exists(status) &&
+			!std::filesystem::is_regular_file(status) )
 		{
 			return ValidationResult::INVALID_IS_DIRECTORY;
 		}
 
-		if (std::filesystem::exists(path) && !_canOverwriteFile)
+		if (std::filesystem::exists(status) && !_canOverwriteFile)
 		{
 			return ValidationResult::INVALID_ACCESS_FORBIDDEN;
 		}
@@ -101,12 +111,15 @@ namespace tftplib {
 			return ValidationResult::INVALID_ACCESS_FORBIDDEN;
 		}
 
-		if (!std::filesystem::exists(path))
+		std::error_code ec;
+		auto status = std::filesystem::status(path, ec);
+
+		if (!std::filesystem::exists(status))
 		{
 			return ValidationResult::INVALID_NO_SUCH_FILE;
 		}
 
-		if (!std::filesystem::is_regular_file(path))
+		if (!std::filesystem::is_regular_file(status))
 		{
 			return ValidationResult::INVALID_IS_DIRECTORY;
 		}
@@ -117,53 +130,82 @@ namespace tftplib {
 	/* ***************************************************
 	 *	File locking API
 	 * ***************************************************/
-	bool 
-	FileSecurityHandler::LockFileForRead(std::filesystem::path file)
+	uint64_t
+	FileSecurityHandler::LockHash(const std::filesystem::path& file)
 	{
-		std::lock_guard lock{_mutex};
+		return FileLockTable::Hash(file);
+	}
 
-		return _locks[file].TryLockRead();
+	bool 
+	FileSecurityHandler::LockFileForRead(const std::filesystem::path& file)
+	{
+		return LockFileForRead(file, LockHash(file));
 	}
 	
 	bool 
-	FileSecurityHandler::LockFileForWrite(std::filesystem::path file)
+	FileSecurityHandler::LockFileForWrite(const std::filesystem::path& file)
 	{
-		std::lock_guard lock{ _mutex };
-
-		return _locks[file].TryLockWrite();
+		return LockFileForWrite(file, LockHash(file));
 	}
 
 	bool 
-	FileSecurityHandler::UnlockFileForRead(std::filesystem::path file)
+	FileSecurityHandler::UnlockFileForRead(const std::filesystem::path& file)
 	{
-		std::lock_guard lock{ _mutex };
-
-		auto it = _locks.find(file);
-		if( it == _locks.end() ) return false; // wtf
+		return UnlockFileForRead(file, LockHash(file));
+	}
+	
+	bool 
+	FileSecurityHandler::UnlockFileForWrite(const std::filesystem::path& file)
+	{
+		return UnlockFileForWrite(file, LockHash(file));
+	}
 
-		it->second.UnlockRead();
-		if (it->second.IsFree())
-		{
-			_locks.erase(it);
-		}
+	bool 
+	FileSecurityHandler::LockFileForRead(const std::filesystem::path& file,
+		uint64_t hash, std::chrono::milliseconds wait)
+	{
+		return _locks.LockRead(hash, file, wait);
+	}
+	
+	bool 
+	FileSecurityHandler::LockFileForWrite(const std::filesystem::path& file,
+		uint64_t hash, std::chrono::milliseconds wait)
+	{
+		return _locks.LockWrite(hash, file, wait);
+	}
 
-		return true;
+	bool 
+	FileSecurityHandler::UnlockFileForRead(const std::filesystem::path& file,
+		uint64_t hash)
+	{
+		return _locks.UnlockRead(hash, file);
 	}
 	
 	bool 
-	FileSecurityHandler::UnlockFileForWrite(std::filesystem::path file)
+	FileSecurityHandler::UnlockFileForWrite(const std::filesystem::path& file,
+		uint64_t hash)
 	{
-		std::lock_guard lock{ _mutex };
+		return _locks.UnlockWrite(hash, file);
+	}
 
-		auto it = _locks.find(file);
-		if (it == _locks.end()) return false; // wtf
+	bool 
+	FileSecurityHandler::QueueFileForWrite(const std::filesystem::path& file,
+		uint64_t hash)
+	{
+		return _locks.QueueWrite(hash, file);
+	}
 
-		it->second.UnlockWrite();
-		if (it->second.IsFree())
-		{
-			_locks.erase(it);
-		}
+	bool 
+	FileSecurityHandler::LockQueuedFileForWrite(const std::filesystem::path& file,
+		uint64_t hash)
+	{
+		return _locks.LockQueuedWrite(hash, file);
+	}
 
-		return true;
+	void 
+	FileSecurityHandler::DequeueFileForWrite(const std::filesystem::path& file,
+		uint64_t hash)
+	{
+		_locks.DequeueWrite(hash, file);
 	}
 }
\ No newline at end of file
@@ -2,9 +2,7 @@
 
 #include <filesystem>
 #include <optional>
-#include "RWInterlock.h"
-#include <mutex>
-#include <unordered_map>
+#include "FileLockTable.h"
 
 namespace tftplib 
 {
@@ -32,6 +30,8 @@ namespace tftplib
 			INVALID_NO_SUCH_FILE,
 			INVALID_IS_DIRECTORY,
 			INVALID_ACCESS_FORBIDDEN,
+			INVALID_FILE_LOCKED,
+			INVALID_MODE,			// Transfer mode not served
 
 			INVALID_PERMISSIONS // OS LEVEL PERMISSIONS
 		};
@@ -56,6 +56,8 @@ namespace tftplib
 		 *		under the assumption that setup API isn't called
 		 * ***************************************************/
 
+		 const std::filesystem::path& GetRootDirectory() const;
+
 		 std::filesystem::path
 		 AbsoluteFromServerRoot(std::filesystem::path file) const;
 
@@ -67,11 +69,30 @@ namespace tftplib
 		  *	File locking API
 		  *		Thread safety considerations : reentrant and safe
 		  *		under the assumption that setup API isn't called
+		  *
+		  *		The hash overloads take LockHash(file), computed
+		  *		once per file by the caller. With a wait, the
+		  *		calling thread sleeps up to wait for the file :
+		  *		not for the server workers.
 		  * ***************************************************/
-		 bool LockFileForRead(std::filesystem::path file);
-		 bool LockFileForWrite(std::filesystem::path file);
-		 bool UnlockFileForRead(std::filesystem::path file);
-		 bool UnlockFileForWrite(std::filesystem::path file);
+		 static uint64_t LockHash(const std::filesystem::path& file);
+
+		 bool LockFileForRead(const std::filesystem::path& file);
+		 bool LockFileForWrite(const std::filesystem::path& file);
+		 bool UnlockFileForRead(const std::filesystem::path& file);
+		 bool UnlockFileForWrite(const std::filesystem::path& file);
+
+		 bool LockFileForRead(const std::filesystem::path& file, uint64_t hash,
+			 std::chrono::milliseconds wait = {});
+		 bool LockFileForWrite(const std::filesystem::path& file, uint64_t hash,
+			 std::chrono::milliseconds wait = {});
+		 bool UnlockFileForRead(const std::filesystem::path& file, uint64_t hash);
+		 bool UnlockFileForWrite(const std::filesystem::path& file, uint64_t hash);
+
+		 // Writers that wait without sleeping : see FileLockTable.
+		 bool QueueFileForWrite(const std::filesystem::path& file, uint64_t hash);
+		 bool LockQueuedFileForWrite(const std::filesystem::path& file, uint64_t hash);
+		 void DequeueFileForWrite(const std::filesystem::path& file, uint64_t hash);
 
 		
 	private:
@@ -88,7 +109,6 @@ namespace tftplib
 
 		 std::filesystem::path _rootDirectory {""};
 
-		 mutable std::mutex _mutex;
-		 std::unordered_map< std::filesystem::path, RWInterlock> _locks;
+		 FileLockTable _locks;
 	};
 }
@@ -91,6 +91,12 @@ namespace tftplib {
 	{
 	}
 
+	bool
+	FileWriter::Preallocate(uint64_t size)
+	{
+		return _file->Preallocate(size);
+	}
+
 	void 
 	FileWriter::WriteBlock(const uint8_t* buffer, size_t bufferSize)
 	{
@@ -31,6 +31,10 @@ public:
 	FileWriter(const FileWriter& rhs) = delete;
 	FileWriter& operator=(const FileWriter& rhs) = delete;
 
+	// Reserve the expected file size up front : one allocation instead
+	// of growing the file block by block.
+	bool Preallocate(uint64_t size);
+
 	void WriteBlock(const uint8_t *buffer, size_t bufferSize);
 	void Finalize();
 
@@ -0,0 +1,296 @@
+﻿#include "pch.h"
+#include "GeneratedFileSystem.h"
+#include "Metrics.h"
+#include <algorithm>
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * GeneratedFileSystem::Reader
+	 * *********************************************************************/
+	// Streams the generator into DATA blocks, keeping a copy for the
+	// cache while the file is small enough.
+	class GeneratedFileSystem::Reader : public VfsReader
+	{
+	public:
+		Reader(GeneratedFileSystem& owner,
+			std::unique_ptr<ContentGenerator> generator,
+			std::string key,
+			std::chrono::seconds ttl)
+			: _owner{ owner }
+			, _generator{ std::move(generator) }
+			, _key{ std::move(key) }
+			, _ttl{ ttl }
+			, _copy{ std::make_shared<std::vector<uint8_t>>() }
+		{
+		}
+
+		~Reader()
+		{
+			// Dropped before the generator finished.
+			if (!_done)
+			{
+				Finish();
+			}
+		}
+
+		size_t ReadBlock(uint8_t* buffer, size_t bufferSize) override
+		{
+			if (_failed)
+			{
+				return static_cast<size_t>(-1);
+			}
+
+			size_t filled = 0;
+			while (!_done && filled < bufferSize)
+			{
+				size_t made = _generator->Generate(buffer + filled, bufferSize - filled);
+				if (made > bufferSize - filled)
+				{
+					// Even after part of the block : a short block would
+					// end the file there.
+					_failed = true;
+					_copy = nullptr;
+					Finish();
+					return static_cast<size_t>(-1);
+				}
+
+				if (made == 0)
+				{
+					if (_copy)
+					{
+						_owner.Store(_key, std::move(_copy), _ttl);
+					}
+					Finish();
+					break;
+				}
+
+				if (_copy && _copy->size() + made > MaxCachedSize)
+				{
+					_copy = nullptr;
+				}
+				else if (_copy)
+				{
+					_copy->insert(_copy->end(), buffer + filled, buffer + filled + made);
+				}
+
+				filled += made;
+			}
+
+			return filled;
+		}
+
+	private:
+		// The render slot is for generating : not held through the rest
+		// of the transfer.
+		void Finish()
+		{
+			_done = true;
+			_generator = nullptr;
+			_owner.ReleaseRender();
+		}
+
+	private:
+		GeneratedFileSystem& _owner;
+		std::unique_ptr<ContentGenerator> _generator;
+		const std::string _key;
+		const std::chrono::seconds _ttl;
+
+		std::shared_ptr<std::vector<uint8_t>> _copy;	// nullptr : not cached
+		bool _done{ false };
+		bool _failed{ false };
+	};
+
+	/* *********************************************************************
+	 * GeneratedFileSystem
+	 * *********************************************************************/
+	GeneratedFileSystem::GeneratedFileSystem(Metrics& metrics)
+		: _metrics{ metrics }
+	{
+	}
+
+	void GeneratedFileSystem::Add(std::string_view pattern,
+		std::shared_ptr<ContentProvider> provider,
+		std::chrono::seconds ttl)
+	{
+		_providers.push_back(Registration{ Normalize(pattern), std::move(provider), ttl });
+	}
+
+	void GeneratedFileSystem::SetMaxRenders(uint32_t max)
+	{
+		_maxRenders = std::max<uint32_t>(max, 1);
+	}
+
+	bool GeneratedFileSystem::Matches(std::string_view pattern, std::string_view name)
+	{
+		// Greedy, back to the last '*' on a mismatch.
+		size_t p = 0;
+		size_t n = 0;
+		size_t star = std::string_view::npos;
+		size_t resume = 0;
+		while (n < name.size())
+		{
+			if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+			{
+				p++;
+				n++;
+			}
+			else if (p < pattern.size() && pattern[p] == '*')
+			{
+				star = p++;
+				resume = n;
+			}
+			else if (star != std::string_view::npos)
+			{
+				p = star + 1;
+				n = ++resume;
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		while (p < pattern.size() && pattern[p] == '*')
+		{
+			p++;
+		}
+
+		return p == pattern.size();
+	}
+
+	const GeneratedFileSystem::Registration*
+	GeneratedFileSystem::Find(std::string_view name) const
+	{
+		for (const Registration& registration : _providers)
+		{
+			if (Matches(registration.pattern, name))
+			{
+				return &registration;
+			}
+		}
+
+		return nullptr;
+	}
+
+	GeneratedFileSystem::Content
+	GeneratedFileSystem::Cached(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock{ _cacheLock };
+		auto it = _cache.find(key);
+		if (it == _cache.end())
+		{
+			return nullptr;
+		}
+
+		if (it->second.expires <= Clock::now())
+		{
+			_cache.erase(it);
+			return nullptr;
+		}
+
+		return it->second.content;
+	}
+
+	void GeneratedFileSystem::Store(const std::string& key, Content content,
+		std::chrono::seconds ttl)
+	{
+		if (ttl.count() <= 0)
+		{
+			return;
+		}
+
+		auto now = Clock::now();
+		std::lock_guard<std::mutex> lock{ _cacheLock };
+		_cache[key] = CacheEntry{ std::move(content), now + ttl };
+
+		// Keys nobody asks for again go once in a while.
+		if (now >= _nextSweep)
+		{
+			std::erase_if(_cache, [now](const auto& entry) {
+				return entry.second.expires <= now;
+			});
+			_nextSweep = now + std::chrono::seconds{ 10 };
+		}
+	}
+
+	void GeneratedFileSystem::ReleaseRender()
+	{
+		_renders.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	GeneratedFileSystem::Result
+	GeneratedFileSystem::Stat(std::string_view name, VfsStat& stat)
+	{
+		std::string normalized = Normalize(name);
+		const Registration* registration = Find(normalized);
+		if (!registration)
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		Content content = Cached(registration->provider->Key(normalized));
+		stat.size = content ? content->size() : 0;
+		stat.sizeKnown = content != nullptr;
+		stat.modified = {};
+		return Result::VALID;
+	}
+
+	GeneratedFileSystem::Result
+	GeneratedFileSystem::OpenReader(std::string_view name, bool netascii,
+		VfsStat& stat, std::unique_ptr<VfsReader>& reader)
+	{
+		std::string normalized = Normalize(name);
+		const Registration* registration = Find(normalized);
+		if (!registration)
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		if (netascii)
+		{
+			return Result::INVALID_MODE;
+		}
+
+		std::string key = registration->provider->Key(normalized);
+		Content content = Cached(key);
+		if (content)
+		{
+			_metrics.Add(Counter::GENERATED_CACHE_HITS);
+			stat.size = content->size();
+			stat.sizeKnown = true;
+			stat.modified = {};
+			reader = std::make_unique<BufferReader>(content->data(),
+				content->size(), content);
+			return Result::VALID;
+		}
+
+		if (_renders.fetch_add(1, std::memory_order_relaxed) >= _maxRenders)
+		{
+			ReleaseRender();
+			return Result::INVALID_FILE_LOCKED;
+		}
+
+		auto generator = registration->provider->Open(normalized);
+		if (!generator)
+		{
+			ReleaseRender();
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		_metrics.Add(Counter::GENERATED_RENDERS);
+		stat.size = 0;
+		stat.sizeKnown = false;
+		stat.modified = {};
+		reader = std::make_unique<Reader>(*this, std::move(generator),
+			std::move(key), registration->ttl);
+		return Result::VALID;
+	}
+
+	GeneratedFileSystem::Result
+	GeneratedFileSystem::OpenWriter(std::string_view /*name*/, bool /*netascii*/,
+		std::unique_ptr<VfsWriter>& /*writer*/)
+	{
+		return Result::INVALID_ACCESS_FORBIDDEN;
+	}
+}
@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include "ContentProvider.h"
+#include "VirtualFileSystem.h"
+
+namespace tftplib {
+
+	class Metrics;
+
+	// **********************************************************************
+	// Files made on request by content providers, read-only, octet only.
+	//	The first provider whose pattern matches the name makes it. The
+	//	generator runs in the transfer, on its worker, one block at a
+	//	time : the first block goes out before the file is finished.
+	//
+	//	What was made is cached by key for the provider's TTL, up to
+	//	MaxCachedSize per file. Requests that miss the cache while
+	//	another makes the same file make their own copy.
+	//
+	//	At most SetMaxRenders generators run at once. Past that, requests
+	//	are turned away as FILE_LOCKED and clients try again.
+	// **********************************************************************
+	class GeneratedFileSystem : public VirtualFileSystem
+	{
+	public:
+		static constexpr size_t MaxCachedSize = 0x100000;
+
+		GeneratedFileSystem(Metrics& metrics);
+
+		// Setup, before serving. Patterns are matched against whole
+		// normalized names, '*' matching any run of characters and '?'
+		// any one.
+		void Add(std::string_view pattern,
+			std::shared_ptr<ContentProvider> provider,
+			std::chrono::seconds ttl);
+		void SetMaxRenders(uint32_t max);
+
+		bool IsEmpty() const { return _providers.empty(); }
+
+		bool IsReadOnly() const override { return true; }
+
+		// Sizes are only known once made : cached files only.
+		Result Stat(std::string_view name, VfsStat& stat) override;
+
+		Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) override;
+
+		Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) override;
+
+		static bool Matches(std::string_view pattern, std::string_view name);
+
+	private:
+		using Clock = std::chrono::steady_clock;
+		using Content = std::shared_ptr<const std::vector<uint8_t>>;
+
+		struct Registration {
+			std::string pattern;			// Normalized
+			std::shared_ptr<ContentProvider> provider;
+			std::chrono::seconds ttl;
+		};
+
+		struct CacheEntry {
+			Content content;
+			Clock::time_point expires;
+		};
+
+		class Reader;
+
+		const Registration* Find(std::string_view name) const;
+		Content Cached(const std::string& key);
+		void Store(const std::string& key, Content content, std::chrono::seconds ttl);
+		void ReleaseRender();
+
+	private:
+		Metrics& _metrics;
+		std::vector<Registration> _providers{};
+		uint32_t _maxRenders{ 16 };
+		std::atomic<uint32_t> _renders{ 0 };
+
+		std::mutex _cacheLock;
+		std::unordered_map<std::string, CacheEntry> _cache{};
+		Clock::time_point _nextSweep{};
+	};
+}
@@ -2,14 +2,27 @@
 #include "HaloBuffer.h"
 #include <stdexcept>
 
+#if defined(_WIN32)
 #include <windows.h>
 #include <WinBase.h>
+#else
+#include <cstdint>
+#include <sys/mman.h>
+#include <linux/memfd.h>
+#include <unistd.h>
+#endif
 
 namespace tftplib {
+
+#if defined(_WIN32)
+	/* *********************************************************************
+	 * Windows implementation : placeholders and MapViewOfFile3.
+	 *	Always uses normal pages.
+	 * *********************************************************************/
 	class HaloBuffer::Os 
 	{
 	public:
-		static Os* Make(size_t size);
+		static Os* Make(size_t size, Arena::Pages pages);
 		static size_t GetPageSize();
 
 	public:
@@ -17,6 +30,7 @@ namespace tftplib {
 		~Os();
 		void* Buffer() const;
 		size_t Size() const;
+		bool IsHuge() const { return false; }
 
 	private:
 		Os();
@@ -39,7 +53,7 @@ namespace tftplib {
 
 	};
 
-	HaloBuffer::Os* HaloBuffer::Os::Make(size_t size)
+	HaloBuffer::Os* HaloBuffer::Os::Make(size_t size, Arena::Pages)
 	{
 		HaloBuffer::Os *os = new HaloBuffer::Os{};
 		if( !os->Allocate(size) )
@@ -191,9 +205,181 @@ namespace tftplib {
 			: (size & keepAligned) + align;
 	}
 
-	HaloBuffer::HaloBuffer(size_t size)
+#else
+	/* *********************************************************************
+	 * Linux implementation : one memfd mapped twice, back to back, in a
+	 *	reserved region.
+	 * *********************************************************************/
+	class HaloBuffer::Os
+	{
+	public:
+		static Os* Make(size_t size, Arena::Pages pages);
+		static size_t GetPageSize();
+
+	public:
+
+		~Os();
+		void* Buffer() const;
+		size_t Size() const;
+		bool IsHuge() const { return _huge; }
+
+	private:
+		Os();
+		void Free();
+
+		bool Allocate(size_t size, bool huge);
+		size_t Align(size_t size, size_t align);
+
+	private:
+		void* _actualBuffer{ nullptr };
+
+		int _memfd{ -1 };
+		void* _reserved{ nullptr };
+		size_t _reservedSize{ 0 };
+
+		size_t _physicalMemorySize{ 0 };
+		bool _huge{ false };
+	};
+
+	HaloBuffer::Os* HaloBuffer::Os::Make(size_t size, Arena::Pages pages)
+	{
+		HaloBuffer::Os* os = new HaloBuffer::Os{};
+
+		// Huge pages only when the ring is already a multiple of them :
+		// don't silently grow small rings to 2 MiB.
+		bool huge = pages == Arena::Pages::HUGE_PAGES
+			&& size > 0
+			&& size % Arena::HugePageSize == 0;
+
+		if ((huge && os->Allocate(size, true)) || os->Allocate(size, false))
+		{
+			return os;
+		}
+
+		delete os;
+		return nullptr;
+	}
+
+	size_t HaloBuffer::Os::GetPageSize()
+	{
+		static size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		return pageSize;
+	}
+
+	HaloBuffer::Os::~Os()
 	{
-		_os.reset(Os::Make(size));
+		Free();
+	}
+
+	void* HaloBuffer::Os::Buffer() const
+	{
+		return _actualBuffer;
+	}
+
+	size_t HaloBuffer::Os::Size() const
+	{
+		return _physicalMemorySize;
+	}
+
+	HaloBuffer::Os::Os() {};
+
+	void HaloBuffer::Os::Free()
+	{
+		// Both views live inside the reservation.
+		if (_reserved != nullptr)
+		{
+			munmap(_reserved, _reservedSize);
+		}
+
+		if (_memfd >= 0)
+		{
+			close(_memfd);
+		}
+
+		_actualBuffer	= nullptr;
+		_reserved		= nullptr;
+		_reservedSize	= 0;
+		_memfd			= -1;
+		_huge			= false;
+	}
+
+	bool HaloBuffer::Os::Allocate(size_t size, bool huge)
+	{
+		size_t align = huge ? Arena::HugePageSize : GetPageSize();
+		_physicalMemorySize = Align(size, align);
+
+		try {
+			unsigned int flags = MFD_CLOEXEC;
+			if (huge)
+			{
+				flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+			}
+
+			_memfd = memfd_create("tftplib-halo", flags);
+			if (_memfd < 0)
+			{
+				throw std::runtime_error{ "can't create memfd" };
+			}
+
+			if (ftruncate(_memfd, static_cast<off_t>(_physicalMemorySize)) != 0)
+			{
+				throw std::runtime_error{ "can't size memfd" };
+			}
+
+			// Reserve both views at once so nothing lands in between.
+			// Huge page views need a 2 MiB aligned start.
+			_reservedSize = 2 * _physicalMemorySize + (huge ? align : 0);
+			_reserved = mmap(nullptr, _reservedSize, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (_reserved == MAP_FAILED)
+			{
+				_reserved = nullptr;
+				throw std::runtime_error{ "can't reserve views" };
+			}
+
+			uintptr_t base = reinterpret_cast<uintptr_t>(_reserved);
+			base = (base + align - 1) & ~(uintptr_t)(align - 1);
+			char* first = reinterpret_cast<char*>(base);
+			char* second = first + _physicalMemorySize;
+
+			void* view1 = mmap(first, _physicalMemorySize,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _memfd, 0);
+			void* view2 = mmap(second, _physicalMemorySize,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _memfd, 0);
+
+			if (view1 == MAP_FAILED || view2 == MAP_FAILED)
+			{
+				throw std::runtime_error{ "view mapping failed" };
+			}
+
+			_actualBuffer = first;
+			_huge = huge;
+		}
+		catch (std::runtime_error&)
+		{
+			Free();
+			return false;
+		}
+
+		return true;
+	}
+
+	size_t HaloBuffer::Os::Align(size_t size, size_t align)
+	{
+		size_t keepAligned = ~(align - 1);
+
+		return (size & keepAligned) == size
+			? size
+			: (size & keepAligned) + align;
+	}
+#endif
+
+	/* *********************************************************************
+	 * HaloBuffer
+	 * *********************************************************************/
+	HaloBuffer::HaloBuffer(size_t size, Arena::Pages pages)
+	{
+		_os.reset(Os::Make(size, pages));
 		if (_os == nullptr)
 		{
 			throw std::runtime_error {"Could not allocate buffer"};
@@ -211,4 +397,62 @@ namespace tftplib {
 	{
 		return _os->Buffer();
 	}
+
+	bool HaloBuffer::UsesHugePages() const
+	{
+		return _os->IsHuge();
+	}
+
+	size_t HaloBuffer::Writable() const
+	{
+		return Size() - Readable();
+	}
+
+	uint8_t* HaloBuffer::WritePtr() const
+	{
+		size_t at = _produced.load(std::memory_order_relaxed) % Size();
+		return GetAt<uint8_t>(at);
+	}
+
+	void HaloBuffer::Commit(size_t count)
+	{
+		if (count > Writable())
+		{
+			throw std::runtime_error{ "HaloBuffer overflow" };
+		}
+
+		// Single writer per cursor : no read-modify-write needed.
+		_produced.store(_produced.load(std::memory_order_relaxed) + count,
+			std::memory_order_release);
+	}
+
+	size_t HaloBuffer::Readable() const
+	{
+		return _produced.load(std::memory_order_acquire)
+			- _consumed.load(std::memory_order_acquire);
+	}
+
+	const uint8_t* HaloBuffer::ReadPtr() const
+	{
+		size_t at = _consumed.load(std::memory_order_relaxed) % Size();
+		return GetAt<uint8_t>(at);
+	}
+
+	void HaloBuffer::Release(size_t count)
+	{
+		if (count > Readable())
+		{
+			throw std::runtime_error{ "HaloBuffer underflow" };
+		}
+
+		// Single writer per cursor : no read-modify-write needed.
+		_consumed.store(_consumed.load(std::memory_order_relaxed) + count,
+			std::memory_order_release);
+	}
+
+	void HaloBuffer::ResetCursors()
+	{
+		_produced = 0;
+		_consumed = 0;
+	}
 }
\ No newline at end of file
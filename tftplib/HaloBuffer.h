@@ -1,21 +1,32 @@
 ﻿#pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include "Arena.h"
 
 namespace tftplib {
 
 	// Totally not a ring buffer
+	//	Size() bytes of memory mapped twice back to back : any access of up
+	//	to Size() bytes starting inside the first view never wraps.
+	//	With Pages::HUGE_PAGES, uses 2 MiB pages when size is a multiple of
+	//	them (Linux only).
+	//
+	//	Also usable as a single producer / single consumer byte ring : the
+	//	region between the cursors is always contiguous in memory.
 	class HaloBuffer
 	{
 	private:
 		class Os;
 
 	public:
-		HaloBuffer(size_t size);
+		HaloBuffer(size_t size, Arena::Pages pages = Arena::Pages::NORMAL);
 		~HaloBuffer();
 
 		size_t Size() const;
 		void* Get() const;
+		bool UsesHugePages() const;
 
 		template <typename T>
 		T* Get() const;
@@ -23,9 +34,25 @@ namespace tftplib {
 		template <typename T>
 		T* GetAt(size_t at) const;
 
+		// Producer side : WritePtr() has Writable() contiguous bytes.
+		size_t Writable() const;
+		uint8_t* WritePtr() const;
+		void Commit(size_t count);
+
+		// Consumer side : ReadPtr() has Readable() contiguous bytes.
+		size_t Readable() const;
+		const uint8_t* ReadPtr() const;
+		void Release(size_t count);
+
+		void ResetCursors();
+
 	private:
 		std::unique_ptr<Os> _os;
 
+		// Total bytes committed / released. Never wrap in practice.
+		std::atomic<size_t> _produced{ 0 };
+		std::atomic<size_t> _consumed{ 0 };
+
 	};
 
 	template <typename T>
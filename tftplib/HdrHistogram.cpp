@@ -0,0 +1,107 @@
+﻿#include "pch.h"
+#include "HdrHistogram.h"
+#include <algorithm>
+#include <cmath>
+
+namespace tftplib {
+
+	static_assert(HdrHistogram::IndexOf(HdrHistogram::MaxValue)
+		== HdrHistogram::BucketCount - 1);
+	static_assert(HdrHistogram::HighestEquivalent(HdrHistogram::BucketCount - 1)
+		== HdrHistogram::MaxValue);
+
+	HdrHistogram::HdrHistogram()
+		: _counts(BucketCount, 0)
+	{
+	}
+
+	void HdrHistogram::Record(uint64_t value, uint64_t count)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		value = std::min(value, MaxValue);
+		_counts[IndexOf(value)] += count;
+		_count += count;
+		_sum += value * count;
+		_min = std::min(_min, value);
+		_max = std::max(_max, value);
+	}
+
+	void HdrHistogram::Merge(const HdrHistogram& other)
+	{
+		for (size_t i = 0; i < BucketCount; i++)
+		{
+			_counts[i] += other._counts[i];
+		}
+
+		_count += other._count;
+		_sum += other._sum;
+		_min = std::min(_min, other._min);
+		_max = std::max(_max, other._max);
+	}
+
+	void HdrHistogram::Reset()
+	{
+		std::fill(_counts.begin(), _counts.end(), 0);
+		_count = 0;
+		_sum = 0;
+		_min = ~0ull;
+		_max = 0;
+	}
+
+	double HdrHistogram::Mean() const
+	{
+		return _count == 0 ? 0.0 : double(_sum) / double(_count);
+	}
+
+	uint64_t HdrHistogram::ValueAtPercentile(double percentile) const
+	{
+		if (_count == 0)
+		{
+			return 0;
+		}
+
+		percentile = std::clamp(percentile, 0.0, 100.0);
+		uint64_t rank = static_cast<uint64_t>(
+			std::ceil(percentile / 100.0 * double(_count)));
+		rank = std::max<uint64_t>(rank, 1);
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BucketCount; i++)
+		{
+			seen += _counts[i];
+			if (seen >= rank)
+			{
+				return std::min(HighestEquivalent(i), _max);
+			}
+		}
+
+		return _max;
+	}
+
+	void HdrRecorder::MergeInto(HdrHistogram& histogram) const
+	{
+		uint64_t count = 0;
+		for (size_t i = 0; i < HdrHistogram::BucketCount; i++)
+		{
+			uint64_t n = _counts[i].load(std::memory_order_relaxed);
+			histogram._counts[i] += n;
+			count += n;
+		}
+
+		if (count == 0)
+		{
+			return;
+		}
+
+		histogram._count += count;
+		histogram._sum += _sum.load(std::memory_order_relaxed);
+		histogram._min = std::min(histogram._min,
+			_min.load(std::memory_order_relaxed));
+		histogram._max = std::max(histogram._max,
+			_max.load(std::memory_order_relaxed));
+	}
+}
@@ -0,0 +1,139 @@
+﻿#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tftplib {
+
+	// **********************************************************************
+	// High dynamic range histogram.
+	//	Values up to MaxValue fall in log-linear buckets : every power of
+	//	two is split in 32 linear sub-buckets, which bounds the error of
+	//	any reported value to 1/32 (~3%) of it. Bucket layout is fixed,
+	//	so histograms merge by adding counts.
+	//
+	//	Recording is a handful of instructions and never allocates.
+	// **********************************************************************
+	class HdrHistogram
+	{
+	public:
+		static constexpr uint32_t SubBucketBits = 6;
+		static constexpr uint32_t ValueBits = 40;
+		static constexpr uint64_t MaxValue = (1ull << ValueBits) - 1;
+
+		static constexpr size_t SubBucketCount = size_t{ 1 } << SubBucketBits;
+		static constexpr size_t HalfCount = SubBucketCount / 2;
+		static constexpr size_t BucketCount =
+			(ValueBits - SubBucketBits) * HalfCount + SubBucketCount;
+
+		// Values above MaxValue are recorded as MaxValue.
+		static constexpr size_t IndexOf(uint64_t value) {
+			if (value > MaxValue) {
+				value = MaxValue;
+			}
+
+			if (value < SubBucketCount) {
+				return static_cast<size_t>(value);
+			}
+
+			uint32_t shift = std::bit_width(value) - SubBucketBits;
+			return shift * HalfCount + static_cast<size_t>(value >> shift);
+		}
+
+		static constexpr uint64_t LowestEquivalent(size_t index) {
+			if (index < SubBucketCount) {
+				return index;
+			}
+
+			uint32_t shift = static_cast<uint32_t>(index / HalfCount) - 1;
+			return uint64_t{ index - shift * HalfCount } << shift;
+		}
+
+		static constexpr uint64_t HighestEquivalent(size_t index) {
+			if (index < SubBucketCount) {
+				return index;
+			}
+
+			uint32_t shift = static_cast<uint32_t>(index / HalfCount) - 1;
+			return LowestEquivalent(index) + (uint64_t{ 1 } << shift) - 1;
+		}
+
+	public:
+		HdrHistogram();
+
+		void Record(uint64_t value, uint64_t count = 1);
+		void Merge(const HdrHistogram& other);
+		void Reset();
+
+		uint64_t Count() const { return _count; }
+		uint64_t Sum() const { return _sum; }
+		uint64_t Min() const { return _count == 0 ? 0 : _min; }
+		uint64_t Max() const { return _max; }
+		double Mean() const;
+
+		// Highest value within the bucket holding the given percentile
+		// (0 to 100) of the recorded values.
+		uint64_t ValueAtPercentile(double percentile) const;
+
+		uint64_t CountAt(size_t index) const { return _counts[index]; }
+
+	private:
+		std::vector<uint64_t> _counts;
+		uint64_t _count{ 0 };
+		uint64_t _sum{ 0 };
+		uint64_t _min{ ~0ull };
+		uint64_t _max{ 0 };
+
+		friend class HdrRecorder;
+	};
+
+	// **********************************************************************
+	// HdrHistogram recorded into by a single thread and read by others.
+	//	Plain loads and stores of relaxed atomics : no locked instruction
+	//	on the recording path. Readers merge a recorder into a histogram,
+	//	which may catch a value half recorded : counted in its bucket but
+	//	not yet in the sum.
+	// **********************************************************************
+	class HdrRecorder
+	{
+	public:
+		HdrRecorder() = default;
+		HdrRecorder(const HdrRecorder&) = delete;
+		HdrRecorder& operator=(const HdrRecorder&) = delete;
+
+		// Owning thread only.
+		void Record(uint64_t value) {
+			if (value > HdrHistogram::MaxValue) {
+				value = HdrHistogram::MaxValue;
+			}
+
+			Bump(_counts[HdrHistogram::IndexOf(value)], 1);
+			Bump(_sum, value);
+
+			if (value < _min.load(std::memory_order_relaxed)) {
+				_min.store(value, std::memory_order_relaxed);
+			}
+			if (value > _max.load(std::memory_order_relaxed)) {
+				_max.store(value, std::memory_order_relaxed);
+			}
+		}
+
+		// Any thread.
+		void MergeInto(HdrHistogram& histogram) const;
+
+	private:
+		static void Bump(std::atomic<uint64_t>& counter, uint64_t n) {
+			counter.store(counter.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint64_t> _counts[HdrHistogram::BucketCount]{};
+		std::atomic<uint64_t> _sum{ 0 };
+		std::atomic<uint64_t> _min{ ~0ull };
+		std::atomic<uint64_t> _max{ 0 };
+	};
+}
@@ -0,0 +1,152 @@
+﻿#include "pch.h"
+#include "Impairment.h"
+#include <algorithm>
+
+namespace tftplib {
+
+	Impairment::Impairment(const ImpairmentProfile& profile)
+		: _profile{ profile }
+		, _random{ profile.seed }
+	{
+		_thread = std::thread(&Impairment::Deliver, this);
+	}
+
+	Impairment::~Impairment()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ _lock };
+			_stopping = true;
+		}
+
+		_wake.notify_one();
+		_thread.join();
+	}
+
+	Impairment::Plan Impairment::Decide(size_t size)
+	{
+		Plan plan{};
+		auto now = Clock::now();
+
+		std::lock_guard<std::mutex> lock{ _lock };
+		_stats.packets++;
+
+		if (Roll(_profile.loss))
+		{
+			_stats.dropped++;
+			return plan;
+		}
+
+		uint32_t copies = 1;
+		if (Roll(_profile.duplicate))
+		{
+			_stats.duplicated++;
+			copies = 2;
+		}
+
+		for (uint32_t i = 0; i < copies; i++)
+		{
+			auto at = DepartureOf(size, now) + _profile.delay;
+			if (_profile.jitter.count() > 0)
+			{
+				at += std::chrono::microseconds{
+					_random() % uint64_t(_profile.jitter.count() + 1) };
+			}
+
+			if (Roll(_profile.reorder))
+			{
+				_stats.reordered++;
+				at += _profile.reorderHold;
+			}
+
+			if (at <= now)
+			{
+				plan.immediate++;
+			}
+			else
+			{
+				plan.at[plan.deferred++] = at;
+				_stats.deferred++;
+			}
+		}
+
+		return plan;
+	}
+
+	void Impairment::Defer(Clock::time_point at, Sender send)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ _lock };
+			if (_stopping)
+			{
+				return;
+			}
+
+			_pending.push_back(Pending{ at, _sequence++, std::move(send) });
+			std::push_heap(_pending.begin(), _pending.end(), std::greater<>{});
+		}
+
+		_wake.notify_one();
+	}
+
+	ImpairmentStats Impairment::GetStats() const
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		return _stats;
+	}
+
+	void Impairment::Deliver()
+	{
+		std::unique_lock<std::mutex> lock{ _lock };
+		while (!_stopping)
+		{
+			if (_pending.empty())
+			{
+				_wake.wait(lock);
+				continue;
+			}
+
+			auto at = _pending.front().at;
+			if (Clock::now() < at)
+			{
+				_wake.wait_until(lock, at);
+				continue;
+			}
+
+			std::pop_heap(_pending.begin(), _pending.end(), std::greater<>{});
+			Sender send = std::move(_pending.back().send);
+			_pending.pop_back();
+
+			lock.unlock();
+			send();
+			lock.lock();
+		}
+
+		_pending.clear();
+	}
+
+	bool Impairment::Roll(double probability)
+	{
+		if (probability <= 0.0)
+		{
+			return false;
+		}
+
+		return std::uniform_real_distribution<double>{ 0.0, 1.0 }(_random)
+			< probability;
+	}
+
+	// Packets leave one after the other at the link rate.
+	Impairment::Clock::time_point
+	Impairment::DepartureOf(size_t size, Clock::time_point now)
+	{
+		if (_profile.bandwidthBps == 0)
+		{
+			return now;
+		}
+
+		auto departure = std::max(now, _linkFreeAt);
+		_linkFreeAt = departure + std::chrono::nanoseconds{
+			uint64_t(size) * 8 * 1'000'000'000ull / _profile.bandwidthBps };
+		return departure;
+	}
+}
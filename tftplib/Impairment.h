@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace tftplib {
+
+	// What an impaired link does to the packets sent through it.
+	struct ImpairmentProfile {
+		double loss{ 0.0 };						// Probability, 0 to 1
+		double duplicate{ 0.0 };
+		double reorder{ 0.0 };					// Held back behind later packets
+		std::chrono::microseconds delay{ 0 };
+		std::chrono::microseconds jitter{ 0 };	// Added uniformly, 0 to jitter
+		std::chrono::microseconds reorderHold{ 2000 };
+		uint64_t bandwidthBps{ 0 };				// Bits per second, 0 : unlimited
+		uint64_t seed{ 1 };
+
+		bool IsActive() const {
+			return loss > 0.0 || duplicate > 0.0 || reorder > 0.0
+				|| delay.count() > 0 || jitter.count() > 0 || bandwidthBps > 0;
+		}
+	};
+
+	struct ImpairmentStats {
+		uint64_t packets{ 0 };
+		uint64_t dropped{ 0 };
+		uint64_t duplicated{ 0 };
+		uint64_t reordered{ 0 };
+		uint64_t deferred{ 0 };
+	};
+
+	// **********************************************************************
+	// Seeded packet loss, duplication, reordering, delay and bandwidth
+	//	caps on the send path of the sockets it is attached to.
+	//	Impairing what each end sends covers both directions on loopback,
+	//	without tc/netem or privileges.
+	//
+	//	Decisions come from one generator under a lock : a run is
+	//	reproducible as long as packets reach Plan() in the same order.
+	//	Delayed copies are sent by a delivery thread.
+	// **********************************************************************
+	class Impairment
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+		using Sender = std::function<void()>;
+
+		// Fate of one packet : copies to send right away, and when to send
+		// the held back ones.
+		struct Plan {
+			uint32_t immediate{ 0 };
+			uint32_t deferred{ 0 };
+			Clock::time_point at[2]{};
+		};
+
+	public:
+		explicit Impairment(const ImpairmentProfile& profile);
+		~Impairment();
+		Impairment(const Impairment&) = delete;
+		Impairment& operator=(const Impairment&) = delete;
+
+		Plan Decide(size_t size);
+
+		// Run send at the given time on the delivery thread. Pending
+		// sends are dropped when the Impairment goes away.
+		void Defer(Clock::time_point at, Sender send);
+
+		const ImpairmentProfile& Profile() const { return _profile; }
+		ImpairmentStats GetStats() const;
+
+	private:
+		struct Pending {
+			Clock::time_point at;
+			uint64_t sequence;
+			Sender send;
+
+			bool operator>(const Pending& rhs) const {
+				return at != rhs.at ? at > rhs.at : sequence > rhs.sequence;
+			}
+		};
+
+		void Deliver();
+		bool Roll(double probability);
+		Clock::time_point DepartureOf(size_t size, Clock::time_point now);
+
+	private:
+		const ImpairmentProfile _profile;
+
+		mutable std::mutex _lock;
+		std::condition_variable _wake;
+		std::mt19937_64 _random;
+		Clock::time_point _linkFreeAt{};
+		std::vector<Pending> _pending{};		// Min heap on at
+		uint64_t _sequence{ 0 };
+		ImpairmentStats _stats{};
+		bool _stopping{ false };
+
+		std::thread _thread{};
+	};
+}
@@ -0,0 +1,168 @@
+﻿#include "pch.h"
+#include "MemoryFileSystem.h"
+
+namespace tftplib {
+
+	// Collects the upload, published whole on Commit.
+	class MemoryWriter : public VfsWriter
+	{
+	public:
+		MemoryWriter(MemoryFileSystem& files, std::string name)
+			: _files{ files }
+			, _name{ std::move(name) }
+		{
+		}
+
+		bool Preallocate(uint64_t size) override
+		{
+			if (size > _content.max_size())
+			{
+				return false;
+			}
+
+			_content.reserve(static_cast<size_t>(size));
+			return true;
+		}
+
+		void WriteBlock(const uint8_t* buffer, size_t bufferSize) override
+		{
+			_content.insert(_content.end(), buffer, buffer + bufferSize);
+		}
+
+		void Commit() override
+		{
+			_files.Put(_name, std::move(_content));
+		}
+
+	private:
+		MemoryFileSystem& _files;
+		const std::string _name;
+		std::vector<uint8_t> _content{};
+	};
+
+	MemoryFileSystem::MemoryFileSystem() = default;
+
+	MemoryFileSystem& MemoryFileSystem::SetWritable(bool writable)
+	{
+		_writable = writable;
+		return *this;
+	}
+
+	void MemoryFileSystem::Put(std::string_view name, std::vector<uint8_t> content)
+	{
+		auto entry = std::make_shared<const Content>(Content{
+			std::move(content), std::filesystem::file_time_type::clock::now() });
+		Publish(Normalize(name), std::move(entry));
+	}
+
+	bool MemoryFileSystem::Remove(std::string_view name)
+	{
+		if (!Find(name))
+		{
+			return false;
+		}
+
+		Publish(Normalize(name), nullptr);
+		return true;
+	}
+
+	MemoryFileSystem::Shard& MemoryFileSystem::ShardOf(std::string_view normalized)
+	{
+		return _shards[std::hash<std::string_view>{}(normalized) % Shards];
+	}
+
+	const MemoryFileSystem::Shard&
+	MemoryFileSystem::ShardOf(std::string_view normalized) const
+	{
+		return _shards[std::hash<std::string_view>{}(normalized) % Shards];
+	}
+
+	std::shared_ptr<const MemoryFileSystem::Content>
+	MemoryFileSystem::Find(std::string_view name) const
+	{
+		std::string normalized = Normalize(name);
+		const Shard& shard = ShardOf(normalized);
+
+		std::shared_lock lock{ shard.lock };
+		auto it = shard.files.find(normalized);
+		return it == shard.files.end() ? nullptr : it->second;
+	}
+
+	// nullptr content removes the file. The replaced content is released
+	// out of the lock.
+	void MemoryFileSystem::Publish(std::string name,
+		std::shared_ptr<const Content> content)
+	{
+		Shard& shard = ShardOf(name);
+
+		std::unique_lock lock{ shard.lock };
+		if (content)
+		{
+			shard.files[std::move(name)].swap(content);
+		}
+		else
+		{
+			auto it = shard.files.find(name);
+			if (it != shard.files.end())
+			{
+				content = std::move(it->second);
+				shard.files.erase(it);
+			}
+		}
+		lock.unlock();
+	}
+
+	MemoryFileSystem::Result
+	MemoryFileSystem::Stat(std::string_view name, VfsStat& stat)
+	{
+		std::shared_ptr<const Content> content = Find(name);
+		if (!content)
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		stat.size = content->data.size();
+		stat.modified = content->modified;
+		return Result::VALID;
+	}
+
+	MemoryFileSystem::Result
+	MemoryFileSystem::OpenReader(std::string_view name, bool netascii,
+		VfsStat& stat, std::unique_ptr<VfsReader>& reader)
+	{
+		std::shared_ptr<const Content> content = Find(name);
+		if (!content)
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		if (netascii)
+		{
+			return Result::INVALID_MODE;
+		}
+
+		stat.size = content->data.size();
+		stat.modified = content->modified;
+		reader = std::make_unique<BufferReader>(content->data.data(),
+			content->data.size(), content);
+		return Result::VALID;
+	}
+
+	MemoryFileSystem::Result
+	MemoryFileSystem::OpenWriter(std::string_view name, bool netascii,
+		std::unique_ptr<VfsWriter>& writer)
+	{
+		if (!_writable)
+		{
+			return Result::INVALID_ACCESS_FORBIDDEN;
+		}
+
+		if (netascii)
+		{
+			return Result::INVALID_MODE;
+		}
+
+		writer = std::make_unique<MemoryWriter>(*this, Normalize(name));
+		return Result::VALID;
+	}
+}
@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include "VirtualFileSystem.h"
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Files held in memory : hot content, or benchmarks without the disk.
+	//	Names are normalized, so they compare like they would on disk.
+	//
+	//	The table is spread over shards by name, each behind a reader /
+	//	writer lock. Readers share a shard and only wait for a writer of
+	//	the same shard, for the time of one map update ; content is built
+	//	before the lock is taken. Readers keep the content they opened,
+	//	whatever happens to the table after.
+	//
+	//	Octet only : content is kept and served as is.
+	// **********************************************************************
+	class MemoryFileSystem : public VirtualFileSystem
+	{
+	public:
+		MemoryFileSystem();
+
+		// Uploads are kept when true. Off by default : they're held in
+		// memory whole, and nothing limits their size.
+		MemoryFileSystem& SetWritable(bool writable);
+
+		void Put(std::string_view name, std::vector<uint8_t> content);
+		bool Remove(std::string_view name);
+
+		bool IsReadOnly() const override { return !_writable; }
+
+		Result Stat(std::string_view name, VfsStat& stat) override;
+
+		Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) override;
+
+		Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) override;
+
+	private:
+		struct Content {
+			std::vector<uint8_t> data;
+			std::filesystem::file_time_type modified;
+		};
+
+		static constexpr size_t Shards = 16;
+
+		struct Shard {
+			mutable std::shared_mutex lock;
+			std::unordered_map<std::string, std::shared_ptr<const Content>> files;
+		};
+
+		Shard& ShardOf(std::string_view normalized);
+		const Shard& ShardOf(std::string_view normalized) const;
+
+		std::shared_ptr<const Content> Find(std::string_view name) const;
+		void Publish(std::string name, std::shared_ptr<const Content> content);
+
+	private:
+		std::array<Shard, Shards> _shards{};
+		bool _writable{ false };
+	};
+}
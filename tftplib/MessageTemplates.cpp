@@ -0,0 +1,67 @@
+﻿#include "pch.h"
+#include "MessageTemplates.h"
+#include <cstring>
+
+namespace tftplib {
+
+	MessageTemplates::MessageTemplates()
+	{
+		// Codes are stored in network order : count on the low byte.
+		ErrorCode last = ErrorCode::LAST;
+		uint8_t count = reinterpret_cast<const uint8_t*>(&last)[1] + 1;
+		for (uint8_t code = 0; code < count; code++)
+		{
+			ErrorCode error{};
+			PutU16(&error, code);
+			Add(error, nullptr);
+		}
+
+		for (const char* message : { errors::TimedOut, errors::Unavailable,
+			errors::CriticalError, errors::ShutDown })
+		{
+			Add(ErrorCode::UNDEFINED, message);
+		}
+	}
+
+	MessageTemplates::Payload
+	MessageTemplates::Error(ErrorCode code) const
+	{
+		return Error(code, nullptr);
+	}
+
+	MessageTemplates::Payload
+	MessageTemplates::Error(ErrorCode code, const char* message) const
+	{
+		for (const Entry& entry : _errors)
+		{
+			if (entry.code != code)
+			{
+				continue;
+			}
+
+			bool same = entry.message == message
+				|| (entry.message && message && strcmp(entry.message, message) == 0);
+			if (same)
+			{
+				return Payload{ entry.bytes, entry.size };
+			}
+		}
+
+		return Payload{};
+	}
+
+	void
+	MessageTemplates::Add(ErrorCode code, const char* message)
+	{
+		Entry entry{};
+		entry.code = code;
+		entry.message = message;
+		entry.size = static_cast<uint16_t>(encode<MessageError>(entry.bytes,
+			sizeof(entry.bytes), code, message));
+
+		if (entry.size > 0)
+		{
+			_errors.push_back(entry);
+		}
+	}
+}
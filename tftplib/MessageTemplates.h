@@ -0,0 +1,59 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "tftp_messages.h"
+
+namespace tftplib {
+
+	// Custom error messages sent by transactions, pre-encoded as well.
+	namespace errors {
+		inline constexpr const char* TimedOut = "transaction timed out";
+		inline constexpr const char* Unavailable = "temporarily unavailable";
+		inline constexpr const char* CriticalError = "critical server error";
+		inline constexpr const char* ShutDown = "Server shut down";
+	}
+
+	// **********************************************************************
+	// Immutable, pre-encoded response payloads.
+	//	Built once when the server is created, then only read : any thread
+	//	may send straight from the table, so rejecting a client costs a
+	//	single sendmsg and no encoding.
+	// **********************************************************************
+	class MessageTemplates
+	{
+	public:
+		struct Payload {
+			const uint8_t* data{ nullptr };
+			uint16_t size{ 0 };
+
+			explicit operator bool() const { return data != nullptr; }
+		};
+
+		MessageTemplates();
+
+		// ERROR carrying the default message for code.
+		Payload Error(ErrorCode code) const;
+
+		// ERROR carrying message, when the pair was pre-encoded.
+		// Unset otherwise : the caller encodes it itself.
+		Payload Error(ErrorCode code, const char* message) const;
+
+	private:
+		// Fits every default and custom message above.
+		static constexpr size_t MaxPayloadSize = 64;
+
+		struct Entry {
+			ErrorCode code{ ErrorCode::UNDEFINED };
+			const char* message{ nullptr };		// nullptr : default message
+			uint16_t size{ 0 };
+			uint8_t bytes[MaxPayloadSize]{};
+		};
+
+		void Add(ErrorCode code, const char* message);
+
+	private:
+		std::vector<Entry> _errors{};
+	};
+}
@@ -0,0 +1,225 @@
+﻿#include "pch.h"
+#include "Metrics.h"
+#include <fstream>
+#include <system_error>
+
+namespace tftplib {
+
+	static std::atomic<uint64_t> nextMetricsId{ 1 };
+
+	/* *********************************************************************
+	 * TimingSet : every timing recorder of one thread.
+	 * *********************************************************************/
+	class TimingSet
+	{
+	public:
+		HdrRecorder& At(Timing t, SizeClass c) {
+			return _recorders[size_t(t)][size_t(c)];
+		}
+
+		void MergeInto(MetricsSnapshot::Timings& timings) const {
+			for (size_t t = 0; t < size_t(Timing::COUNT); t++)
+			{
+				for (size_t c = 0; c < size_t(SizeClass::COUNT); c++)
+				{
+					_recorders[t][c].MergeInto(timings[t][c]);
+				}
+			}
+		}
+
+		// A released set keeps its counts and goes to the next thread
+		// recording for the first time.
+		bool Acquire() {
+			return !_owned.exchange(true, std::memory_order_acquire);
+		}
+
+		void Release() { _owned.store(false, std::memory_order_release); }
+
+	private:
+		HdrRecorder _recorders[size_t(Timing::COUNT)][size_t(SizeClass::COUNT)];
+		std::atomic<bool> _owned{ false };
+	};
+
+	// The calling thread's timing set, released when the thread exits.
+	struct ThreadTimings {
+		uint64_t metrics{ 0 };
+		std::shared_ptr<TimingSet> set{};
+
+		~ThreadTimings() {
+			if (set) set->Release();
+		}
+	};
+
+	static thread_local ThreadTimings threadTimings{};
+
+	/* *********************************************************************
+	 * Metrics
+	 * *********************************************************************/
+	Metrics::Metrics()
+		: _id{ nextMetricsId.fetch_add(1) }
+	{
+	}
+
+	Metrics::~Metrics()
+	{
+	}
+
+	size_t Metrics::NextShard()
+	{
+		static std::atomic<size_t> next{ 0 };
+		return next.fetch_add(1, std::memory_order_relaxed) % Shards;
+	}
+
+	TimingSet& Metrics::LocalTimings()
+	{
+		if (threadTimings.metrics == _id)
+		{
+			return *threadTimings.set;
+		}
+
+		// First record of this thread for this registry.
+		if (threadTimings.set)
+		{
+			threadTimings.set->Release();
+		}
+
+		std::lock_guard<std::mutex> lock{ _timingsLock };
+		std::shared_ptr<TimingSet> set = nullptr;
+		for (auto& candidate : _timings)
+		{
+			if (candidate->Acquire())
+			{
+				set = candidate;
+				break;
+			}
+		}
+
+		if (!set)
+		{
+			set = std::make_shared<TimingSet>();
+			set->Acquire();
+			_timings.push_back(set);
+		}
+
+		threadTimings.metrics = _id;
+		threadTimings.set = set;
+		return *set;
+	}
+
+	void Metrics::Record(Timing t, SizeClass c, uint64_t value)
+	{
+		LocalTimings().At(t, c).Record(value);
+	}
+
+	MetricsSnapshot Metrics::Snapshot() const
+	{
+		MetricsSnapshot snapshot{};
+		for (const Shard& shard : _shards)
+		{
+			for (size_t i = 0; i < snapshot.counters.size(); i++)
+			{
+				snapshot.counters[i] +=
+					shard.counters[i].load(std::memory_order_relaxed);
+			}
+
+			for (size_t i = 0; i < snapshot.gauges.size(); i++)
+			{
+				snapshot.gauges[i] +=
+					shard.gauges[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock{ _timingsLock };
+		for (auto& set : _timings)
+		{
+			set->MergeInto(snapshot.timings);
+		}
+
+		return snapshot;
+	}
+
+	HdrHistogram MetricsSnapshot::Get(Timing t) const
+	{
+		HdrHistogram merged{};
+		for (const HdrHistogram& h : timings[size_t(t)])
+		{
+			merged.Merge(h);
+		}
+		return merged;
+	}
+
+	void Metrics::WritePrometheus(std::ostream& os,
+		const MetricsSnapshot& snapshot)
+	{
+		static constexpr double Quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+		// Enough digits for microsecond sums over long uptimes.
+		auto precision = os.precision(15);
+
+		for (size_t i = 0; i < snapshot.counters.size(); i++)
+		{
+			os << "# HELP " << CounterInfo[i].name << " " << CounterInfo[i].help << "\n"
+				<< "# TYPE " << CounterInfo[i].name << " counter\n"
+				<< CounterInfo[i].name << " " << snapshot.counters[i] << "\n";
+		}
+
+		for (size_t i = 0; i < snapshot.gauges.size(); i++)
+		{
+			os << "# HELP " << GaugeInfo[i].name << " " << GaugeInfo[i].help << "\n"
+				<< "# TYPE " << GaugeInfo[i].name << " gauge\n"
+				<< GaugeInfo[i].name << " " << snapshot.gauges[i] << "\n";
+		}
+
+		// HDR histograms are exposed as summaries, one per size class.
+		for (size_t t = 0; t < snapshot.timings.size(); t++)
+		{
+			const TimingInfo& info = TimingInfos[t];
+			os << "# HELP " << info.name << " " << info.help << "\n"
+				<< "# TYPE " << info.name << " summary\n";
+
+			for (size_t c = 0; c < snapshot.timings[t].size(); c++)
+			{
+				const HdrHistogram& h = snapshot.timings[t][c];
+				const char* size = SizeClassNames[c];
+
+				for (double q : Quantiles)
+				{
+					os << info.name << "{size=\"" << size << "\",quantile=\"" << q
+						<< "\"} " << double(h.ValueAtPercentile(q * 100.0)) * info.scale
+						<< "\n";
+				}
+
+				os << info.name << "_sum{size=\"" << size << "\"} "
+					<< double(h.Sum()) * info.scale << "\n"
+					<< info.name << "_count{size=\"" << size << "\"} "
+					<< h.Count() << "\n";
+			}
+		}
+
+		os.precision(precision);
+	}
+
+	bool Metrics::DumpToFile(const std::filesystem::path& path) const
+	{
+		std::filesystem::path staging = path;
+		staging += ".tmp";
+
+		{
+			std::ofstream out{ staging, std::ios::binary | std::ios::trunc };
+			if (!out)
+			{
+				return false;
+			}
+
+			WritePrometheus(out, Snapshot());
+			if (!out.flush())
+			{
+				return false;
+			}
+		}
+
+		std::error_code ec;
+		std::filesystem::rename(staging, path, ec);
+		return !ec;
+	}
+}
@@ -0,0 +1,248 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include "HdrHistogram.h"
+
+namespace tftplib {
+
+	enum class Counter : uint8_t {
+		PACKETS_IN,
+		PACKETS_OUT,
+		BYTES_IN,
+		BYTES_OUT,
+		FILE_BYTES_SENT,				// RRQ payload acknowledged
+		FILE_BYTES_RECEIVED,			// WRQ payload written
+		RETRANSMITS,
+		TIMEOUTS,
+		DUPLICATE_ACKS,					// Duplicate or stale, ignored
+		RETRANSMITS_AVOIDED,			// Duplicate ACKs not answered with DATA
+		FAST_RETRANSMITS,				// Windows resent after K duplicates
+		MULTICAST_BLOCKS_SENT,			// DATA sent once to a whole group
+		MULTICAST_MASTER_CHANGES,
+		STREAM_CHUNKS_READ,				// Shared reads : from the file
+		STREAM_CHUNKS_SHARED,			// Shared reads : from another's read
+		PACK_READS,						// RRQs served from the pack archive
+		GENERATED_RENDERS,				// Files made by content providers
+		GENERATED_CACHE_HITS,
+		PATH_CACHE_HITS,				// Disk lookups answered from memory
+		PATH_CACHE_MISSES,
+		PATH_CACHE_INVALIDATIONS,		// Entries dropped on changes
+		PATH_CACHE_EVICTIONS,			// Entries dropped for room
+		TRANSACTIONS_STARTED,
+		TRANSACTIONS_COMPLETED,
+		TRANSACTIONS_ABORTED,
+		TRANSACTIONS_REJECTED,
+		REQUESTS_PARKED,				// Waited for a file in use
+		DATAGRAM_POOL_EXHAUSTED,
+		ALLOCATOR_EXHAUSTED,
+
+		COUNT
+	};
+
+	enum class Gauge : uint8_t {
+		ACTIVE_TRANSACTIONS,
+		DATAGRAMS_IN_USE,
+		MULTICAST_SESSIONS,
+		STREAM_BYTES_CACHED,
+
+		COUNT
+	};
+
+	// Recorded per transfer, in HDR histograms.
+	enum class Timing : uint8_t {
+		ADMISSION,						// Request received to first reply, us
+		FIRST_BYTE,						// Request received to block 1 delivered, us
+		BLOCK_RTT,						// DATA sent to its ACK, first try only, us
+		TRANSFER,						// Request received to last block, us
+		THROUGHPUT,						// File bytes over transfer time, KiB/s
+
+		COUNT
+	};
+
+	// Timings are broken down by the size of the transferred file.
+	enum class SizeClass : uint8_t {
+		UNDER_64K,
+		UNDER_1M,
+		UNDER_16M,
+		LARGE,
+
+		COUNT
+	};
+
+	inline SizeClass SizeClassOf(uint64_t bytes) {
+		return bytes < 0x10000 ? SizeClass::UNDER_64K
+			: bytes < 0x100000 ? SizeClass::UNDER_1M
+			: bytes < 0x1000000 ? SizeClass::UNDER_16M
+			: SizeClass::LARGE;
+	}
+
+	struct MetricInfo {
+		const char* name;
+		const char* help;
+	};
+
+	inline constexpr MetricInfo CounterInfo[] = {
+		{ "tftp_packets_in_total", "Datagrams received" },
+		{ "tftp_packets_out_total", "Datagrams sent" },
+		{ "tftp_bytes_in_total", "Datagram bytes received" },
+		{ "tftp_bytes_out_total", "Datagram bytes sent" },
+		{ "tftp_file_bytes_sent_total", "File bytes served to clients" },
+		{ "tftp_file_bytes_received_total", "File bytes written from clients" },
+		{ "tftp_retransmits_total", "DATA blocks sent again" },
+		{ "tftp_timeouts_total", "Receive deadlines elapsed" },
+		{ "tftp_duplicate_acks_total", "Duplicate or stale ACKs ignored" },
+		{ "tftp_retransmits_avoided_total", "Duplicate ACKs that did not trigger a retransmission" },
+		{ "tftp_fast_retransmits_total", "Windows resent after repeated duplicate ACKs" },
+		{ "tftp_multicast_blocks_sent_total", "DATA blocks sent to a multicast group" },
+		{ "tftp_multicast_master_changes_total", "Multicast clients made master" },
+		{ "tftp_stream_chunks_read_total", "Shared stream chunks read from disk" },
+		{ "tftp_stream_chunks_shared_total", "Shared stream chunks served from memory" },
+		{ "tftp_pack_reads_total", "Downloads served from the pack archive" },
+		{ "tftp_generated_renders_total", "Files made by content providers" },
+		{ "tftp_generated_cache_hits_total", "Generated files served from the cache" },
+		{ "tftp_path_cache_hits_total", "Disk lookups answered from the path cache" },
+		{ "tftp_path_cache_misses_total", "Disk lookups that went to the disk" },
+		{ "tftp_path_cache_invalidations_total", "Path cache entries dropped on file changes" },
+		{ "tftp_path_cache_evictions_total", "Path cache entries dropped to stay under its size" },
+		{ "tftp_transactions_started_total", "Transfers started" },
+		{ "tftp_transactions_completed_total", "Transfers completed" },
+		{ "tftp_transactions_aborted_total", "Transfers aborted" },
+		{ "tftp_transactions_rejected_total", "Requests turned away" },
+		{ "tftp_requests_parked_total", "Requests that waited for a file in use" },
+		{ "tftp_datagram_pool_exhausted_total", "Datagram allocations failed" },
+		{ "tftp_allocator_exhausted_total", "Coroutine frame allocations failed" },
+	};
+
+	inline constexpr MetricInfo GaugeInfo[] = {
+		{ "tftp_active_transactions", "Transfers in progress" },
+		{ "tftp_datagrams_in_use", "Datagrams taken from the pools" },
+		{ "tftp_multicast_sessions", "Files being sent to a multicast group" },
+		{ "tftp_stream_bytes_cached", "File bytes held for shared readers" },
+	};
+
+	struct TimingInfo {
+		const char* name;
+		const char* help;
+		double scale;					// Recorded unit to exposed unit
+	};
+
+	inline constexpr TimingInfo TimingInfos[] = {
+		{ "tftp_admission_seconds", "Request received to first reply", 1e-6 },
+		{ "tftp_first_byte_seconds", "Request received to first block delivered", 1e-6 },
+		{ "tftp_block_rtt_seconds", "Time from DATA to its ACK", 1e-6 },
+		{ "tftp_transfer_seconds", "Transfer duration", 1e-6 },
+		{ "tftp_throughput_bytes_per_second", "File bytes per second of transfer", 1024.0 },
+	};
+
+	inline constexpr const char* SizeClassNames[] = {
+		"under_64k", "under_1m", "under_16m", "large"
+	};
+
+	static_assert(std::size(CounterInfo) == size_t(Counter::COUNT));
+	static_assert(std::size(GaugeInfo) == size_t(Gauge::COUNT));
+	static_assert(std::size(TimingInfos) == size_t(Timing::COUNT));
+	static_assert(std::size(SizeClassNames) == size_t(SizeClass::COUNT));
+
+	struct MetricsSnapshot {
+		using Timings = std::array<std::array<HdrHistogram, size_t(SizeClass::COUNT)>,
+			size_t(Timing::COUNT)>;
+
+		std::array<uint64_t, size_t(Counter::COUNT)> counters{};
+		std::array<int64_t, size_t(Gauge::COUNT)> gauges{};
+		Timings timings{};
+
+		uint64_t Get(Counter c) const { return counters[size_t(c)]; }
+		int64_t Get(Gauge g) const { return gauges[size_t(g)]; }
+		const HdrHistogram& Get(Timing t, SizeClass c) const {
+			return timings[size_t(t)][size_t(c)];
+		}
+
+		// Every size class merged.
+		HdrHistogram Get(Timing t) const;
+	};
+
+	class TimingSet;
+
+	// **********************************************************************
+	// Server wide counters, gauges and timing histograms.
+	//	Every counter update is a relaxed atomic add to the calling
+	//	thread's shard : no lock, and threads don't share cache lines as
+	//	long as there are fewer of them than shards.
+	//
+	//	Timings go to HDR recorders owned by the calling thread, taken on
+	//	its first record. Snapshot() sums the shards and merges the
+	//	recorders, so values read while traffic flows are only consistent
+	//	with themselves.
+	// **********************************************************************
+	class Metrics
+	{
+	public:
+		static constexpr size_t Shards = 16;
+
+	public:
+		Metrics();
+		~Metrics();
+		Metrics(const Metrics&) = delete;
+		Metrics& operator=(const Metrics&) = delete;
+
+		void Add(Counter c, uint64_t n = 1) {
+			Local().counters[size_t(c)].fetch_add(n, std::memory_order_relaxed);
+		}
+
+		void Add(Gauge g, int64_t n) {
+			Local().gauges[size_t(g)].fetch_add(n, std::memory_order_relaxed);
+		}
+
+		void Record(Timing t, SizeClass c, uint64_t value);
+
+		void Record(Timing t, SizeClass c, std::chrono::microseconds elapsed) {
+			Record(t, c, elapsed.count() < 0 ? 0 : uint64_t(elapsed.count()));
+		}
+
+		MetricsSnapshot Snapshot() const;
+
+		// Prometheus text exposition format, version 0.0.4.
+		static void WritePrometheus(std::ostream& os,
+			const MetricsSnapshot& snapshot);
+
+		// Write the exposition next to path, then rename it over path so
+		// scrapers never read a partial file.
+		bool DumpToFile(const std::filesystem::path& path) const;
+
+	private:
+		struct alignas(64) Shard {
+			std::atomic<uint64_t> counters[size_t(Counter::COUNT)]{};
+			std::atomic<int64_t> gauges[size_t(Gauge::COUNT)]{};
+		};
+
+		Shard& Local() {
+			return _shards[ShardIndex()];
+		}
+
+		// Threads get shards round robin on their first update.
+		static size_t ShardIndex() {
+			thread_local const size_t index = NextShard();
+			return index;
+		}
+
+		static size_t NextShard();
+
+		TimingSet& LocalTimings();
+
+	private:
+		Shard _shards[Shards];
+
+		const uint64_t _id;
+		mutable std::mutex _timingsLock;
+		std::vector<std::shared_ptr<TimingSet>> _timings;
+	};
+}
@@ -0,0 +1,374 @@
+﻿#include "pch.h"
+#include "MetricsExporter.h"
+#include <sstream>
+#include <string>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * OS Specific class declaration
+	 * *********************************************************************/
+	class MetricsExporter::Os
+	{
+	public:
+		enum class Wakeup { CLIENT, SIGNAL, TIMEOUT };
+
+	public:
+		Os() = default;
+		~Os();
+
+		bool Listen(const std::filesystem::path& path);
+		Wakeup Wait(NativeHandle signal, int64_t timeoutMs);
+
+		// Send the whole payload to one pending client, then close it.
+		void Reply(const std::string& payload);
+
+	private:
+		std::filesystem::path _path{};
+#if defined(_WIN32)
+		SOCKET _listener{ INVALID_SOCKET };
+		WSAEVENT _event{ WSA_INVALID_EVENT };
+#else
+		int _listener{ -1 };
+#endif
+	};
+
+	// A stalled client must not hold the exporter.
+	static constexpr int ReplyTimeoutMs = 500;
+
+	/* *********************************************************************
+	 * OS Specific functions definition
+	 * *********************************************************************/
+#if defined(_WIN32)
+
+	MetricsExporter::Os::~Os()
+	{
+		if (_listener != INVALID_SOCKET)
+		{
+			closesocket(_listener);
+			std::error_code ec;
+			std::filesystem::remove(_path, ec);
+		}
+
+		if (_event != WSA_INVALID_EVENT)
+		{
+			WSACloseEvent(_event);
+		}
+	}
+
+	bool MetricsExporter::Os::Listen(const std::filesystem::path& path)
+	{
+		std::string native = path.string();
+
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (native.size() >= sizeof(address.sun_path))
+		{
+			return false;
+		}
+		memcpy(address.sun_path, native.c_str(), native.size());
+
+		_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_listener == INVALID_SOCKET)
+		{
+			return false;
+		}
+		_path = path;
+
+		// A previous run may have left its socket file behind.
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+
+		if (bind(_listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR
+			|| listen(_listener, 8) == SOCKET_ERROR)
+		{
+			return false;
+		}
+
+		_event = WSACreateEvent();
+		return _event != WSA_INVALID_EVENT
+			&& WSAEventSelect(_listener, _event, FD_ACCEPT) == 0;
+	}
+
+	MetricsExporter::Os::Wakeup
+	MetricsExporter::Os::Wait(NativeHandle signal, int64_t timeoutMs)
+	{
+		HANDLE handles[] = { reinterpret_cast<HANDLE>(signal), _event };
+		DWORD timeout = timeoutMs < 0 ? INFINITE : static_cast<DWORD>(timeoutMs);
+
+		switch (WaitForMultipleObjects(2, handles, FALSE, timeout))
+		{
+			case WAIT_OBJECT_0:
+				return Wakeup::SIGNAL;
+
+			case WAIT_OBJECT_0 + 1:
+				WSAResetEvent(_event);
+				return Wakeup::CLIENT;
+
+			default:
+				return Wakeup::TIMEOUT;
+		}
+	}
+
+	void MetricsExporter::Os::Reply(const std::string& payload)
+	{
+		SOCKET client = accept(_listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		// Accepted sockets inherit the listener's event selection.
+		WSAEventSelect(client, nullptr, 0);
+		u_long blocking = 0;
+		ioctlsocket(client, FIONBIO, &blocking);
+
+		DWORD timeout = ReplyTimeoutMs;
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO,
+			(const char*)&timeout, sizeof(timeout));
+
+		size_t sent = 0;
+		while (sent < payload.size())
+		{
+			int result = send(client, payload.data() + sent,
+				static_cast<int>(payload.size() - sent), 0);
+			if (result <= 0)
+			{
+				break;
+			}
+			sent += result;
+		}
+
+		closesocket(client);
+	}
+
+#else
+
+	MetricsExporter::Os::~Os()
+	{
+		if (_listener != -1)
+		{
+			close(_listener);
+			std::error_code ec;
+			std::filesystem::remove(_path, ec);
+		}
+	}
+
+	bool MetricsExporter::Os::Listen(const std::filesystem::path& path)
+	{
+		std::string native = path.string();
+
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (native.size() >= sizeof(address.sun_path))
+		{
+			return false;
+		}
+		memcpy(address.sun_path, native.c_str(), native.size());
+
+		_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (_listener == -1)
+		{
+			return false;
+		}
+		_path = path;
+
+		// A previous run may have left its socket file behind.
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+
+		return bind(_listener, (sockaddr*)&address, sizeof(address)) == 0
+			&& listen(_listener, 8) == 0;
+	}
+
+	MetricsExporter::Os::Wakeup
+	MetricsExporter::Os::Wait(NativeHandle signal, int64_t timeoutMs)
+	{
+		pollfd fds[2]{};
+		fds[0].fd = static_cast<int>(signal);
+		fds[0].events = POLLIN;
+		fds[1].fd = _listener;
+		fds[1].events = POLLIN;
+
+		int timeout = timeoutMs < 0 ? -1 : static_cast<int>(timeoutMs);
+		int result = 0;
+		do
+		{
+			result = poll(fds, 2, timeout);
+		} while (result == -1 && errno == EINTR);
+
+		if (result <= 0)
+		{
+			return Wakeup::TIMEOUT;
+		}
+
+		return (fds[0].revents & POLLIN) ? Wakeup::SIGNAL : Wakeup::CLIENT;
+	}
+
+	void MetricsExporter::Os::Reply(const std::string& payload)
+	{
+		int client = accept4(_listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1)
+		{
+			return;
+		}
+
+		timeval timeout{};
+		timeout.tv_usec = ReplyTimeoutMs * 1000;
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		size_t sent = 0;
+		while (sent < payload.size())
+		{
+			ssize_t result = send(client, payload.data() + sent,
+				payload.size() - sent, MSG_NOSIGNAL);
+			if (result <= 0)
+			{
+				break;
+			}
+			sent += result;
+		}
+
+		close(client);
+	}
+
+#endif
+
+	/* *********************************************************************
+	 * MetricsExporter functions definition
+	 * *********************************************************************/
+	MetricsExporter::MetricsExporter(const Metrics& metrics)
+		: _metrics{ metrics }
+	{
+	}
+
+	MetricsExporter::~MetricsExporter()
+	{
+		Stop();
+	}
+
+	MetricsExporter& MetricsExporter::SetFile(const std::filesystem::path& path)
+	{
+		_file = path;
+		return *this;
+	}
+
+	MetricsExporter& MetricsExporter::SetSocket(const std::filesystem::path& path)
+	{
+		_socket = path;
+		return *this;
+	}
+
+	MetricsExporter& MetricsExporter::SetInterval(std::chrono::milliseconds interval)
+	{
+		_interval = interval;
+		return *this;
+	}
+
+	bool MetricsExporter::Start(std::ostream& err)
+	{
+		if (_running || !IsEnabled())
+		{
+			return false;
+		}
+
+		_err = &err;
+		if (!_socket.empty())
+		{
+			_os = std::make_unique<Os>();
+			if (!_os->Listen(_socket))
+			{
+				err << "[Metrics] Could not listen on " << _socket << std::endl;
+				_os = nullptr;
+			}
+		}
+
+		_signal.Reset();
+		_running = true;
+		_thread = std::thread(&MetricsExporter::Run, this);
+		return true;
+	}
+
+	void MetricsExporter::Stop()
+	{
+		if (!_running.exchange(false))
+		{
+			return;
+		}
+
+		_signal.EmitSignal();
+		_thread.join();
+		_os = nullptr;
+
+		// Leave the final counts behind.
+		if (!_file.empty())
+		{
+			_metrics.DumpToFile(_file);
+		}
+	}
+
+	void MetricsExporter::Run()
+	{
+		using namespace std::chrono;
+
+		auto nextDump = steady_clock::now();
+		bool dumpFailed = false;
+
+		while (_running)
+		{
+			auto now = steady_clock::now();
+			if (!_file.empty() && now >= nextDump)
+			{
+				bool dumped = _metrics.DumpToFile(_file);
+				if (!dumped && !dumpFailed)
+				{
+					*_err << "[Metrics] Could not write " << _file << std::endl;
+				}
+				dumpFailed = !dumped;
+				nextDump = now + _interval;
+			}
+
+			int64_t timeoutMs = _file.empty() ? -1
+				: ceil<milliseconds>(nextDump - now).count();
+
+			if (!_os)
+			{
+				_signal.WaitForSignal(milliseconds{ timeoutMs < 0 ? 1000 : timeoutMs });
+				continue;
+			}
+
+			switch (_os->Wait(_signal.GetNativeHandle(), timeoutMs))
+			{
+				case Os::Wakeup::CLIENT:
+					Serve();
+					break;
+
+				case Os::Wakeup::SIGNAL:
+					_signal.Consume();
+					break;
+
+				case Os::Wakeup::TIMEOUT:
+					break;
+			}
+		}
+	}
+
+	void MetricsExporter::Serve()
+	{
+		std::ostringstream exposition;
+		Metrics::WritePrometheus(exposition, _metrics.Snapshot());
+		_os->Reply(exposition.str());
+	}
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include "Metrics.h"
+#include "Signal.h"
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Publishes a Metrics registry in the Prometheus text format.
+	//	A background thread rewrites the metrics file every interval and
+	//	answers each connection on the Unix socket with one exposition,
+	//	then closes it. Either output may be left unset.
+	// **********************************************************************
+	class MetricsExporter
+	{
+	private:
+		class Os;
+
+	public:
+		MetricsExporter(const Metrics& metrics);
+		~MetricsExporter();
+		MetricsExporter(const MetricsExporter&) = delete;
+		MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+		// To set before starting the exporter
+		MetricsExporter& SetFile(const std::filesystem::path& path);
+		MetricsExporter& SetSocket(const std::filesystem::path& path);
+		MetricsExporter& SetInterval(std::chrono::milliseconds interval);
+
+		bool Start(std::ostream& err);
+		void Stop();
+
+		bool IsEnabled() const {
+			return !_file.empty() || !_socket.empty();
+		}
+
+	private:
+		void Run();
+		void Serve();
+
+	private:
+		const Metrics& _metrics;
+
+		std::filesystem::path _file{};
+		std::filesystem::path _socket{};
+		std::chrono::milliseconds _interval{ 1000 };
+
+		std::unique_ptr<Os> _os;
+		std::ostream* _err{ nullptr };
+		std::thread _thread{};
+		Signal _signal{};
+		std::atomic<bool> _running{ false };
+	};
+}
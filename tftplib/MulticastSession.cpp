@@ -0,0 +1,340 @@
+﻿#include "pch.h"
+#include "MulticastSession.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "UdpSocketWindows.h"
+#include "VirtualFileSystem.h"
+#include "tftp_messages.h"
+#include <algorithm>
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * MulticastSession
+	 * *********************************************************************/
+	MulticastSession::MulticastSession(VirtualFileSystem& files,
+		const std::string& file,
+		uint64_t fileSize,
+		uint16_t blockSize,
+		const std::string& group,
+		uint16_t port,
+		std::shared_ptr<UdpSocketWindows> socket,
+		Metrics& metrics,
+		Tracer& tracer)
+		: _files{ files }
+		, _file{ file }
+		, _blockSize{ blockSize }
+		, _lastBlock{ static_cast<uint16_t>(fileSize / blockSize + 1) }
+		, _port{ port }
+		, _groupOption{ group + "," + std::to_string(port) }
+		, _socket{ std::move(socket) }
+		, _metrics{ metrics }
+		, _tracer{ tracer }
+		, _packet( size_t{ MessageData::HeaderSize() } + blockSize )
+	{
+		UdpSocketWindows::Resolve(group.c_str(), port, _group);
+	}
+
+	MulticastSession::~MulticastSession()
+	{
+		_socket->Unbind();
+	}
+
+	bool MulticastSession::Join(const Member& member)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		_members.push_back(member);
+
+		bool master = _members.size() == 1;
+		if (master)
+		{
+			_masterAcked = false;
+			_promoted = false;
+		}
+
+		_tracer.Emit(TraceId::MULTICAST_JOIN, member.tid,
+			_port, _members.size(), master);
+		return master;
+	}
+
+	void MulticastSession::Leave(const void* owner)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		auto it = std::find_if(_members.begin(), _members.end(),
+			[owner](const Member& m) { return m.owner == owner; });
+		if (it == _members.end())
+		{
+			return;
+		}
+
+		bool wasMaster = it == _members.begin();
+		_members.erase(it);
+		if (wasMaster)
+		{
+			Promote();
+		}
+	}
+
+	bool MulticastSession::IsEmpty() const
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		return _members.empty();
+	}
+
+	bool MulticastSession::IsMaster(const void* owner) const
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		return !_members.empty() && _members.front().owner == owner;
+	}
+
+	MulticastSession::AckResult
+	MulticastSession::OnAck(const void* owner, uint16_t block)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		if (_members.empty() || _members.front().owner != owner
+			|| block > _lastBlock)
+		{
+			return AckResult::IGNORED;
+		}
+
+		if (block == _lastBlock)
+		{
+			_members.erase(_members.begin());
+			Promote();
+			return AckResult::COMPLETE;
+		}
+
+		// Once the master is going, an ACK for the block before the
+		// current one was already answered.
+		bool first = !_masterAcked;
+		_masterAcked = true;
+		if (!first && static_cast<uint16_t>(block + 1) == _current)
+		{
+			return AckResult::IGNORED;
+		}
+
+		return SendBlock(static_cast<uint16_t>(block + 1))
+			? AckResult::SENT
+			: AckResult::FAILED;
+	}
+
+	bool MulticastSession::Resend(const void* owner)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		if (_members.empty() || _members.front().owner != owner)
+		{
+			return false;
+		}
+
+		if (!_masterAcked)
+		{
+			return _promoted && SendMasterOack(_members.front());
+		}
+
+		return SendBlock(_current);
+	}
+
+	// Lock held.
+	void MulticastSession::Promote()
+	{
+		_masterAcked = false;
+		if (_members.empty())
+		{
+			return;
+		}
+
+		_promoted = true;
+
+		const Member& master = _members.front();
+		_metrics.Add(Counter::MULTICAST_MASTER_CHANGES);
+		_tracer.Emit(TraceId::MULTICAST_MASTER, master.tid,
+			_port, _members.size(), _current);
+
+		SendMasterOack(master);
+	}
+
+	// Lock held.
+	bool MulticastSession::SendBlock(uint16_t block)
+	{
+		if (block != _current || _packetSize == 0)
+		{
+			uint8_t* payload = _packet.data() + MessageData::HeaderSize();
+			size_t read = ReadBlock(block, payload);
+			if (read > _blockSize)
+			{
+				_packetSize = 0;
+				return false;
+			}
+
+			encode<MessageData>(_packet.data(), _packet.size(), block,
+				static_cast<uint16_t>(read));
+			_packetSize = MessageData::HeaderSize() + read;
+			_current = block;
+		}
+
+		if (!_socket->SendTo(_packet.data(), _packetSize, _group))
+		{
+			return false;
+		}
+
+		_metrics.Add(Counter::MULTICAST_BLOCKS_SENT);
+		_metrics.Add(Counter::PACKETS_OUT);
+		_metrics.Add(Counter::BYTES_OUT, _packetSize);
+		_metrics.Add(Counter::FILE_BYTES_SENT,
+			_packetSize - MessageData::HeaderSize());
+		return true;
+	}
+
+	// Lock held. Later masters only hear about the multicast option.
+	bool MulticastSession::SendMasterOack(const Member& member)
+	{
+		std::string value = _groupOption + ",1";
+		OptionValue option{ options::Multicast, 0, value.c_str() };
+
+		uint8_t oack[128];
+		size_t size = encode<MessageOack>(oack, sizeof(oack), &option, size_t{ 1 });
+		if (size == 0 || !member.socket->SendTo(oack, size, member.client))
+		{
+			return false;
+		}
+
+		_metrics.Add(Counter::PACKETS_OUT);
+		_metrics.Add(Counter::BYTES_OUT, size);
+		return true;
+	}
+
+	// Lock held. Masters mostly ask for the next block ; a new master
+	// may go back to the start.
+	size_t MulticastSession::ReadBlock(uint16_t block, uint8_t* buffer)
+	{
+		if (!_reader || block < _nextRead)
+		{
+			_reader = nullptr;
+			VfsStat stat{};
+			if (_files.OpenReader(_file, false, stat, _reader)
+				!= VirtualFileSystem::Result::VALID)
+			{
+				return -1;
+			}
+			_nextRead = 1;
+		}
+
+		while (_nextRead < block)
+		{
+			_reader->ReadBlock(buffer, _blockSize);
+			_nextRead++;
+		}
+
+		_nextRead++;
+		return _reader->ReadBlock(buffer, _blockSize);
+	}
+
+	/* *********************************************************************
+	 * MulticastSessions
+	 * *********************************************************************/
+	void MulticastSessions::Configure(VirtualFileSystem& files,
+		const std::string& group,
+		uint16_t basePort, uint32_t maxSessions, const std::string& host,
+		uint8_t ttl, std::shared_ptr<Impairment> impairment,
+		Metrics& metrics, Tracer& tracer)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		_files = &files;
+		_group = group;
+		_basePort = basePort;
+		_host = host;
+		_ttl = ttl;
+		_impairment = std::move(impairment);
+		_metrics = &metrics;
+		_tracer = &tracer;
+		_sessions.assign(group.empty() ? 0 : maxSessions, nullptr);
+	}
+
+	void MulticastSessions::Clear()
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		for (auto& session : _sessions)
+		{
+			if (session)
+			{
+				_metrics->Add(Gauge::MULTICAST_SESSIONS, -1);
+			}
+		}
+
+		_sessions.clear();
+		_group.clear();
+		_impairment = nullptr;
+	}
+
+	std::shared_ptr<MulticastSession>
+	MulticastSessions::Join(std::string_view name,
+		uint64_t fileSize,
+		uint16_t blockSize,
+		const MulticastSession::Member& member,
+		bool& master)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+
+		// "/a" and "A" are one file, one session.
+		std::string file = VirtualFileSystem::Normalize(name);
+		std::shared_ptr<MulticastSession> session = nullptr;
+		size_t freeSlot = _sessions.size();
+		for (size_t i = 0; i < _sessions.size(); i++)
+		{
+			if (_sessions[i] && _sessions[i]->File() == file)
+			{
+				session = _sessions[i];
+				break;
+			}
+
+			if (!_sessions[i] && freeSlot == _sessions.size())
+			{
+				freeSlot = i;
+			}
+		}
+
+		if (session == nullptr)
+		{
+			if (freeSlot == _sessions.size())
+			{
+				return nullptr;
+			}
+
+			auto socket = std::make_shared<UdpSocketWindows>();
+			socket->SetImpairment(_impairment);
+			if (!socket->Bind(_host.c_str(), 0)
+				|| !socket->EnableMulticastSend(_ttl))
+			{
+				socket->Unbind();
+				return nullptr;
+			}
+
+			session = std::make_shared<MulticastSession>(*_files, file, fileSize,
+				blockSize, _group, static_cast<uint16_t>(_basePort + freeSlot),
+				socket, *_metrics, *_tracer);
+			_sessions[freeSlot] = session;
+			_metrics->Add(Gauge::MULTICAST_SESSIONS, 1);
+		}
+
+		master = session->Join(member);
+		return session;
+	}
+
+	void MulticastSessions::Leave(
+		const std::shared_ptr<MulticastSession>& session, const void* owner)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		session->Leave(owner);
+		if (!session->IsEmpty())
+		{
+			return;
+		}
+
+		auto it = std::find(_sessions.begin(), _sessions.end(), session);
+		if (it != _sessions.end())
+		{
+			*it = nullptr;
+			_metrics->Add(Gauge::MULTICAST_SESSIONS, -1);
+		}
+	}
+}
@@ -0,0 +1,166 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Datagram.h"
+
+namespace tftplib {
+
+	class Impairment;
+	class Metrics;
+	class Tracer;
+	class UdpSocketWindows;
+	class VfsReader;
+	class VirtualFileSystem;
+
+	// **********************************************************************
+	// One file sent to a multicast group (RFC 2090).
+	//	Every client reading the file joins the session through its own
+	//	transaction. One of them, the master, ACKs : each ACK sends the
+	//	next block once, to the whole group. The others collect blocks
+	//	as they go by and wait for their turn.
+	//
+	//	When the master has the whole file, or goes away, the oldest
+	//	member is made master with an OACK and ACKs what it still
+	//	misses. The session ends with its last member.
+	//
+	//	Members run on any worker : the session is behind a lock.
+	// **********************************************************************
+	class MulticastSession
+	{
+	public:
+		// What the session needs of a member transaction. owner is only
+		// used as a key.
+		struct Member {
+			const void* owner{ nullptr };
+			std::shared_ptr<UdpSocketWindows> socket{ nullptr };
+			SocketAddress client{};
+			uint32_t tid{ 0 };			// For the trace
+		};
+
+		enum class AckResult {
+			IGNORED,					// Not from the master, or stale
+			SENT,						// Next block sent to the group
+			COMPLETE,					// The master has the whole file
+			FAILED						// Could not read or send
+		};
+
+	public:
+		// file is a normalized name, read from files.
+		MulticastSession(VirtualFileSystem& files,
+			const std::string& file,
+			uint64_t fileSize,
+			uint16_t blockSize,
+			const std::string& group,
+			uint16_t port,
+			std::shared_ptr<UdpSocketWindows> socket,
+			Metrics& metrics,
+			Tracer& tracer);
+		~MulticastSession();
+
+		MulticastSession(const MulticastSession&) = delete;
+		MulticastSession& operator=(const MulticastSession&) = delete;
+
+		const std::string& File() const { return _file; }
+		uint16_t Port() const { return _port; }
+
+		// "address,port" of the group, the start of the multicast option.
+		const std::string& Group() const { return _groupOption; }
+
+		// Returns true when the new member is master. It sends its own
+		// OACK ; later masters get theirs from the session.
+		bool Join(const Member& member);
+		void Leave(const void* owner);
+		bool IsEmpty() const;
+
+		bool IsMaster(const void* owner) const;
+
+		AckResult OnAck(const void* owner, uint16_t block);
+
+		// The master went quiet : send the current block again, or the
+		// OACK of a promoted master that never ACKed. False when there's
+		// nothing the session can resend.
+		bool Resend(const void* owner);
+
+	private:
+		void Promote();
+		bool SendBlock(uint16_t block);
+		bool SendMasterOack(const Member& member);
+		size_t ReadBlock(uint16_t block, uint8_t* buffer);
+
+	private:
+		VirtualFileSystem& _files;
+		const std::string _file;
+		const uint16_t _blockSize;
+		const uint16_t _lastBlock;
+		const uint16_t _port;
+		const std::string _groupOption;
+		SocketAddress _group{};
+
+		std::shared_ptr<UdpSocketWindows> _socket;
+		Metrics& _metrics;
+		Tracer& _tracer;
+
+		mutable std::mutex _lock;
+		std::vector<Member> _members{};		// Join order, master first
+		bool _masterAcked{ false };
+		bool _promoted{ false };			// The master got its OACK from us
+
+		// The current block, encoded, for resends.
+		std::vector<uint8_t> _packet{};
+		size_t _packetSize{ 0 };
+		uint16_t _current{ 0 };
+
+		// Sequential reader : a block before the next one reopens it.
+		std::unique_ptr<VfsReader> _reader{ nullptr };
+		uint16_t _nextRead{ 1 };
+	};
+
+	// **********************************************************************
+	// The multicast sessions of a server, one per file being read. Each
+	//	session gets its own port, from the base port up.
+	// **********************************************************************
+	class MulticastSessions
+	{
+	public:
+		// An empty group turns multicast off.
+		void Configure(VirtualFileSystem& files,
+			const std::string& group, uint16_t basePort,
+			uint32_t maxSessions, const std::string& host, uint8_t ttl,
+			std::shared_ptr<Impairment> impairment,
+			Metrics& metrics, Tracer& tracer);
+		void Clear();
+
+		bool IsEnabled() const { return !_group.empty(); }
+
+		// Join the file's session, opening it if needed. nullptr when
+		// no session can be opened : the client is served in unicast.
+		std::shared_ptr<MulticastSession> Join(
+			std::string_view file,
+			uint64_t fileSize,
+			uint16_t blockSize,
+			const MulticastSession::Member& member,
+			bool& master);
+
+		void Leave(const std::shared_ptr<MulticastSession>& session,
+			const void* owner);
+
+	private:
+		std::mutex _lock;
+		VirtualFileSystem* _files{ nullptr };
+		std::string _group{};
+		uint16_t _basePort{ 0 };
+		std::string _host{};
+		uint8_t _ttl{ 1 };
+		std::shared_ptr<Impairment> _impairment{ nullptr };
+		Metrics* _metrics{ nullptr };
+		Tracer* _tracer{ nullptr };
+
+		// The group of slot i listens on _basePort + i.
+		std::vector<std::shared_ptr<MulticastSession>> _sessions{};
+	};
+}
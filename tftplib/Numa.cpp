@@ -0,0 +1,254 @@
+﻿#include "pch.h"
+#include "Numa.h"
+#include <new>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cctype>
+#include <filesystem>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace tftplib {
+
+#if defined(_WIN32)
+	/* *********************************************************************
+	 * Windows implementation
+	 * *********************************************************************/
+	static PROCESSOR_NUMBER ToProcessorNumber(uint32_t cpu)
+	{
+		PROCESSOR_NUMBER pn{};
+		pn.Group = static_cast<WORD>(cpu / 64);
+		pn.Number = static_cast<BYTE>(cpu % 64);
+		return pn;
+	}
+
+	uint32_t Numa::NodeCount()
+	{
+		ULONG highest = 0;
+		if (!GetNumaHighestNodeNumber(&highest))
+		{
+			return 1;
+		}
+		return static_cast<uint32_t>(highest) + 1;
+	}
+
+	uint32_t Numa::NodeOfCpu(uint32_t cpu)
+	{
+		if (cpu == AnyCpu)
+		{
+			return 0;
+		}
+
+		PROCESSOR_NUMBER pn = ToProcessorNumber(cpu);
+		USHORT node = 0;
+		if (!GetNumaProcessorNodeEx(&pn, &node) || node == MAXUSHORT)
+		{
+			return 0;
+		}
+		return node;
+	}
+
+	std::vector<uint32_t> Numa::CpuNodes()
+	{
+		std::vector<uint32_t> nodes;
+		WORD groups = GetActiveProcessorGroupCount();
+		for (WORD group = 0; group < groups; group++)
+		{
+			DWORD count = GetActiveProcessorCount(group);
+			nodes.resize(static_cast<size_t>(group) * 64 + count, 0);
+			for (DWORD number = 0; number < count; number++)
+			{
+				uint32_t cpu = static_cast<uint32_t>(group) * 64 + number;
+				nodes[cpu] = NodeOfCpu(cpu);
+			}
+		}
+		return nodes;
+	}
+
+	uint32_t Numa::CurrentCpu()
+	{
+		PROCESSOR_NUMBER pn{};
+		GetCurrentProcessorNumberEx(&pn);
+		return static_cast<uint32_t>(pn.Group) * 64 + pn.Number;
+	}
+
+	bool Numa::PinCurrentThread(uint32_t cpu)
+	{
+		PROCESSOR_NUMBER pn = ToProcessorNumber(cpu);
+
+		GROUP_AFFINITY affinity{};
+		affinity.Group = pn.Group;
+		affinity.Mask = KAFFINITY{ 1 } << pn.Number;
+		return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+	}
+
+	void* Numa::AllocateOnNode(size_t size, uint32_t node)
+	{
+		void* ptr = (node == AnyNode)
+			? VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)
+			: VirtualAllocExNuma(GetCurrentProcess(), nullptr, size,
+				MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+
+		if (ptr == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	void Numa::Free(void* ptr, size_t)
+	{
+		if (ptr != nullptr)
+		{
+			VirtualFree(ptr, 0, MEM_RELEASE);
+		}
+	}
+
+	void Numa::PreferNode(void*, size_t, uint32_t)
+	{
+	}
+
+#else
+	/* *********************************************************************
+	 * Linux implementation
+	 * *********************************************************************/
+	uint32_t Numa::NodeCount()
+	{
+		std::error_code ec;
+		uint32_t count = 0;
+		for (auto& entry : std::filesystem::directory_iterator(
+			"/sys/devices/system/node", ec))
+		{
+			std::string name = entry.path().filename().string();
+			if (name.rfind("node", 0) == 0
+				&& name.size() > 4
+				&& std::isdigit(static_cast<unsigned char>(name[4])))
+			{
+				count++;
+			}
+		}
+		return count == 0 ? 1 : count;
+	}
+
+	uint32_t Numa::NodeOfCpu(uint32_t cpu)
+	{
+		if (cpu == AnyCpu)
+		{
+			return 0;
+		}
+
+		// cpuN/ holds a nodeM link to the node owning it.
+		std::error_code ec;
+		std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+		for (auto& entry : std::filesystem::directory_iterator(dir, ec))
+		{
+			std::string name = entry.path().filename().string();
+			if (name.rfind("node", 0) == 0
+				&& name.size() > 4
+				&& std::isdigit(static_cast<unsigned char>(name[4])))
+			{
+				return static_cast<uint32_t>(std::stoul(name.substr(4)));
+			}
+		}
+		return 0;
+	}
+
+	std::vector<uint32_t> Numa::CpuNodes()
+	{
+		// nodeN/ holds a cpuM link to every CPU it owns.
+		std::vector<uint32_t> nodes;
+		std::error_code ec;
+		for (auto& node : std::filesystem::directory_iterator(
+			"/sys/devices/system/node", ec))
+		{
+			std::string name = node.path().filename().string();
+			if (name.rfind("node", 0) != 0
+				|| name.size() <= 4
+				|| !std::isdigit(static_cast<unsigned char>(name[4])))
+			{
+				continue;
+			}
+
+			uint32_t id = static_cast<uint32_t>(std::stoul(name.substr(4)));
+			for (auto& entry : std::filesystem::directory_iterator(node.path(), ec))
+			{
+				std::string cpu = entry.path().filename().string();
+				if (cpu.rfind("cpu", 0) == 0
+					&& cpu.size() > 3
+					&& std::isdigit(static_cast<unsigned char>(cpu[3])))
+				{
+					size_t index = std::stoul(cpu.substr(3));
+					if (index >= nodes.size())
+					{
+						nodes.resize(index + 1, 0);
+					}
+					nodes[index] = id;
+				}
+			}
+		}
+		return nodes;
+	}
+
+	uint32_t Numa::CurrentCpu()
+	{
+		int cpu = sched_getcpu();
+		return cpu < 0 ? 0 : static_cast<uint32_t>(cpu);
+	}
+
+	bool Numa::PinCurrentThread(uint32_t cpu)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	}
+
+	void* Numa::AllocateOnNode(size_t size, uint32_t node)
+	{
+		void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+
+		PreferNode(ptr, size, node);
+		return ptr;
+	}
+
+	void Numa::PreferNode(void* ptr, size_t size, uint32_t node)
+	{
+		if (node == AnyNode || node >= 64)
+		{
+			return;
+		}
+
+		// Preferred rather than bound : fall back to other nodes
+		// instead of failing. Without mbind, first touch decides.
+		unsigned long mask = 1ul << node;
+		syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask,
+			sizeof(mask) * 8, 0);
+	}
+
+	void Numa::Free(void* ptr, size_t size)
+	{
+		if (ptr != nullptr)
+		{
+			munmap(ptr, size);
+		}
+	}
+#endif
+
+	uint32_t Numa::CurrentNode()
+	{
+		return NodeOfCpu(CurrentCpu());
+	}
+}
@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tftplib {
+
+	// **********************************************************************
+	// CPU and NUMA topology helpers.
+	//	CPUs are numbered globally (processor group * 64 + number on
+	//	Windows). Memory returned by AllocateOnNode is page aligned, bound to
+	//	the node when the OS allows it and otherwise placed on first touch.
+	//	It must be released with Free.
+	// **********************************************************************
+	class Numa
+	{
+	public:
+		static constexpr uint32_t AnyCpu = ~0u;
+		static constexpr uint32_t AnyNode = ~0u;
+
+	public:
+		static uint32_t NodeCount();
+		static uint32_t NodeOfCpu(uint32_t cpu);
+
+		// Node of every CPU, indexed by CPU. Asks the OS : built once,
+		// where NodeOfCpu would be called per request.
+		static std::vector<uint32_t> CpuNodes();
+
+		static uint32_t CurrentCpu();
+		static uint32_t CurrentNode();
+
+		static bool PinCurrentThread(uint32_t cpu);
+
+		static void* AllocateOnNode(size_t size, uint32_t node);
+		static void Free(void* ptr, size_t size);
+
+		// Prefer node for an existing mapping. No-op where placement is
+		// decided at allocation time (Windows).
+		static void PreferNode(void* ptr, size_t size, uint32_t node);
+	};
+}
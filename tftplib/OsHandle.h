@@ -0,0 +1,13 @@
+﻿#pragma once
+
+#include <cstdint>
+
+namespace tftplib {
+
+	// Opaque OS handle that can be waited on.
+	//	Windows : HANDLE / SOCKET
+	//	Linux	: file descriptor
+	using NativeHandle = std::intptr_t;
+
+	constexpr NativeHandle InvalidNativeHandle = -1;
+}
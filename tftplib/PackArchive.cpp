@@ -0,0 +1,351 @@
+﻿#include "pch.h"
+#include "PackArchive.h"
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace tftplib {
+
+	namespace {
+
+		// What Windows would make of the name : one separator, no case.
+		char Normalize(char c)
+		{
+			if (c == '\\')
+			{
+				return '/';
+			}
+
+			return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+		}
+
+		// Requests often start at the root.
+		std::string_view SkipRoot(std::string_view name)
+		{
+			while (!name.empty() && (name.front() == '/' || name.front() == '\\'))
+			{
+				name.remove_prefix(1);
+			}
+
+			return name;
+		}
+
+		struct PackedFile {
+			std::string name;
+			std::filesystem::path path;
+			uint64_t size;
+		};
+	}
+
+	/* *********************************************************************
+	 * PackArchive
+	 * *********************************************************************/
+	struct PackArchive::Mapping {
+		HANDLE file{ INVALID_HANDLE_VALUE };
+		HANDLE mapping{ nullptr };
+		const void* view{ nullptr };
+
+		~Mapping()
+		{
+			if (view) UnmapViewOfFile(view);
+			if (mapping) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		}
+	};
+
+	std::unique_ptr<PackArchive> PackArchive::Open(const std::filesystem::path& pack)
+	{
+		auto mapping = std::make_unique<Mapping>();
+		mapping->file = CreateFileW(pack.wstring().c_str(), GENERIC_READ,
+			FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (mapping->file == INVALID_HANDLE_VALUE)
+		{
+			return nullptr;
+		}
+
+		LARGE_INTEGER size{};
+		if (!GetFileSizeEx(mapping->file, &size)
+			|| static_cast<uint64_t>(size.QuadPart) < sizeof(Header))
+		{
+			return nullptr;
+		}
+
+		mapping->mapping = CreateFileMappingW(mapping->file, nullptr,
+			PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping->mapping)
+		{
+			return nullptr;
+		}
+
+		mapping->view = MapViewOfFile(mapping->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!mapping->view)
+		{
+			return nullptr;
+		}
+
+		std::unique_ptr<PackArchive> archive{ new PackArchive{ std::move(mapping) } };
+		if (!archive->Validate(static_cast<uint64_t>(size.QuadPart)))
+		{
+			return nullptr;
+		}
+
+		return archive;
+	}
+
+	PackArchive::PackArchive(std::unique_ptr<Mapping> mapping)
+		: _mapping{ std::move(mapping) }
+		, _base{ static_cast<const uint8_t*>(_mapping->view) }
+		, _header{ reinterpret_cast<const Header*>(_base) }
+	{
+	}
+
+	PackArchive::~PackArchive() = default;
+
+	// Checked once, so lookups can trust every offset.
+	bool PackArchive::Validate(uint64_t mappedSize)
+	{
+		const Header& h = *_header;
+		if (memcmp(h.magic, Magic, sizeof(Magic)) != 0
+			|| h.version != Version
+			|| h.packSize != mappedSize
+			|| h.bucketCount == 0
+			|| (h.bucketCount & (h.bucketCount - 1)) != 0
+			|| h.bucketCount < h.entryCount)
+		{
+			return false;
+		}
+
+		// Sections in order inside the pack, each large enough : sizes
+		// are compared to differences, which can't overflow.
+		if (h.bucketsOffset < sizeof(Header)
+			|| h.bucketsOffset > h.entriesOffset
+			|| h.entriesOffset > h.namesOffset
+			|| h.namesOffset > h.dataOffset
+			|| h.dataOffset > mappedSize
+			|| uint64_t{ h.bucketCount } * sizeof(uint32_t) > h.entriesOffset - h.bucketsOffset
+			|| uint64_t{ h.entryCount } * sizeof(Entry) > h.namesOffset - h.entriesOffset
+			|| h.bucketsOffset % alignof(uint32_t) != 0
+			|| h.entriesOffset % alignof(Entry) != 0)
+		{
+			return false;
+		}
+
+		_buckets = reinterpret_cast<const uint32_t*>(_base + h.bucketsOffset);
+		_entries = reinterpret_cast<const Entry*>(_base + h.entriesOffset);
+		_names = reinterpret_cast<const char*>(_base + h.namesOffset);
+
+		for (uint32_t i = 0; i < h.bucketCount; i++)
+		{
+			if (_buckets[i] > h.entryCount)
+			{
+				return false;
+			}
+		}
+
+		uint64_t namesSize = h.dataOffset - h.namesOffset;
+		uint64_t dataSize = mappedSize - h.dataOffset;
+		for (uint32_t i = 0; i < h.entryCount; i++)
+		{
+			const Entry& e = _entries[i];
+			if (uint64_t{ e.nameOffset } + e.nameLength > namesSize
+				|| e.dataOffset > dataSize
+				|| e.size > dataSize - e.dataOffset)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	uint64_t PackArchive::Hash(std::string_view name)
+	{
+		// FNV-1a, over the normalized name.
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (char c : SkipRoot(name))
+		{
+			hash ^= static_cast<uint8_t>(Normalize(c));
+			hash *= 0x100000001b3ull;
+		}
+
+		return hash;
+	}
+
+	bool PackArchive::Find(std::string_view name, Content& content) const
+	{
+		name = SkipRoot(name);
+		uint64_t hash = Hash(name);
+
+		uint32_t mask = _header->bucketCount - 1;
+		for (uint32_t probe = 0; probe <= mask; probe++)
+		{
+			uint32_t slot = _buckets[(hash + probe) & mask];
+			if (slot == 0)
+			{
+				return false;
+			}
+
+			const Entry& e = _entries[slot - 1];
+			if (e.hash != hash || e.nameLength != name.size())
+			{
+				continue;
+			}
+
+			const char* stored = _names + e.nameOffset;
+			bool same = std::equal(name.begin(), name.end(), stored,
+				[](char a, char b) { return Normalize(a) == b; });
+			if (same)
+			{
+				content.data = _base + _header->dataOffset + e.dataOffset;
+				content.size = e.size;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool PackArchive::Build(const std::filesystem::path& directory,
+		const std::filesystem::path& pack,
+		std::ostream& err)
+	{
+		std::error_code ec;
+		std::vector<PackedFile> files;
+		for (auto it = std::filesystem::recursive_directory_iterator(directory, ec);
+			!ec && it != std::filesystem::recursive_directory_iterator();
+			it.increment(ec))
+		{
+			if (!it->is_regular_file(ec))
+			{
+				continue;
+			}
+
+			std::string name = it->path().lexically_relative(directory).generic_string();
+			std::transform(name.begin(), name.end(), name.begin(), Normalize);
+			files.push_back(PackedFile{ name, it->path(), it->file_size(ec) });
+		}
+
+		if (ec)
+		{
+			err << "Cannot list " << directory << " : " << ec.message() << std::endl;
+			return false;
+		}
+
+		std::sort(files.begin(), files.end(),
+			[](const PackedFile& a, const PackedFile& b) { return a.name < b.name; });
+		for (size_t i = 1; i < files.size(); i++)
+		{
+			if (files[i].name == files[i - 1].name)
+			{
+				err << "Names differ only by case : " << files[i - 1].path
+					<< " and " << files[i].path << std::endl;
+				return false;
+			}
+		}
+
+		if (files.size() > UINT32_MAX / 2)
+		{
+			err << "Too many files" << std::endl;
+			return false;
+		}
+
+		// At most half full, probes stay short.
+		uint32_t bucketCount = 1;
+		while (bucketCount < files.size() * 2)
+		{
+			bucketCount <<= 1;
+		}
+
+		std::vector<uint32_t> buckets(bucketCount, 0);
+		std::vector<Entry> entries(files.size());
+		std::string names;
+		uint64_t dataSize = 0;
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			Entry& e = entries[i];
+			e.hash = Hash(files[i].name);
+			e.dataOffset = dataSize;
+			e.size = files[i].size;
+			e.nameOffset = static_cast<uint32_t>(names.size());
+			e.nameLength = static_cast<uint32_t>(files[i].name.size());
+			names += files[i].name;
+			if (names.size() > UINT32_MAX)
+			{
+				err << "Names too long" << std::endl;
+				return false;
+			}
+			dataSize += files[i].size;
+
+			uint32_t mask = bucketCount - 1;
+			uint64_t probe = e.hash;
+			while (buckets[probe & mask] != 0)
+			{
+				probe++;
+			}
+			buckets[probe & mask] = static_cast<uint32_t>(i + 1);
+		}
+
+		Header header{};
+		memcpy(header.magic, Magic, sizeof(Magic));
+		header.version = Version;
+		header.entryCount = static_cast<uint32_t>(entries.size());
+		header.bucketCount = bucketCount;
+		header.bucketsOffset = sizeof(Header);
+		header.entriesOffset = header.bucketsOffset + buckets.size() * sizeof(uint32_t);
+		header.entriesOffset = (header.entriesOffset + alignof(Entry) - 1)
+			& ~uint64_t{ alignof(Entry) - 1 };
+		header.namesOffset = header.entriesOffset + entries.size() * sizeof(Entry);
+		header.dataOffset = header.namesOffset + names.size();
+		header.packSize = header.dataOffset + dataSize;
+
+		std::ofstream out{ pack, std::ios::binary | std::ios::trunc };
+		if (!out)
+		{
+			err << "Cannot create " << pack << std::endl;
+			return false;
+		}
+
+		const char padding[alignof(Entry)] = {};
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(buckets.data()),
+			buckets.size() * sizeof(uint32_t));
+		out.write(padding, header.entriesOffset
+			- header.bucketsOffset - buckets.size() * sizeof(uint32_t));
+		out.write(reinterpret_cast<const char*>(entries.data()),
+			entries.size() * sizeof(Entry));
+		out.write(names.data(), names.size());
+
+		std::vector<char> buffer(0x100000);
+		for (const PackedFile& file : files)
+		{
+			std::ifstream in{ file.path, std::ios::binary };
+			uint64_t copied = 0;
+			while (in && copied < file.size)
+			{
+				in.read(buffer.data(), std::min<uint64_t>(buffer.size(), file.size - copied));
+				out.write(buffer.data(), in.gcount());
+				copied += in.gcount();
+			}
+
+			if (copied != file.size)
+			{
+				err << "Cannot read " << file.path << " whole" << std::endl;
+				return false;
+			}
+		}
+
+		out.close();
+		if (!out)
+		{
+			err << "Cannot write " << pack << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,97 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <string_view>
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Read-only archive of many small files, mapped in memory whole.
+	//	Built offline from a directory (PackTftpLib), loaded once by the
+	//	server : RRQs for packed files are served from the mapping with
+	//	no filesystem call at all.
+	//
+	//	Layout, little endian :
+	//		Header
+	//		Buckets		bucketCount x uint32, entry index + 1, 0 : empty
+	//		Entries		entryCount x Entry
+	//		Names		normalized paths, not terminated
+	//		Data		file contents, back to back
+	//
+	//	Names are relative to the packed directory, '/' separated and
+	//	lower case, like Windows sees them. Lookups hash the requested
+	//	name as they normalize it and probe the open addressed buckets.
+	// **********************************************************************
+	class PackArchive
+	{
+	public:
+		static constexpr char Magic[8] = { 'T', 'F', 'T', 'P', 'P', 'A', 'C', 'K' };
+		static constexpr uint32_t Version = 1;
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t entryCount;
+			uint32_t bucketCount;		// Power of two
+			uint32_t reserved;
+			uint64_t bucketsOffset;
+			uint64_t entriesOffset;
+			uint64_t namesOffset;
+			uint64_t dataOffset;
+			uint64_t packSize;
+		};
+
+		struct Entry {
+			uint64_t hash;
+			uint64_t dataOffset;
+			uint64_t size;
+			uint32_t nameOffset;		// From namesOffset
+			uint32_t nameLength;
+		};
+
+		struct Content {
+			const uint8_t* data{ nullptr };
+			uint64_t size{ 0 };
+		};
+
+	public:
+		// nullptr when the pack can't be mapped or is malformed.
+		static std::unique_ptr<PackArchive> Open(const std::filesystem::path& pack);
+
+		// Pack every regular file under directory. Fails on names that
+		// only differ by case.
+		static bool Build(const std::filesystem::path& directory,
+			const std::filesystem::path& pack,
+			std::ostream& err);
+
+		static uint64_t Hash(std::string_view name);
+
+	public:
+		~PackArchive();
+
+		PackArchive(const PackArchive&) = delete;
+		PackArchive& operator=(const PackArchive&) = delete;
+
+		// Thread safe : the pack is never written.
+		bool Find(std::string_view name, Content& content) const;
+
+		uint32_t Count() const { return _header->entryCount; }
+
+	private:
+		struct Mapping;
+
+		PackArchive(std::unique_ptr<Mapping> mapping);
+		bool Validate(uint64_t mappedSize);
+
+	private:
+		std::unique_ptr<Mapping> _mapping;
+		const uint8_t* _base{ nullptr };
+		const Header* _header{ nullptr };
+		const uint32_t* _buckets{ nullptr };
+		const Entry* _entries{ nullptr };
+		const char* _names{ nullptr };
+	};
+}
@@ -0,0 +1,58 @@
+﻿#include "pch.h"
+#include "PackFileSystem.h"
+#include "Metrics.h"
+
+namespace tftplib {
+
+	PackFileSystem::PackFileSystem(std::unique_ptr<PackArchive> pack, Metrics* metrics)
+		: _pack{ std::move(pack) }
+		, _metrics{ metrics }
+	{
+	}
+
+	PackFileSystem::Result
+	PackFileSystem::Stat(std::string_view name, VfsStat& stat)
+	{
+		PackArchive::Content content{};
+		if (!_pack->Find(name, content))
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		stat.size = content.size;
+		stat.modified = {};
+		return Result::VALID;
+	}
+
+	PackFileSystem::Result
+	PackFileSystem::OpenReader(std::string_view name, bool netascii,
+		VfsStat& stat, std::unique_ptr<VfsReader>& reader)
+	{
+		PackArchive::Content content{};
+		if (!_pack->Find(name, content))
+		{
+			return Result::INVALID_NO_SUCH_FILE;
+		}
+
+		if (netascii)
+		{
+			return Result::INVALID_MODE;
+		}
+
+		stat.size = content.size;
+		stat.modified = {};
+		reader = std::make_unique<BufferReader>(content.data, content.size);
+		if (_metrics)
+		{
+			_metrics->Add(Counter::PACK_READS);
+		}
+		return Result::VALID;
+	}
+
+	PackFileSystem::Result
+	PackFileSystem::OpenWriter(std::string_view /*name*/, bool /*netascii*/,
+		std::unique_ptr<VfsWriter>& /*writer*/)
+	{
+		return Result::INVALID_ACCESS_FORBIDDEN;
+	}
+}
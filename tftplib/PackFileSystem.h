@@ -0,0 +1,37 @@
+﻿#pragma once
+
+#include "VirtualFileSystem.h"
+#include "PackArchive.h"
+
+namespace tftplib {
+
+	class Metrics;
+
+	// **********************************************************************
+	// A PackArchive, read-only. Files are served from the mapping : no
+	//	filesystem call and nothing to lock. Readers point into the
+	//	mapping, the pack must outlive them. Octet only.
+	// **********************************************************************
+	class PackFileSystem : public VirtualFileSystem
+	{
+	public:
+		// Downloads are counted when metrics are given.
+		PackFileSystem(std::unique_ptr<PackArchive> pack, Metrics* metrics = nullptr);
+
+		const PackArchive& Pack() const { return *_pack; }
+
+		bool IsReadOnly() const override { return true; }
+
+		Result Stat(std::string_view name, VfsStat& stat) override;
+
+		Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) override;
+
+		Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) override;
+
+	private:
+		std::unique_ptr<PackArchive> _pack;
+		Metrics* _metrics;
+	};
+}
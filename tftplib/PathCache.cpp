@@ -0,0 +1,608 @@
+﻿#include "pch.h"
+#include "PathCache.h"
+#include "Metrics.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * OS Specific class declaration
+	 * *********************************************************************/
+	class PathCache::Os
+	{
+	public:
+		enum class Wakeup { CHANGES, MISSED, SIGNAL, FAILED };
+
+	public:
+		Os() = default;
+		~Os();
+
+		bool Open(const std::filesystem::path& root);
+
+		// Directories holding entries, relative to the root. Windows
+		// watches the whole tree from the start.
+		bool WatchDirectory(const std::string& relative);
+
+		// Names relative to the root, '/' separated. MISSED : changes were
+		// lost, anything may have changed.
+		Wakeup Wait(NativeHandle signal, std::vector<std::string>& changed);
+
+	private:
+#if defined(_WIN32)
+		bool Arm();
+
+		HANDLE _directory{ INVALID_HANDLE_VALUE };
+		HANDLE _event{ nullptr };
+		OVERLAPPED _overlapped{};
+		bool _pending{ false };
+		std::vector<DWORD> _buffer = std::vector<DWORD>(0x4000);
+#else
+		int _fd{ -1 };
+		std::filesystem::path _root{};
+		std::mutex _lock;
+		std::unordered_map<int, std::string> _directories{};
+		std::unordered_map<std::string, int> _watches{};
+#endif
+	};
+
+	/* *********************************************************************
+	 * OS Specific functions definition
+	 * *********************************************************************/
+#if defined(_WIN32)
+
+	static constexpr DWORD WatchFilter = FILE_NOTIFY_CHANGE_FILE_NAME
+		| FILE_NOTIFY_CHANGE_DIR_NAME
+		| FILE_NOTIFY_CHANGE_ATTRIBUTES
+		| FILE_NOTIFY_CHANGE_SIZE
+		| FILE_NOTIFY_CHANGE_LAST_WRITE
+		| FILE_NOTIFY_CHANGE_SECURITY;
+
+	PathCache::Os::~Os()
+	{
+		if (_pending)
+		{
+			DWORD bytes = 0;
+			CancelIoEx(_directory, &_overlapped);
+			GetOverlappedResult(_directory, &_overlapped, &bytes, TRUE);
+		}
+
+		if (_directory != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(_directory);
+		}
+
+		if (_event != nullptr)
+		{
+			CloseHandle(_event);
+		}
+	}
+
+	bool PathCache::Os::Open(const std::filesystem::path& root)
+	{
+		_directory = CreateFileW(root.c_str(), FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+			nullptr);
+		if (_directory == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		return _event != nullptr && Arm();
+	}
+
+	bool PathCache::Os::Arm()
+	{
+		ResetEvent(_event);
+		_overlapped = {};
+		_overlapped.hEvent = _event;
+
+		_pending = ReadDirectoryChangesW(_directory, _buffer.data(),
+			static_cast<DWORD>(_buffer.size() * sizeof(DWORD)), TRUE,
+			WatchFilter, nullptr, &_overlapped, nullptr);
+		return _pending;
+	}
+
+	bool PathCache::Os::WatchDirectory(const std::string& /*relative*/)
+	{
+		return true;
+	}
+
+	PathCache::Os::Wakeup
+	PathCache::Os::Wait(NativeHandle signal, std::vector<std::string>& changed)
+	{
+		HANDLE handles[] = { reinterpret_cast<HANDLE>(signal), _event };
+		switch (WaitForMultipleObjects(2, handles, FALSE, INFINITE))
+		{
+			case WAIT_OBJECT_0:
+				return Wakeup::SIGNAL;
+
+			case WAIT_OBJECT_0 + 1:
+				break;
+
+			default:
+				return Wakeup::FAILED;
+		}
+
+		DWORD bytes = 0;
+		BOOL done = GetOverlappedResult(_directory, &_overlapped, &bytes, FALSE);
+		_pending = false;
+
+		// Nothing returned : the buffer overflowed.
+		Wakeup wakeup = done && bytes > 0 ? Wakeup::CHANGES : Wakeup::MISSED;
+		if (!done && GetLastError() != ERROR_NOTIFY_ENUM_DIR)
+		{
+			return Wakeup::FAILED;
+		}
+
+		const uint8_t* at = reinterpret_cast<const uint8_t*>(_buffer.data());
+		while (wakeup == Wakeup::CHANGES)
+		{
+			auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(at);
+			std::wstring_view name{ info->FileName,
+				info->FileNameLength / sizeof(WCHAR) };
+
+			try
+			{
+				changed.push_back(std::filesystem::path{ name }.generic_string());
+			}
+			catch (const std::exception&)
+			{
+				// Not in the code page of requests : can't tell which it was.
+				wakeup = Wakeup::MISSED;
+			}
+
+			if (info->NextEntryOffset == 0)
+			{
+				break;
+			}
+			at += info->NextEntryOffset;
+		}
+
+		return Arm() ? wakeup : Wakeup::FAILED;
+	}
+
+#else
+
+	static constexpr uint32_t WatchMask = IN_CREATE | IN_DELETE
+		| IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB
+		| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+	PathCache::Os::~Os()
+	{
+		if (_fd != -1)
+		{
+			close(_fd);
+		}
+	}
+
+	bool PathCache::Os::Open(const std::filesystem::path& root)
+	{
+		_root = root;
+		_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		return _fd != -1 && WatchDirectory("");
+	}
+
+	bool PathCache::Os::WatchDirectory(const std::string& relative)
+	{
+		std::lock_guard lock{ _lock };
+		if (_watches.contains(relative))
+		{
+			return true;
+		}
+
+		int wd = inotify_add_watch(_fd, (_root / relative).c_str(), WatchMask);
+		if (wd == -1)
+		{
+			return false;
+		}
+
+		_watches[relative] = wd;
+		_directories[wd] = relative;
+		return true;
+	}
+
+	PathCache::Os::Wakeup
+	PathCache::Os::Wait(NativeHandle signal, std::vector<std::string>& changed)
+	{
+		pollfd fds[2]{};
+		fds[0].fd = static_cast<int>(signal);
+		fds[0].events = POLLIN;
+		fds[1].fd = _fd;
+		fds[1].events = POLLIN;
+
+		int result = 0;
+		do
+		{
+			result = poll(fds, 2, -1);
+		} while (result == -1 && errno == EINTR);
+
+		if (result <= 0)
+		{
+			return Wakeup::FAILED;
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			return Wakeup::SIGNAL;
+		}
+
+		Wakeup wakeup = Wakeup::CHANGES;
+		alignas(inotify_event) char buffer[0x4000];
+		ssize_t length = 0;
+		while ((length = read(_fd, buffer, sizeof(buffer))) > 0)
+		{
+			std::lock_guard lock{ _lock };
+			for (char* at = buffer; at < buffer + length;
+				at += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(at)->len)
+			{
+				auto event = reinterpret_cast<const inotify_event*>(at);
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					wakeup = Wakeup::MISSED;
+					continue;
+				}
+
+				auto it = _directories.find(event->wd);
+				if (it == _directories.end())
+				{
+					continue;
+				}
+
+				std::string name = it->second;
+				if (event->len > 0)
+				{
+					name = name.empty() ? std::string{ event->name }
+						: name + "/" + event->name;
+				}
+				changed.push_back(std::move(name));
+
+				// Gone or moved : watched again once it holds entries.
+				if (event->mask & IN_IGNORED)
+				{
+					_watches.erase(it->second);
+					_directories.erase(it);
+				}
+			}
+		}
+
+		if (length == -1 && errno != EAGAIN && errno != EINTR)
+		{
+			return Wakeup::FAILED;
+		}
+
+		return wakeup;
+	}
+
+#endif
+
+	/* *********************************************************************
+	 * PathCache functions definition
+	 * *********************************************************************/
+	PathCache::PathCache(Metrics& metrics)
+		: _metrics{ metrics }
+	{
+	}
+
+	PathCache::~PathCache()
+	{
+		if (_thread.joinable())
+		{
+			_running = false;
+			_signal.EmitSignal();
+			_thread.join();
+		}
+	}
+
+	bool PathCache::Watch(const std::filesystem::path& root)
+	{
+		std::error_code ec;
+		_root = std::filesystem::absolute(root, ec).lexically_normal();
+		if (!_root.has_filename())
+		{
+			_root = _root.parent_path();
+		}
+
+		_os = std::make_unique<Os>();
+		if (ec || !_os->Open(_root))
+		{
+			_os = nullptr;
+			return false;
+		}
+
+		_signal.Reset();
+		_running = true;
+		_thread = std::thread(&PathCache::Run, this);
+		return true;
+	}
+
+	PathCache::Shard& PathCache::ShardOf(std::string_view name)
+	{
+		return _shards[std::hash<std::string_view>{}(name) % Shards];
+	}
+
+	PathCache::EntryPtr
+	PathCache::Find(std::string_view name, uint64_t& generation)
+	{
+		generation = _generation.load(std::memory_order_acquire);
+		if (!_running)
+		{
+			return nullptr;
+		}
+
+		Shard& shard = ShardOf(name);
+		EntryPtr entry = nullptr;
+		{
+			std::lock_guard lock{ shard.lock };
+			auto it = shard.entries.find(name);
+			if (it != shard.entries.end())
+			{
+				Slot& slot = it->second;
+				slot.order->splice(slot.order->begin(), *slot.order, slot.at);
+				entry = slot.at->second;
+			}
+		}
+
+		_metrics.Add(entry ? Counter::PATH_CACHE_HITS : Counter::PATH_CACHE_MISSES);
+		return entry;
+	}
+
+	bool PathCache::Relative(const std::filesystem::path& path,
+		std::filesystem::path& relative) const
+	{
+		relative = path.lexically_normal().lexically_relative(_root);
+		return !relative.empty() && *relative.begin() != "..";
+	}
+
+	void PathCache::Track(Entry& entry)
+	{
+		entry.watched.clear();
+
+		std::filesystem::path relative;
+		if (!_running || !Relative(entry.path, relative))
+		{
+			return;
+		}
+
+		// Every directory down to the file's.
+		std::filesystem::path directory;
+		for (const auto& part : relative.parent_path())
+		{
+			if (!_os->WatchDirectory(directory.generic_string()))
+			{
+				return;
+			}
+			directory /= part;
+		}
+
+		if (!_os->WatchDirectory(directory.generic_string()))
+		{
+			return;
+		}
+
+		entry.watched = VirtualFileSystem::Normalize(relative.generic_string());
+	}
+
+	void PathCache::Erase(Shard& shard, Order::iterator at)
+	{
+		auto it = shard.entries.find(at->first);
+		Order& order = *it->second.order;
+		shard.watched.erase(it->second.watched);
+		shard.entries.erase(it);
+		order.erase(at);
+	}
+
+	bool PathCache::Touches(std::string_view changed, std::string_view watched)
+	{
+		// The root, the file, or a directory above it.
+		return changed.empty()
+			|| (watched.starts_with(changed)
+				&& (watched.size() == changed.size() || watched[changed.size()] == '/'));
+	}
+
+	bool PathCache::Unchanged(std::string_view watched, uint64_t generation)
+	{
+		std::lock_guard lock{ _changesLock };
+		if (_generation.load(std::memory_order_relaxed) == generation)
+		{
+			return true;
+		}
+
+		// Changes since then forgotten : anything may have changed.
+		if (_changes.empty() || _changes.front().generation > generation + 1)
+		{
+			return false;
+		}
+
+		for (const Change& change : _changes)
+		{
+			if (change.generation <= generation)
+			{
+				continue;
+			}
+
+			for (const std::string& name : change.names)
+			{
+				if (Touches(name, watched))
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	PathCache::EntryPtr
+	PathCache::Store(std::string_view name, Entry entry, uint64_t generation)
+	{
+		bool negative = entry.result != VirtualFileSystem::Result::VALID;
+		bool keep = _running && !entry.watched.empty();
+		auto shared = std::make_shared<const Entry>(std::move(entry));
+		if (!keep)
+		{
+			return shared;
+		}
+
+		Shard& shard = ShardOf(name);
+		Order& order = negative ? shard.negative : shard.found;
+		size_t max = (negative ? MaxNegativeEntries : MaxEntries) / Shards;
+
+		uint64_t evicted = 0;
+		{
+			// Under the shard lock : a change after the check finds the
+			// entry to drop.
+			std::lock_guard lock{ shard.lock };
+			if (!Unchanged(shared->watched, generation))
+			{
+				return shared;
+			}
+
+			auto it = shard.entries.find(name);
+			if (it != shard.entries.end())
+			{
+				Erase(shard, it->second.at);
+			}
+
+			order.emplace_front(std::string{ name }, shared);
+			auto watched = shard.watched.emplace(shared->watched, order.begin());
+			shard.entries.emplace(order.front().first,
+				Slot{ &order, order.begin(), watched });
+
+			for (; order.size() > max; evicted++)
+			{
+				Erase(shard, std::prev(order.end()));
+			}
+		}
+
+		if (evicted > 0)
+		{
+			_metrics.Add(Counter::PATH_CACHE_EVICTIONS, evicted);
+		}
+		return shared;
+	}
+
+	void PathCache::Invalidate(const std::filesystem::path& path)
+	{
+		std::filesystem::path relative;
+		if (Relative(path, relative))
+		{
+			Drop({ VirtualFileSystem::Normalize(relative.generic_string()) });
+		}
+	}
+
+	void PathCache::Drop(const std::vector<std::string>& changed)
+	{
+		std::vector<std::string> names;
+		names.reserve(changed.size());
+		for (const std::string& name : changed)
+		{
+			names.push_back(VirtualFileSystem::Normalize(name));
+		}
+
+		// Remembered for the stores in flight, which read the files
+		// before the change.
+		{
+			std::lock_guard lock{ _changesLock };
+			uint64_t generation = _generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+			_changes.push_back(Change{ generation, names });
+			if (_changes.size() > MaxChanges)
+			{
+				_changes.pop_front();
+			}
+		}
+
+		uint64_t dropped = 0;
+		std::vector<Order::iterator> changedEntries;
+		for (Shard& shard : _shards)
+		{
+			std::lock_guard lock{ shard.lock };
+			for (const std::string& name : names)
+			{
+				// The entries of the file, then of the files under it.
+				changedEntries.clear();
+				auto [first, last] = shard.watched.equal_range(name);
+				for (auto it = first; it != last; ++it)
+				{
+					changedEntries.push_back(it->second);
+				}
+
+				std::string below = name.empty() ? name : name + "/";
+				for (auto it = shard.watched.lower_bound(below);
+					it != shard.watched.end() && it->first.starts_with(below); ++it)
+				{
+					changedEntries.push_back(it->second);
+				}
+
+				for (Order::iterator at : changedEntries)
+				{
+					Erase(shard, at);
+				}
+				dropped += changedEntries.size();
+			}
+		}
+
+		_metrics.Add(Counter::PATH_CACHE_INVALIDATIONS, dropped);
+	}
+
+	void PathCache::Clear()
+	{
+		// Older stores can't tell what changed.
+		{
+			std::lock_guard lock{ _changesLock };
+			_generation.fetch_add(1, std::memory_order_acq_rel);
+			_changes.clear();
+		}
+
+		uint64_t dropped = 0;
+		for (Shard& shard : _shards)
+		{
+			std::lock_guard lock{ shard.lock };
+			dropped += shard.entries.size();
+			shard.entries.clear();
+			shard.watched.clear();
+			shard.found.clear();
+			shard.negative.clear();
+		}
+
+		_metrics.Add(Counter::PATH_CACHE_INVALIDATIONS, dropped);
+	}
+
+	void PathCache::Run()
+	{
+		std::vector<std::string> changed;
+		while (_running)
+		{
+			changed.clear();
+			switch (_os->Wait(_signal.GetNativeHandle(), changed))
+			{
+				case Os::Wakeup::CHANGES:
+					Drop(changed);
+					break;
+
+				case Os::Wakeup::MISSED:
+					Clear();
+					break;
+
+				case Os::Wakeup::SIGNAL:
+					_signal.Consume();
+					break;
+
+				case Os::Wakeup::FAILED:
+					// Changes can't be heard anymore : stop caching.
+					_running = false;
+					Clear();
+					break;
+			}
+		}
+	}
+}
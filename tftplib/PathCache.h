@@ -0,0 +1,144 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Signal.h"
+#include "VirtualFileSystem.h"
+
+namespace tftplib {
+
+	class Metrics;
+
+	// **********************************************************************
+	// What DiskFileSystem found for a request name : the path, whether it
+	//	may be read, and its size and time. A repeated request is answered
+	//	without asking the disk.
+	//
+	//	A background thread watches the root directory (directory change
+	//	notifications on Windows, inotify on Linux) and drops the entries
+	//	of the files that change, or all of them when changes were missed.
+	//	Until it does, a changed file is seen as it was : the window is the
+	//	notification delay.
+	//
+	//	Entries are spread over shards by name, each with its own lock and
+	//	least recently used first out past MaxEntries. Names that weren't
+	//	served (missing, forbidden) are capped apart, lower : requests for
+	//	random names don't push the files out. Entries are also indexed
+	//	by file, so a change only visits the entries it drops.
+	//
+	//	An entry made while its file (or a directory above it) changed is
+	//	not kept ; changes to other files don't matter to it. Nothing is
+	//	cached when the root can't be watched.
+	// **********************************************************************
+	class PathCache
+	{
+	private:
+		class Os;
+
+	public:
+		struct Entry {
+			std::filesystem::path path;
+			uint64_t lockHash;				// FileSecurityHandler::LockHash
+			VirtualFileSystem::Result result;
+			VfsStat stat;
+			std::string watched;		// Normalized, relative to the root
+		};
+
+		using EntryPtr = std::shared_ptr<const Entry>;
+
+		static constexpr size_t Shards = 16;
+		static constexpr size_t MaxEntries = 0x10000;
+		static constexpr size_t MaxNegativeEntries = 0x1000;
+
+		// Change batches remembered for the stores in flight. Older
+		// stores are dropped.
+		static constexpr size_t MaxChanges = 64;
+
+	public:
+		PathCache(Metrics& metrics);
+		~PathCache();
+		PathCache(const PathCache&) = delete;
+		PathCache& operator=(const PathCache&) = delete;
+
+		// Setup, before serving. False when the root can't be watched.
+		bool Watch(const std::filesystem::path& root);
+
+		// Generation to give back to Store : entries whose file changed
+		// since are dropped.
+		EntryPtr Find(std::string_view name, uint64_t& generation);
+
+		// Before the path is looked at, so changes made while it is are
+		// heard of. Sets entry.watched, left empty when the path can't be
+		// watched : Store doesn't keep it.
+		void Track(Entry& entry);
+		EntryPtr Store(std::string_view name, Entry entry, uint64_t generation);
+
+		// Changed by the server itself : dropped before it's heard of.
+		void Invalidate(const std::filesystem::path& path);
+		void Clear();
+
+	private:
+		// Most recently used first. Keys of the maps point into it.
+		using Order = std::list<std::pair<std::string, EntryPtr>>;
+
+		// By Entry::watched : a directory's files follow it, after '/'.
+		using Index = std::multimap<std::string_view, Order::iterator>;
+
+		struct Slot {
+			Order* order;
+			Order::iterator at;
+			Index::iterator watched;
+		};
+
+		struct Shard {
+			std::mutex lock;
+			std::unordered_map<std::string_view, Slot> entries;
+			Index watched;
+			Order found;
+			Order negative;
+		};
+
+		struct Change {
+			uint64_t generation;
+			std::vector<std::string> names;		// Normalized
+		};
+
+		Shard& ShardOf(std::string_view name);
+		static void Erase(Shard& shard, Order::iterator at);
+		static bool Touches(std::string_view changed, std::string_view watched);
+
+		// Lock of the shard held. False when watched may have changed
+		// since generation.
+		bool Unchanged(std::string_view watched, uint64_t generation);
+		bool Relative(const std::filesystem::path& path,
+			std::filesystem::path& relative) const;
+
+		// The files, and everything under those that are directories.
+		void Drop(const std::vector<std::string>& changed);
+		void Run();
+
+	private:
+		Metrics& _metrics;
+		std::filesystem::path _root{};
+		std::array<Shard, Shards> _shards{};
+		std::atomic<uint64_t> _generation{ 0 };
+		std::mutex _changesLock{};
+		std::deque<Change> _changes{};			// Last MaxChanges, oldest first
+
+		std::unique_ptr<Os> _os;
+		std::thread _thread{};
+		Signal _signal{};
+		std::atomic<bool> _running{ false };
+	};
+}
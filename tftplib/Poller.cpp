@@ -0,0 +1,279 @@
+﻿#include "pch.h"
+#include "Poller.h"
+#include "Signal.h"
+#include <stdexcept>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <Winsock2.h>
+#include <windows.h>
+#else
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * OS Specific class declaration
+	 * *********************************************************************/
+	class Poller::Os
+	{
+	public:
+		Os(NativeHandle signal);
+		~Os();
+
+		bool Watch(NativeHandle socket, uint64_t token);
+		void Unwatch(NativeHandle socket);
+		void Mute(NativeHandle socket, uint64_t token, bool mute);
+		size_t Wait(int64_t timeoutMs, std::vector<uint64_t>& ready);
+
+	private:
+#if defined(_WIN32)
+		struct Watched {
+			SOCKET socket{ INVALID_SOCKET };
+			WSAEVENT event{ WSA_INVALID_EVENT };
+			uint64_t token{ 0 };
+		};
+
+		HANDLE _signal{ nullptr };
+		std::vector<Watched> _watched;
+		std::vector<HANDLE> _handles;
+#else
+		static constexpr int MaxEvents = 64;
+
+		int _epoll{ -1 };
+		epoll_event _events[MaxEvents]{};
+#endif
+	};
+
+	/* *********************************************************************
+	 * OS Specific functions definition
+	 * *********************************************************************/
+#if defined(_WIN32)
+
+	Poller::Os::Os(NativeHandle signal)
+		: _signal{ reinterpret_cast<HANDLE>(signal) }
+	{
+	}
+
+	Poller::Os::~Os()
+	{
+		for (auto& w : _watched)
+		{
+			WSAEventSelect(w.socket, nullptr, 0);
+			WSACloseEvent(w.event);
+		}
+	}
+
+	bool Poller::Os::Watch(NativeHandle socket, uint64_t token)
+	{
+		// Slot 0 of the wait set is reserved for the signal.
+		if (_watched.size() + 1 >= MAXIMUM_WAIT_OBJECTS)
+		{
+			return false;
+		}
+
+		Watched w{};
+		w.socket = static_cast<SOCKET>(socket);
+		w.token = token;
+		w.event = WSACreateEvent();
+		if (w.event == WSA_INVALID_EVENT)
+		{
+			return false;
+		}
+
+		if (WSAEventSelect(w.socket, w.event, FD_READ) == SOCKET_ERROR)
+		{
+			WSACloseEvent(w.event);
+			return false;
+		}
+
+		_watched.push_back(w);
+		return true;
+	}
+
+	void Poller::Os::Unwatch(NativeHandle socket)
+	{
+		auto it = std::find_if(_watched.begin(), _watched.end(),
+			[socket](const Watched& w) {
+				return w.socket == static_cast<SOCKET>(socket);
+			});
+
+		if (it == _watched.end())
+		{
+			return;
+		}
+
+		WSAEventSelect(it->socket, nullptr, 0);
+		WSACloseEvent(it->event);
+		_watched.erase(it);
+	}
+
+	void Poller::Os::Mute(NativeHandle /*socket*/, uint64_t /*token*/, bool /*mute*/)
+	{
+		// Events are reset as they're reported : nothing to hold back.
+	}
+
+	size_t Poller::Os::Wait(int64_t timeoutMs, std::vector<uint64_t>& ready)
+	{
+		_handles.clear();
+		_handles.push_back(_signal);
+		for (auto& w : _watched)
+		{
+			_handles.push_back(w.event);
+		}
+
+		DWORD timeout = timeoutMs < 0 ? INFINITE : static_cast<DWORD>(timeoutMs);
+		DWORD result = WaitForMultipleObjects(
+			static_cast<DWORD>(_handles.size()),
+			_handles.data(),
+			FALSE,
+			timeout);
+
+		if (result == WAIT_TIMEOUT || result == WAIT_FAILED)
+		{
+			return 0;
+		}
+
+		// The signal is manual-reset : the wait left it set, and
+		// Signal::Consume() resets it and records the wake latency.
+		if (result == WAIT_OBJECT_0)
+		{
+			ready.push_back(SignalToken);
+		}
+
+		// Socket events are manual-reset. FD_READ is posted again by
+		// Winsock after a receive if more datagrams are pending.
+		for (auto& w : _watched)
+		{
+			if (WaitForSingleObject(w.event, 0) == WAIT_OBJECT_0)
+			{
+				WSAResetEvent(w.event);
+				ready.push_back(w.token);
+			}
+		}
+
+		return ready.size();
+	}
+
+#else
+
+	Poller::Os::Os(NativeHandle signal)
+	{
+		_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (_epoll == -1)
+		{
+			throw std::runtime_error{ "Could not create epoll instance" };
+		}
+
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.u64 = SignalToken;
+		if (epoll_ctl(_epoll, EPOLL_CTL_ADD, static_cast<int>(signal), &ev) == -1)
+		{
+			close(_epoll);
+			throw std::runtime_error{ "Could not watch signal" };
+		}
+	}
+
+	Poller::Os::~Os()
+	{
+		close(_epoll);
+	}
+
+	bool Poller::Os::Watch(NativeHandle socket, uint64_t token)
+	{
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.u64 = token;
+		return epoll_ctl(_epoll, EPOLL_CTL_ADD, static_cast<int>(socket), &ev) == 0;
+	}
+
+	void Poller::Os::Unwatch(NativeHandle socket)
+	{
+		(void)epoll_ctl(_epoll, EPOLL_CTL_DEL, static_cast<int>(socket), nullptr);
+	}
+
+	void Poller::Os::Mute(NativeHandle socket, uint64_t token, bool mute)
+	{
+		// Level-triggered : a readable socket is reported until read.
+		epoll_event ev{};
+		ev.events = mute ? 0u : static_cast<uint32_t>(EPOLLIN);
+		ev.data.u64 = token;
+		(void)epoll_ctl(_epoll, EPOLL_CTL_MOD, static_cast<int>(socket), &ev);
+	}
+
+	size_t Poller::Os::Wait(int64_t timeoutMs, std::vector<uint64_t>& ready)
+	{
+		int timeout = timeoutMs < 0 ? -1 : static_cast<int>(timeoutMs);
+		int count = 0;
+		do
+		{
+			count = epoll_wait(_epoll, _events, MaxEvents, timeout);
+		} while (count == -1 && errno == EINTR);
+
+		for (int i = 0; i < count; ++i)
+		{
+			ready.push_back(_events[i].data.u64);
+		}
+
+		return ready.size();
+	}
+
+#endif
+
+	/* *********************************************************************
+	 * Poller functions definition
+	 * *********************************************************************/
+	Poller::Poller(Signal& signal)
+		: _os{ std::make_unique<Poller::Os>(signal.GetNativeHandle()) }
+	{
+	}
+
+	Poller::~Poller() {}
+
+	bool Poller::Watch(NativeHandle socket, uint64_t token)
+	{
+		if (socket == InvalidNativeHandle)
+		{
+			return false;
+		}
+
+		return _os->Watch(socket, token);
+	}
+
+	void Poller::Unwatch(NativeHandle socket)
+	{
+		if (socket == InvalidNativeHandle)
+		{
+			return;
+		}
+
+		_os->Unwatch(socket);
+	}
+
+	void Poller::Mute(NativeHandle socket, uint64_t token)
+	{
+		if (socket != InvalidNativeHandle)
+		{
+			_os->Mute(socket, token, true);
+		}
+	}
+
+	void Poller::Unmute(NativeHandle socket, uint64_t token)
+	{
+		if (socket != InvalidNativeHandle)
+		{
+			_os->Mute(socket, token, false);
+		}
+	}
+
+	size_t Poller::Wait(std::chrono::milliseconds timeout,
+		std::vector<uint64_t>& ready)
+	{
+		ready.clear();
+		return _os->Wait(timeout.count(), ready);
+	}
+}
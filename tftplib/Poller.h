@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "OsHandle.h"
+
+namespace tftplib {
+
+	class Signal;
+
+	// **********************************************************************
+	// Readiness multiplexer.
+	//	Blocks on "any watched socket readable OR signal emitted OR timeout"
+	//	in a single OS wait (epoll on Linux, WaitForMultipleObjects on
+	//	Windows). The signal is always watched and reported as SignalToken.
+	//
+	//	Not thread safe : a poller belongs to the thread that waits on it.
+	//	Other threads wake it up through the signal.
+	// **********************************************************************
+	class Poller
+	{
+	private:
+		class Os;
+
+	public:
+		static constexpr uint64_t SignalToken = ~0ull;
+		static constexpr std::chrono::milliseconds Infinite{ -1 };
+
+		// Sockets a single poller can watch. WaitForMultipleObjects is
+		// limited to 64 handles, one of which is the signal.
+#if defined(_WIN32)
+		static constexpr size_t MaxWatched = 63;
+#else
+		static constexpr size_t MaxWatched = 0x10000;
+#endif
+
+	public:
+		Poller(Signal& signal);
+		~Poller();
+		Poller(const Poller&) = delete;
+		Poller& operator=(const Poller&) = delete;
+
+		// Watch a socket for readability. token is reported on wakeup.
+		bool Watch(NativeHandle socket, uint64_t token);
+		void Unwatch(NativeHandle socket);
+
+		// Stop reporting a watched socket the caller already knows is
+		// readable, until Unmute. Windows reports a socket once per
+		// receive anyway : only Linux needs it.
+		void Mute(NativeHandle socket, uint64_t token);
+		void Unmute(NativeHandle socket, uint64_t token);
+
+		// Wait until at least one watched object is ready or timeout
+		// elapses. Returns the number of tokens written to ready.
+		// Does not consume the signal : caller must call Signal::Consume()
+		// when SignalToken is reported.
+		size_t Wait(std::chrono::milliseconds timeout,
+			std::vector<uint64_t>& ready);
+
+	private:
+		std::unique_ptr<Os> _os;
+	};
+}
@@ -1,10 +1,13 @@
 ﻿#pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 #include <memory>
 #include <string>
 #include <stdexcept>
+#include <type_traits>
+#include "Arena.h"
 
 namespace tftplib
 {
@@ -17,6 +20,9 @@ namespace tftplib
 	// Only the following safeguards are provided : 
 	//	- BUF_SZ must be greater than 0
 	//	- PTR_TYPE must be smaller than BUF_SZ
+	//
+	// Buffers are allocated on the given NUMA node, on huge pages if asked.
+	// Alloc and Free are lock free and may be called from any thread.
 	// **********************************************************************
 	
 	template <size_t BUF_SZ, typename PTR_TYPE = char>
@@ -25,19 +31,22 @@ namespace tftplib
 		static_assert(BUF_SZ > 0, 
 			"Buffer size must be greater than 0");
 
-		template <typename T> static constexpr bool IsSizeValid(size_t SZ) {
-			return sizeof(T) <= BUF_SZ;
-		}
-
-		template <> static constexpr bool IsSizeValid<void>(size_t SZ) {
-			return true;
+		template <typename T> static constexpr bool IsSizeValid() {
+			if constexpr (std::is_void_v<T>) {
+				return true;
+			}
+			else {
+				return sizeof(T) <= BUF_SZ;
+			}
 		}
 
-		static_assert(IsSizeValid<PTR_TYPE>(BUF_SZ),
+		static_assert(IsSizeValid<PTR_TYPE>(),
 			"PTR_TYPE is bigger than buffer");
 
 	public:
-		PoolOfBuffers(size_t poolSize);
+		PoolOfBuffers(size_t poolSize,
+			uint32_t node = Numa::AnyNode,
+			Arena::Pages pages = Arena::Pages::NORMAL);
 		~PoolOfBuffers();
 		PoolOfBuffers(const PoolOfBuffers&) = delete;
 		PoolOfBuffers& operator=(const PoolOfBuffers&) = delete;
@@ -49,56 +58,66 @@ namespace tftplib
 			return BUF_SZ;
 		}
 
+		Arena::Backing GetBacking() const {
+			return _arena.GetBacking();
+		}
+
 	private:
+		Arena _arena;
 		char* _buffer{ nullptr };
-		bool* _used{ nullptr }; // Array of flags indicating if a buffer is used
+		std::atomic<bool>* _used{ nullptr }; // Array of flags indicating if a buffer is used
 
 		size_t _poolSize{ 0 }; // Number of buffers in the pool
-		size_t _cursor{ 0 }; // Current position in the pool
+		std::atomic<size_t> _cursor{ 0 }; // Where the next search starts
 	};
 
 }
 
 template <size_t BUF_SZ, typename PTR_TYPE>
-tftplib::PoolOfBuffers<BUF_SZ, PTR_TYPE>::PoolOfBuffers(size_t poolSize)
+tftplib::PoolOfBuffers<BUF_SZ, PTR_TYPE>::PoolOfBuffers(size_t poolSize,
+	uint32_t node,
+	Arena::Pages pages)
 	: _poolSize(poolSize)
 {
 	if (poolSize == 0) {
 		throw std::runtime_error("Pool size must be greater than 0");
 	}
 
-	_buffer = new char[poolSize * BUF_SZ];
-	_used = new bool[poolSize];
+	_arena = Arena(poolSize * BUF_SZ, node, pages);
+	_buffer = static_cast<char*>(_arena.Data());
+	_used = new std::atomic<bool>[poolSize];
 	if (!_buffer || !_used) {
 		throw std::bad_alloc();
 	}
 
 	for (size_t i = 0; i < _poolSize; ++i) {
-		_used[i] = false;
+		_used[i].store(false, std::memory_order_relaxed);
 	}
 }
 
 template <size_t BUF_SZ, typename PTR_TYPE>
 tftplib::PoolOfBuffers<BUF_SZ, PTR_TYPE>::~PoolOfBuffers()
 {
-	delete[] _buffer;
+	delete[] _used;
 }
 
 template <size_t BUF_SZ, typename PTR_TYPE>
 PTR_TYPE*
 tftplib::PoolOfBuffers<BUF_SZ, PTR_TYPE>::Alloc()
 {
-	size_t backupCursor = _cursor;
+	// The cursor is only a hint : racing threads may start from the same
+	// place, the exchange on the flag decides who gets the buffer.
+	size_t start = _cursor.load(std::memory_order_relaxed);
 
-	do {
-		size_t current = _cursor;
-		_cursor = (_cursor + 1) % _poolSize;
+	for (size_t i = 0; i < _poolSize; ++i) {
+		size_t current = (start + i) % _poolSize;
 
-		if (!_used[current]) {
-			_used[current] = true;
+		if (!_used[current].load(std::memory_order_relaxed)
+			&& !_used[current].exchange(true, std::memory_order_acquire)) {
+			_cursor.store((current + 1) % _poolSize, std::memory_order_relaxed);
 			return reinterpret_cast<PTR_TYPE*>(_buffer + current * BUF_SZ);
 		}
-	} while (_cursor != backupCursor);
+	}
 
 	return nullptr;
 }
@@ -112,10 +131,8 @@ tftplib::PoolOfBuffers<BUF_SZ, PTR_TYPE>::Free(PTR_TYPE* ptr)
 	}
 
 	size_t index = (reinterpret_cast<char*>(ptr) - _buffer) / BUF_SZ;
-	if (index < _poolSize && _used[index]) {
-		_used[index] = false;
-	}
-	else {
+	if (index >= _poolSize
+		|| !_used[index].exchange(false, std::memory_order_release)) {
 		throw std::runtime_error("Pointer does not belong to this pool");
 	}
 }
\ No newline at end of file
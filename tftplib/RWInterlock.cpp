@@ -1,81 +1,269 @@
 ﻿#include "pch.h"
 #include "RWInterlock.h"
-#include <thread>
+#include <climits>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#endif
 
 namespace tftplib {
 
 	constexpr uint32_t WriteFlag = 0x80000000;
-	constexpr uint32_t Attempts = 3;
+	constexpr uint32_t SleepFlag = 0x40000000;		// Unlockers must wake
+	constexpr uint32_t PendingMask = 0x3F000000;	// Writers waiting
+	constexpr uint32_t PendingOne = 0x01000000;
+	constexpr uint32_t ReaderMask = 0x00FFFFFF;
+
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t)
+		&& std::atomic<uint32_t>::is_always_lock_free);
+
+	/* *********************************************************************
+	 * OS Specific functions definition
+	 * *********************************************************************/
+#if defined(_WIN32)
+
+	static void WaitOnWord(std::atomic<uint32_t>& word, uint32_t expected,
+		int64_t timeoutMs)
+	{
+		WaitOnAddress(&word, &expected, sizeof(expected),
+			static_cast<DWORD>(timeoutMs));
+	}
+
+	static void WakeWord(std::atomic<uint32_t>& word)
+	{
+		WakeByAddressAll(&word);
+	}
+
+#else
+
+	static void WaitOnWord(std::atomic<uint32_t>& word, uint32_t expected,
+		int64_t timeoutMs)
+	{
+		timespec timeout{};
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+			FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+	}
+
+	static void WakeWord(std::atomic<uint32_t>& word)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+			FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+#endif
 
+	/* *********************************************************************
+	 * RWInterlock
+	 * *********************************************************************/
 	bool RWInterlock::TryLockRead()
 	{
-		uint32_t attempt = Attempts;
-		bool result = false;
-		
-		while (!result && attempt--) 
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while ((counter & (WriteFlag | PendingMask)) == 0)
 		{
-			result = LockReadAttempt();
-			std::this_thread::yield();
+			if (_counter.compare_exchange_weak(counter, counter + 1,
+				std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				return true;
+			}
 		}
 
-		return result;
+		return false;
 	}
 
 	bool RWInterlock::TryLockWrite()
 	{
-		uint32_t attempt = Attempts;
-		bool result = false;
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while ((counter & (WriteFlag | ReaderMask)) == 0)
+		{
+			if (_counter.compare_exchange_weak(counter, counter | WriteFlag,
+				std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
 
-		while (!result && attempt--)
+		return false;
+	}
+
+	bool RWInterlock::LockRead(std::chrono::milliseconds timeout)
+	{
+		if (TryLockRead())
 		{
-			result = LockWriteAttempt();
-			std::this_thread::yield();
+			return true;
 		}
 
-		return result;
+		auto deadline = Clock::now() + timeout;
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while (true)
+		{
+			if ((counter & (WriteFlag | PendingMask)) == 0)
+			{
+				if (_counter.compare_exchange_weak(counter, counter + 1,
+					std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					return true;
+				}
+				continue;
+			}
+
+			if ((counter & SleepFlag) == 0
+				&& !_counter.compare_exchange_weak(counter, counter | SleepFlag,
+					std::memory_order_relaxed))
+			{
+				continue;
+			}
+
+			if (!Wait(counter | SleepFlag, deadline))
+			{
+				return false;
+			}
+			counter = _counter.load(std::memory_order_relaxed);
+		}
 	}
-	
-	void RWInterlock::UnlockRead()
+
+	bool RWInterlock::LockWrite(std::chrono::milliseconds timeout)
 	{
-		_counter.fetch_add(-1);
+		if (TryLockWrite())
+		{
+			return true;
+		}
+
+		auto deadline = Clock::now() + timeout;
+		bool pending = false;
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while (true)
+		{
+			if ((counter & (WriteFlag | ReaderMask)) == 0)
+			{
+				uint32_t locked = (counter | WriteFlag) - (pending ? PendingOne : 0);
+				if (_counter.compare_exchange_weak(counter, locked,
+					std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					return true;
+				}
+				continue;
+			}
+
+			// Counted once among the writers waiting, when there's room.
+			bool join = !pending && (counter & PendingMask) != PendingMask;
+			uint32_t waiting = (counter | SleepFlag) + (join ? PendingOne : 0);
+			if (waiting != counter)
+			{
+				if (!_counter.compare_exchange_weak(counter, waiting,
+					std::memory_order_relaxed))
+				{
+					continue;
+				}
+				pending = pending || join;
+			}
+
+			if (!Wait(waiting, deadline))
+			{
+				break;
+			}
+			counter = _counter.load(std::memory_order_relaxed);
+		}
+
+		// Readers held back for us may go.
+		if (pending)
+		{
+			uint32_t left = _counter.fetch_sub(PendingOne, std::memory_order_relaxed);
+			if (left & SleepFlag)
+			{
+				Wake();
+			}
+		}
+
+		return false;
 	}
-	
-	void RWInterlock::UnlockWrite()
+
+	bool RWInterlock::QueueWrite()
 	{
-		_counter.fetch_and(~WriteFlag);
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while ((counter & PendingMask) != PendingMask)
+		{
+			if (_counter.compare_exchange_weak(counter, counter + PendingOne,
+				std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+
+		return false;
 	}
 
-	bool RWInterlock::IsFree() const
+	bool RWInterlock::TryLockQueuedWrite()
 	{
-		return _counter == 0;
+		uint32_t counter = _counter.load(std::memory_order_relaxed);
+		while ((counter & (WriteFlag | ReaderMask)) == 0)
+		{
+			if (_counter.compare_exchange_weak(counter,
+				(counter | WriteFlag) - PendingOne,
+				std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+
+		return false;
 	}
 
-	bool RWInterlock::LockReadAttempt()
+	void RWInterlock::DequeueWrite()
 	{
-		if (_counter.fetch_add(1) & WriteFlag)
+		// Readers held back for us may go.
+		uint32_t left = _counter.fetch_sub(PendingOne, std::memory_order_relaxed);
+		if (left & SleepFlag)
 		{
-			_counter.fetch_add(-1);
-			return false;
+			Wake();
 		}
+	}
 
-		return true;
+	void RWInterlock::UnlockRead()
+	{
+		uint32_t left = _counter.fetch_sub(1, std::memory_order_release) - 1;
+		if ((left & ReaderMask) == 0 && (left & SleepFlag))
+		{
+			Wake();
+		}
 	}
 
-	bool RWInterlock::LockWriteAttempt()
+	void RWInterlock::UnlockWrite()
 	{
-		uint32_t r = _counter.fetch_or(WriteFlag);
-		if ((r & WriteFlag) == WriteFlag)
+		uint32_t left = _counter.fetch_and(~WriteFlag, std::memory_order_release);
+		if (left & SleepFlag)
 		{
-			// Other writer has lock. Leave lock alone and exit.
-			return false;
+			Wake();
 		}
-		else if (r != 0)
+	}
+
+	bool RWInterlock::IsFree() const
+	{
+		return (_counter.load(std::memory_order_relaxed) & (WriteFlag | ReaderMask)) == 0;
+	}
+
+	bool RWInterlock::Wait(uint32_t expected, Clock::time_point deadline)
+	{
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+		if (left.count() <= 0)
 		{
-			// Reader has lock. Remove write lock and exit.
-			_counter.fetch_and(~WriteFlag);
 			return false;
 		}
 
+		WaitOnWord(_counter, expected, left.count());
 		return true;
 	}
-}
\ No newline at end of file
+
+	void RWInterlock::Wake()
+	{
+		// Sleepers still blocked set the flag again.
+		_counter.fetch_and(~SleepFlag, std::memory_order_relaxed);
+		WakeWord(_counter);
+	}
+}
@@ -1,26 +1,54 @@
 ﻿#pragma once
 
 #include <atomic>
-#include <semaphore>
+#include <chrono>
 #include <cstdint>
 
 namespace tftplib {
+
+	// **********************************************************************
+	// Reader / writer lock in one 32-bit word : readers, writers waiting,
+	//	sleepers, writer.
+	//
+	//	Try* fail at once when the lock is taken ; uncontended, locking and
+	//	unlocking are one atomic operation each. Lock* wait up to timeout,
+	//	asleep on the word (futex on Linux, WaitOnAddress on Windows).
+	//
+	//	Writers first : while a writer waits, new readers stay out, so a
+	//	file read without pause still gets written. Readers already in
+	//	finish first. A writer that can't sleep here (a parked transfer)
+	//	queues, retries with TryLockQueuedWrite, and leaves the queue if
+	//	it gives up.
+	// **********************************************************************
 	class RWInterlock
 	{
 	public:
 		bool TryLockRead();
 		bool TryLockWrite();
 
+		bool LockRead(std::chrono::milliseconds timeout);
+		bool LockWrite(std::chrono::milliseconds timeout);
+
+		// Counted among the writers waiting until locked or dequeued.
+		// False when too many wait already.
+		bool QueueWrite();
+		bool TryLockQueuedWrite();
+		void DequeueWrite();
+
 		void UnlockRead();
 		void UnlockWrite();
 
 		bool IsFree() const;
 
 	private:
-		bool LockReadAttempt();
-		bool LockWriteAttempt();
+		using Clock = std::chrono::steady_clock;
+
+		// False once the deadline passed. Returns when the word isn't
+		// expected anymore, on a wakeup, or spuriously.
+		bool Wait(uint32_t expected, Clock::time_point deadline);
+		void Wake();
 
 	private:
-		std::atomic<uint_fast32_t> _counter{ 0 };
+		std::atomic<uint32_t> _counter{ 0 };
 	};
-}
\ No newline at end of file
+}
@@ -1,23 +1,15 @@
 ﻿#include "pch.h"
 #include "Server.h"
 #include <thread>
+#include <algorithm>
 
 #include "ServerWorker.h"
+#include "DiskFileSystem.h"
+#include "PackFileSystem.h"
 #include "tftp_messages.h"
-#include "Allocator.h"
 
 namespace tftplib {
 	
-	template<typename T, typename... Args>
-	std::unique_ptr<T, std::function<void(void*)>>
-		MakeManagedMessage(std::shared_ptr<Allocator>& alloc, Args... args)
-	{
-		return std::unique_ptr<T, std::function<void(void*)>>{
-			T::create(args...,
-				[alloc](size_t size) { return alloc->allocate(size); }),
-				[alloc](void* ptr) { alloc->free(ptr); }};
-	}
-
 	Server::Server() 
 		: _out{ nullptr }
 		, _err{ nullptr }
@@ -57,27 +49,90 @@ namespace tftplib {
 			throw std::runtime_error("Invalid server configuration");
 		}
 
+		_tracer.SetLevel(_out || _err ? _traceLevel : TraceLevel::OFF);
+		_tracer.Start(Out(), Err());
+		_metricsExporter.Start(Err());
+
 		_fileSecurity.Reset()
 			.SetFileCreationPolicy(FileSecurityHandler::FileCreationPolicy::ALLOW)
 			.SetOverwritePolicy(FileSecurityHandler::OverwritePolicy::ALLOW)
 			.SetRootDirectory(_rootDirectory);
 
-		_factory = DatagramFactory::Instantiate(_threadCount * 8);
-		_alloc = std::make_shared<Allocator>(_messagePoolSize);
+		// Root directory, under the pack, under the providers, under the
+		// mounts.
+		auto disk = std::make_shared<DiskFileSystem>(_fileSecurity, _metrics);
+		disk->SetSharedReads(_sharedReads)
+			.SetPathCache(_pathCache);
+		_files.Clear();
+		_files.Mount("", disk);
+
+		if (!_packPath.empty())
+		{
+			auto pack = PackArchive::Open(_packPath);
+			if (pack)
+			{
+				Out() << "[Server] Serving " << pack->Count()
+					<< " files from " << _packPath << std::endl;
+				_files.Mount("", std::make_shared<PackFileSystem>(
+					std::move(pack), &_metrics));
+			}
+			else
+			{
+				Err() << "[Server] Cannot load pack " << _packPath
+					<< ", serving from the root directory only" << std::endl;
+			}
+		}
+
+		if (!_generated->IsEmpty())
+		{
+			_files.Mount("", _generated);
+		}
+
+		for (const auto& [prefix, files] : _mounts)
+		{
+			_files.Mount(prefix, files);
+		}
+
+		_cpuNodes = Numa::CpuNodes();
+		uint32_t dispatchNode = _dispatchCpu == Numa::AnyCpu
+			? Numa::AnyNode
+			: NodeOfCpu(_dispatchCpu);
+
+		_factory = DatagramFactory::Instantiate(
+			_maxTransactions * DatagramsPerTransaction(),
+			dispatchNode, _pages);
+		_factory->SetMetrics(&_metrics);
+
+		if (_pages == Arena::Pages::HUGE_PAGES
+			&& _factory->GetBacking() != Arena::Backing::HUGE_PAGES)
+		{
+			Out() << "[Server] Explicit huge pages unavailable, datagram pool "
+				<< (_factory->GetBacking() == Arena::Backing::TRANSPARENT_HUGE_PAGES
+					? "uses transparent huge pages" : "uses normal pages")
+				<< std::endl;
+		}
 		_controlSocket.Bind(_host.c_str(), _port);
 
-		_transactions = new TransactionRecord[_threadCount];
+		_transactions = new TransactionRecord[_maxTransactions];
 
-		for (uint32_t i = 0; i < _threadCount; i++)
+		if (_impairmentProfile.IsActive())
+		{
+			_impairment = std::make_shared<Impairment>(_impairmentProfile);
+		}
+
+		_multicast.Configure(_files, _multicastGroup, _multicastPort,
+			_multicastSessions, _host, _multicastTtl, _impairment,
+			_metrics, _tracer);
+
+		for (uint32_t i = 0; i < _maxTransactions; i++)
 		{
 			auto socket = std::make_shared<UdpSocketWindows>();
+			socket->SetImpairment(_impairment);
 			_transactionSockets.push_back(socket);
-
-			auto worker = std::make_shared<ServerWorker>(*this, _factory);
-			worker->Start();
-			_workers.push_back(worker);
 		}
 
+		StartWorkers();
+
 		_dispatchThread = std::thread(&Server::MainServerThread, this);
 
 		_starting = false;
@@ -101,6 +156,7 @@ namespace tftplib {
 
 		// Cleanup block
 		{
+			_dispatchSignal.EmitSignal();
 			_dispatchThread.join();
 
 			for (auto& worker : _workers) {
@@ -110,17 +166,35 @@ namespace tftplib {
 			for (auto& worker : _workers) {
 				worker->Stop();
 			}
+			_executor.Detach();
+			_tracer.Stop();
+			_metricsExporter.Stop();
+
+			if (!_workerCpus.empty()) {
+				NumaStats stats = GetNumaStats();
+				Out() << "[NUMA] assignments local=" << stats.localAssignments
+					<< " cross-node=" << stats.crossNodeAssignments
+					<< " steals=" << stats.steals
+					<< " cross-node=" << stats.crossNodeSteals
+					<< std::endl;
+			}
 
 			for (auto& socket : _transactionSockets) {
 				socket->Unbind();
 			}
 
 			_controlSocket.Unbind();
-			_alloc = nullptr;
-			_factory = nullptr;
 
+			// Workers and their transactions hold datagrams : factories
+			// go last.
 			_workers.clear();
 			_transactionSockets.clear();
+			_multicast.Clear();
+			_impairment = nullptr;
+			_files.Clear();
+
+			_factory = nullptr;
+			_nodeFactories.clear();
 			delete[] _transactions;
 		}
 
@@ -128,83 +202,161 @@ namespace tftplib {
 		_stopping = false;
 	}
 
+	void Server::StartWorkers()
+	{
+		// Spread transactions over workers. A worker can't watch more
+		// sockets than its poller supports.
+		size_t perWorker = (_maxTransactions + _threadCount - 1) / _threadCount;
+		perWorker = std::min(perWorker, Poller::MaxWatched);
+
+		// One datagram pool per NUMA node, sized for the workers on it.
+		std::vector<uint32_t> cpus(_threadCount, Numa::AnyCpu);
+		std::vector<size_t> nodeCapacity;
+		for (uint32_t i = 0; i < _threadCount && !_workerCpus.empty(); i++)
+		{
+			cpus[i] = _workerCpus[i % _workerCpus.size()];
+			uint32_t node = NodeOfCpu(cpus[i]);
+			if (node >= nodeCapacity.size())
+			{
+				nodeCapacity.resize(node + 1, 0);
+			}
+			nodeCapacity[node] += perWorker;
+		}
+
+		_nodeFactories.assign(nodeCapacity.size(), nullptr);
+		for (uint32_t node = 0; node < nodeCapacity.size(); node++)
+		{
+			if (nodeCapacity[node] > 0)
+			{
+				_nodeFactories[node] = DatagramFactory::Instantiate(
+					nodeCapacity[node] * DatagramsPerTransaction(), node, _pages);
+				_nodeFactories[node]->SetMetrics(&_metrics);
+			}
+		}
+
+		for (uint32_t i = 0; i < _threadCount; i++)
+		{
+			std::shared_ptr<DatagramFactory> factory = _factory;
+			if (cpus[i] != Numa::AnyCpu)
+			{
+				factory = _nodeFactories[NodeOfCpu(cpus[i])];
+			}
+
+			auto worker = std::make_shared<ServerWorker>(*this, _executor,
+				*factory, perWorker, cpus[i]);
+			_workers.push_back(worker);
+		}
+
+		// Every worker must be known to the executor before any can steal.
+		_executor.Attach(_workers);
+		for (auto& worker : _workers)
+		{
+			worker->Start();
+		}
+	}
+
 	void Server::MainServerThread()
 	{
+		if (_dispatchCpu != Numa::AnyCpu && !Numa::PinCurrentThread(_dispatchCpu))
+		{
+			Err() << "[Server] Could not pin dispatch thread to cpu "
+				<< _dispatchCpu << std::endl;
+		}
+
 		_running = true;
 
+		std::vector<uint64_t> ready;
+		NativeHandle control = _controlSocket.GetNativeHandle();
+		_dispatchPoller.Watch(control, 0);
+
 		while (!_stopping)
 		{
-			while (!_controlSocket.Poll(100) && !_stopping) ;
+			// Single wait on control socket OR stop signal.
+			_dispatchPoller.Wait(Poller::Infinite, ready);
+			bool readable = false;
+			for (uint64_t token : ready)
+			{
+				if (token == Poller::SignalToken)
+				{
+					_dispatchSignal.Consume();
+				}
+				else
+				{
+					readable = true;
+				}
+			}
 
 			if (_stopping) {
 				break;
 			}
 
-			std::shared_ptr<Datagram> datagram = _controlSocket.Receive(*_factory);
+			if (!readable) {
+				continue;
+			}
+
+			DatagramRef datagram = _controlSocket.Receive(*_factory);
 			if (datagram == nullptr || !datagram->IsValid()) {
-				Err() << "Received invalid datagram or out of buffers. Waiting a bit." << std::endl;
+				_tracer.Emit(TraceId::CONTROL_NO_DATAGRAM, 0);
 				std::this_thread::sleep_for(std::chrono::milliseconds(100));
 				continue;
 			}
 
+			_metrics.Add(Counter::PACKETS_IN);
+			_metrics.Add(Counter::BYTES_IN, datagram->GetDataSize());
+
 			if (datagram->GetDataSize() < sizeof(OpCode)) 
 			{
-				Err() << "Received invalid message. Ignoring." << std::endl;
+				_tracer.Emit(TraceId::CONTROL_INVALID, 0, datagram->GetDataSize());
 				continue;
 			}
 
 			OpCode *op = (OpCode *)datagram->GetData();
-			Out() << "Control socket receive: " << OpCodeToStr(*op) << " from "
-				<< datagram->GetSourcePort() 
-				<< ":" << datagram->GetSourcePort()
-				<< std::endl;
+			_tracer.Emit(TraceId::CONTROL_RECEIVED, 0,
+				OpCodeToStr(*op), datagram->GetSourcePort());
 
 			switch (*op)
 			{
 				case OpCode::RRQ:
 				case OpCode::WRQ:
-					Out() << "Received request message" << std::endl;
 					ProcessNewTransactionRequest(datagram);
 					break;
 
 				case OpCode::ACK:
 					if (datagram->GetDataSize() < sizeof(MessageAck))
 					{
-						Out() << "Ignoring malformed ACK" << std::endl;
+						_tracer.Emit(TraceId::CONTROL_INVALID, 0,
+							datagram->GetDataSize());
 					}
 					else 
 					{
 						MessageAck *ack = (MessageAck*)datagram->GetData();
-						Out() << "Ignoring ACK " << ack->getBlockNumber() << std::endl;
+						_tracer.Emit(TraceId::CONTROL_IGNORED, 0,
+							"ACK", ack->getBlockNumber());
 					}
 					break;
 
 				default:
-					Err() << "Ignoring unexpected message" << std::endl;
+					_tracer.Emit(TraceId::CONTROL_IGNORED, 0,
+						OpCodeToStr(*op), 0);
 					break;
 			}
 		}
 
+		_dispatchPoller.Unwatch(control);
 		_running = false;
 	}
 
 	void 
 	Server::ProcessNewTransactionRequest(
-		std::shared_ptr<Datagram> &transactionRequest)
+		DatagramRef &transactionRequest)
 	{
-		Out() << "Received message on control port from "
-			<< transactionRequest->GetSourceAddress()
-			<< ":"  << transactionRequest->GetSourcePort()
-			<< std::endl;
+		uint16_t clientPort = transactionRequest->GetSourcePort();
+		_tracer.Emit(TraceId::REQUEST_RECEIVED, uint32_t{ clientPort } << 16,
+			OpCodeToStr(*(OpCode*)transactionRequest->GetData()), clientPort);
 
 		// Check if we are handling max transactions
 		if (IsHandlingMaxTransactions()) {
-			Err() << "Rejecting transaction from "
-				<< transactionRequest->GetSourceAddress() 
-				<< ":" 
-				<< transactionRequest->GetSourcePort()
-				<< " due to max transactions limit." 
-				<< std::endl;
+			RecordRejected(transactionRequest, "max transactions");
 			
 			ReplyRejectTransactionNoWorkerAvailable(*transactionRequest);
 		}
@@ -227,7 +379,7 @@ namespace tftplib {
 	Server::FindTransactionRecord(
 		const std::function<bool(Server::TransactionRecord*)>& filter) const
 	{
-		for (unsigned int i = 0; i < _threadCount; i++)
+		for (unsigned int i = 0; i < _maxTransactions; i++)
 		{
 			if (filter(&_transactions[i]))
 			{
@@ -272,38 +424,102 @@ namespace tftplib {
 		return true;
 	}
 
+	void
+	Server::RecordRejected(const DatagramRef& transactionRequest,
+		const char* reason)
+	{
+		_metrics.Add(Counter::TRANSACTIONS_REJECTED);
+
+		uint16_t clientPort = transactionRequest->GetSourcePort();
+		_tracer.Emit(TraceId::REQUEST_REJECTED, uint32_t{ clientPort } << 16,
+			clientPort, reason);
+	}
+
 	void 
 	Server::ReplyRejectTransactionNoWorkerAvailable(
 		const Datagram& transactionRequest)
 	{
-		auto message = MakeManagedMessage<MessageError>(
-			_alloc,
-			tftplib::ErrorCode::DISK_FULL);
+		// Shedding load : one send straight from the template table.
+		auto reject = _templates.Error(tftplib::ErrorCode::DISK_FULL);
 
-		if(message == nullptr)
+		if (_controlSocket.SendTo(reject.data, reject.size,
+			transactionRequest.GetSourceSocketAddress()))
 		{
-			return;
+			_metrics.Add(Counter::PACKETS_OUT);
+			_metrics.Add(Counter::BYTES_OUT, reject.size);
+		}
+	}
+
+	std::shared_ptr<ServerWorker>
+	Server::SelectWorker(uint32_t node) const
+	{
+		std::shared_ptr<ServerWorker> worker = nullptr;
+		for (auto& candidate : _workers)
+		{
+			if (node != Numa::AnyNode && candidate->Node() != node)
+			{
+				continue;
+			}
+
+			if (!candidate->IsBusy()
+				&& (worker == nullptr || candidate->Load() < worker->Load()))
+			{
+				worker = candidate;
+			}
 		}
 
-		auto response = _factory->BuildResponse(
-			(const uint8_t*)message.get(),
-			static_cast<uint16_t>(message->Size()),
-			transactionRequest);
+		return worker;
+	}
 
-		_controlSocket.Send(response);
+	uint32_t Server::NodeOfCpu(uint32_t cpu) const
+	{
+		// Unknown CPUs are node 0, as for Numa::NodeOfCpu.
+		return cpu < _cpuNodes.size() ? _cpuNodes[cpu] : 0;
 	}
 
 	std::shared_ptr<ServerWorker> 
 	Server::AssignWorkerToTransaction(
-		std::shared_ptr<Datagram>& transactionRequest)
+		DatagramRef& transactionRequest)
 	{
+		// Home the transaction on the least loaded worker of the node
+		// whose receive queue got the request. Work is rebalanced
+		// afterwards by the executor.
+		std::shared_ptr<ServerWorker> worker = nullptr;
+		if (!_workerCpus.empty())
+		{
+			uint32_t node = NodeOfCpu(_controlSocket.GetReceiveCpu());
+			worker = SelectWorker(node);
+			if (worker != nullptr)
+			{
+				_localAssignments.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				worker = SelectWorker(Numa::AnyNode);
+				if (worker != nullptr)
+				{
+					_crossNodeAssignments.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		}
+		else
+		{
+			worker = SelectWorker(Numa::AnyNode);
+		}
+
+		if (worker == nullptr)
+		{
+			RecordRejected(transactionRequest, "no worker");
+			return nullptr;
+		}
+
 		size_t freeSocket = 0;
 		std::shared_ptr<UdpSocketWindows> socket = nullptr;
 		for( ; freeSocket < _transactionSockets.size(); freeSocket++ )
 		{
-			socket = _transactionSockets[freeSocket];
-			if (!socket->IsBound())
+			if (_transactionSockets[freeSocket]->IsInactive())
 			{
+				socket = _transactionSockets[freeSocket];
 				socket->Bind(_host.c_str(), 0);
 				break;
 			}
@@ -311,7 +527,7 @@ namespace tftplib {
 
 		if (socket == nullptr) 
 		{
-			Err() << "Couldn't find free socket for incoming transaction!" << std::endl;
+			RecordRejected(transactionRequest, "no socket");
 			return nullptr;
 		}
 
@@ -320,31 +536,24 @@ namespace tftplib {
 		auto * record = FindFreeTransactionRecord();
 		if (record == nullptr)
 		{
-			Err() << "[Server] Couldn't find free record for transaction" << std::endl;
+			RecordRejected(transactionRequest, "no record");
 			return nullptr;
 		}
 
-		for (size_t i = 0; i < _workers.size(); ++i)
+		record->socketId = freeSocket;
+		record->clientTID = clientTid;
+		record->serverTID = serverTid;
+		record->isActive = true;
+
+		if (!worker->AssignTransaction(transactionRequest, socket))
 		{
-			if ( !_workers[i]->IsBusy()) 
-			{
-				record->socketId = freeSocket;
-				record->clientTID = clientTid;
-				record->serverTID = serverTid;
-				record->isActive = true;
-				
-				_workers[i]->AssignTransaction(transactionRequest, socket);
-
-				return _workers[i];
-			}
+			// Shouldn't happen : the dispatcher is the only producer.
+			RecordRejected(transactionRequest, "worker refused");
+			TerminateTransaction(clientTid, serverTid);
+			return nullptr;
 		}
 
-		// Shouldn't happen.
-		Err()  << "No available worker to handle transaction : "
-			<< clientTid << "/" << serverTid
-			<< std::endl;
-
-		return nullptr;
+		return worker;
 	}
 
 	// Setters for server configuration
@@ -363,6 +572,28 @@ namespace tftplib {
 		return* this;
 	}
 
+	Server& Server::SetPackArchive(const std::filesystem::path& pack) {
+		_packPath = pack;
+		return *this;
+	}
+
+	Server& Server::AddContentProvider(const std::string& pattern,
+		std::shared_ptr<ContentProvider> provider, std::chrono::seconds ttl) {
+		_generated->Add(pattern, std::move(provider), ttl);
+		return *this;
+	}
+
+	Server& Server::SetMaxRenders(uint32_t max) {
+		_generated->SetMaxRenders(max);
+		return *this;
+	}
+
+	Server& Server::Mount(const std::string& prefix,
+		std::shared_ptr<VirtualFileSystem> files) {
+		_mounts.emplace_back(prefix, std::move(files));
+		return *this;
+	}
+
 	Server& Server::SetTimeout(uint32_t timeoutMs) {
 		_timeoutMs = timeoutMs;
 		return *this;
@@ -373,6 +604,113 @@ namespace tftplib {
 		return *this;
 	}
 
+	Server& Server::SetMaxTransactions(uint32_t max) {
+		_maxTransactions = max;
+		return *this;
+	}
+
+	Server& Server::SetMaxWindowSize(uint16_t max) {
+		_maxWindowSize = std::clamp<uint16_t>(max, 1, defaults::MaxWindowSize);
+		return *this;
+	}
+
+	Server& Server::SetMulticast(const std::string& group, uint16_t basePort,
+		uint32_t maxSessions, uint8_t ttl) {
+		_multicastGroup = group;
+		_multicastPort = basePort;
+		_multicastSessions = maxSessions;
+		_multicastTtl = ttl;
+		return *this;
+	}
+
+	Server& Server::SetUploadQuota(uint64_t maxBytes) {
+		_uploadQuota = maxBytes;
+		return *this;
+	}
+
+	Server& Server::SetLockWait(uint32_t waitMs) {
+		_lockWaitMs = waitMs;
+		return *this;
+	}
+
+	Server& Server::SetSharedReads(bool enable) {
+		_sharedReads = enable;
+		return *this;
+	}
+
+	Server& Server::SetPathCache(bool enable) {
+		_pathCache = enable;
+		return *this;
+	}
+
+	Server& Server::SetFastRetransmit(uint32_t duplicateAcks) {
+		_fastRetransmitAcks = duplicateAcks;
+		return *this;
+	}
+
+	size_t Server::DatagramsPerTransaction() const {
+		return std::max<size_t>(8, size_t{ _maxWindowSize } + 2);
+	}
+
+	Server& Server::SetDispatchCpu(uint32_t cpu) {
+		_dispatchCpu = cpu;
+		return *this;
+	}
+
+	Server& Server::SetWorkerCpus(const std::vector<uint32_t>& cpus) {
+		_workerCpus = cpus;
+		return *this;
+	}
+
+	Server& Server::SetHugePages(bool enable) {
+		_pages = enable ? Arena::Pages::HUGE_PAGES : Arena::Pages::NORMAL;
+		return *this;
+	}
+
+	Server& Server::SetTraceLevel(TraceLevel level) {
+		_traceLevel = level;
+		return *this;
+	}
+
+	Server& Server::SetMetricsFile(const std::filesystem::path& path) {
+		_metricsExporter.SetFile(path);
+		return *this;
+	}
+
+	Server& Server::SetMetricsSocket(const std::filesystem::path& path) {
+		_metricsExporter.SetSocket(path);
+		return *this;
+	}
+
+	Server& Server::SetMetricsInterval(std::chrono::milliseconds interval) {
+		_metricsExporter.SetInterval(interval);
+		return *this;
+	}
+
+	MetricsSnapshot Server::GetMetrics() const {
+		return _metrics.Snapshot();
+	}
+
+	Server& Server::SetImpairment(const ImpairmentProfile& profile) {
+		_impairmentProfile = profile;
+		return *this;
+	}
+
+	ImpairmentStats Server::GetImpairmentStats() const {
+		return _impairment ? _impairment->GetStats() : ImpairmentStats{};
+	}
+
+	Server::NumaStats Server::GetNumaStats() const {
+		Executor::Stats executor = _executor.GetStats();
+
+		NumaStats stats{};
+		stats.localAssignments = _localAssignments.load();
+		stats.crossNodeAssignments = _crossNodeAssignments.load();
+		stats.steals = executor.steals;
+		stats.crossNodeSteals = executor.crossNodeSteals;
+		return stats;
+	}
+
 	Server& Server::SetOutStream(std::ostream* os) {
 		_out = os;
 		return *this;
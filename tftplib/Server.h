@@ -16,12 +16,24 @@
 
 #include <mutex>
 #include "FileSecurityHandler.h"
+#include "Signal.h"
+#include "Poller.h"
+#include "Executor.h"
+#include "Numa.h"
+#include "Arena.h"
+#include "MessageTemplates.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include "MetricsExporter.h"
+#include "Impairment.h"
+#include "MulticastSession.h"
+#include "VirtualFileSystem.h"
+#include "GeneratedFileSystem.h"
 
 
 namespace tftplib
 {
 	class ServerWorker;
-	class Allocator;
 
 	class Server
 	{
@@ -36,6 +48,16 @@ namespace tftplib
 			std::atomic<bool> isActive {false};
 		};
 		
+	public:
+		// Traffic that crossed NUMA nodes. Only counted when workers are
+		// pinned.
+		struct NumaStats {
+			uint64_t localAssignments{ 0 };		// Homed on receiving node
+			uint64_t crossNodeAssignments{ 0 };	// Homed on another node
+			uint64_t steals{ 0 };
+			uint64_t crossNodeSteals{ 0 };
+		};
+
 	public:
 		Server();
 		~Server();
@@ -50,8 +72,92 @@ namespace tftplib
 		Server& SetPort(uint16_t port);
 		Server& SetHost(const std::string& host);
 		Server& SetRootDirectory(const std::filesystem::path &root);
+
+		// Serve the files of a pack (PackTftpLib) from memory, ahead of
+		// the root directory. Uploads still go to the root directory.
+		// Loaded at start, empty path : none.
+		Server& SetPackArchive(const std::filesystem::path& pack);
+
+		// Serve names under prefix from files, ahead of the root
+		// directory and of the pack. See MountedFileSystem.
+		Server& Mount(const std::string& prefix,
+			std::shared_ptr<VirtualFileSystem> files);
+
+		// Make the files matching pattern with provider, ahead of the
+		// root directory and the pack. What it makes is cached for ttl.
+		// See GeneratedFileSystem.
+		Server& AddContentProvider(const std::string& pattern,
+			std::shared_ptr<ContentProvider> provider,
+			std::chrono::seconds ttl = std::chrono::seconds{ 60 });
+
+		// Content providers running at once, past which requests are
+		// turned away until one finishes.
+		Server& SetMaxRenders(uint32_t max);
 		Server& SetTimeout(uint32_t timeoutMs);
 		Server& SetThreadCount(uint32_t max);
+		Server& SetMaxTransactions(uint32_t max);
+
+		// Largest windowsize granted to clients (RFC 7440), 1 to turn
+		// windowing down. Datagram pools grow with it.
+		Server& SetMaxWindowSize(uint16_t max);
+
+		// Largest upload accepted, in bytes. A WRQ declaring a larger
+		// tsize is refused before any data flows. 0 : no limit.
+		Server& SetUploadQuota(uint64_t maxBytes);
+
+		// How long a request for a file in use waits for it before
+		// being refused, retrying without holding a worker. 0 : refused
+		// at once. 300 ms by default.
+		Server& SetLockWait(uint32_t waitMs);
+
+		// Serve RRQs asking for the multicast option (RFC 2090) : each
+		// file read by several clients at once is sent once, to group on
+		// port basePort + n, n < maxSessions. Octet mode, files under
+		// 65535 blocks. Off while group is empty.
+		Server& SetMulticast(const std::string& group, uint16_t basePort,
+			uint32_t maxSessions = 16, uint8_t ttl = 1);
+
+		// Concurrent downloads of a file share one read of it, each
+		// at its own pace. Octet mode. On by default.
+		Server& SetSharedReads(bool enable);
+
+		// Remember what read requests found on disk until the files
+		// change, watching the root directory. On by default.
+		Server& SetPathCache(bool enable);
+
+		// Resend the window after this many duplicates of the same ACK
+		// in windowed mode, instead of waiting for the timer. 0 : off.
+		Server& SetFastRetransmit(uint32_t duplicateAcks);
+
+		// Pin the dispatch thread and the workers. Worker i runs on
+		// cpus[i % cpus.size()]. Each NUMA node spanned by the workers
+		// gets its own datagram and frame pools.
+		Server& SetDispatchCpu(uint32_t cpu);
+		Server& SetWorkerCpus(const std::vector<uint32_t>& cpus);
+
+		// Back datagram pools with 2 MiB pages.
+		Server& SetHugePages(bool enable);
+
+		NumaStats GetNumaStats() const;
+
+		// Verbosity of the per-packet trace. Events are written to the
+		// out and err streams by a background thread.
+		Server& SetTraceLevel(TraceLevel level);
+
+		// Prometheus text dumps of the server metrics : rewritten to a
+		// file every interval, and served on each connection to a Unix
+		// socket. Both are off by default.
+		Server& SetMetricsFile(const std::filesystem::path& path);
+		Server& SetMetricsSocket(const std::filesystem::path& path);
+		Server& SetMetricsInterval(std::chrono::milliseconds interval);
+
+		MetricsSnapshot GetMetrics() const;
+
+		// Impair every datagram the transactions send : seeded loss,
+		// duplication, reordering, delay and bandwidth cap. Off by default.
+		Server& SetImpairment(const ImpairmentProfile& profile);
+
+		ImpairmentStats GetImpairmentStats() const;
 
 		Server& SetOutStream(std::ostream *os);
 		Server& SetErrStream(std::ostream* os);
@@ -68,11 +174,20 @@ namespace tftplib
 
 		bool IsHandlingMaxTransactions() const;
 
+		// Pool datagrams to plan per transaction : a full window in
+		// flight, plus what is being received.
+		size_t DatagramsPerTransaction() const;
+
 		void ProcessNewTransactionRequest(
-			std::shared_ptr<Datagram> &transactionRequest);
+			DatagramRef &transactionRequest);
 
 		std::shared_ptr<ServerWorker> AssignWorkerToTransaction(
-			std::shared_ptr<Datagram>& transactionRequest);
+			DatagramRef& transactionRequest);
+
+		std::shared_ptr<ServerWorker> SelectWorker(uint32_t node) const;
+		uint32_t NodeOfCpu(uint32_t cpu) const;
+
+		void StartWorkers();
 
 		TransactionRecord* FindTransactionRecord(
 			const std::function<bool(TransactionRecord*)>& filter) const;
@@ -83,6 +198,9 @@ namespace tftplib
 
 		bool TerminateTransaction( uint16_t clientTid, uint16_t serverTid );
 
+		void RecordRejected(const DatagramRef& transactionRequest,
+			const char* reason);
+
 	private:
 		// Reply functions
 		void ReplyRejectTransactionNoWorkerAvailable(const Datagram& transactionRequest);
@@ -99,23 +217,55 @@ namespace tftplib
 		uint16_t _port{ tftplib::defaults::ServerPort }; // Default TFTP port
 		std::string _host{ "0.0.0.0" };
 		std::filesystem::path _rootDirectory{};
+		std::filesystem::path _packPath{};
+		std::vector<std::pair<std::string, std::shared_ptr<VirtualFileSystem>>> _mounts{};
 		uint32_t _timeoutMs{1000};
 		uint32_t _threadCount{1};
+		uint32_t _maxTransactions{64};
 		uint16_t _blockSize { tftplib::defaults::BlockSize };
-		uint32_t _messagePoolSize { 64000 };
+		uint16_t _maxWindowSize { 8 };
+		uint32_t _fastRetransmitAcks { 0 };
+		uint64_t _uploadQuota { 0 };
+		uint32_t _lockWaitMs { 300 };
+		std::string _multicastGroup {};
+		uint16_t _multicastPort { 1758 };
+		uint32_t _multicastSessions { 16 };
+		uint8_t _multicastTtl { 1 };
+		bool _sharedReads { true };
+		bool _pathCache { true };
+		uint32_t _dispatchCpu { Numa::AnyCpu };
+		std::vector<uint32_t> _workerCpus {};
+		Arena::Pages _pages { Arena::Pages::NORMAL };
+		TraceLevel _traceLevel { TraceLevel::INFO };
+		ImpairmentProfile _impairmentProfile {};
 
 		// Server state
 		std::unique_ptr<UdpSocketWindows::GlobalOsContext> _osContext;
-		std::shared_ptr<Allocator> _alloc;
+		const MessageTemplates _templates {};
+		Tracer _tracer {};
+		Metrics _metrics {};
+		MetricsExporter _metricsExporter { _metrics };
 		std::shared_ptr<DatagramFactory> _factory {nullptr};
+		std::vector<std::shared_ptr<DatagramFactory>> _nodeFactories {};
+		std::vector<uint32_t> _cpuNodes {};		// Numa::CpuNodes, at start
 		
 		FileSecurityHandler _fileSecurity;
 
 		UdpSocketWindows _controlSocket {};
 		std::vector< std::shared_ptr<UdpSocketWindows>> _transactionSockets {};
+		std::shared_ptr<Impairment> _impairment {nullptr};
+		MulticastSessions _multicast {};
+		MountedFileSystem _files {};
+		std::shared_ptr<GeneratedFileSystem> _generated {
+			std::make_shared<GeneratedFileSystem>(_metrics) };
 
 		std::thread _dispatchThread {};
+		Signal _dispatchSignal {};
+		Poller _dispatchPoller { _dispatchSignal };
 		std::vector<std::shared_ptr<ServerWorker>> _workers;
+		Executor _executor {};
+		std::atomic<uint64_t> _localAssignments {0};
+		std::atomic<uint64_t> _crossNodeAssignments {0};
 		
 		TransactionRecord *_transactions;
 
@@ -125,6 +275,7 @@ namespace tftplib
 		std::atomic<bool> _stopping{ false };
 
 		friend class ServerWorker;
+		friend class Transaction;
 	};
 }
 
@@ -1,37 +1,33 @@
 ﻿#include "pch.h"
 #include "ServerWorker.h"
 #include "Server.h"
+#include "Executor.h"
 #include <thread>
 #include <string>
-#include "HaloBuffer.h"
-#include "FileReader.h"
+#include <algorithm>
 
 namespace tftplib {
-	class Finalizer {
-		private:
-			std::function<void()> _finale;
-			bool _cancelled {false};
-
-		public:
-			Finalizer(std::function<void()> finale) 
-			: _finale { finale }
-			{}
-
-			~Finalizer() {
-				if( !_cancelled ) _finale();
-			}
-
-			void Abort() { _cancelled = true; }
-	};
 
-	ServerWorker::ServerWorker(Server& parent, 
-		std::weak_ptr<DatagramFactory> factory)
-		: _fw {nullptr}
-		, _fr{ nullptr }
+	// Worker whose event loop runs on this thread.
+	static thread_local const ServerWorker* CurrentWorker = nullptr;
+
+	ServerWorker::ServerWorker(Server& parent,
+		Executor& executor,
+		DatagramFactory& factory,
+		size_t capacity,
+		uint32_t cpu)
+		: _cpu{ cpu }
+		, _node{ cpu == Numa::AnyCpu ? Numa::AnyNode : Numa::NodeOfCpu(cpu) }
+		, _capacity{ std::max<size_t>(capacity, 1) }
+		, _assignments{ std::max<size_t>(capacity, 1) + 4 }
+		, _transactions( std::max<size_t>(capacity, 1) )
+		, _frames{ std::max<size_t>(capacity, 1) * FrameBudget, _node }
+		, _runQueue{ std::max<size_t>(capacity, 2) }
 		, _parent{parent}
-		, _fileBuffer { std::make_unique<HaloBuffer>(0x020000)  }
+		, _executor{executor}
 		, _factory { factory }
 	{
+		_frames.setMetrics(&parent._metrics);
 	}
 
 	ServerWorker::~ServerWorker(){}
@@ -64,75 +60,52 @@ namespace tftplib {
 	void ServerWorker::Stop()
 	{
 		RequestStop();
-		if( _thread.joinable() ) 
+		if( _thread.joinable() )
 		{
 			_thread.join();
 		}
 
-		_socket = nullptr;
-
-		_clientHost = "";
-		_clientTid = 0;
-		_serverTid = 0;
-		_lastAck = 0;
-		_filePath = "";
-		_asciiMode = false;
 		_signal.Reset();
 	}
 
 	// Transaction handling
-	void ServerWorker::AssignTransaction(
-		std::shared_ptr<Datagram>& transactionRequest,
+	bool ServerWorker::AssignTransaction(
+		DatagramRef& transactionRequest,
 		std::shared_ptr<UdpSocketWindows> socket)
 	{
-		uint16_t clientTid = transactionRequest->GetSourcePort();
-		uint16_t serverTid = socket->GetLocalPort();
-
+		if (_activity != ActivityState::ACTIVE)
 		{
-			TransactionState expected{ TransactionState::WAITING_FOR_REQUEST };
-			TransactionState desired{ TransactionState::SETTING_UP_REQUEST };
-			if (!_state.compare_exchange_strong(expected, desired))
-			{
-				Err() << "AssignTransaction(" 
-					<< clientTid << "," << serverTid 
-					<< ") called while : ";
-				if (expected == TransactionState::INACTIVE)
-				{
-					Err() << "worker is inactive" << std::endl;
-				}
-				else if (expected == TransactionState::TERMINATING)
-				{
-					Err() << "worker is terminating" << std::endl;
-				}
-				else
-				{
-					Err() << "worker is handling transaction " 
-						<< _clientTid << "/" << _serverTid
-						<< std::endl;
-				}
-				return;
-			}
+			_parent._tracer.Emit(TraceId::WORKER_INACTIVE,
+				(uint32_t{ transactionRequest->GetSourcePort() } << 16)
+					| socket->GetLocalPort());
+			return false;
 		}
 
-		_lastAck = 0;
-		_clientHost = transactionRequest->GetSourceAddress();
-		_clientTid = clientTid;
-		_serverTid = serverTid;
-		_socket = socket;
-		
-		TransactionState expected { TransactionState::SETTING_UP_REQUEST };
-		TransactionState desired{ TransactionState::PROCESSING_REQUEST };
-		if (!_state.compare_exchange_strong(expected, desired)) 
+		if (IsBusy() || _assignments.IsFull())
 		{
-			Err() << "Serious threading error in AssignTransaction" << std::endl;
+			return false;
 		}
 
-		ProcessRequestMessage(transactionRequest);
+		_load.fetch_add(1);
+		_assignments.Write(Assignment{ transactionRequest, socket });
+		_signal.EmitSignal();
+
+		return true;
 	}
 
 	bool ServerWorker::IsBusy() const
 	{
-		return _state != TransactionState::WAITING_FOR_REQUEST;
+		return _load >= _capacity;
+	}
+
+	size_t ServerWorker::Load() const
+	{
+		return _load;
+	}
+
+	size_t ServerWorker::Capacity() const
+	{
+		return _capacity;
 	}
 
 	std::ostream& ServerWorker::Out()
@@ -145,667 +118,310 @@ namespace tftplib {
 		return _parent.Err();
 	}
 
-	void ServerWorker::Run()
+	Allocator& ServerWorker::FrameAllocator()
 	{
-		_state = TransactionState::WAITING_FOR_REQUEST;
-		
-		while (_activity == ActivityState::ACTIVE)
-		{
-			while (_activity == ActivityState::ACTIVE 
-				&& _state == TransactionState::WAITING_FOR_REQUEST )
-			{
-				_signal.WaitForSignal( std::chrono::seconds{1});
-			}
-
-			ProcessActivityStateChange();
-			ProcessTransactionState();
-		}
-
-		_state = TransactionState::INACTIVE;
-		_activity = ActivityState::INACTIVE;
+		return _frames;
 	}
 
-	void ServerWorker::ProcessActivityStateChange()
+	Transaction* ServerWorker::Steal()
 	{
-		if (_activity == ActivityState::ACTIVE
-			|| _activity == ActivityState::INACTIVE)
-		{
-			return;
-		}
-
-		Out() << "[TERMINATING] Processing request to stop" << std::endl;
-
-		while (_state == TransactionState::SETTING_UP_REQUEST
-			|| _state == TransactionState::PROCESSING_REQUEST)
-		{
-			Out() << "[TERMINATING] Waiting for request message to be handled..." 
-				<< std::endl;
-			_signal.WaitForSignal(std::chrono::milliseconds{ 50 });
-		}
+		Transaction* transaction = nullptr;
+		return _runQueue.Steal(transaction) ? transaction : nullptr;
+	}
 
-		if (_state != TransactionState::WAITING_FOR_REQUEST)
+	bool ServerWorker::WakeIfIdle()
+	{
+		bool expected = true;
+		if (!_idle.compare_exchange_strong(expected, false))
 		{
-			ErrorWithMessage(ErrorCode::UNDEFINED, "Server shut down");
+			return false;
 		}
 
-		_state = TransactionState::TERMINATING;
+		_signal.EmitSignal();
+		return true;
 	}
 
-	void ServerWorker::ProcessTransactionState()
+	void ServerWorker::Wake()
 	{
-		switch (_state)
-		{
-			case TransactionState::INACTIVE:
-			case TransactionState::WAITING_FOR_REQUEST:
-				return;
-
-			case TransactionState::SETTING_UP_REQUEST:
-			case TransactionState::PROCESSING_REQUEST:
-				_signal.WaitForSignal(std::chrono::milliseconds{ 20 });
-				return;
-
-			case TransactionState::WAITING_FOR_DATA:
-				return ProcessWaitingForDataState();
-
-			case TransactionState::WAITING_FOR_ACK:
-				return ProcessWaitingForAckState();
-
-			case TransactionState::TERMINATING:
-				return;
-		}
+		_signal.EmitSignal();
 	}
 
-	void 
-	ServerWorker::ProcessWaitingForDataState()
+	bool ServerWorker::IsCurrentThread() const
 	{
-		using namespace std::chrono;
-		using ms = milliseconds;
-
-		auto beginning = steady_clock::now();
-		auto now = beginning;
-
-		auto factory = _factory.lock();
-		if (!factory)
-		{
-			Err() << "[WaitingForData] Cannot grab factory. Shutting down?"
-				<< std::endl;
-			return;
-		}
+		return CurrentWorker == this;
+	}
 
-		while (duration_cast<ms>(now - beginning) < _transactionTimeout
-			&& _activity == ActivityState::ACTIVE
-			&& !_socket->Poll(50) )
-		{
-			now = steady_clock::now();
-			Out() << "[WaitingForData] Elapsed: "
-				<< duration_cast<ms>(now - beginning).count() << "ms"
-				<< std::endl;
-		}
+	/* *********************************************************************
+	 * Event loop
+	 * *********************************************************************/
+	void ServerWorker::Run()
+	{
+		CurrentWorker = this;
 
-		if (_activity != ActivityState::ACTIVE)
+		if (_cpu != Numa::AnyCpu && !Numa::PinCurrentThread(_cpu))
 		{
-			return;
+			Err() << "[ServerWorker] Could not pin worker to cpu "
+				<< _cpu << std::endl;
 		}
 
-		auto errorResult = MessageErrorCategory::TIMEOUT;
-		if (_socket->HasDatagram())
+		while (_activity == ActivityState::ACTIVE)
 		{
-			auto datagram = _socket->Receive(*factory);
+			StartAssignedTransactions();
+			ScheduleExpiredTransactions();
 
-			if (!datagram)
-			{
-				Err() << "[WaitingForData] could not allocate memory for message"
-					<< std::endl;
-			}
-			errorResult = ProcessDataMessage(datagram);
-		}
+			bool more = RunScheduledTransactions();
+			ReapTransactions();
 
-		if (errorResult != MessageErrorCategory::NO_ERROR)
-		{
-			Abort(errorResult);
+			WaitForEvents(more);
 		}
-	}
 
-	void 
-	ServerWorker::ProcessWaitingForAckState()
-	{
-		std::shared_ptr<Datagram> datagram = 
-			MakeMessageDatagram<MessageData>(_factory, _lastAck + 1, _dataBlockSize);
-
-		MessageData* message = (MessageData*)datagram->GetData();
-		size_t read = _fr->ReadBlock((uint8_t*)message->getDataBuffer(),
-			_dataBlockSize);
-		datagram->SetDataSize((uint16_t)read + MessageData::HeaderSize() );
+		Out() << "[TERMINATING] Processing request to stop" << std::endl;
+		ShutDownTransactions();
 
-		size_t attempt = 0;
-		while( _activity == ActivityState::ACTIVE ) 
-		{
-			SendMessage(datagram);
-			
-			MessageErrorCategory result = WaitForAck(_lastAck + 1);
-			switch (result)
-			{
-				case MessageErrorCategory::NO_ERROR:
-					if (read < _dataBlockSize)
-					{
-						TerminateTransaction();
-					}
-					return;
-
-				case MessageErrorCategory::TIMEOUT:
-					if( attempt++ <= _retries)
-					{
-						// Try again. Otherwise, fall back to error out.
-						continue;
-					}
-
-				default:
-					Abort(result);
-					return;
-			}
-		}
+		_activity = ActivityState::INACTIVE;
 	}
 
-	ServerWorker::MessageErrorCategory
-	ServerWorker::WaitForAck(uint16_t ack)
+	void ServerWorker::StartAssignedTransactions()
 	{
-		using namespace std::chrono;
-		using ms = milliseconds;
-
-		auto beginning = steady_clock::now();
-		auto now = beginning;
-
-		auto factory = _factory.lock();
-		if (!factory)
+		while (!_assignments.IsEmpty())
 		{
-			Err() << "[WaitForAck] Cannot grab factory. Shutting down?"
-				<< std::endl;
-			return ServerWorker::MessageErrorCategory::CRITICAL_SERVER_ERROR;
-		}
+			Assignment assignment = _assignments.Read();
 
-		while (duration_cast<ms>(now - beginning) < _transactionTimeout
-			&& _activity == ActivityState::ACTIVE
-			&& !_socket->Poll(50))
-		{
-			now = steady_clock::now();
-			Out() << "[WaitForAck] Elapsed: "
-				<< duration_cast<ms>(now - beginning).count() << "ms"
-				<< std::endl;
-		}
+			auto slot = std::find(_transactions.begin(), _transactions.end(),
+				nullptr);
+			if (slot == _transactions.end())
+			{
+				// Load accounting prevents this.
+				_parent._tracer.Emit(TraceId::WORKER_NO_SLOT, 0);
+				_load.fetch_sub(1);
+				continue;
+			}
 
-		if (_activity != ActivityState::ACTIVE)
-		{
-			return ServerWorker::MessageErrorCategory::SHUTTING_DOWN;
-		}
+			uint64_t token = slot - _transactions.begin();
+			*slot = std::make_unique<Transaction>(*this, _parent, _factory,
+				assignment.request, assignment.socket);
 
-		auto errorResult = MessageErrorCategory::TIMEOUT;
-		if (_socket->HasDatagram())
-		{
-			auto datagram = _socket->Receive(*factory);
+			_parent._metrics.Add(Counter::TRANSACTIONS_STARTED);
+			_parent._metrics.Add(Gauge::ACTIVE_TRANSACTIONS, 1);
 
-			if (!datagram)
+			// Unpolled, every packet of the client would be missed. The
+			// slot and the record are released when reaped.
+			if (!_poller.Watch(assignment.socket->GetNativeHandle(), token))
 			{
-				Err() << "[WaitForAck] could not allocate memory for message"
-					<< std::endl;
+				(*slot)->Refuse();
+				continue;
 			}
 
-			errorResult = ProcessAckMessage(ack, datagram);
+			(*slot)->Start();
 		}
-
-		return errorResult;
 	}
 
-	ServerWorker::MessageErrorCategory
-	ServerWorker::ProcessAckMessage( uint16_t expectedAck,
-		const std::shared_ptr<Datagram>& dataMessage)
+	void ServerWorker::ScheduleExpiredTransactions()
 	{
-		if (dataMessage->GetDataSize() < sizeof(OpCode))
+		auto now = Transaction::Clock::now();
+		for (auto& transaction : _transactions)
 		{
-			return ServerWorker::MessageErrorCategory::INVALID_MESSAGE_FORMAT;
-		}
-
-		OpCode *opcode = (OpCode*)dataMessage->GetData();
-		switch (*opcode)
-		{
-			case OpCode::ACK:
-				// Happy path.
-				break;
-
-			case OpCode::ERROR:
-				Err() << "[ProcessAckMessage] Rcv client error" << std::endl;
-				return ProcessErrorMessage(dataMessage);
-
-			default:
-				return ServerWorker::MessageErrorCategory::INVALID_OPCODE;
-		}
-
-		if (dataMessage->GetDataSize() < sizeof(MessageAck))
-		{
-			return ServerWorker::MessageErrorCategory::INVALID_MESSAGE_FORMAT;
-		}
-
-		MessageAck* msg = (MessageAck*)dataMessage->GetData();
-		if (msg->getBlockNumber() != expectedAck)
-		{
-			// Weird case - received ack late?
-			// Let's just return timeout and trigger a resend. 
-			// Maybe things will work out fine.
-			return ServerWorker::MessageErrorCategory::TIMEOUT;
+			if (transaction
+				&& transaction->IsWaiting()
+				&& transaction->Deadline() <= now)
+			{
+				ScheduleTransaction(*transaction, Transaction::Wakeup::TIMEOUT);
+			}
 		}
-
-		_lastAck = expectedAck;
-		return ServerWorker::MessageErrorCategory::NO_ERROR;
-	}
-
-	ServerWorker::MessageErrorCategory
-	ServerWorker::ProcessErrorMessage(const std::shared_ptr<Datagram>& errMessage)
-	{
-			
-		return ServerWorker::MessageErrorCategory::CLIENT_ERROR;
 	}
 
-	void 
-	ServerWorker::ProcessRequestMessage(
-		std::shared_ptr<Datagram>& transactionRequest)
+	void ServerWorker::ScheduleReadyTransactions()
 	{
-		MessageErrorCategory error = MessageErrorCategory::NO_ERROR;
-
-		/* **************************************************************
-		 *  Initial message and state validation
-		 *  *************************************************************/
-		
-		// Validate state
-		if( error == MessageErrorCategory::NO_ERROR 
-			&& _state != TransactionState::PROCESSING_REQUEST)
-		{
-			Err() << "ERROR! Invalid state for function " __FUNCTION__ << std::endl;
-			error = MessageErrorCategory::INVALID_STATE;
-		}
-
-		// Validate message size
-		if (error == MessageErrorCategory::NO_ERROR 
-			&& transactionRequest->GetDataSize() < (sizeof(OpCode) + 2))
-		{
-			Err() << "Invalid message size for request." << std::endl;
-			error = MessageErrorCategory::INVALID_MESSAGE_SIZE;
-		}
+		ScheduleDeferredTransactions();
 
-		// Validate operation is actually a request
-		const char* data = transactionRequest->GetData();
-		OpCode requestType = *((OpCode*)data);
-
-		if (error == MessageErrorCategory::NO_ERROR
-			&& requestType != OpCode::RRQ
-			&& requestType != OpCode::WRQ)
+		for (uint64_t token : _ready)
 		{
-			Err() << "Invalid message opcode. Expecting: RRQ/WRQ "
-				<< "received: " << OpCodeToStr(requestType) << std::endl;
-			error = MessageErrorCategory::INVALID_OPCODE;
-		}
+			if (token == Poller::SignalToken)
+			{
+				// New assignment, stop request or steal hint.
+				// Handled by the loop.
+				_signal.Consume();
+				continue;
+			}
 
-		/* **************************************************************
-		 *  Validate and handle request
-		 *  *************************************************************/
-		const MessageRequest* rwrq = ((MessageRequest*)data);
-		if (error == MessageErrorCategory::NO_ERROR
-			&& !rwrq->Validate(transactionRequest->GetDataSize()))
-		{
-			error = MessageErrorCategory::INVALID_MESSAGE_FORMAT;
-		}
+			if (token >= _transactions.size())
+			{
+				continue;
+			}
 
-		if (error == MessageErrorCategory::NO_ERROR)
-		{
-			error = ProcessRequestMessage(rwrq);
+			auto& transaction = _transactions[token];
+			if (transaction && transaction->IsWaiting())
+			{
+				ScheduleTransaction(*transaction, Transaction::Wakeup::READABLE);
+			}
+			else if (transaction && !transaction->IsDone()
+				&& std::find(_deferred.begin(), _deferred.end(), token) == _deferred.end())
+			{
+				// Queued or running : the datagram waits for it to come back.
+				_poller.Mute(transaction->Socket()->GetNativeHandle(), token);
+				_deferred.push_back(token);
+			}
 		}
 
-		/* **************************************************************
-		 *  Reject request in case of error.
-		 *  *************************************************************/
-		if (error != MessageErrorCategory::NO_ERROR) 
+		// More than we can start right away : let an idle sibling help.
+		if (_runQueue.Size() > 1)
 		{
-			RejectTransactionRequest(error);
+			_executor.NotifyWork(*this);
 		}
 	}
 
-	ServerWorker::MessageErrorCategory
-	ServerWorker::ProcessRequestMessage(const MessageRequest* rwrq)
+	void ServerWorker::ScheduleDeferredTransactions()
 	{
-		MessageErrorCategory error = MessageErrorCategory::NO_ERROR;
-
-		/* **************************************************************
-		 *  File setup and validation
-		 *  *************************************************************/
-		_filePath = 
-			_parent.FileSecurity().AbsoluteFromServerRoot(rwrq->getFilename());
-
-		auto fileValidation = rwrq->getMessageCode() == OpCode::RRQ 
-			? _parent.FileSecurity().IsFileValidForRead(_filePath)
-			: _parent.FileSecurity().IsFileValidForWrite(_filePath);
-
-		error = FileSecurityErrorToMessageError(fileValidation);
-		if (error != MessageErrorCategory::NO_ERROR)
-		{
-			return error;
-		}
-
-		/* **************************************************************
-		 *  Mode Setup and validation
-		 *  *************************************************************/
-		if (rwrq->getMode() == mode::Mode::MAIL)
-		{
-			return MessageErrorCategory::INVALID_MODE;
-		}
-
-		_currentOperation = rwrq->getMessageCode();
-		_asciiMode = rwrq->getMode() == mode::Mode::NETASCII;
-
-		/* **************************************************************
-		 *  Lock file 
-		 *  *************************************************************/
-		_fileLocked = _currentOperation == OpCode::RRQ
-			? _parent.FileSecurity().LockFileForRead(_filePath)
-			: _parent.FileSecurity().LockFileForWrite(_filePath);
-
-		if (!_fileLocked)
-		{
-			return MessageErrorCategory::FILE_LOCKED;
-		}
-
-		 /* **************************************************************
-		  *  Everything went well - update state and ack.
-		  *  *************************************************************/
-
-		if (_currentOperation == OpCode::WRQ) {
-			auto eolMode = _asciiMode
-				? FileWriter::ForceNativeEOL::YES
-				: FileWriter::ForceNativeEOL::NO;
-
-			_fw.reset(new FileWriter(_filePath, _fileBuffer.get(), eolMode));
-			_fr.reset(nullptr);
-			_state = TransactionState::WAITING_FOR_DATA;
-			if (!Ack(0))
+		std::erase_if(_deferred, [this](uint64_t token) {
+			auto& transaction = _transactions[token];
+			if (!transaction || transaction->IsDone())
 			{
-				MessageErrorCategory::CRITICAL_SERVER_ERROR;
+				return true;
 			}
-		}
-		else 
-		{
-			auto eolMode = _asciiMode
-				? FileReader::ForceNativeEOL::YES
-				: FileReader::ForceNativeEOL::NO;
-
-			_fw.reset(nullptr);
-			_fr.reset(new FileReader( _filePath, _fileBuffer.get(), eolMode ));
-			_state = TransactionState::WAITING_FOR_ACK;
-		}
 
+			if (!transaction->IsWaiting())
+			{
+				return false;
+			}
 
-		_signal.EmitSignal();
-
-		return MessageErrorCategory::NO_ERROR;
+			_poller.Unmute(transaction->Socket()->GetNativeHandle(), token);
+			ScheduleTransaction(*transaction, Transaction::Wakeup::READABLE);
+			return true;
+		});
 	}
 
-	void 
-	ServerWorker::RejectTransactionRequest(MessageErrorCategory errorReason)
+	void ServerWorker::ScheduleTransaction(Transaction& transaction,
+		Transaction::Wakeup reason)
 	{
-		Abort(errorReason);
+		transaction.Schedule(reason);
+		if (!_runQueue.Push(&transaction))
+		{
+			// Queue holds capacity entries and a transaction is queued
+			// at most once, so this can't happen. Run it inline.
+			transaction.RunScheduled();
+		}
 	}
 
-	ServerWorker::MessageErrorCategory
-	ServerWorker::ProcessDataMessage(
-			const std::shared_ptr<Datagram>& datagram)
+	bool ServerWorker::RunScheduledTransactions()
 	{
-		/* ***************************************************
-		 *  Validation of message and opcode
-		 * ***************************************************/
-
-		// msg size
-		if (datagram->GetDataSize() < sizeof(MessageData))
+		Transaction* transaction = nullptr;
+		while (_runQueue.Pop(transaction))
 		{
-			Err() << "[ProcessDataMessage] INVALID_MESSAGE_SIZE" << std::endl;
-			return MessageErrorCategory::INVALID_MESSAGE_SIZE;
-		}
-
-		// opcode
-		OpCode* opCode = (OpCode*)datagram->GetData();
-		if ( *opCode == OpCode::ERROR) {
-			Err() << "[ProcessDataMessage] CLIENT_ERROR" << std::endl;
-			return MessageErrorCategory::CLIENT_ERROR;
+			transaction->RunScheduled();
 		}
 
-		MessageData *msg = (MessageData * )datagram->GetData();
-		uint16_t dataSize = datagram->GetDataSize() - msg->HeaderSize();
-		bool isLastMessage = dataSize != _dataBlockSize;
-		uint16_t expectedBlock = (_lastAck == 0xFFFF) ? 0 : (_lastAck + 1);
-		
-		Out() << "[ProcessDataMessage] Block=" << msg->getBlockNumber()
-			<< ", expectedBlock=" << expectedBlock
-			<< ", msgsize=" << datagram->GetDataSize()
-			<< ", blocksize=" << dataSize
-			<< std::endl;
-		
-		// block number
-		if (msg->getBlockNumber() != expectedBlock)
+		if (_activity != ActivityState::ACTIVE)
 		{
-			return MessageErrorCategory::INVALID_BLOCK;
+			return false;
 		}
 
-		/* ***************************************************
-		 *  Process the message
-		 * ***************************************************/
-
-		_fw->WriteBlock( (uint8_t*)msg->getData(), dataSize);
-		Ack(msg->getBlockNumber());
-
-		if (isLastMessage)
+		// Own work is done : help loaded siblings, but come back to our
+		// sockets after a batch.
+		for (size_t i = 0; i < StealBatch; ++i)
 		{
-			_fw->Finalize();
-			TerminateTransaction();
-		}
-
-		return MessageErrorCategory::NO_ERROR;
-	}
-
-	bool
-	ServerWorker::Ack(uint16_t ack)
-	{
-		Out() << "[Ack] block=" << ack << std::endl;
-
-		std::shared_ptr<Datagram> datagram = 
-			MakeMessageDatagram<MessageAck>(_factory, ack);
+			transaction = _executor.Steal(*this);
+			if (transaction == nullptr)
+			{
+				return false;
+			}
 
-		bool result = SendMessage(datagram);
-		if (result)
-		{
-			_lastAck = ack;
+			transaction->RunScheduled();
 		}
 
-		return result;
+		return true;
 	}
 
-	bool 
-	ServerWorker::Error(ErrorCode errorCode)
+	void ServerWorker::WaitForEvents(bool poll)
 	{
-		std::shared_ptr<Datagram> datagram =
-			MakeMessageDatagram<MessageError>(_factory, errorCode);
-
-		return SendMessage(datagram);
-	}
-
-	bool 
-	ServerWorker::Error(MessageErrorCategory errorCode)
-	{
-		const char* msg = nullptr;
-		ErrorCode err = ErrorCode::UNDEFINED;
-
-		switch (errorCode)
-		{
-			case MessageErrorCategory::NO_ERROR:
-				return false;
-			
-			case MessageErrorCategory::INVALID_STATE:
-			case MessageErrorCategory::INVALID_OPCODE:
-				err = ErrorCode::ILLEGAL_OPERATION;
-				break;
-
-			case MessageErrorCategory::TIMEOUT:
-				msg = "transaction timed out";
-				break;
-
-			case MessageErrorCategory::INVALID_MESSAGE_SIZE:
-			case MessageErrorCategory::INVALID_MESSAGE_FORMAT:
-			case MessageErrorCategory::INVALID_MODE:
-				err = ErrorCode::ILLEGAL_OPERATION;
-				break;
-
-			case MessageErrorCategory::NO_SUCH_FILE:
-				err = ErrorCode::FILE_NOT_FOUND;
-				break;
-
-			case MessageErrorCategory::ACCESS_FORBIDDEN:
-				err = ErrorCode::ACCESS_VIOLATION;
-				break;
-			case MessageErrorCategory::FILE_LOCKED:
-				msg = "temporarily unavailable";
-				break;
-
-			case MessageErrorCategory::UNSAFE_PATH:
-				err = ErrorCode::ACCESS_VIOLATION;
-				break;
-
-			case MessageErrorCategory::CRITICAL_SERVER_ERROR:
-				msg = "critical server error";
-				break;
-				
-		}
-
-		return ErrorWithMessage(err, msg);
-	}
-
+		using namespace std::chrono;
 
-	bool
-	ServerWorker::ErrorWithMessage(ErrorCode errorCode, const char* msg)
-	{
-		std::shared_ptr<Datagram> datagram =
-			MakeMessageDatagram<MessageError>(_factory, errorCode, msg);
+		// Idle : siblings may wake us to steal their work.
+		_idle = !poll;
+		_poller.Wait(poll ? milliseconds{ 0 } : NextTimeout(), _ready);
+		_idle = false;
 
-		return SendMessage(datagram);
+		ScheduleReadyTransactions();
 	}
 
-	bool
-	ServerWorker::Abort(MessageErrorCategory error, bool sendErrorMsg)
+	void ServerWorker::ReapTransactions()
 	{
-		Out() << "[Abort] error=" 
-			<< MessageErrorCategoryToString(error) << std::endl;
-
-		if (error == MessageErrorCategory::NO_ERROR)
-		{
-			return false;
-		}
-		
-		if (sendErrorMsg)
+		for (auto& transaction : _transactions)
 		{
-			Error(error);
+			if (transaction && transaction->IsDone())
+			{
+				// Released here rather than by the transaction : the poller
+				// belongs to this thread.
+				_poller.Unwatch(transaction->Socket()->GetNativeHandle());
+				std::erase(_deferred, uint64_t(&transaction - _transactions.data()));
+				_parent.TerminateTransaction(transaction->ClientTid(),
+					transaction->ServerTid());
+
+				transaction = nullptr;
+				_load.fetch_sub(1);
+				_parent._metrics.Add(Gauge::ACTIVE_TRANSACTIONS, -1);
+			}
 		}
-
-		return TerminateTransaction();
 	}
 
-	bool 
-	ServerWorker::SendMessage(std::shared_ptr<Datagram>& datagram)
+	void ServerWorker::ShutDownTransactions()
 	{
-		if (!datagram)
+		// Requests that were never started are simply dropped.
+		while (!_assignments.IsEmpty())
 		{
-			return false;
+			Assignment assignment = _assignments.Read();
+			_parent.TerminateTransaction(assignment.request->GetSourcePort(),
+				assignment.socket->GetLocalPort());
+			_load.fetch_sub(1);
 		}
 
-		if (!_socket || !_socket->IsBound())
+		// A sibling may still be running one of our transactions : keep
+		// going until every one of them came back and was reaped.
+		while (_load > 0)
 		{
-			return false;
-		}
-
-		return _socket->Send(datagram);
-	}
+			Transaction* transaction = nullptr;
+			while (_runQueue.Pop(transaction))
+			{
+				transaction->RunScheduled();
+			}
 
-	bool 
-	ServerWorker::TerminateTransaction()
-	{
-		Out() << "[TerminateTransaction]" << std::endl;
+			for (auto& t : _transactions)
+			{
+				if (t && t->IsWaiting())
+				{
+					t->Resume(Transaction::Wakeup::SHUTDOWN);
+				}
+			}
 
-		_fw = nullptr;
-		_fr = nullptr;
-		_socket = nullptr;
+			ReapTransactions();
 
-		if (_fileLocked && _currentOperation != OpCode::UNDEF)
-		{
-			(_currentOperation == OpCode::RRQ)
-				? _parent.FileSecurity().UnlockFileForRead(_filePath)
-				: _parent.FileSecurity().UnlockFileForWrite(_filePath);
+			if (_load > 0)
+			{
+				std::this_thread::yield();
+			}
 		}
-
-		bool result = _parent.TerminateTransaction(_clientTid, _serverTid);
-		_state = TransactionState::WAITING_FOR_REQUEST;
-		
-		return result;
 	}
 
-	ServerWorker::MessageErrorCategory
-	ServerWorker::FileSecurityErrorToMessageError(
-			FileSecurityHandler::ValidationResult fse) const
+	std::chrono::milliseconds ServerWorker::NextTimeout() const
 	{
-		using FSEVR = FileSecurityHandler::ValidationResult;
-		using MEC = MessageErrorCategory;
-		switch (fse)
+		using namespace std::chrono;
+
+		bool any = false;
+		auto nearest = Transaction::Clock::time_point::max();
+		for (auto& transaction : _transactions)
 		{
-			case FSEVR::VALID: return MEC::NO_ERROR;
-			
-			case FSEVR::INVALID_FORMAT: return MEC::NO_SUCH_FILE;
-			case FSEVR::INVALID_ESCAPE_ROOT: return MEC::UNSAFE_PATH;
-			case FSEVR::INVALID_CANT_CREATE_FILE: return MEC::ACCESS_FORBIDDEN;
-			case FSEVR::INVALID_NO_SUCH_FILE: return MEC::NO_SUCH_FILE;
-			case FSEVR::INVALID_IS_DIRECTORY:return MEC::NO_SUCH_FILE;
-			case FSEVR::INVALID_ACCESS_FORBIDDEN: return MEC::ACCESS_FORBIDDEN;
-			case FSEVR::INVALID_PERMISSIONS: return MEC::ACCESS_FORBIDDEN;
-
-			default: return MEC::ACCESS_FORBIDDEN;
+			if (transaction && transaction->IsWaiting())
+			{
+				nearest = std::min(nearest, transaction->Deadline());
+				any = true;
+			}
 		}
-	}
 
-	const char* 
-	ServerWorker::MessageErrorCategoryToString(MessageErrorCategory mec) const
-	{
-		switch (mec)
+		if (!any)
 		{
-			case MessageErrorCategory::NO_ERROR: 
-				return "NO_ERROR";
-			case MessageErrorCategory::INVALID_STATE: 
-				return "INVALID_STATE";
-			case MessageErrorCategory::INVALID_OPCODE:
-				return "INVALID_OPCODE";
-			case MessageErrorCategory::INVALID_BLOCK:
-				return "INVALID_BLOCK";
-			case MessageErrorCategory::TIMEOUT:
-				return "TIMEOUT";
-			case MessageErrorCategory::INVALID_MESSAGE_SIZE:
-				return "INVALID_MESSAGE_SIZE";
-			case MessageErrorCategory::INVALID_MESSAGE_FORMAT:
-				return "INVALID_MESSAGE_FORMAT";
-			case MessageErrorCategory::INVALID_MODE:
-				return "INVALID_MODE";
-			case MessageErrorCategory::NO_SUCH_FILE:
-				return "NO_SUCH_FILE";
-			case MessageErrorCategory::ACCESS_FORBIDDEN:
-				return "ACCESS_FORBIDDEN";
-			case MessageErrorCategory::FILE_LOCKED:
-				return "FILE_LOCKED";
-			case MessageErrorCategory::UNSAFE_PATH:
-				return "UNSAFE_PATH";
-			case MessageErrorCategory::CLIENT_ERROR:
-				return "CLIENT_ERROR";
-			case MessageErrorCategory::CRITICAL_SERVER_ERROR:
-				return "CRITICAL_SERVER_ERROR";
-			default:
-				return "[UNKNOWN]";
+			return Poller::Infinite;
 		}
+
+		auto remaining = ceil<milliseconds>(nearest - Transaction::Clock::now());
+		return std::max(remaining, milliseconds{ 0 });
 	}
 }
@@ -7,59 +7,58 @@
 #include <vector>
 #include "RingBuffer.h"
 #include "Signal.h"
+#include "Poller.h"
 #include <ostream>
 #include "UdpSocketWindows.h"
 #include "DatagramFactory.h"
-#include <filesystem>
-#include "tftp_messages.h"
-#include "FileSecurityHandler.h"
-#include "FileWriter.h"
+#include "Allocator.h"
+#include "Transaction.h"
+#include "WorkStealingDeque.h"
+#include "Numa.h"
 
 namespace tftplib {
 	class Server;
-	class MessageRequest;
-	class FileWriter;
-	class FileReader;
-	class HaloBuffer;
-
+	class Executor;
+
+	// **********************************************************************
+	// Worker thread running an event loop over many transactions.
+	//	Each transaction is a coroutine suspended on its socket. The loop
+	//	blocks in a single Poller wait on every transaction socket, the
+	//	worker signal (new assignment, stop or steal hint) and the nearest
+	//	deadline.
+	//
+	//	Ready continuations go to the worker's run queue. The worker drains
+	//	it, then steals from its siblings through the Executor before going
+	//	back to sleep. Sockets never move : a transaction is always watched,
+	//	timed out and reaped by its home worker.
+	// **********************************************************************
 	class ServerWorker
 	{
 	public:
 		enum class ActivityState {
 			INACTIVE,					// Worker thread is not running
-			
-			ACTIVE,						// Worker thread is running
-			
-			TERMINATING					// Worker thread is shutting down
-										// Will transition to inactive.
-		};
-
-		enum class TransactionState {
-			INACTIVE,					// Worker thread is not running
-
-			WAITING_FOR_REQUEST,		// Worker thread is running
-										// but not currently handling a transaction
-
-			SETTING_UP_REQUEST,			// Setting up state for request handling
 
-			PROCESSING_REQUEST,			// Worker thread is processing 
-										// a transaction request
-
-			WAITING_FOR_DATA,			// Worker thread is waiting for data 
-										// from the client
-
-			WAITING_FOR_ACK,			// Worker thread is waiting for ACK from 
-										// the client
+			ACTIVE,						// Worker thread is running
 
 			TERMINATING					// Worker thread is shutting down
 										// Will transition to inactive.
 		};
 
+		// Frame memory budgeted for each concurrent transaction.
+		static constexpr size_t FrameBudget = 0x1000;
+
+		// Continuations stolen in a row before polling own sockets again.
+		static constexpr size_t StealBatch = 8;
 
 	public:
-		
-		ServerWorker(Server &parent, 
-			std::weak_ptr<DatagramFactory> factory);
+
+		// A worker given a cpu pins itself to it and allocates its frames
+		// on that cpu's NUMA node.
+		ServerWorker(Server &parent,
+			Executor &executor,
+			DatagramFactory& factory,
+			size_t capacity,
+			uint32_t cpu = Numa::AnyCpu);
 
 		~ServerWorker();
 		ServerWorker& operator=(ServerWorker&&) = delete;
@@ -72,180 +71,89 @@ namespace tftplib {
 		void Stop();
 
 		// Transaction handling
-		void AssignTransaction(std::shared_ptr<Datagram>& transactionRequest,
+		//	Called from the dispatch thread. The request is handed over
+		//	to the worker thread which validates it and runs the transfer.
+		bool AssignTransaction(DatagramRef& transactionRequest,
 			std::shared_ptr<UdpSocketWindows> socket );
 
+		// True when the worker can't take any more transaction.
 		bool IsBusy() const;
 
+		size_t Load() const;
+		size_t Capacity() const;
+
+		uint32_t Cpu() const { return _cpu; }
+		uint32_t Node() const { return _node; }
+
 		std::ostream& Out();
 		std::ostream& Err();
 
+		// Transaction interface
+		Allocator& FrameAllocator();
+
+		// Executor interface. Called from sibling workers.
+		Transaction* Steal();
+		bool WakeIfIdle();
+
+		// A sibling handed one of our transactions back : its deadline
+		// and readiness are ours to watch again.
+		void Wake();
+		bool IsCurrentThread() const;
+
 	private:
-	
-		enum class MessageErrorCategory
-		{
-			NO_ERROR,
-
-			// State and operation sequencing errors
-			INVALID_STATE,
-			INVALID_OPCODE,
-			INVALID_BLOCK,
-			TIMEOUT,
-			
-			// Message structure errors
-			INVALID_MESSAGE_SIZE,
-			INVALID_MESSAGE_FORMAT,
-			
-			// Message error
-			INVALID_MODE,
-
-			// File errors
-			NO_SUCH_FILE,
-			ACCESS_FORBIDDEN,
-			FILE_LOCKED,
-			UNSAFE_PATH,
-
-			// Received an error from the client - abort processing.
-			CLIENT_ERROR,
-
-			// Critical server error - abort processing.
-			CRITICAL_SERVER_ERROR,
-			SHUTTING_DOWN
+		struct Assignment {
+			DatagramRef request{ nullptr };
+			std::shared_ptr<UdpSocketWindows> socket{ nullptr };
 		};
 
 	private:
 		void Run();
 
-		void ProcessActivityStateChange();
-		void ProcessTransactionState();
-
-		void ProcessWaitingForDataState();
-		void ProcessWaitingForAckState();
-
-		/* ***************************************************
-		 *  Message Processing : RRQ and WRQ
-		 * ***************************************************/
-		
-		void ProcessRequestMessage(
-			std::shared_ptr<Datagram>& transactionRequest );
-		
-		MessageErrorCategory ProcessRequestMessage(
-			const MessageRequest* rwrq);
-
-		void RejectTransactionRequest(MessageErrorCategory errorReason);
-
-		/* ***************************************************
-		 *  Message Processing : Data
-		 * ***************************************************/
+		void StartAssignedTransactions();
+		void ScheduleExpiredTransactions();
+		void ScheduleReadyTransactions();
+		void ScheduleDeferredTransactions();
+		void ScheduleTransaction(Transaction& transaction,
+			Transaction::Wakeup reason);
+		bool RunScheduledTransactions();
+		void WaitForEvents(bool poll);
+		void ReapTransactions();
+		void ShutDownTransactions();
 
-		MessageErrorCategory ProcessDataMessage(
-			const std::shared_ptr<Datagram>& dataMessage );
-
-		/* ***************************************************
-		 *  Message Processing : Read
-		 * ***************************************************/
-
-		MessageErrorCategory WaitForAck(uint16_t ack);
-		MessageErrorCategory ProcessAckMessage(uint16_t expectedAck,
-			const std::shared_ptr<Datagram>& dataMessage);
-
-		MessageErrorCategory ProcessErrorMessage(
-			const std::shared_ptr<Datagram>& errMessage);
-
-		/* ***************************************************
-		 *  General state and message handling
-		 * ***************************************************/
-
-		bool Ack(uint16_t ack);
-
-		bool Error(ErrorCode errorCode);
-
-		bool Error(MessageErrorCategory errorCode);
-
-		bool ErrorWithMessage(ErrorCode errorCode, const char* msg);
-
-		bool Abort(MessageErrorCategory error, bool sendErrorMsg = true);
-
-		bool SendMessage(std::shared_ptr<Datagram> &datagram);
-
-		bool TerminateTransaction();
-
-		/* ***************************************************
-		 *  General utility functions
-		 * ***************************************************/
-
-		MessageErrorCategory 
-		FileSecurityErrorToMessageError(
-			FileSecurityHandler::ValidationResult fse) const;
-
-		const char* MessageErrorCategoryToString(MessageErrorCategory mec) const;
-
-		template<typename T, typename... Args>
-		std::shared_ptr<Datagram>
-		MakeMessageDatagram(std::weak_ptr<DatagramFactory>& factoryHandle,
-				Args... args);
+		std::chrono::milliseconds NextTimeout() const;
 
 	private:
 		std::thread _thread {};
 		Signal _signal{};
+		Poller _poller{ _signal };
+		std::vector<uint64_t> _ready{};
+
+		// Readable while run by a sibling : scheduled once handed back.
+		std::vector<uint64_t> _deferred{};
 
 		// State handling
 		std::atomic<ActivityState> _activity {ActivityState::INACTIVE};
-		std::atomic<TransactionState> _state { TransactionState::INACTIVE };
-
-		// Transaction resources and settings
-		std::string _clientHost {""};
-		uint16_t _clientTid {0};
-		uint16_t _serverTid{ 0 };
-		uint16_t _lastAck {0};
 
-		OpCode _currentOperation { OpCode::UNDEF };
-		bool _asciiMode {false};
+		// Placement
+		const uint32_t _cpu;
+		const uint32_t _node;
 
-		std::filesystem::path _filePath {""};
-		bool _fileLocked {false};
-		std::unique_ptr<FileWriter> _fw;
-		std::unique_ptr<FileReader> _fr;
+		// Dispatch thread -> worker thread hand-off
+		const size_t _capacity;
+		std::atomic<size_t> _load{ 0 };
+		RingBuffer<Assignment> _assignments;
 
-		std::shared_ptr<UdpSocketWindows> _socket{nullptr};
+		// Transactions, indexed by their poller token.
+		std::vector<std::unique_ptr<Transaction>> _transactions;
+		Allocator _frames;
 
-		// General settings
-		uint32_t _retries {3};
-		std::chrono::milliseconds _transactionTimeout {1000};
-		uint16_t _dataBlockSize {512};
+		// Ready continuations. Home worker pushes, anyone runs.
+		WorkStealingDeque<Transaction*> _runQueue;
+		std::atomic<bool> _idle{ false };
 
-		// 
+		//
 		Server &_parent;
-		std::unique_ptr<tftplib::HaloBuffer> _fileBuffer;
-		std::weak_ptr<DatagramFactory> _factory;
+		Executor &_executor;
+		DatagramFactory& _factory;		// Owned by the Server, outlives us
 	};
 }
-
-namespace tftplib {
-	template<typename T, typename... Args>
-	std::shared_ptr<Datagram>
-	ServerWorker::MakeMessageDatagram(std::weak_ptr<DatagramFactory>& factoryHandle,
-		Args... args)
-	{
-		auto factory = factoryHandle.lock();
-		if (!factory) return nullptr;
-
-		auto assembly = factory->StartAssembly()
-			.SetDestinationAddress(_clientHost)
-			.SetDestinationPort(_clientTid);
-
-		T* message = T::create(args...,
-			[&assembly](size_t sz) {
-				assembly.SetDataSize(static_cast<uint16_t>(sz));
-				return assembly.GetDataBuffer();
-			});
-
-		if (message == nullptr)
-		{
-			return nullptr;
-		}
-
-		return assembly.Finalize();
-	}
-}
-
@@ -0,0 +1,225 @@
+﻿#include "pch.h"
+#include "SharedFileStream.h"
+#include "File.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cstring>
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * SharedFileStream::Reader
+	 * *********************************************************************/
+	SharedFileStream::Reader::Reader(std::shared_ptr<SharedFileStream> stream,
+		size_t slot)
+		: _stream{ std::move(stream) }
+		, _slot{ slot }
+	{
+	}
+
+	SharedFileStream::Reader::~Reader()
+	{
+		_stream->Detach(_slot);
+	}
+
+	size_t SharedFileStream::Reader::ReadBlock(uint8_t* buffer, size_t bufferSize)
+	{
+		size_t copied = 0;
+		while (copied < bufferSize)
+		{
+			uint64_t index = _offset / ChunkSize;
+			if (!_chunk || index != _chunkIndex)
+			{
+				_chunk = _stream->ChunkAt(_slot, index);
+				_chunkIndex = index;
+				if (!_chunk)
+				{
+					// Even mid block : a short block would end the file.
+					return static_cast<size_t>(-1);
+				}
+			}
+
+			size_t within = static_cast<size_t>(_offset % ChunkSize);
+			if (within >= _chunk->size())
+			{
+				break;
+			}
+
+			size_t count = std::min<size_t>(bufferSize - copied,
+				_chunk->size() - within);
+			memcpy(buffer + copied, _chunk->data() + within, count);
+			copied += count;
+			_offset += count;
+
+			// A short chunk is the last one.
+			if (_chunk->size() < ChunkSize)
+			{
+				break;
+			}
+		}
+
+		return copied;
+	}
+
+	/* *********************************************************************
+	 * SharedFileStream
+	 * *********************************************************************/
+	SharedFileStream::SharedFileStream(std::unique_ptr<File> file,
+		uint64_t size,
+		std::filesystem::file_time_type modified,
+		Metrics& metrics)
+		: _file{ std::move(file) }
+		, _size{ size }
+		, _modified{ modified }
+		, _metrics{ metrics }
+	{
+	}
+
+	SharedFileStream::~SharedFileStream()
+	{
+		_metrics.Add(Gauge::STREAM_BYTES_CACHED,
+			-static_cast<int64_t>(_cachedBytes));
+	}
+
+	bool SharedFileStream::Matches(uint64_t size,
+		std::filesystem::file_time_type modified) const
+	{
+		return _size == size && _modified == modified;
+	}
+
+	std::unique_ptr<SharedFileStream::Reader> SharedFileStream::Attach()
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		auto it = std::find(_positions.begin(), _positions.end(), Detached);
+		size_t slot = it - _positions.begin();
+		if (it == _positions.end())
+		{
+			_positions.push_back(0);
+		}
+		else
+		{
+			*it = 0;
+		}
+
+		return std::make_unique<Reader>(shared_from_this(), slot);
+	}
+
+	void SharedFileStream::Detach(size_t slot)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+		_positions[slot] = Detached;
+		Trim();
+	}
+
+	std::shared_ptr<const SharedFileStream::Chunk>
+	SharedFileStream::ChunkAt(size_t slot, uint64_t index)
+	{
+		std::unique_lock<std::mutex> lock{ _lock };
+		_positions[slot] = index;
+
+		auto it = _chunks.find(index);
+		if (it != _chunks.end())
+		{
+			std::shared_ptr<const Chunk> chunk = it->second;
+			_metrics.Add(Counter::STREAM_CHUNKS_SHARED);
+			Trim();
+			return chunk;
+		}
+
+		// Being read : wait for it rather than reading it too.
+		auto pending = _loading.find(index);
+		if (pending != _loading.end())
+		{
+			std::shared_ptr<Loading> loading = pending->second;
+			_loaded.wait(lock, [&loading] { return loading->done; });
+			if (loading->chunk)
+			{
+				_metrics.Add(Counter::STREAM_CHUNKS_SHARED);
+			}
+			return loading->chunk;
+		}
+
+		auto loading = std::make_shared<Loading>();
+		_loading.emplace(index, loading);
+		lock.unlock();
+
+		auto chunk = std::make_shared<Chunk>(ChunkSize);
+		size_t read = _file->ReadAt(index * ChunkSize, chunk->data(), ChunkSize);
+
+		lock.lock();
+		_loading.erase(index);
+		loading->done = true;
+		if (read <= ChunkSize)
+		{
+			chunk->resize(read);
+			loading->chunk = chunk;
+			_chunks.emplace(index, chunk);
+			_cachedBytes += read;
+			_metrics.Add(Counter::STREAM_CHUNKS_READ);
+			_metrics.Add(Gauge::STREAM_BYTES_CACHED, static_cast<int64_t>(read));
+			Trim();
+		}
+
+		_loaded.notify_all();
+		return loading->chunk;
+	}
+
+	// Lock held. Readers keep the chunk they're in : dropping it here
+	// only stops sharing it.
+	void SharedFileStream::Trim()
+	{
+		uint64_t slowest = *std::min_element(_positions.begin(), _positions.end());
+
+		int64_t dropped = 0;
+		while (!_chunks.empty()
+			&& (_chunks.begin()->first < slowest || _chunks.size() > MaxChunks))
+		{
+			dropped += _chunks.begin()->second->size();
+			_chunks.erase(_chunks.begin());
+		}
+
+		if (dropped != 0)
+		{
+			_cachedBytes -= dropped;
+			_metrics.Add(Gauge::STREAM_BYTES_CACHED, -dropped);
+		}
+	}
+
+	/* *********************************************************************
+	 * SharedFileStreams
+	 * *********************************************************************/
+	SharedFileStreams::SharedFileStreams(Metrics& metrics)
+		: _metrics{ metrics }
+	{
+	}
+
+	std::unique_ptr<SharedFileStream::Reader>
+	SharedFileStreams::Open(const std::filesystem::path& file,
+		uint64_t size,
+		std::filesystem::file_time_type modified)
+	{
+		std::lock_guard<std::mutex> lock{ _lock };
+
+		std::shared_ptr<SharedFileStream> stream = _streams[file].lock();
+		if (stream == nullptr || !stream->Matches(size, modified))
+		{
+			// Readers of an older stream keep it : it goes with them.
+			std::unique_ptr<File> handle{ File::Open(file, File::OpenForRead) };
+			if (!handle)
+			{
+				_streams.erase(file);
+				return nullptr;
+			}
+
+			stream = std::make_shared<SharedFileStream>(std::move(handle),
+				size, modified, _metrics);
+			_streams[file] = stream;
+
+			std::erase_if(_streams, [](const auto& entry) {
+				return entry.second.expired();
+			});
+		}
+
+		return stream->Attach();
+	}
+}
@@ -0,0 +1,131 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tftplib {
+
+	class File;
+	class Metrics;
+
+	// **********************************************************************
+	// One read of a file, shared by every unicast transfer of it.
+	//	The file is read in chunks, each once, into buffers the readers
+	//	share. Every reader goes at its own pace ; a chunk is dropped once
+	//	the slowest reader is past it, or when too many are cached.
+	//
+	//	A late reader starts over from the first chunk : it reads again
+	//	what was dropped and holds everything ahead of it, what faster
+	//	readers already read, until it gets there.
+	//
+	//	Readers run on any worker : the stream is behind a lock, taken
+	//	once per chunk. The file is read out of the lock ; only readers
+	//	wanting the chunk being read wait for it.
+	// **********************************************************************
+	class SharedFileStream : public std::enable_shared_from_this<SharedFileStream>
+	{
+	public:
+		static constexpr size_t ChunkSize = 0x10000;
+
+		// Beyond this, the oldest chunks go even if a reader still
+		// needs them : it reads them again.
+		static constexpr size_t MaxChunks = 64;
+
+		using Chunk = std::vector<uint8_t>;
+
+		// Sequential reader, for one transfer.
+		class Reader
+		{
+		public:
+			Reader(std::shared_ptr<SharedFileStream> stream, size_t slot);
+			~Reader();
+
+			Reader(const Reader&) = delete;
+			Reader& operator=(const Reader&) = delete;
+
+			// Same contract as FileReader::ReadBlock : short at the end
+			// of the file, -1 when the file can't be read.
+			size_t ReadBlock(uint8_t* buffer, size_t bufferSize);
+
+		private:
+			std::shared_ptr<SharedFileStream> _stream;
+			const size_t _slot;
+			uint64_t _offset{ 0 };
+
+			// Copied from without the lock.
+			std::shared_ptr<const Chunk> _chunk{ nullptr };
+			uint64_t _chunkIndex{ 0 };
+		};
+
+	public:
+		SharedFileStream(std::unique_ptr<File> file,
+			uint64_t size,
+			std::filesystem::file_time_type modified,
+			Metrics& metrics);
+		~SharedFileStream();
+
+		SharedFileStream(const SharedFileStream&) = delete;
+		SharedFileStream& operator=(const SharedFileStream&) = delete;
+
+		// Still the same file, not rewritten since it was opened.
+		bool Matches(uint64_t size, std::filesystem::file_time_type modified) const;
+
+		std::unique_ptr<Reader> Attach();
+
+	private:
+		std::shared_ptr<const Chunk> ChunkAt(size_t slot, uint64_t index);
+		void Detach(size_t slot);
+		void Trim();
+
+	private:
+		static constexpr uint64_t Detached = UINT64_MAX;
+
+		// A chunk being read. chunk stays nullptr if the read failed.
+		struct Loading {
+			std::shared_ptr<const Chunk> chunk{ nullptr };
+			bool done{ false };
+		};
+
+		std::unique_ptr<File> _file;
+		const uint64_t _size;
+		const std::filesystem::file_time_type _modified;
+		Metrics& _metrics;
+
+		std::mutex _lock;
+		std::map<uint64_t, std::shared_ptr<const Chunk>> _chunks{};
+		std::map<uint64_t, std::shared_ptr<Loading>> _loading{};
+		std::condition_variable _loaded{};
+		size_t _cachedBytes{ 0 };
+
+		// Chunk each reader is at, by slot.
+		std::vector<uint64_t> _positions{};
+	};
+
+	// **********************************************************************
+	// The shared streams of a server, one per file being read. A stream
+	//	lives as long as its readers.
+	// **********************************************************************
+	class SharedFileStreams
+	{
+	public:
+		SharedFileStreams(Metrics& metrics);
+
+		// Attach to the file's stream, opening it when there's none or
+		// the file changed. nullptr when the file can't be opened.
+		std::unique_ptr<SharedFileStream::Reader> Open(
+			const std::filesystem::path& file,
+			uint64_t size,
+			std::filesystem::file_time_type modified);
+
+	private:
+		Metrics& _metrics;
+
+		std::mutex _lock;
+		std::map<std::filesystem::path, std::weak_ptr<SharedFileStream>> _streams{};
+	};
+}
@@ -1,24 +1,233 @@
 ﻿#include "pch.h"
 #include "Signal.h"
+#include <stdexcept>
 
-void tftplib::Signal::EmitSignal()
-{
-	if (_mallet.try_acquire())
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * OS Specific class declaration
+	 * *********************************************************************/
+	class Signal::Os
 	{
-		_bell.release();
+	public:
+		Os();
+		~Os();
+
+		void Emit();
+		bool Wait(int64_t timeoutMs);
+		bool Consume();
+
+		NativeHandle Handle() const;
+
+	private:
+#if defined(_WIN32)
+		HANDLE _event{ nullptr };
+#else
+		int _fd{ -1 };
+#endif
+	};
+
+	/* *********************************************************************
+	 * OS Specific functions definition
+	 * *********************************************************************/
+#if defined(_WIN32)
+
+	Signal::Os::Os()
+	{
+		// Manual-reset : waiting doesn't consume the signal, so a Poller
+		// can report it and leave Consume() to reset it, like eventfd.
+		_event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		if (_event == nullptr)
+		{
+			throw std::runtime_error{ "Could not create signal event" };
+		}
 	}
-}
 
-bool tftplib::Signal::WaitForSignal()
-{
-	_bell.acquire();
-	_mallet.release();
-	return true;
-}
+	Signal::Os::~Os()
+	{
+		CloseHandle(_event);
+	}
+
+	void Signal::Os::Emit()
+	{
+		SetEvent(_event);
+	}
+
+	bool Signal::Os::Wait(int64_t timeoutMs)
+	{
+		DWORD timeout = timeoutMs < 0 ? INFINITE : static_cast<DWORD>(timeoutMs);
+		return WaitForSingleObject(_event, timeout) == WAIT_OBJECT_0 && Consume();
+	}
+
+	bool Signal::Os::Consume()
+	{
+		// Emissions racing the reset collapse into this wakeup : what they
+		// published is seen by the caller, which looks after consuming.
+		if (WaitForSingleObject(_event, 0) != WAIT_OBJECT_0)
+		{
+			return false;
+		}
+
+		ResetEvent(_event);
+		return true;
+	}
+
+	NativeHandle Signal::Os::Handle() const
+	{
+		return reinterpret_cast<NativeHandle>(_event);
+	}
+
+#else
+
+	Signal::Os::Os()
+	{
+		_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (_fd == -1)
+		{
+			throw std::runtime_error{ "Could not create signal eventfd" };
+		}
+	}
+
+	Signal::Os::~Os()
+	{
+		close(_fd);
+	}
 
-void tftplib::Signal::Reset()
-{
-	(void)_bell.try_acquire();
-	(void)_mallet.try_acquire();
-	_mallet.release();
+	void Signal::Os::Emit()
+	{
+		uint64_t one = 1;
+		(void)write(_fd, &one, sizeof(one));
+	}
+
+	bool Signal::Os::Wait(int64_t timeoutMs)
+	{
+		pollfd pfd{};
+		pfd.fd = _fd;
+		pfd.events = POLLIN;
+
+		int timeout = timeoutMs < 0 ? -1 : static_cast<int>(timeoutMs);
+		int result = 0;
+		do
+		{
+			result = poll(&pfd, 1, timeout);
+		} while (result == -1 && errno == EINTR);
+
+		return result > 0 && Consume();
+	}
+
+	bool Signal::Os::Consume()
+	{
+		// Reading resets the counter : emissions collapse into one wakeup.
+		uint64_t value = 0;
+		return read(_fd, &value, sizeof(value)) == sizeof(value);
+	}
+
+	NativeHandle Signal::Os::Handle() const
+	{
+		return static_cast<NativeHandle>(_fd);
+	}
+
+#endif
+
+	/* *********************************************************************
+	 * Signal functions definition
+	 * *********************************************************************/
+	static int64_t SteadyNowNs()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count();
+	}
+
+	Signal::Signal()
+		: _os{ std::make_unique<Signal::Os>() }
+	{
+	}
+
+	Signal::~Signal() {}
+
+	void Signal::EmitSignal()
+	{
+		int64_t none = 0;
+		_emittedAt.compare_exchange_strong(none, SteadyNowNs());
+
+		_os->Emit();
+	}
+
+	bool Signal::WaitForSignal()
+	{
+		return Wait(-1);
+	}
+
+	void Signal::Reset()
+	{
+		(void)_os->Consume();
+		_emittedAt = 0;
+	}
+
+	bool Signal::Consume()
+	{
+		if (!_os->Consume())
+		{
+			return false;
+		}
+
+		RecordWakeup();
+		return true;
+	}
+
+	NativeHandle Signal::GetNativeHandle() const
+	{
+		return _os->Handle();
+	}
+
+	Signal::WakeLatency Signal::GetWakeLatency() const
+	{
+		using ns = std::chrono::nanoseconds;
+
+		WakeLatency latency{};
+		latency.wakeups = _wakeups;
+		latency.last = ns{ _lastLatencyNs.load() };
+		latency.max = ns{ _maxLatencyNs.load() };
+		latency.total = ns{ _totalLatencyNs.load() };
+		return latency;
+	}
+
+	bool Signal::Wait(int64_t timeoutMs)
+	{
+		if (!_os->Wait(timeoutMs))
+		{
+			return false;
+		}
+
+		RecordWakeup();
+		return true;
+	}
+
+	void Signal::RecordWakeup()
+	{
+		int64_t emittedAt = _emittedAt.exchange(0);
+		if (emittedAt == 0)
+		{
+			return;
+		}
+
+		int64_t latency = SteadyNowNs() - emittedAt;
+		_wakeups.fetch_add(1, std::memory_order_relaxed);
+		_lastLatencyNs.store(latency, std::memory_order_relaxed);
+		_totalLatencyNs.fetch_add(latency, std::memory_order_relaxed);
+
+		int64_t max = _maxLatencyNs.load(std::memory_order_relaxed);
+		while (latency > max
+			&& !_maxLatencyNs.compare_exchange_weak(max, latency)) ;
+	}
 }
@@ -1,12 +1,40 @@
 ﻿#pragma once
 
-#include <semaphore>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <memory>
+#include "OsHandle.h"
 
 namespace tftplib {
+
+	// **********************************************************************
+	// Binary wakeup signal.
+	//	Multiple emissions before a wait collapse into a single wakeup.
+	//
+	//	Backed by a waitable OS object (eventfd on Linux, manual-reset event
+	//	on Windows) so the signal can be waited on alongside sockets
+	//	through a Poller.
+	// **********************************************************************
 	class Signal
 	{
+	private:
+		class Os;
+
+	public:
+		struct WakeLatency {
+			uint64_t wakeups{ 0 };
+			std::chrono::nanoseconds last{ 0 };
+			std::chrono::nanoseconds max{ 0 };
+			std::chrono::nanoseconds total{ 0 };
+		};
+
 	public:
+		Signal();
+		~Signal();
+		Signal(const Signal&) = delete;
+		Signal& operator=(const Signal&) = delete;
+
 		void EmitSignal();
 
 		bool WaitForSignal();
@@ -16,25 +44,38 @@ namespace tftplib {
 
 		void Reset();
 
+		// Consume a pending signal without blocking.
+		// To be called once a Poller reported the signal handle as ready.
+		bool Consume();
+
+		NativeHandle GetNativeHandle() const;
+
+		// Time elapsed between emission and the waiter consuming the signal.
+		WakeLatency GetWakeLatency() const;
+
+	private:
+		bool Wait(int64_t timeoutMs);
+		void RecordWakeup();
+
 	private:
-		std::binary_semaphore _bell{ 0 };
-		std::binary_semaphore _mallet{ 1 };
+		std::unique_ptr<Os> _os;
+
+		// Steady clock timestamp (ns) of the oldest pending emission.
+		std::atomic<int64_t> _emittedAt{ 0 };
+
+		std::atomic<uint64_t> _wakeups{ 0 };
+		std::atomic<int64_t> _lastLatencyNs{ 0 };
+		std::atomic<int64_t> _maxLatencyNs{ 0 };
+		std::atomic<int64_t> _totalLatencyNs{ 0 };
 	};
 }
 
 
 
 template< class Rep, class Period >
-bool 
+bool
 tftplib::Signal::WaitForSignal(const std::chrono::duration<Rep, Period>& rel_time)
 {
-	if (_bell.try_acquire_for(rel_time))
-	{
-		_mallet.release();
-		return true;
-	}
-	else
-	{
-		return false;
-	}
+	auto ms = std::chrono::ceil<std::chrono::milliseconds>(rel_time).count();
+	return Wait(ms < 0 ? 0 : static_cast<int64_t>(ms));
 }
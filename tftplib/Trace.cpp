@@ -0,0 +1,289 @@
+﻿#include "pch.h"
+#include "Trace.h"
+#include <algorithm>
+#include <iomanip>
+
+namespace tftplib {
+
+	static uint64_t NowNs()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(
+			steady_clock::now().time_since_epoch()).count();
+	}
+
+	static std::atomic<uint64_t> nextTracerId{ 1 };
+
+	/* *********************************************************************
+	 * TraceRing : single producer, single consumer.
+	 * *********************************************************************/
+	class TraceRing
+	{
+	public:
+		explicit TraceRing(uint16_t thread)
+			: _events{ new TraceEvent[Tracer::RingCapacity] }
+			, _thread{ thread }
+		{
+		}
+
+		uint16_t Thread() const { return _thread; }
+
+		// Producer
+		TraceEvent* Reserve()
+		{
+			uint64_t head = _head.load(std::memory_order_relaxed);
+			if (head - _tail.load(std::memory_order_acquire) >= Tracer::RingCapacity)
+			{
+				_dropped.store(_dropped.load(std::memory_order_relaxed) + 1,
+					std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			return &_events[head & (Tracer::RingCapacity - 1)];
+		}
+
+		void Commit()
+		{
+			_head.store(_head.load(std::memory_order_relaxed) + 1,
+				std::memory_order_release);
+		}
+
+		void Retire() { _retired.store(true, std::memory_order_release); }
+
+		// Consumer
+		template <typename F>
+		void Consume(F&& sink)
+		{
+			uint64_t tail = _tail.load(std::memory_order_relaxed);
+			uint64_t head = _head.load(std::memory_order_acquire);
+			for (; tail != head; ++tail)
+			{
+				sink(_events[tail & (Tracer::RingCapacity - 1)]);
+			}
+			_tail.store(tail, std::memory_order_release);
+		}
+
+		bool IsRetired() const { return _retired.load(std::memory_order_acquire); }
+		uint64_t Dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+	private:
+		std::unique_ptr<TraceEvent[]> _events;
+		const uint16_t _thread;
+
+		alignas(64) std::atomic<uint64_t> _head{ 0 };
+		std::atomic<uint64_t> _dropped{ 0 };
+		alignas(64) std::atomic<uint64_t> _tail{ 0 };
+		std::atomic<bool> _retired{ false };
+	};
+
+	static_assert((Tracer::RingCapacity & (Tracer::RingCapacity - 1)) == 0,
+		"Ring capacity must be a power of two");
+
+	// The calling thread's ring. Retired when the thread exits, so the
+	// drainer can release it once empty.
+	struct ThreadRing {
+		uint64_t tracer{ 0 };
+		std::shared_ptr<TraceRing> ring{};
+
+		~ThreadRing() {
+			if (ring) ring->Retire();
+		}
+	};
+
+	static thread_local ThreadRing threadRing{};
+
+	/* *********************************************************************
+	 * Tracer
+	 * *********************************************************************/
+	Tracer::Tracer()
+		: _id{ nextTracerId.fetch_add(1) }
+		, _origin{ NowNs() }
+	{
+	}
+
+	Tracer::~Tracer()
+	{
+		Stop();
+	}
+
+	void Tracer::Push(TraceId id, uint32_t transaction,
+		const TraceArg* args, size_t count)
+	{
+		TraceRing& ring = LocalRing();
+		TraceEvent* event = ring.Reserve();
+		if (event == nullptr)
+		{
+			return;
+		}
+
+		event->timestamp = NowNs();
+		event->id = id;
+		event->thread = ring.Thread();
+		event->transaction = transaction;
+		for (size_t i = 0; i < 4; i++)
+		{
+			event->args[i] = i < count ? args[i].value : 0;
+		}
+
+		ring.Commit();
+	}
+
+	TraceRing& Tracer::LocalRing()
+	{
+		if (threadRing.tracer == _id)
+		{
+			return *threadRing.ring;
+		}
+
+		// First event of this thread for this tracer.
+		std::lock_guard<std::mutex> lock{ _ringsLock };
+		if (threadRing.ring)
+		{
+			threadRing.ring->Retire();
+		}
+
+		threadRing.ring = std::make_shared<TraceRing>(_nextThread++);
+		threadRing.tracer = _id;
+		_rings.push_back(threadRing.ring);
+		return *threadRing.ring;
+	}
+
+	void Tracer::Start(std::ostream& out, std::ostream& err)
+	{
+		std::lock_guard<std::mutex> lock{ _drainLock };
+		if (_running)
+		{
+			return;
+		}
+
+		_out = &out;
+		_err = &err;
+		_running = true;
+		_drainer = std::thread(&Tracer::DrainerThread, this);
+	}
+
+	void Tracer::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ _drainLock };
+			if (!_running)
+			{
+				return;
+			}
+			_running = false;
+		}
+
+		_drainWake.notify_one();
+		_drainer.join();
+
+		// Whatever was emitted before Stop.
+		Drain();
+
+		uint64_t dropped = Dropped();
+		if (dropped > 0)
+		{
+			*_err << "[Trace] " << dropped << " events dropped" << std::endl;
+		}
+	}
+
+	uint64_t Tracer::Dropped() const
+	{
+		std::lock_guard<std::mutex> lock{ _ringsLock };
+
+		uint64_t dropped = _retiredDrops.load(std::memory_order_relaxed);
+		for (const auto& ring : _rings)
+		{
+			dropped += ring->Dropped();
+		}
+		return dropped;
+	}
+
+	void Tracer::DrainerThread()
+	{
+		std::unique_lock<std::mutex> lock{ _drainLock };
+		while (_running)
+		{
+			_drainWake.wait_for(lock, std::chrono::milliseconds{ 10 });
+
+			lock.unlock();
+			Drain();
+			lock.lock();
+		}
+	}
+
+	void Tracer::Drain()
+	{
+		_batch.clear();
+		{
+			std::lock_guard<std::mutex> lock{ _ringsLock };
+			for (size_t i = 0; i < _rings.size(); )
+			{
+				// Retired before consuming : nothing can follow, release it.
+				bool retired = _rings[i]->IsRetired();
+				_rings[i]->Consume([this](const TraceEvent& e) {
+					_batch.push_back(e);
+				});
+
+				if (retired)
+				{
+					_retiredDrops.fetch_add(_rings[i]->Dropped());
+					_rings.erase(_rings.begin() + i);
+				}
+				else
+				{
+					i++;
+				}
+			}
+		}
+
+		std::stable_sort(_batch.begin(), _batch.end(),
+			[](const TraceEvent& a, const TraceEvent& b) {
+				return a.timestamp < b.timestamp;
+			});
+
+		for (const TraceEvent& event : _batch)
+		{
+			Format(event);
+		}
+
+		if (!_batch.empty())
+		{
+			_out->flush();
+			_err->flush();
+		}
+	}
+
+	void Tracer::Format(const TraceEvent& event)
+	{
+		const TraceEventInfo& info = TraceEvents[size_t(event.id)];
+		std::ostream& os = info.level == TraceLevel::ERRORS ? *_err : *_out;
+
+		uint64_t elapsed = event.timestamp - _origin;
+		os << "[" << elapsed / 1000000000 << "."
+			<< std::setw(6) << std::setfill('0') << (elapsed / 1000) % 1000000
+			<< std::setfill(' ') << "] t" << event.thread << " ";
+
+		if (event.transaction != 0)
+		{
+			os << (event.transaction >> 16) << "/"
+				<< (event.transaction & 0xFFFF) << " ";
+		}
+
+		os << info.name;
+		for (size_t i = 0; i < 4 && info.args[i] != nullptr; i++)
+		{
+			os << " " << info.args[i] << "=";
+			if (info.strings & (1 << i))
+			{
+				const char* str = reinterpret_cast<const char*>(event.args[i]);
+				os << (str ? str : "");
+			}
+			else
+			{
+				os << event.args[i];
+			}
+		}
+
+		os << "\n";
+	}
+}
@@ -0,0 +1,195 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace tftplib {
+
+	enum class TraceLevel : uint8_t {
+		OFF,
+		ERRORS,						// Failures, formatted to the err stream
+		INFO,						// One per transfer or request
+		VERBOSE						// One per packet
+	};
+
+	enum class TraceId : uint16_t {
+		CONTROL_RECEIVED,
+		CONTROL_INVALID,
+		CONTROL_IGNORED,
+		CONTROL_NO_DATAGRAM,
+		REQUEST_RECEIVED,
+		REQUEST_REJECTED,
+		REQUEST_INVALID,
+		WORKER_INACTIVE,
+		WORKER_NO_SLOT,
+		TRANSFER_NO_FRAME,
+		TRANSFER_EXCEPTION,
+		TRANSFER_NOT_WATCHED,
+		RECV_NO_DATAGRAM,
+		DATA_RECEIVED,
+		DATA_INVALID,
+		UPLOAD_REFUSED,
+		ACK_SENT,
+		ACK_DUPLICATE,
+		FAST_RETRANSMIT,
+		MULTICAST_JOIN,
+		MULTICAST_MASTER,
+		CLIENT_ERROR,
+		TRANSFER_ABORTED,
+		TRANSFER_SHUT_DOWN,
+		TRANSFER_TERMINATED,
+		TRANSFER_STATS,
+
+		COUNT
+	};
+
+	// How the drainer formats an event. Bit i of strings set means
+	// args[i] is a static C string, an integer otherwise.
+	struct TraceEventInfo {
+		TraceLevel level;
+		const char* name;
+		const char* args[4];
+		uint8_t strings;
+	};
+
+	inline constexpr TraceEventInfo TraceEvents[] = {
+		{ TraceLevel::VERBOSE,	"control-received",	{ "op", "port" }, 0b01 },
+		{ TraceLevel::ERRORS,	"control-invalid",	{ "size" }, 0 },
+		{ TraceLevel::VERBOSE,	"control-ignored",	{ "op", "block" }, 0b01 },
+		{ TraceLevel::ERRORS,	"control-no-datagram", {}, 0 },
+		{ TraceLevel::INFO,		"request-received",	{ "op", "port" }, 0b01 },
+		{ TraceLevel::ERRORS,	"request-rejected",	{ "port", "reason" }, 0b10 },
+		{ TraceLevel::ERRORS,	"request-invalid",	{ "reason", "op" }, 0b11 },
+		{ TraceLevel::ERRORS,	"worker-inactive",	{}, 0 },
+		{ TraceLevel::ERRORS,	"worker-no-slot",	{}, 0 },
+		{ TraceLevel::ERRORS,	"transfer-no-frame", {}, 0 },
+		{ TraceLevel::ERRORS,	"transfer-exception", {}, 0 },
+		{ TraceLevel::ERRORS,	"transfer-not-watched", {}, 0 },
+		{ TraceLevel::ERRORS,	"recv-no-datagram",	{}, 0 },
+		{ TraceLevel::VERBOSE,	"data",				{ "block", "expected", "size", "payload" }, 0 },
+		{ TraceLevel::ERRORS,	"data-invalid",		{ "reason" }, 0b1 },
+		{ TraceLevel::INFO,		"upload-refused",	{ "size", "quota" }, 0 },
+		{ TraceLevel::VERBOSE,	"ack",				{ "block" }, 0 },
+		{ TraceLevel::VERBOSE,	"ack-duplicate",	{ "block", "last" }, 0 },
+		{ TraceLevel::INFO,		"fast-retransmit",	{ "block", "inflight" }, 0 },
+		{ TraceLevel::INFO,		"multicast-join",	{ "port", "members", "master" }, 0 },
+		{ TraceLevel::INFO,		"multicast-master",	{ "port", "members", "block" }, 0 },
+		{ TraceLevel::ERRORS,	"client-error",		{}, 0 },
+		{ TraceLevel::INFO,		"aborted",			{ "error" }, 0b1 },
+		{ TraceLevel::INFO,		"shut-down",		{}, 0 },
+		{ TraceLevel::INFO,		"terminated",		{}, 0 },
+		{ TraceLevel::INFO,		"transfer",			{ "bytes", "packets", "retransmits", "ms" }, 0 },
+	};
+
+	static_assert(std::size(TraceEvents) == size_t(TraceId::COUNT),
+		"TraceEvents must describe every TraceId");
+
+	// Fixed size binary event. Formatting is left to the drainer.
+	struct TraceEvent {
+		uint64_t timestamp{ 0 };		// steady clock, ns
+		TraceId id{ TraceId::COUNT };
+		uint16_t thread{ 0 };
+		uint32_t transaction{ 0 };		// client tid << 16 | server tid
+		uint64_t args[4]{};
+	};
+
+	// An event argument : any integer, or a string with static lifetime.
+	struct TraceArg {
+		uint64_t value;
+
+		template <std::integral T>
+		TraceArg(T v) : value{ static_cast<uint64_t>(v) } {}
+
+		TraceArg(const char* s) : value{ reinterpret_cast<uintptr_t>(s) } {}
+	};
+
+	class TraceRing;
+
+	// **********************************************************************
+	// Lock free binary tracing.
+	//	Each emitting thread gets its own single producer ring of
+	//	TraceEvents, registered on its first event. A background drainer
+	//	collects the rings, orders events by time and formats them to the
+	//	configured streams, off the hot path.
+	//
+	//	An event below the level costs one load and one branch. A full
+	//	ring drops events rather than block the emitting thread.
+	// **********************************************************************
+	class Tracer
+	{
+	public:
+		static constexpr size_t RingCapacity = 0x1000;	// Events per thread
+
+	public:
+		Tracer();
+		~Tracer();
+		Tracer(const Tracer&) = delete;
+		Tracer& operator=(const Tracer&) = delete;
+
+		void SetLevel(TraceLevel level) {
+			_level.store(level, std::memory_order_relaxed);
+		}
+
+		TraceLevel Level() const {
+			return _level.load(std::memory_order_relaxed);
+		}
+
+		template <typename... Args>
+		void Emit(TraceId id, uint32_t transaction, Args... args) {
+			static_assert(sizeof...(Args) <= 4, "At most 4 trace arguments");
+			if (TraceEvents[size_t(id)].level > Level()) {
+				return;
+			}
+
+			TraceArg values[] = { TraceArg{ 0 }, TraceArg{ args }... };
+			Push(id, transaction, values + 1, sizeof...(Args));
+		}
+
+		// Start formatting events to out, ERRORS ones to err.
+		void Start(std::ostream& out, std::ostream& err);
+
+		// Drain what's left and stop the drainer.
+		void Stop();
+
+		// Events lost to full rings.
+		uint64_t Dropped() const;
+
+	private:
+		void Push(TraceId id, uint32_t transaction,
+			const TraceArg* args, size_t count);
+
+		TraceRing& LocalRing();
+
+		void DrainerThread();
+		void Drain();
+		void Format(const TraceEvent& event);
+
+	private:
+		const uint64_t _id;
+		const uint64_t _origin;
+		std::atomic<TraceLevel> _level{ TraceLevel::INFO };
+
+		mutable std::mutex _ringsLock{};
+		std::vector<std::shared_ptr<TraceRing>> _rings{};
+		uint16_t _nextThread{ 0 };
+		std::atomic<uint64_t> _retiredDrops{ 0 };
+
+		std::ostream* _out{ nullptr };
+		std::ostream* _err{ nullptr };
+		std::vector<TraceEvent> _batch{};
+
+		std::thread _drainer{};
+		std::mutex _drainLock{};
+		std::condition_variable _drainWake{};
+		bool _running{ false };
+	};
+}
@@ -0,0 +1,1357 @@
+﻿#include "pch.h"
+#include "Transaction.h"
+#include "ServerWorker.h"
+#include "Server.h"
+
+namespace tftplib {
+
+	/* *********************************************************************
+	 * Awaitables
+	 * *********************************************************************/
+	void
+	Transaction::RecvAwaiter::await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		// Published to the home worker once the resumer returns.
+		_owner._awaiting = h;
+		_owner._deadline = _deadline;
+		_owner._wakeup = Wakeup::NONE;
+	}
+
+	Transaction::RecvResult
+	Transaction::RecvAwaiter::await_resume()
+	{
+		RecvResult result{};
+		result.wakeup = _owner._wakeup;
+
+		if (result.wakeup == Wakeup::TIMEOUT)
+		{
+			_owner._stats.timeouts++;
+			_owner._metrics.Add(Counter::TIMEOUTS);
+		}
+
+		if (result.wakeup != Wakeup::READABLE)
+		{
+			return result;
+		}
+
+		result.datagram = _owner._socket->Receive(_owner._factory);
+		if (!result.datagram)
+		{
+			_owner.Trace(TraceId::RECV_NO_DATAGRAM);
+		}
+		else
+		{
+			_owner.CountReceived(result.datagram->GetDataSize());
+		}
+
+		return result;
+	}
+
+	void
+	Transaction::ParkAwaiter::await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		_owner._awaiting = h;
+		_owner._deadline = _deadline;
+		_owner._wakeup = Wakeup::NONE;
+	}
+
+	Transaction::Wakeup
+	Transaction::ParkAwaiter::await_resume()
+	{
+		// The client doesn't know this port yet : whatever came is stray.
+		if (_owner._wakeup == Wakeup::READABLE)
+		{
+			_owner._socket->Receive(_owner._factory);
+		}
+
+		return _owner._wakeup;
+	}
+
+	size_t
+	Transaction::ReadBlockAwaiter::await_resume()
+	{
+		return _owner._reader->ReadBlock(_buffer, _size);
+	}
+
+	/* *********************************************************************
+	 * Transaction
+	 * *********************************************************************/
+	static constexpr auto LockRetryInterval = std::chrono::milliseconds{ 20 };
+
+	Transaction::Transaction(ServerWorker& worker,
+		Server& server,
+		DatagramFactory& factory,
+		DatagramRef request,
+		std::shared_ptr<UdpSocketWindows> socket)
+		: _worker{ worker }
+		, _parent{ server }
+		, _factory{ factory }
+		, _tracer{ server._tracer }
+		, _metrics{ server._metrics }
+		, _request{ request }
+		, _clientHost{ request->GetSourceAddress() }
+		, _clientAddress{ request->GetSourceSocketAddress() }
+		, _clientTid{ request->GetSourcePort() }
+		, _serverTid{ socket->GetLocalPort() }
+		, _writer{ nullptr }
+		, _reader{ nullptr }
+		, _socket{ socket }
+		, _transactionTimeout{ server._timeoutMs }
+	{
+		_stats.started = ReceivedAt(request);
+	}
+
+	Transaction::~Transaction()
+	{
+		// A master leaving hands over to the next member.
+		if (_session)
+		{
+			_parent._multicast.Leave(_session, this);
+		}
+	}
+
+	void Transaction::Start()
+	{
+		_transfer = Run();
+		if (!_transfer.IsValid())
+		{
+			Trace(TraceId::TRANSFER_NO_FRAME);
+			Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+		}
+		else if (_transfer.Failed() && !_terminated)
+		{
+			// Ran eagerly up to its first suspension : it may have thrown.
+			Trace(TraceId::TRANSFER_EXCEPTION);
+			Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+		}
+
+		Publish();
+	}
+
+	void Transaction::Refuse()
+	{
+		Trace(TraceId::TRANSFER_NOT_WATCHED);
+		Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+		Publish();
+	}
+
+	bool Transaction::IsDone() const
+	{
+		return _runState.load(std::memory_order_acquire) == RunState::DONE;
+	}
+
+	bool Transaction::IsWaiting() const
+	{
+		return _runState.load(std::memory_order_acquire) == RunState::WAITING;
+	}
+
+	void Transaction::Schedule(Wakeup reason)
+	{
+		_wakeup = reason;
+		_runState.store(RunState::QUEUED, std::memory_order_release);
+	}
+
+	void Transaction::RunScheduled()
+	{
+		_runState.store(RunState::RUNNING, std::memory_order_relaxed);
+
+		if (_awaiting)
+		{
+			auto handle = _awaiting;
+			_awaiting = nullptr;
+			handle.resume();
+		}
+
+		if (_transfer.Failed() && !_terminated)
+		{
+			Trace(TraceId::TRANSFER_EXCEPTION);
+			Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+		}
+
+		Publish();
+	}
+
+	void Transaction::Resume(Wakeup reason)
+	{
+		Schedule(reason);
+		RunScheduled();
+	}
+
+	void Transaction::Publish()
+	{
+		// Hand the transaction back to its home worker. Nothing may touch
+		// this object past the store when it becomes WAITING.
+		RunState state = _transfer.IsDone() ? RunState::DONE : RunState::WAITING;
+		ServerWorker& home = _worker;
+		bool stolen = !home.IsCurrentThread();
+		_runState.store(state, std::memory_order_release);
+
+		// Run by a sibling : home may be asleep past the new deadline, or
+		// holding a datagram for us.
+		if (stolen)
+		{
+			home.Wake();
+		}
+	}
+
+	Allocator& Transaction::FrameAllocator()
+	{
+		return _worker.FrameAllocator();
+	}
+
+	std::ostream& Transaction::Out()
+	{
+		return _parent.Out();
+	}
+
+	std::ostream& Transaction::Err()
+	{
+		return _parent.Err();
+	}
+
+	Transaction::RecvAwaiter
+	Transaction::Recv(Clock::time_point deadline)
+	{
+		return RecvAwaiter{ *this, deadline };
+	}
+
+	Transaction::ParkAwaiter
+	Transaction::Park(Clock::time_point deadline)
+	{
+		return ParkAwaiter{ *this, deadline };
+	}
+
+	Transaction::ReadBlockAwaiter
+	Transaction::ReadBlock(uint8_t* buffer, size_t size)
+	{
+		return ReadBlockAwaiter{ *this, buffer, size };
+	}
+
+	/* *********************************************************************
+	 * Transfer flow
+	 * *********************************************************************/
+	Transfer
+	Transaction::Run()
+	{
+		MessageErrorCategory error = ProcessRequestMessage();
+
+		// A file in use is waited for a while rather than refused : the
+		// transfer parks and tries again, its worker serving the others.
+		auto parkedUntil = Clock::now() + std::chrono::milliseconds{ _parent._lockWaitMs };
+		if (error == MessageErrorCategory::FILE_LOCKED && _parent._lockWaitMs > 0)
+		{
+			_metrics.Add(Counter::REQUESTS_PARKED);
+		}
+
+		while (error == MessageErrorCategory::FILE_LOCKED && Clock::now() < parkedUntil)
+		{
+			if (co_await Park(std::min(Clock::now() + LockRetryInterval, parkedUntil))
+				== Wakeup::SHUTDOWN)
+			{
+				ShutDown();
+				co_return;
+			}
+
+			error = ProcessRequestMessage();
+		}
+		_request = nullptr;
+		_writeTicket = nullptr;
+
+		if (error != MessageErrorCategory::NO_ERROR)
+		{
+			Abort(error);
+			co_return;
+		}
+
+		/* **************************************************************
+		 *  WRQ : ack every window of DATA blocks until the last one.
+		 *	The OACK, when options were granted, stands for ACK 0. On
+		 *	timeout the last reply is sent again.
+		 *  *************************************************************/
+		if (_currentOperation == OpCode::WRQ)
+		{
+			bool replied = _optionCount > 0 ? SendOptionAck() : Ack(0);
+			if (!replied)
+			{
+				Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+				co_return;
+			}
+			_stats.firstReply = Clock::now();
+
+			uint32_t attempt = 0;
+			while (!_terminated)
+			{
+				RecvResult rcv = co_await Recv(Clock::now() + _transactionTimeout);
+				if (rcv.wakeup == Wakeup::SHUTDOWN)
+				{
+					ShutDown();
+					co_return;
+				}
+
+				if (!rcv.datagram)
+				{
+					if (++attempt > _retries)
+					{
+						Abort(MessageErrorCategory::TIMEOUT);
+						co_return;
+					}
+
+					_stats.retransmits++;
+					_metrics.Add(Counter::RETRANSMITS);
+					SendMessage(_lastReply);
+					continue;
+				}
+
+				uint16_t lastBlock = _lastBlock;
+				error = ProcessDataMessage(rcv.datagram);
+				if (error != MessageErrorCategory::NO_ERROR)
+				{
+					Abort(error);
+					co_return;
+				}
+
+				if (_lastBlock != lastBlock)
+				{
+					attempt = 0;
+				}
+			}
+
+			co_return;
+		}
+
+		/* **************************************************************
+		 *  RRQ, multicast : the session sends DATA to the group. Members
+		 *	wait for their turn as master, only the master times out
+		 *	and its ACKs drive the session.
+		 *  *************************************************************/
+		if (_session)
+		{
+			if (!SendOptionAck())
+			{
+				Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+				co_return;
+			}
+			_stats.firstReply = Clock::now();
+
+			uint32_t attempt = 0;
+			while (!_terminated)
+			{
+				RecvResult rcv = co_await Recv(Clock::now() + _transactionTimeout);
+				if (rcv.wakeup == Wakeup::SHUTDOWN)
+				{
+					ShutDown();
+					co_return;
+				}
+
+				if (!rcv.datagram)
+				{
+					if (!_session->IsMaster(this))
+					{
+						attempt = 0;
+						continue;
+					}
+
+					if (++attempt > _retries)
+					{
+						Abort(MessageErrorCategory::TIMEOUT);
+						co_return;
+					}
+
+					_stats.retransmits++;
+					_metrics.Add(Counter::RETRANSMITS);
+					if (!_session->Resend(this))
+					{
+						SendMessage(_lastReply);
+					}
+					continue;
+				}
+
+				uint16_t acked = 0;
+				error = ProcessAckMessage(rcv.datagram, acked);
+				if (error != MessageErrorCategory::NO_ERROR)
+				{
+					Abort(error);
+					co_return;
+				}
+
+				switch (_session->OnAck(this, acked))
+				{
+					case MulticastSession::AckResult::IGNORED:
+						CountDuplicateAck(acked, false);
+						break;
+
+					case MulticastSession::AckResult::SENT:
+						attempt = 0;
+						break;
+
+					case MulticastSession::AckResult::COMPLETE:
+						_stats.fileBytes = _stats.fileSize;
+						TerminateTransaction();
+						break;
+
+					case MulticastSession::AckResult::FAILED:
+						Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+						co_return;
+				}
+			}
+
+			co_return;
+		}
+
+		/* **************************************************************
+		 *  RRQ : keep up to windowsize DATA blocks in flight.
+		 *	Only the timer resends the window. Duplicate and stale ACKs
+		 *	are counted and dropped : answering them is the Sorcerer's
+		 *	Apprentice, every delayed packet doubling the traffic from
+		 *	then on. In windowed mode, fast retransmit may resend the
+		 *	window after K duplicates of the same ACK.
+		 *  *************************************************************/
+		if (_optionCount > 0)
+		{
+			// The client confirms the OACK with ACK 0.
+			if (!SendOptionAck())
+			{
+				Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+				co_return;
+			}
+			_stats.firstReply = Clock::now();
+
+			uint32_t attempt = 0;
+			auto deadline = Clock::now() + _transactionTimeout;
+			while (true)
+			{
+				RecvResult rcv = co_await Recv(deadline);
+				if (rcv.wakeup == Wakeup::SHUTDOWN)
+				{
+					ShutDown();
+					co_return;
+				}
+
+				if (!rcv.datagram)
+				{
+					if (++attempt > _retries)
+					{
+						Abort(MessageErrorCategory::TIMEOUT);
+						co_return;
+					}
+
+					_stats.retransmits++;
+					_metrics.Add(Counter::RETRANSMITS);
+					SendMessage(_lastReply);
+					deadline = Clock::now() + _transactionTimeout;
+					continue;
+				}
+
+				uint16_t acked = 0;
+				error = ProcessAckMessage(rcv.datagram, acked);
+				if (error != MessageErrorCategory::NO_ERROR)
+				{
+					Abort(error);
+					co_return;
+				}
+
+				if (acked == 0)
+				{
+					break;
+				}
+
+				CountDuplicateAck(acked, false);
+			}
+		}
+
+		WindowSlot window[defaults::MaxWindowSize];
+		size_t head = 0;					// Slot of block _lastAck + 1
+		uint16_t inFlight = 0;
+		bool lastRead = false;
+		uint32_t attempt = 0;
+		uint32_t duplicates = 0;
+		auto deadline = Clock::now() + _transactionTimeout;
+
+		while (!_terminated)
+		{
+			// Top the window up with new blocks.
+			while (!lastRead && inFlight < _windowSize)
+			{
+				uint16_t block = static_cast<uint16_t>(_lastAck + inFlight + 1);
+
+				DatagramRef datagram =
+					MakeMessageDatagram<MessageData>(block, _dataBlockSize);
+				if (!datagram)
+				{
+					Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+					co_return;
+				}
+
+				MessageData* message = (MessageData*)datagram->GetDataBuffer();
+				size_t read = co_await ReadBlock(
+					(uint8_t*)message->getDataBuffer(), _dataBlockSize);
+				if (read > _dataBlockSize)
+				{
+					// The file can't be read, or made, any further.
+					Abort(MessageErrorCategory::CRITICAL_SERVER_ERROR);
+					co_return;
+				}
+
+				datagram->SetDataSize((uint16_t)read + MessageData::HeaderSize());
+				lastRead = read < _dataBlockSize;
+
+				auto sentAt = Clock::now();
+				if (inFlight == 0)
+				{
+					deadline = sentAt + _transactionTimeout;
+				}
+				if (_stats.firstReply == Clock::time_point{})
+				{
+					_stats.firstReply = sentAt;
+				}
+
+				window[(head + inFlight) % _windowSize] =
+					WindowSlot{ datagram, sentAt, read, false };
+				inFlight++;
+				SendMessage(datagram);
+			}
+
+			RecvResult rcv = co_await Recv(deadline);
+			if (rcv.wakeup == Wakeup::SHUTDOWN)
+			{
+				ShutDown();
+				co_return;
+			}
+
+			if (!rcv.datagram)
+			{
+				if (++attempt > _retries)
+				{
+					Abort(MessageErrorCategory::TIMEOUT);
+					co_return;
+				}
+
+				RetransmitWindow(window, head, inFlight);
+				duplicates = 0;
+				deadline = Clock::now() + _transactionTimeout;
+				continue;
+			}
+
+			uint16_t acked = 0;
+			error = ProcessAckMessage(rcv.datagram, acked);
+			if (error != MessageErrorCategory::NO_ERROR)
+			{
+				Abort(error);
+				co_return;
+			}
+
+			uint16_t advance = static_cast<uint16_t>(acked - _lastAck);
+			if (advance == 0 || advance > inFlight)
+			{
+				// The deadline stays : only progress pushes it back.
+				bool fast = advance == 0
+					&& _windowSize > 1
+					&& _fastRetransmitAcks != 0
+					&& ++duplicates == _fastRetransmitAcks;
+
+				CountDuplicateAck(acked, fast);
+				if (fast)
+				{
+					Trace(TraceId::FAST_RETRANSMIT, _lastAck + 1, inFlight);
+					RetransmitWindow(window, head, inFlight);
+				}
+				continue;
+			}
+
+			// Blocks up to acked are delivered.
+			auto ackedAt = ReceivedAt(rcv.datagram);
+			for (uint16_t i = 0; i < advance; i++)
+			{
+				WindowSlot& slot = window[head];
+				uint16_t block = static_cast<uint16_t>(_lastAck + i + 1);
+				if (block == 1 && _stats.fileBytes == 0)
+				{
+					_stats.firstByte = ackedAt;
+				}
+
+				// A retransmitted block's ACK may answer either copy.
+				if (i + 1 == advance && !slot.retransmitted)
+				{
+					_metrics.Record(Timing::BLOCK_RTT, TransferSizeClass(),
+						std::chrono::duration_cast<std::chrono::microseconds>(
+							ackedAt - slot.sentAt));
+				}
+
+				_stats.fileBytes += slot.size;
+				_metrics.Add(Counter::FILE_BYTES_SENT, slot.size);
+
+				slot = WindowSlot{};
+				head = (head + 1) % _windowSize;
+			}
+
+			_lastAck = acked;
+			inFlight -= advance;
+			attempt = 0;
+			duplicates = 0;
+			deadline = Clock::now() + _transactionTimeout;
+
+			if (lastRead && inFlight == 0)
+			{
+				TerminateTransaction();
+			}
+		}
+	}
+
+	void
+	Transaction::RetransmitWindow(WindowSlot* window, size_t head,
+		uint16_t inFlight)
+	{
+		for (uint16_t i = 0; i < inFlight; i++)
+		{
+			WindowSlot& slot = window[(head + i) % _windowSize];
+			slot.retransmitted = true;
+
+			_stats.retransmits++;
+			_metrics.Add(Counter::RETRANSMITS);
+			SendMessage(slot.datagram);
+		}
+	}
+
+	void
+	Transaction::CountDuplicateAck(uint16_t block, bool retransmitted)
+	{
+		Trace(TraceId::ACK_DUPLICATE, block, _lastAck);
+
+		_stats.duplicateAcks++;
+		_metrics.Add(Counter::DUPLICATE_ACKS);
+		if (retransmitted)
+		{
+			_stats.fastRetransmits++;
+			_metrics.Add(Counter::FAST_RETRANSMITS);
+		}
+		else
+		{
+			_metrics.Add(Counter::RETRANSMITS_AVOIDED);
+		}
+	}
+
+	/* *********************************************************************
+	 * Message processing
+	 * *********************************************************************/
+	Transaction::MessageErrorCategory
+	Transaction::ProcessAckMessage(const DatagramRef& dataMessage,
+		uint16_t& block)
+	{
+		if (dataMessage->GetDataSize() < sizeof(OpCode))
+		{
+			return MessageErrorCategory::INVALID_MESSAGE_FORMAT;
+		}
+
+		OpCode *opcode = (OpCode*)dataMessage->GetData();
+		switch (*opcode)
+		{
+			case OpCode::ACK:
+				// Happy path.
+				break;
+
+			case OpCode::ERROR:
+				Trace(TraceId::CLIENT_ERROR);
+				return ProcessErrorMessage(dataMessage);
+
+			default:
+				return MessageErrorCategory::INVALID_OPCODE;
+		}
+
+		if (dataMessage->GetDataSize() < sizeof(MessageAck))
+		{
+			return MessageErrorCategory::INVALID_MESSAGE_FORMAT;
+		}
+
+		// Whether it moves the window is up to the caller.
+		MessageAck* msg = (MessageAck*)dataMessage->GetData();
+		block = msg->getBlockNumber();
+		return MessageErrorCategory::NO_ERROR;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessErrorMessage(const DatagramRef& errMessage)
+	{
+
+		return MessageErrorCategory::CLIENT_ERROR;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessRequestMessage()
+	{
+		MessageErrorCategory error = MessageErrorCategory::NO_ERROR;
+
+		/* **************************************************************
+		 *  Initial message and state validation
+		 *  *************************************************************/
+
+		// Validate message size
+		if (error == MessageErrorCategory::NO_ERROR
+			&& _request->GetDataSize() < (sizeof(OpCode) + 2))
+		{
+			Trace(TraceId::REQUEST_INVALID, "size", "");
+			error = MessageErrorCategory::INVALID_MESSAGE_SIZE;
+		}
+
+		// Validate operation is actually a request
+		const char* data = _request->GetData();
+		OpCode requestType = *((OpCode*)data);
+
+		if (error == MessageErrorCategory::NO_ERROR
+			&& requestType != OpCode::RRQ
+			&& requestType != OpCode::WRQ)
+		{
+			Trace(TraceId::REQUEST_INVALID, "opcode", OpCodeToStr(requestType));
+			error = MessageErrorCategory::INVALID_OPCODE;
+		}
+
+		/* **************************************************************
+		 *  Validate and handle request
+		 *  *************************************************************/
+		const MessageRequest* rwrq = ((MessageRequest*)data);
+		if (error == MessageErrorCategory::NO_ERROR
+			&& !rwrq->Validate(_request->GetDataSize()))
+		{
+			error = MessageErrorCategory::INVALID_MESSAGE_FORMAT;
+		}
+
+		if (error == MessageErrorCategory::NO_ERROR)
+		{
+			error = ProcessRequestMessage(rwrq);
+		}
+
+		if (error == MessageErrorCategory::NO_ERROR)
+		{
+			error = ProcessRequestOptions(rwrq, _request->GetDataSize());
+		}
+
+		return error;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessRequestOptions(const MessageRequest* rwrq,
+		uint16_t messageSz)
+	{
+		_uploadLimit = _parent._uploadQuota;
+		_fastRetransmitAcks = _parent._fastRetransmitAcks;
+
+		RequestOption requested[8];
+		size_t count = rwrq->getOptionsS(messageSz, requested, std::size(requested));
+		bool multicast = false;
+
+		// Unknown and unusable options are left out of the OACK.
+		for (size_t i = 0; i < count; i++)
+		{
+			const RequestOption& option = requested[i];
+			char* end = nullptr;
+			unsigned long long value = strtoull(option.value, &end, 10);
+			if (end == option.value || *end != '\0')
+			{
+				continue;
+			}
+
+			if (options::Matches(option.name, options::WindowSize)
+				&& value >= 1 && value <= 65535)
+			{
+				_windowSize = static_cast<uint16_t>(
+					std::min<unsigned long long>(value, _parent._maxWindowSize));
+				AcknowledgeOption(options::WindowSize, _windowSize);
+			}
+			else if (options::Matches(option.name, options::Timeout)
+				&& value >= 1 && value <= 255)
+			{
+				_transactionTimeout = std::chrono::seconds{ value };
+				AcknowledgeOption(options::Timeout, value);
+			}
+			else if (options::Matches(option.name, options::Multicast))
+			{
+				multicast = true;
+			}
+			else if (options::Matches(option.name, options::TransferSize))
+			{
+				MessageErrorCategory error = ProcessTransferSize(value);
+				if (error != MessageErrorCategory::NO_ERROR)
+				{
+					return error;
+				}
+			}
+		}
+
+		if (multicast)
+		{
+			JoinMulticast();
+		}
+
+		return MessageErrorCategory::NO_ERROR;
+	}
+
+	bool
+	Transaction::JoinMulticast()
+	{
+		// Block numbers don't wrap in a multicast session.
+		uint64_t blocks = _stats.fileSize / _dataBlockSize + 1;
+		if (_currentOperation != OpCode::RRQ
+			|| _asciiMode
+			|| !_fileSizeKnown
+			|| !_parent._multicast.IsEnabled()
+			|| blocks > 0xFFFF)
+		{
+			return false;
+		}
+
+		MulticastSession::Member member{ this, _socket, _clientAddress, TraceTid() };
+		bool master = false;
+		_session = _parent._multicast.Join(_fileName, _stats.fileSize,
+			_dataBlockSize, member, master);
+		if (!_session)
+		{
+			return false;
+		}
+
+		snprintf(_multicastOption, sizeof(_multicastOption), "%s,%d",
+			_session->Group().c_str(), master ? 1 : 0);
+		AcknowledgeOption(options::Multicast, 0, _multicastOption);
+
+		// Lock-step, from the session's reader : ours can go.
+		_windowSize = 1;
+		for (uint8_t i = 0; i < _optionCount; i++)
+		{
+			if (_options[i].name == options::WindowSize)
+			{
+				_options[i] = _options[--_optionCount];
+				break;
+			}
+		}
+
+		_reader = nullptr;
+		return true;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessTransferSize(uint64_t declared)
+	{
+		// RRQ : the client sends 0 and learns the size of the file, if
+		// we know it before sending it.
+		if (_currentOperation == OpCode::RRQ)
+		{
+			if (_fileSizeKnown)
+			{
+				AcknowledgeOption(options::TransferSize, _stats.fileSize);
+			}
+			return MessageErrorCategory::NO_ERROR;
+		}
+
+		// WRQ : refuse what won't fit, then reserve it in one piece.
+		if ((_uploadLimit != 0 && declared > _uploadLimit)
+			|| (declared > 0 && !_writer->Preallocate(declared)))
+		{
+			Trace(TraceId::UPLOAD_REFUSED, declared, _uploadLimit);
+			return MessageErrorCategory::DISK_FULL;
+		}
+
+		AcknowledgeOption(options::TransferSize, declared);
+		return MessageErrorCategory::NO_ERROR;
+	}
+
+	void
+	Transaction::AcknowledgeOption(const char* name, uint64_t value,
+		const char* text)
+	{
+		for (uint8_t i = 0; i < _optionCount; i++)
+		{
+			if (_options[i].name == name)
+			{
+				_options[i] = OptionValue{ name, value, text };
+				return;
+			}
+		}
+
+		if (_optionCount < std::size(_options))
+		{
+			_options[_optionCount++] = OptionValue{ name, value, text };
+		}
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessRequestMessage(const MessageRequest* rwrq)
+	{
+		MessageErrorCategory error = MessageErrorCategory::NO_ERROR;
+
+		/* **************************************************************
+		 *  Mode Setup and validation
+		 *  *************************************************************/
+		if (rwrq->getMode() == mode::Mode::MAIL)
+		{
+			return MessageErrorCategory::INVALID_MODE;
+		}
+
+		OpCode operation = rwrq->getMessageCode();
+		_asciiMode = rwrq->getMode() == mode::Mode::NETASCII;
+		_fileName = rwrq->getFilename();
+
+		/* **************************************************************
+		 *  Open the file : the file system checks the name and locks
+		 *  the file for as long as we hold the reader or writer.
+		 *  *************************************************************/
+		VirtualFileSystem& files = _parent._files;
+		FileSecurityHandler::ValidationResult result;
+		if (operation == OpCode::WRQ)
+		{
+			// Parked, the upload waits in line : later downloads of the
+			// file are held back until it has it.
+			result = _writeTicket
+				? _writeTicket->TryOpen(_asciiMode, _writer)
+				: files.OpenWriter(_fileName, _asciiMode, _writer);
+			if (result == FileSecurityHandler::ValidationResult::INVALID_FILE_LOCKED
+				&& !_writeTicket && _parent._lockWaitMs > 0)
+			{
+				_writeTicket = files.QueueWriter(_fileName);
+			}
+		}
+		else
+		{
+			// Size class of the transfer timings, and tsize.
+			VfsStat stat{};
+			result = files.OpenReader(_fileName, _asciiMode, stat, _reader);
+			_stats.fileSize = stat.size;
+			_fileSizeKnown = stat.sizeKnown;
+		}
+
+		error = FileSecurityErrorToMessageError(result);
+		if (error != MessageErrorCategory::NO_ERROR)
+		{
+			return error;
+		}
+
+		_currentOperation = operation;
+		return MessageErrorCategory::NO_ERROR;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::ProcessDataMessage(
+			const DatagramRef& datagram)
+	{
+		/* ***************************************************
+		 *  Validation of message and opcode
+		 * ***************************************************/
+
+		// msg size
+		if (datagram->GetDataSize() < MessageData::HeaderSize())
+		{
+			Trace(TraceId::DATA_INVALID, "size");
+			return MessageErrorCategory::INVALID_MESSAGE_SIZE;
+		}
+
+		// opcode
+		OpCode* opCode = (OpCode*)datagram->GetData();
+		if ( *opCode == OpCode::ERROR) {
+			Trace(TraceId::CLIENT_ERROR);
+			return MessageErrorCategory::CLIENT_ERROR;
+		}
+
+		if (*opCode != OpCode::DATA) {
+			Trace(TraceId::DATA_INVALID, "opcode");
+			return MessageErrorCategory::INVALID_OPCODE;
+		}
+
+		MessageData *msg = (MessageData * )datagram->GetData();
+		uint16_t dataSize = datagram->GetDataSize() - msg->HeaderSize();
+		bool isLastMessage = dataSize != _dataBlockSize;
+		uint16_t expectedBlock = static_cast<uint16_t>(_lastBlock + 1);
+
+		Trace(TraceId::DATA_RECEIVED, msg->getBlockNumber(), expectedBlock,
+			datagram->GetDataSize(), dataSize);
+
+		// block number
+		if (msg->getBlockNumber() != expectedBlock)
+		{
+			// A duplicate, or a block past a gap : tell the sender where
+			// we stand, once until the next block in order (RFC 7440).
+			if (!_gapAcked)
+			{
+				_gapAcked = _windowSize > 1;
+				Ack(_lastBlock);
+			}
+			return MessageErrorCategory::NO_ERROR;
+		}
+
+		/* ***************************************************
+		 *  Process the message
+		 * ***************************************************/
+
+		// Uploads that did not declare their size hit the quota here.
+		if (_uploadLimit != 0 && _stats.fileBytes + dataSize > _uploadLimit)
+		{
+			Trace(TraceId::UPLOAD_REFUSED, _stats.fileBytes + dataSize, _uploadLimit);
+			return MessageErrorCategory::DISK_FULL;
+		}
+
+		_writer->WriteBlock( (uint8_t*)msg->getData(), dataSize);
+		if (expectedBlock == 1 && _stats.fileBytes == 0)
+		{
+			_stats.firstByte = ReceivedAt(datagram);
+		}
+		_stats.fileBytes += dataSize;
+		_metrics.Add(Counter::FILE_BYTES_RECEIVED, dataSize);
+
+		_lastBlock = expectedBlock;
+		_gapAcked = false;
+		if (isLastMessage
+			|| static_cast<uint16_t>(_lastBlock - _lastAck) >= _windowSize)
+		{
+			Ack(_lastBlock);
+		}
+
+		if (isLastMessage)
+		{
+			_writer->Commit();
+			TerminateTransaction();
+		}
+
+		return MessageErrorCategory::NO_ERROR;
+	}
+
+	/* *********************************************************************
+	 * General state and message handling
+	 * *********************************************************************/
+	bool
+	Transaction::Ack(uint16_t ack)
+	{
+		Trace(TraceId::ACK_SENT, ack);
+
+		DatagramRef datagram =
+			MakeMessageDatagram<MessageAck>(ack);
+
+		bool result = SendMessage(datagram);
+		if (result)
+		{
+			_lastAck = ack;
+			_lastReply = datagram;
+		}
+
+		return result;
+	}
+
+	bool
+	Transaction::SendOptionAck()
+	{
+		DatagramRef datagram =
+			MakeMessageDatagram<MessageOack>(_options, size_t{ _optionCount });
+
+		bool result = SendMessage(datagram);
+		if (result)
+		{
+			_lastReply = datagram;
+		}
+
+		return result;
+	}
+
+	bool
+	Transaction::Error(ErrorCode errorCode)
+	{
+		return ErrorWithMessage(errorCode, nullptr);
+	}
+
+	bool
+	Transaction::Error(MessageErrorCategory errorCode)
+	{
+		const char* msg = nullptr;
+		ErrorCode err = ErrorCode::UNDEFINED;
+
+		switch (errorCode)
+		{
+			case MessageErrorCategory::NO_ERROR:
+				return false;
+
+			case MessageErrorCategory::INVALID_STATE:
+			case MessageErrorCategory::INVALID_OPCODE:
+				err = ErrorCode::ILLEGAL_OPERATION;
+				break;
+
+			case MessageErrorCategory::TIMEOUT:
+				msg = errors::TimedOut;
+				break;
+
+			case MessageErrorCategory::INVALID_MESSAGE_SIZE:
+			case MessageErrorCategory::INVALID_MESSAGE_FORMAT:
+			case MessageErrorCategory::INVALID_MODE:
+				err = ErrorCode::ILLEGAL_OPERATION;
+				break;
+
+			case MessageErrorCategory::NO_SUCH_FILE:
+				err = ErrorCode::FILE_NOT_FOUND;
+				break;
+
+			case MessageErrorCategory::ACCESS_FORBIDDEN:
+				err = ErrorCode::ACCESS_VIOLATION;
+				break;
+			case MessageErrorCategory::FILE_LOCKED:
+				msg = errors::Unavailable;
+				break;
+
+			case MessageErrorCategory::UNSAFE_PATH:
+				err = ErrorCode::ACCESS_VIOLATION;
+				break;
+
+			case MessageErrorCategory::DISK_FULL:
+				err = ErrorCode::DISK_FULL;
+				break;
+
+			case MessageErrorCategory::CRITICAL_SERVER_ERROR:
+				msg = errors::CriticalError;
+				break;
+
+		}
+
+		return ErrorWithMessage(err, msg);
+	}
+
+
+	bool
+	Transaction::ErrorWithMessage(ErrorCode errorCode, const char* msg)
+	{
+		auto payload = _parent._templates.Error(errorCode, msg);
+		if (payload)
+		{
+			return SendTemplate(payload);
+		}
+
+		DatagramRef datagram =
+			MakeMessageDatagram<MessageError>(errorCode, msg);
+
+		return SendMessage(datagram);
+	}
+
+	bool
+	Transaction::Abort(MessageErrorCategory error, bool sendErrorMsg)
+	{
+		Trace(TraceId::TRANSFER_ABORTED, MessageErrorCategoryToString(error));
+
+		if (error == MessageErrorCategory::NO_ERROR)
+		{
+			return false;
+		}
+
+		_aborted = true;
+		if (sendErrorMsg)
+		{
+			Error(error);
+		}
+
+		return TerminateTransaction();
+	}
+
+	bool
+	Transaction::ShutDown()
+	{
+		Trace(TraceId::TRANSFER_SHUT_DOWN);
+		_aborted = true;
+
+		ErrorWithMessage(ErrorCode::UNDEFINED, errors::ShutDown);
+		return TerminateTransaction();
+	}
+
+	bool
+	Transaction::SendMessage(DatagramRef& datagram)
+	{
+		if (!datagram)
+		{
+			return false;
+		}
+
+		if (_terminated || !_socket || !_socket->IsBound())
+		{
+			return false;
+		}
+
+		if (!_socket->Send(datagram))
+		{
+			return false;
+		}
+
+		CountSent(datagram->GetDataSize());
+		return true;
+	}
+
+	bool
+	Transaction::SendTemplate(const MessageTemplates::Payload& payload)
+	{
+		if (_terminated || !_socket || !_socket->IsBound())
+		{
+			return false;
+		}
+
+		if (!_socket->SendTo(payload.data, payload.size, _clientAddress))
+		{
+			return false;
+		}
+
+		CountSent(payload.size);
+		return true;
+	}
+
+	void
+	Transaction::RecordTimings(Clock::time_point end)
+	{
+		using std::chrono::duration_cast;
+		using std::chrono::microseconds;
+
+		SizeClass size = TransferSizeClass();
+		if (_stats.firstReply != Clock::time_point{})
+		{
+			_metrics.Record(Timing::ADMISSION, size,
+				duration_cast<microseconds>(_stats.firstReply - _stats.started));
+		}
+
+		if (_stats.firstByte != Clock::time_point{})
+		{
+			_metrics.Record(Timing::FIRST_BYTE, size,
+				duration_cast<microseconds>(_stats.firstByte - _stats.started));
+		}
+
+		// Partial transfers would skew both.
+		if (_aborted)
+		{
+			return;
+		}
+
+		auto elapsed = duration_cast<microseconds>(end - _stats.started);
+		_metrics.Record(Timing::TRANSFER, size, elapsed);
+		if (elapsed.count() > 0)
+		{
+			// KiB/s, from bytes/us.
+			uint64_t kibPerSec = _stats.fileBytes * 1'000'000
+				/ (uint64_t(elapsed.count()) * 1024);
+			_metrics.Record(Timing::THROUGHPUT, size, kibPerSec);
+		}
+	}
+
+	SizeClass
+	Transaction::TransferSizeClass() const
+	{
+		return SizeClassOf(_currentOperation == OpCode::RRQ
+			? _stats.fileSize
+			: _stats.fileBytes);
+	}
+
+	Transaction::Clock::time_point
+	Transaction::ReceivedAt(const DatagramRef& datagram)
+	{
+		auto received = datagram->GetReceiveTime();
+		return received == Clock::time_point{} ? Clock::now() : received;
+	}
+
+	void
+	Transaction::CountSent(size_t bytes)
+	{
+		_stats.packetsOut++;
+		_stats.bytesOut += bytes;
+		_metrics.Add(Counter::PACKETS_OUT);
+		_metrics.Add(Counter::BYTES_OUT, bytes);
+	}
+
+	void
+	Transaction::CountReceived(size_t bytes)
+	{
+		_stats.packetsIn++;
+		_stats.bytesIn += bytes;
+		_metrics.Add(Counter::PACKETS_IN);
+		_metrics.Add(Counter::BYTES_IN, bytes);
+	}
+
+	bool
+	Transaction::TerminateTransaction()
+	{
+		if (_terminated)
+		{
+			return true;
+		}
+
+		Trace(TraceId::TRANSFER_TERMINATED);
+
+		auto end = Clock::now();
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+			end - _stats.started);
+		_metrics.Add(_aborted
+			? Counter::TRANSACTIONS_ABORTED
+			: Counter::TRANSACTIONS_COMPLETED);
+		RecordTimings(end);
+		Trace(TraceId::TRANSFER_STATS, _stats.fileBytes,
+			_stats.packetsIn + _stats.packetsOut, _stats.retransmits,
+			elapsed.count() / 1000);
+
+		// The socket and the server record are released by the home
+		// worker when it reaps the transaction : this may run on a thief.
+		_terminated = true;
+
+		// Unlocks the file.
+		_writer = nullptr;
+		_reader = nullptr;
+
+		return true;
+	}
+
+	Transaction::MessageErrorCategory
+	Transaction::FileSecurityErrorToMessageError(
+			FileSecurityHandler::ValidationResult fse) const
+	{
+		using FSEVR = FileSecurityHandler::ValidationResult;
+		using MEC = MessageErrorCategory;
+		switch (fse)
+		{
+			case FSEVR::VALID: return MEC::NO_ERROR;
+
+			case FSEVR::INVALID_FORMAT: return MEC::NO_SUCH_FILE;
+			case FSEVR::INVALID_ESCAPE_ROOT: return MEC::UNSAFE_PATH;
+			case FSEVR::INVALID_CANT_CREATE_FILE: return MEC::ACCESS_FORBIDDEN;
+			case FSEVR::INVALID_NO_SUCH_FILE: return MEC::NO_SUCH_FILE;
+			case FSEVR::INVALID_IS_DIRECTORY:return MEC::NO_SUCH_FILE;
+			case FSEVR::INVALID_ACCESS_FORBIDDEN: return MEC::ACCESS_FORBIDDEN;
+			case FSEVR::INVALID_FILE_LOCKED: return MEC::FILE_LOCKED;
+			case FSEVR::INVALID_MODE: return MEC::INVALID_MODE;
+			case FSEVR::INVALID_PERMISSIONS: return MEC::ACCESS_FORBIDDEN;
+
+			default: return MEC::ACCESS_FORBIDDEN;
+		}
+	}
+
+	const char*
+	Transaction::MessageErrorCategoryToString(MessageErrorCategory mec) const
+	{
+		switch (mec)
+		{
+			case MessageErrorCategory::NO_ERROR:
+				return "NO_ERROR";
+			case MessageErrorCategory::INVALID_STATE:
+				return "INVALID_STATE";
+			case MessageErrorCategory::INVALID_OPCODE:
+				return "INVALID_OPCODE";
+			case MessageErrorCategory::INVALID_BLOCK:
+				return "INVALID_BLOCK";
+			case MessageErrorCategory::TIMEOUT:
+				return "TIMEOUT";
+			case MessageErrorCategory::INVALID_MESSAGE_SIZE:
+				return "INVALID_MESSAGE_SIZE";
+			case MessageErrorCategory::INVALID_MESSAGE_FORMAT:
+				return "INVALID_MESSAGE_FORMAT";
+			case MessageErrorCategory::INVALID_MODE:
+				return "INVALID_MODE";
+			case MessageErrorCategory::NO_SUCH_FILE:
+				return "NO_SUCH_FILE";
+			case MessageErrorCategory::ACCESS_FORBIDDEN:
+				return "ACCESS_FORBIDDEN";
+			case MessageErrorCategory::FILE_LOCKED:
+				return "FILE_LOCKED";
+			case MessageErrorCategory::UNSAFE_PATH:
+				return "UNSAFE_PATH";
+			case MessageErrorCategory::DISK_FULL:
+				return "DISK_FULL";
+			case MessageErrorCategory::CLIENT_ERROR:
+				return "CLIENT_ERROR";
+			case MessageErrorCategory::CRITICAL_SERVER_ERROR:
+				return "CRITICAL_SERVER_ERROR";
+			default:
+				return "[UNKNOWN]";
+		}
+	}
+}
@@ -0,0 +1,406 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <string>
+#include "Datagram.h"
+#include "DatagramFactory.h"
+#include "FileSecurityHandler.h"
+#include "MessageTemplates.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Transfer.h"
+#include "UdpSocketWindows.h"
+#include "VirtualFileSystem.h"
+#include "tftp_messages.h"
+
+namespace tftplib {
+	class Server;
+	class ServerWorker;
+	class MessageRequest;
+	class MulticastSession;
+
+	// **********************************************************************
+	// A single RRQ or WRQ transfer.
+	//	The whole flow is written as one coroutine (Run) suspended on
+	//	co_await Recv(deadline). Its home ServerWorker watches the socket
+	//	and schedules the continuation, which any worker may then run.
+	//	A suspended transfer only costs its frame.
+	//
+	//	At most one thread runs a transaction at a time : RunState hands
+	//	it over between the home worker and the one running it.
+	// **********************************************************************
+	class Transaction
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		enum class Wakeup {
+			NONE,
+			READABLE,					// Socket has a datagram
+			TIMEOUT,					// Deadline elapsed
+			SHUTDOWN					// Worker is terminating
+		};
+
+		enum class RunState {
+			RUNNING,					// Owned by the thread running it
+			WAITING,					// Suspended, owned by home worker
+			QUEUED,						// In a run queue
+			DONE						// Ready to be reaped by home worker
+		};
+
+		// Per transfer counters. Only touched by the thread running the
+		// transaction, and mirrored into the server Metrics as they go.
+		struct TransferStats {
+			Clock::time_point started{};	// Request received
+			Clock::time_point firstReply{};	// First DATA or ACK 0 sent
+			Clock::time_point firstByte{};	// Block 1 delivered
+			uint64_t fileSize{ 0 };			// RRQ only
+			uint64_t packetsIn{ 0 };
+			uint64_t packetsOut{ 0 };
+			uint64_t bytesIn{ 0 };
+			uint64_t bytesOut{ 0 };
+			uint64_t fileBytes{ 0 };		// Sent or written
+			uint32_t retransmits{ 0 };
+			uint32_t timeouts{ 0 };
+			uint32_t duplicateAcks{ 0 };
+			uint32_t fastRetransmits{ 0 };
+		};
+
+		struct RecvResult {
+			Wakeup wakeup{ Wakeup::NONE };
+			DatagramRef datagram{ nullptr };
+		};
+
+		// Awaitable : suspend until the socket is readable or deadline.
+		class RecvAwaiter {
+		public:
+			RecvAwaiter(Transaction& owner, Clock::time_point deadline)
+				: _owner{ owner }, _deadline{ deadline } {}
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) noexcept;
+			RecvResult await_resume();
+
+		private:
+			Transaction& _owner;
+			Clock::time_point _deadline;
+		};
+
+		// Awaitable : suspend until deadline, receiving nothing.
+		class ParkAwaiter {
+		public:
+			ParkAwaiter(Transaction& owner, Clock::time_point deadline)
+				: _owner{ owner }, _deadline{ deadline } {}
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) noexcept;
+			Wakeup await_resume();
+
+		private:
+			Transaction& _owner;
+			Clock::time_point _deadline;
+		};
+
+		// Awaitable : read the next file block.
+		//	File I/O completes synchronously today, so this never suspends.
+		class ReadBlockAwaiter {
+		public:
+			ReadBlockAwaiter(Transaction& owner, uint8_t* buffer, size_t size)
+				: _owner{ owner }, _buffer{ buffer }, _size{ size } {}
+
+			bool await_ready() const noexcept { return true; }
+			void await_suspend(std::coroutine_handle<>) noexcept {}
+			size_t await_resume();
+
+		private:
+			Transaction& _owner;
+			uint8_t* _buffer;
+			size_t _size;
+		};
+
+	public:
+		Transaction(ServerWorker& worker,
+			Server& server,
+			DatagramFactory& factory,
+			DatagramRef request,
+			std::shared_ptr<UdpSocketWindows> socket);
+
+		~Transaction();
+		Transaction(const Transaction&) = delete;
+		Transaction& operator=(const Transaction&) = delete;
+
+		// Start the transfer coroutine. Runs until its first suspension.
+		void Start();
+
+		// Instead of Start, when the socket can't be polled : the client
+		// is told and the transaction is done.
+		void Refuse();
+
+		// Event loop interface
+		bool IsDone() const;
+		bool IsWaiting() const;
+		Clock::time_point Deadline() const { return _deadline; }
+
+		// Home worker : mark a waiting transaction as ready.
+		void Schedule(Wakeup reason);
+
+		// Any worker : run a scheduled transaction until it suspends.
+		void RunScheduled();
+
+		// Schedule and run inline.
+		void Resume(Wakeup reason);
+
+		UdpSocketWindows* Socket() const { return _socket.get(); }
+		uint16_t ClientTid() const { return _clientTid; }
+		uint16_t ServerTid() const { return _serverTid; }
+
+		const TransferStats& Stats() const { return _stats; }
+
+		// Used by Transfer to allocate this transaction's frame.
+		Allocator& FrameAllocator();
+
+		std::ostream& Out();
+		std::ostream& Err();
+
+	private:
+
+		enum class MessageErrorCategory
+		{
+			NO_ERROR,
+
+			// State and operation sequencing errors
+			INVALID_STATE,
+			INVALID_OPCODE,
+			INVALID_BLOCK,
+			TIMEOUT,
+
+			// Message structure errors
+			INVALID_MESSAGE_SIZE,
+			INVALID_MESSAGE_FORMAT,
+
+			// Message error
+			INVALID_MODE,
+
+			// File errors
+			NO_SUCH_FILE,
+			ACCESS_FORBIDDEN,
+			FILE_LOCKED,
+			UNSAFE_PATH,
+			DISK_FULL,
+
+			// Received an error from the client - abort processing.
+			CLIENT_ERROR,
+
+			// Critical server error - abort processing.
+			CRITICAL_SERVER_ERROR,
+			SHUTTING_DOWN
+		};
+
+	private:
+		/* ***************************************************
+		 *  Transfer flows
+		 * ***************************************************/
+
+		Transfer Run();
+
+		RecvAwaiter Recv(Clock::time_point deadline);
+		ParkAwaiter Park(Clock::time_point deadline);
+		ReadBlockAwaiter ReadBlock(uint8_t* buffer, size_t size);
+
+		/* ***************************************************
+		 *  Message Processing : RRQ and WRQ
+		 * ***************************************************/
+
+		MessageErrorCategory ProcessRequestMessage();
+
+		MessageErrorCategory ProcessRequestMessage(
+			const MessageRequest* rwrq);
+
+		// Grant what we support of the request options.
+		MessageErrorCategory ProcessRequestOptions(const MessageRequest* rwrq,
+			uint16_t messageSz);
+
+		// tsize : the size of a download, the room for an upload.
+		MessageErrorCategory ProcessTransferSize(uint64_t declared);
+
+		void AcknowledgeOption(const char* name, uint64_t value,
+			const char* text = nullptr);
+
+		// RFC 2090 : serve the request from the file's multicast session.
+		//	False when it can't be : the transfer stays unicast.
+		bool JoinMulticast();
+
+		/* ***************************************************
+		 *  Message Processing : Data
+		 * ***************************************************/
+
+		MessageErrorCategory ProcessDataMessage(
+			const DatagramRef& dataMessage );
+
+		/* ***************************************************
+		 *  Message Processing : Read
+		 * ***************************************************/
+
+		// A well formed ACK sets block ; ERROR and other opcodes fail.
+		MessageErrorCategory ProcessAckMessage(const DatagramRef& dataMessage,
+			uint16_t& block);
+
+		MessageErrorCategory ProcessErrorMessage(
+			const DatagramRef& errMessage);
+
+		/* ***************************************************
+		 *  General state and message handling
+		 * ***************************************************/
+
+		bool Ack(uint16_t ack);
+
+		bool SendOptionAck();
+
+		// A DATA block in flight.
+		struct WindowSlot {
+			DatagramRef datagram{ nullptr };
+			Clock::time_point sentAt{};
+			size_t size{ 0 };				// File bytes
+			bool retransmitted{ false };
+		};
+
+		void RetransmitWindow(WindowSlot* window, size_t head, uint16_t inFlight);
+		void CountDuplicateAck(uint16_t block, bool retransmitted);
+
+		bool Error(ErrorCode errorCode);
+
+		bool Error(MessageErrorCategory errorCode);
+
+		bool ErrorWithMessage(ErrorCode errorCode, const char* msg);
+
+		bool Abort(MessageErrorCategory error, bool sendErrorMsg = true);
+
+		bool ShutDown();
+
+		bool SendMessage(DatagramRef &datagram);
+
+		bool SendTemplate(const MessageTemplates::Payload& payload);
+
+		bool TerminateTransaction();
+
+		void Publish();
+
+		void CountSent(size_t bytes);
+		void CountReceived(size_t bytes);
+		void RecordTimings(Clock::time_point end);
+
+		SizeClass TransferSizeClass() const;
+
+		// Socket receive time, or now when the datagram doesn't carry one.
+		static Clock::time_point ReceivedAt(const DatagramRef& datagram);
+
+		/* ***************************************************
+		 *  General utility functions
+		 * ***************************************************/
+
+		MessageErrorCategory
+		FileSecurityErrorToMessageError(
+			FileSecurityHandler::ValidationResult fse) const;
+
+		const char* MessageErrorCategoryToString(MessageErrorCategory mec) const;
+
+		uint32_t TraceTid() const {
+			return (uint32_t{ _clientTid } << 16) | _serverTid;
+		}
+
+		template <typename... Args>
+		void Trace(TraceId id, Args... args) {
+			_tracer.Emit(id, TraceTid(), args...);
+		}
+
+		template<typename T, typename... Args>
+		DatagramRef
+		MakeMessageDatagram(Args... args);
+
+	private:
+		ServerWorker& _worker;
+		Server& _parent;
+		DatagramFactory& _factory;		// Owned by the Server, outlives us
+		Tracer& _tracer;
+		Metrics& _metrics;
+
+		// Coroutine state
+		Transfer _transfer{};
+		std::coroutine_handle<> _awaiting{ nullptr };
+		Clock::time_point _deadline{};
+		Wakeup _wakeup{ Wakeup::NONE };
+		std::atomic<RunState> _runState{ RunState::RUNNING };
+
+		// Transaction resources and settings
+		DatagramRef _request{ nullptr };
+		std::string _clientHost {""};
+		SocketAddress _clientAddress{};
+		uint16_t _clientTid {0};
+		uint16_t _serverTid{ 0 };
+		uint16_t _lastAck {0};			// RRQ : acknowledged, WRQ : sent
+		uint16_t _lastBlock {0};		// WRQ : received in order
+		bool _gapAcked {false};
+		DatagramRef _lastReply {nullptr};	// Last ACK or OACK, resent on timeout
+		bool _terminated{ false };
+		bool _aborted{ false };
+		TransferStats _stats{};
+
+		OpCode _currentOperation { OpCode::UNDEF };
+		bool _asciiMode {false};
+
+		std::string _fileName {""};
+		bool _fileSizeKnown {true};			// RRQ, generated files aren't
+		std::unique_ptr<VfsWriter> _writer;
+		std::unique_ptr<VfsReader> _reader;
+		std::unique_ptr<VfsWriteTicket> _writeTicket;	// WRQ parked in line
+
+		std::shared_ptr<UdpSocketWindows> _socket{nullptr};
+
+		// General settings
+		uint32_t _retries {3};
+		std::chrono::milliseconds _transactionTimeout {1000};
+		uint16_t _dataBlockSize {512};
+		uint16_t _windowSize {defaults::WindowSize};
+		uint32_t _fastRetransmitAcks {0};
+		uint64_t _uploadLimit {0};			// WRQ, 0 : none
+
+		// Granted options, sent back in the OACK.
+		OptionValue _options[4] {};
+		uint8_t _optionCount {0};
+
+		std::shared_ptr<MulticastSession> _session {nullptr};
+		char _multicastOption[64] {};		// address,port,mc
+	};
+}
+
+namespace tftplib {
+	template<typename T, typename... Args>
+	DatagramRef
+	Transaction::MakeMessageDatagram(Args... args)
+	{
+		auto assembly = _factory.StartAssembly();
+		if (!assembly.IsValid())
+		{
+			return nullptr;
+		}
+
+		assembly.SetDestinationAddress(_clientHost)
+			.SetDestinationPort(_clientTid)
+			.SetDestination(_clientAddress);
+
+		size_t size = encode<T>(assembly.GetDataBuffer(),
+			assembly.GetDataBufferSize(), args...);
+		if (size == 0)
+		{
+			return nullptr;
+		}
+
+		assembly.SetDataSize(static_cast<uint16_t>(size));
+		return assembly.Finalize();
+	}
+}
@@ -0,0 +1,65 @@
+﻿#include "pch.h"
+#include "Transfer.h"
+#include <utility>
+
+namespace tftplib {
+
+	Transfer::~Transfer()
+	{
+		if (_handle)
+		{
+			_handle.destroy();
+		}
+	}
+
+	Transfer::Transfer(Transfer&& rhs) noexcept
+	{
+		*this = std::move(rhs);
+	}
+
+	Transfer& Transfer::operator=(Transfer&& rhs) noexcept
+	{
+		std::swap(_handle, rhs._handle);
+		return *this;
+	}
+
+	bool Transfer::Failed() const
+	{
+		return _handle
+			&& _handle.done()
+			&& _handle.promise().exception != nullptr;
+	}
+
+	void Transfer::Resume()
+	{
+		if (_handle && !_handle.done())
+		{
+			_handle.resume();
+		}
+	}
+
+	void* Transfer::AllocateFrame(Allocator& alloc, size_t size) noexcept
+	{
+		uint8_t* block = reinterpret_cast<uint8_t*>(
+			alloc.allocate(size + FrameHeaderSize));
+		if (block == nullptr)
+		{
+			return nullptr;
+		}
+
+		*reinterpret_cast<Allocator**>(block) = &alloc;
+		return block + FrameHeaderSize;
+	}
+
+	void Transfer::FreeFrame(void* frame) noexcept
+	{
+		if (frame == nullptr)
+		{
+			return;
+		}
+
+		uint8_t* block = reinterpret_cast<uint8_t*>(frame) - FrameHeaderSize;
+		Allocator* alloc = *reinterpret_cast<Allocator**>(block);
+		alloc->free(block);
+	}
+}
@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include "Allocator.h"
+
+namespace tftplib {
+
+	// **********************************************************************
+	// Coroutine type of a transaction flow (RRQ or WRQ).
+	//	Starts eagerly and runs until its first suspension point. The owner
+	//	resumes it when whatever it awaits is ready and destroys it once
+	//	IsDone().
+	//
+	//	Frames are allocated from the Allocator returned by the coroutine
+	//	owner's FrameAllocator(), never from the global heap. Only member
+	//	coroutines of a class exposing FrameAllocator() are supported.
+	// **********************************************************************
+	class Transfer
+	{
+	public:
+		struct promise_type;
+		using Handle = std::coroutine_handle<promise_type>;
+
+		// Size of the hidden header storing the allocator that owns a frame.
+		// Keeps frames 16 bytes aligned on top of Allocator blocks.
+		static constexpr size_t FrameHeaderSize = 8;
+		static_assert(sizeof(Allocator*) <= FrameHeaderSize);
+
+		struct promise_type
+		{
+			Transfer get_return_object() {
+				return Transfer{ Handle::from_promise(*this) };
+			}
+
+			static Transfer get_return_object_on_allocation_failure() {
+				return Transfer{};
+			}
+
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+
+			void return_void() {}
+
+			void unhandled_exception() {
+				exception = std::current_exception();
+			}
+
+			template <typename Owner, typename... Args>
+			static void* operator new(size_t size, Owner& owner, Args&...) noexcept
+			{
+				return AllocateFrame(owner.FrameAllocator(), size);
+			}
+
+			static void operator delete(void* frame, size_t) noexcept
+			{
+				FreeFrame(frame);
+			}
+
+			std::exception_ptr exception{ nullptr };
+		};
+
+	public:
+		Transfer() = default;
+		~Transfer();
+		Transfer(Transfer&& rhs) noexcept;
+		Transfer& operator=(Transfer&& rhs) noexcept;
+
+		Transfer(const Transfer&) = delete;
+		Transfer& operator=(const Transfer&) = delete;
+
+		// False if the frame could not be allocated.
+		bool IsValid() const { return (bool)_handle; }
+		bool IsDone() const { return !_handle || _handle.done(); }
+		bool Failed() const;
+
+		void Resume();
+
+	private:
+		explicit Transfer(Handle h) : _handle{ h } {}
+
+		static void* AllocateFrame(Allocator& alloc, size_t size) noexcept;
+		static void FreeFrame(void* frame) noexcept;
+
+	private:
+		Handle _handle{ nullptr };
+	};
+}
@@ -1,14 +1,17 @@
 ﻿#include "pch.h"
 #include "UdpSocketWindows.h"
 #include "DatagramFactory.h"
+#include "Impairment.h"
 
 #include <Winsock2.h>
 #include <ws2tcpip.h>
 #include <cstdint>
 #include <string>
 #include <Mswsock.h>
+#include <mstcpip.h>
 #include <tchar.h>
 #include <combaseapi.h>
+#include "Numa.h"
 
 #include <thread>
 #include <chrono>
@@ -187,6 +190,18 @@ namespace tftplib
 		return std::string(ip);
 	}
 
+	/*
+	 * Addr to String conversion, into a caller buffer.
+	 */
+	const char* AddrToBuf(const void* addr, int family,
+		char (&ip)[INET6_ADDRSTRLEN])
+	{
+		if (inet_ntop(family, addr, ip, sizeof(ip)) == nullptr) {
+			ip[0] = '\0';
+		}
+		return ip;
+	}
+
 	/*
 	 * Addr to String conversion
 	 */
@@ -409,6 +424,41 @@ namespace tftplib
 			&& (pollFd.revents == POLLRDNORM);
 	}
 
+	NativeHandle
+	UdpSocketWindows::GetNativeHandle() const
+	{
+		std::shared_ptr<OsSpecific> os = Os();
+		if (!os) {
+			return InvalidNativeHandle;
+		}
+
+		return static_cast<NativeHandle>(os->Socket);
+	}
+
+	uint32_t
+	UdpSocketWindows::GetReceiveCpu() const
+	{
+		std::shared_ptr<OsSpecific> os = Os();
+		if (!os) {
+			return Numa::CurrentCpu();
+		}
+
+		SOCKET_PROCESSOR_AFFINITY affinity{};
+		DWORD returned = 0;
+		int result = WSAIoctl(os->Socket,
+			SIO_QUERY_RSS_PROCESSOR_INFO,
+			nullptr, 0,
+			&affinity, sizeof(affinity),
+			&returned, nullptr, nullptr);
+
+		if (result != 0 || returned < sizeof(affinity)) {
+			return Numa::CurrentCpu();
+		}
+
+		return static_cast<uint32_t>(affinity.Processor.Group) * 64
+			+ affinity.Processor.Number;
+	}
+
 	bool
 	UdpSocketWindows::Bind(const char* hostname, uint16_t port) 
 	{
@@ -478,7 +528,7 @@ namespace tftplib
 		return true;
 	}
 
-	std::shared_ptr<tftplib::Datagram>
+	DatagramRef
 	UdpSocketWindows::Receive(DatagramFactory& factory)
 	{
 		std::shared_ptr<OsSpecific> os = Os();
@@ -497,7 +547,12 @@ namespace tftplib
 		// ************************************************************
 		// Prepare WSAMSG struct and assign all of its buffers
 		// ************************************************************
-		sockaddr remoteHost = {0};
+		static_assert(sizeof(sockaddr_in6) <= SocketAddress::Capacity,
+			"SocketAddress can't hold an IPv6 address");
+
+		SocketAddress remote{};
+		sockaddr* remoteHost = reinterpret_cast<sockaddr*>(remote.bytes);
+		char ip[INET6_ADDRSTRLEN];
 
 		WSABUF buffer;
 		buffer.buf = assembly.GetDataBuffer();
@@ -524,8 +579,8 @@ namespace tftplib
 		msg.lpBuffers = &buffer;
 		msg.Control.buf = assembly.GetControlBuffer();
 		msg.Control.len = controlLen;
-		msg.name = &remoteHost;
-		msg.namelen = sizeof(sockaddr);
+		msg.name = remoteHost;
+		msg.namelen = SocketAddress::Capacity;
 
 		DWORD messageLength = 0;
 
@@ -546,23 +601,27 @@ namespace tftplib
 		// Assign results to the assembly object
 		// ************************************************************
 		assembly.SetDataSize((uint16_t)messageLength);
+		assembly.SetReceiveTime(Datagram::Clock::now());
 		assembly.SetBroadcast( (msg.dwFlags & MSG_BCAST) != 0);
 		assembly.SetDestinationPort( GetSocketPort() );
 
-		// Source IP + Port
-		switch (remoteHost.sa_family) {
+		// Source IP + Port, raw for replies and printable for logs
+		remote.size = static_cast<uint8_t>(msg.namelen);
+		assembly.SetSource(remote);
+
+		switch (remoteHost->sa_family) {
 			case AF_INET:
 			{
-				sockaddr_in* inet4 = (sockaddr_in*)&remoteHost;
+				sockaddr_in* inet4 = (sockaddr_in*)remoteHost;
 				assembly.SetSourcePort(ntohs(inet4->sin_port));
-				assembly.SetSourceAddress(AddrToStr(&inet4->sin_addr));
+				assembly.SetSourceAddress(AddrToBuf(&inet4->sin_addr, AF_INET, ip));
 			} break;
 				
 			case AF_INET6: 
 			{
-				sockaddr_in6* inet6 = (sockaddr_in6*)&remoteHost;
+				sockaddr_in6* inet6 = (sockaddr_in6*)remoteHost;
 				assembly.SetSourcePort(ntohs(inet6->sin6_port));
-				assembly.SetSourceAddress(AddrToStr(&inet6->sin6_addr));
+				assembly.SetSourceAddress(AddrToBuf(&inet6->sin6_addr, AF_INET6, ip));
 			} break;
 		}
 
@@ -578,14 +637,16 @@ namespace tftplib
 				&& header->cmsg_type == IP_PKTINFO) 
 			{
 				IN_PKTINFO* pktInfo = (IN_PKTINFO*)WSA_CMSG_DATA(header);
-				assembly.SetDestinationAddress(AddrToStr(&pktInfo->ipi_addr));
+				assembly.SetDestinationAddress(
+					AddrToBuf(&pktInfo->ipi_addr, AF_INET, ip));
 				break;
 			}
 			else if (header->cmsg_level == IPPROTO_IPV6
 				&& header->cmsg_type == IPV6_PKTINFO)
 			{
 				IN6_PKTINFO* pktInfo = (IN6_PKTINFO*)WSA_CMSG_DATA(header);
-				assembly.SetDestinationAddress(AddrToStr(&pktInfo->ipi6_addr));
+				assembly.SetDestinationAddress(
+					AddrToBuf(&pktInfo->ipi6_addr, AF_INET6, ip));
 				break;
 			}
 		}
@@ -594,19 +655,22 @@ namespace tftplib
 	}
 
 	bool
-	UdpSocketWindows::Send(std::shared_ptr<tftplib::Datagram> datagram)
+	UdpSocketWindows::Send(const DatagramRef& datagram)
 	{
 		std::shared_ptr<OsSpecific> os = Os();
-		if (!os) {
+		if (!os || !datagram) {
 			return false;
 		}
 
-		WSABUF buffer {0};
-		buffer.buf = datagram->GetDataBuffer();
-		buffer.len = datagram->GetDataSize();
+		// Replies carry the requester's raw address : no resolution.
+		const SocketAddress& raw = datagram->GetDestSocketAddress();
+		if (raw.IsSet())
+		{
+			return SendImpaired(os,
+				datagram->GetData(), datagram->GetDataSize(),
+				raw.bytes, raw.size);
+		}
 
-		DWORD sentBytes = 0;
-		
 		AddrInfoBox boxed {};
 		int result = ParseAddress(datagram->GetDestAddress(), 
 			datagram->GetDestPort(), 
@@ -619,19 +683,100 @@ namespace tftplib
 			return false;
 		}
 
-		result = WSASendTo(
-			os->Socket,
-			&buffer, 1,
-			&sentBytes,
-			0,
-			boxed.addrInfo->ai_addr, 
-			static_cast<int>(boxed.addrInfo->ai_addrlen),
-			nullptr, nullptr
-		);
+		return SendImpaired(os,
+			datagram->GetData(), datagram->GetDataSize(),
+			boxed.addrInfo->ai_addr,
+			static_cast<int>(boxed.addrInfo->ai_addrlen));
+	}
 
-		if (result != 0)
+	bool
+	UdpSocketWindows::SendTo(const void* data, size_t size,
+		const SocketAddress& dest)
+	{
+		std::shared_ptr<OsSpecific> os = Os();
+		if (!os || !dest.IsSet()) {
+			return false;
+		}
+
+		return SendImpaired(os, data, size, dest.bytes, dest.size);
+	}
+
+	UdpSocketWindows&
+	UdpSocketWindows::SetImpairment(std::shared_ptr<Impairment> impairment)
+	{
+		_impairment = std::move(impairment);
+		return *this;
+	}
+
+	UdpSocketWindows&
+	UdpSocketWindows::SetReuseAddress(bool reuse)
+	{
+		_reuseAddress = reuse;
+		return *this;
+	}
+
+	bool
+	UdpSocketWindows::Resolve(const char* hostname, uint16_t port,
+		SocketAddress& address)
+	{
+		AddrInfoBox boxed {};
+		if (ParseAddress(hostname, port, &boxed.addrInfo, AF_UNSPEC) != 0
+			|| boxed.addrInfo->ai_addrlen > SocketAddress::Capacity)
 		{
-			LogSocketError("Send::SendTo");
+			return false;
+		}
+
+		address = SocketAddress{};
+		memcpy(address.bytes, boxed.addrInfo->ai_addr, boxed.addrInfo->ai_addrlen);
+		address.size = static_cast<uint8_t>(boxed.addrInfo->ai_addrlen);
+		return true;
+	}
+
+	bool
+	UdpSocketWindows::EnableMulticastSend(uint8_t ttl)
+	{
+		std::shared_ptr<OsSpecific> os = Os();
+		if (!os || os->LocalAddress.sa_family != AF_INET) {
+			return false;
+		}
+
+		in_addr iface = reinterpret_cast<sockaddr_in*>(&os->LocalAddress)->sin_addr;
+		DWORD hops = ttl;
+		DWORD loop = 1;
+
+		if (setsockopt(os->Socket, IPPROTO_IP, IP_MULTICAST_IF,
+				(char*)&iface, sizeof(iface)) == SOCKET_ERROR
+			|| setsockopt(os->Socket, IPPROTO_IP, IP_MULTICAST_TTL,
+				(char*)&hops, sizeof(hops)) == SOCKET_ERROR
+			|| setsockopt(os->Socket, IPPROTO_IP, IP_MULTICAST_LOOP,
+				(char*)&loop, sizeof(loop)) == SOCKET_ERROR)
+		{
+			LogSocketError("EnableMulticastSend");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool
+	UdpSocketWindows::JoinGroup(const char* group, const char* iface)
+	{
+		std::shared_ptr<OsSpecific> os = Os();
+		if (!os) {
+			return false;
+		}
+
+		ip_mreq request{};
+		if (inet_pton(AF_INET, group, &request.imr_multiaddr) != 1
+			|| inet_pton(AF_INET, iface, &request.imr_interface) != 1)
+		{
+			return false;
+		}
+
+		if (setsockopt(os->Socket, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			(char*)&request, sizeof(request)) == SOCKET_ERROR)
+		{
+			LogSocketError("JoinGroup");
 			return false;
 		}
 
@@ -688,6 +833,12 @@ namespace tftplib
 		// Let's not check the result - if anything's up this will only fail on bind lol
 		(void)result;
 
+		if (_reuseAddress) {
+			BOOL reuse = TRUE;
+			setsockopt(os->Socket, SOL_SOCKET, SO_REUSEADDR,
+				(char*)&reuse, sizeof(reuse));
+		}
+
 		return true;
 	}
 
@@ -756,6 +907,79 @@ namespace tftplib
 		return true;
 	}
 
+	bool
+	UdpSocketWindows::SendRaw(OsSpecific* os,
+		const void* data, size_t size,
+		const void* dest, int destLen)
+	{
+		// WSABUF wants a mutable pointer but WSASendTo only reads it.
+		WSABUF buffer {0};
+		buffer.buf = const_cast<char*>(static_cast<const char*>(data));
+		buffer.len = static_cast<ULONG>(size);
+
+		DWORD sentBytes = 0;
+		int result = WSASendTo(
+			os->Socket,
+			&buffer, 1,
+			&sentBytes,
+			0,
+			static_cast<const sockaddr*>(dest), 
+			destLen,
+			nullptr, nullptr
+		);
+
+		if (result != 0)
+		{
+			LogSocketError("Send::SendTo");
+			return false;
+		}
+
+		return true;
+	}
+
+	bool
+	UdpSocketWindows::SendImpaired(const std::shared_ptr<OsSpecific>& os,
+		const void* data, size_t size,
+		const void* dest, int destLen)
+	{
+		if (!_impairment)
+		{
+			return SendRaw(os.get(), data, size, dest, destLen);
+		}
+
+		// A dropped datagram still counts as sent : it's lost on the way.
+		Impairment::Plan plan = _impairment->Decide(size);
+		bool sent = true;
+		for (uint32_t i = 0; i < plan.immediate; i++)
+		{
+			sent = SendRaw(os.get(), data, size, dest, destLen) && sent;
+		}
+
+		// Held back copies own their bytes and keep the OS socket open.
+		for (uint32_t i = 0; i < plan.deferred; i++)
+		{
+			auto bytes = static_cast<const uint8_t*>(data);
+			SocketAddress to{};
+			memcpy(to.bytes, dest, std::min<size_t>(destLen, sizeof(to.bytes)));
+			to.size = static_cast<uint8_t>(destLen);
+
+			_impairment->Defer(plan.at[i],
+				[os, packet = std::vector<uint8_t>(bytes, bytes + size), to] {
+					WSABUF buffer{ 0 };
+					buffer.buf = reinterpret_cast<char*>(
+						const_cast<uint8_t*>(packet.data()));
+					buffer.len = static_cast<ULONG>(packet.size());
+
+					DWORD sentBytes = 0;
+					WSASendTo(os->Socket, &buffer, 1, &sentBytes, 0,
+						reinterpret_cast<const sockaddr*>(to.bytes), to.size,
+						nullptr, nullptr);
+				});
+		}
+
+		return sent;
+	}
+
 	void
 	UdpSocketWindows::LogSocketError(const char* what) const
 	{
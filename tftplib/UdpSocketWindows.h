@@ -3,11 +3,14 @@
 #include <memory>
 #include <iostream>
 #include <atomic>
+#include "OsHandle.h"
 
 namespace tftplib
 {
 	class DatagramFactory;
-	class Datagram;
+	class DatagramRef;
+	class Impairment;
+	struct SocketAddress;
 
 	class UdpSocketWindows
 	{
@@ -26,6 +29,10 @@ namespace tftplib
 		};
 
 		static std::unique_ptr<GlobalOsContext> InitGlobalOsContext();
+
+		// Resolve host and port once, for SendTo.
+		static bool Resolve(const char* hostname, uint16_t port,
+			SocketAddress& address);
 		
 	public:
 		UdpSocketWindows();
@@ -62,13 +69,39 @@ namespace tftplib
 
 		bool Poll(uint32_t timeout = 0) const;
 
+		// Underlying OS socket, for registration with a Poller.
+		// InvalidNativeHandle when the socket isn't bound.
+		NativeHandle GetNativeHandle() const;
+
+		// CPU whose receive queue (RSS) delivers this socket's datagrams.
+		// Falls back to the calling thread's CPU when unknown.
+		uint32_t GetReceiveCpu() const;
+
 		bool Bind(const char* hostname, uint16_t port = 0);
 
 		bool Unbind();
 
-		std::shared_ptr<tftplib::Datagram> Receive(DatagramFactory &factory);
+		DatagramRef Receive(DatagramFactory &factory);
 		
-		bool Send(std::shared_ptr<tftplib::Datagram> datagram);
+		// Sends to the datagram's raw destination when it has one,
+		// resolves its printable address otherwise.
+		bool Send(const DatagramRef& datagram);
+
+		// Send size bytes from data as is, e.g. a pre-encoded template.
+		bool SendTo(const void* data, size_t size, const SocketAddress& dest);
+
+		// Run every datagram sent through impairment, nullptr to stop.
+		// Set while the socket is inactive.
+		UdpSocketWindows& SetImpairment(std::shared_ptr<Impairment> impairment);
+
+		// Let other sockets bind the same port, e.g. every receiver of a
+		// multicast group on one host. Set while the socket is inactive.
+		UdpSocketWindows& SetReuseAddress(bool reuse);
+
+		// IPv4 multicast, on a bound socket. Sending goes out of the
+		// bound interface and loops back to local members.
+		bool EnableMulticastSend(uint8_t ttl);
+		bool JoinGroup(const char* group, const char* iface);
 
 	private:
 		struct OsSpecific;
@@ -92,6 +125,12 @@ namespace tftplib
 
 		bool InitRecvMsg(OsSpecific* os);
 
+		bool SendRaw(OsSpecific* os, const void* data, size_t size,
+			const void* dest, int destLen);
+
+		bool SendImpaired(const std::shared_ptr<OsSpecific>& os,
+			const void* data, size_t size, const void* dest, int destLen);
+
 		void LogSocketError(const char* what) const;
 
 	private:
@@ -104,6 +143,9 @@ namespace tftplib
 		
 		std::shared_ptr<OsSpecific> _osLifeCycle;
 		std::weak_ptr<OsSpecific> _osHandle;
+
+		std::shared_ptr<Impairment> _impairment{ nullptr };
+		bool _reuseAddress{ false };
 	};
 
 }
\ No newline at end of file
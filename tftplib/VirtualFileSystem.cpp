@@ -0,0 +1,165 @@
+﻿#include "pch.h"
+#include "VirtualFileSystem.h"
+#include <algorithm>
+#include <cstring>
+
+namespace tftplib {
+
+	namespace {
+
+		char NormalizeChar(char c)
+		{
+			if (c == '\\')
+			{
+				return '/';
+			}
+
+			return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+		}
+
+		std::string_view SkipSeparators(std::string_view name)
+		{
+			while (!name.empty() && (name.front() == '/' || name.front() == '\\'))
+			{
+				name.remove_prefix(1);
+			}
+
+			return name;
+		}
+
+		// prefix is normalized. Matches whole path components only.
+		bool MatchPrefix(std::string_view name, std::string_view prefix,
+			std::string_view& rest)
+		{
+			name = SkipSeparators(name);
+			if (name.size() < prefix.size()
+				|| !std::equal(prefix.begin(), prefix.end(), name.begin(),
+					[](char p, char n) { return p == NormalizeChar(n); }))
+			{
+				return false;
+			}
+
+			rest = name.substr(prefix.size());
+			if (!prefix.empty() && !rest.empty()
+				&& rest.front() != '/' && rest.front() != '\\')
+			{
+				return false;
+			}
+
+			rest = SkipSeparators(rest);
+			return true;
+		}
+	}
+
+	/* *********************************************************************
+	 * BufferReader
+	 * *********************************************************************/
+	size_t BufferReader::ReadBlock(uint8_t* buffer, size_t bufferSize)
+	{
+		size_t count = static_cast<size_t>(
+			std::min<uint64_t>(bufferSize, _size - _offset));
+		memcpy(buffer, _data + _offset, count);
+		_offset += count;
+		return count;
+	}
+
+	/* *********************************************************************
+	 * VirtualFileSystem
+	 * *********************************************************************/
+	std::string VirtualFileSystem::Normalize(std::string_view name)
+	{
+		name = SkipSeparators(name);
+
+		std::string normalized(name.size(), '\0');
+		std::transform(name.begin(), name.end(), normalized.begin(), NormalizeChar);
+		return normalized;
+	}
+
+	/* *********************************************************************
+	 * MountedFileSystem
+	 * *********************************************************************/
+	void MountedFileSystem::Mount(std::string_view prefix,
+		std::shared_ptr<VirtualFileSystem> files)
+	{
+		std::string normalized = Normalize(prefix);
+		while (!normalized.empty() && normalized.back() == '/')
+		{
+			normalized.pop_back();
+		}
+
+		// Before the mounts of the same prefix, after the longer ones.
+		auto at = std::find_if(_mounts.begin(), _mounts.end(),
+			[&](const MountPoint& m) { return m.prefix.size() <= normalized.size(); });
+		_mounts.insert(at, MountPoint{ normalized, std::move(files) });
+	}
+
+	void MountedFileSystem::Clear()
+	{
+		_mounts.clear();
+	}
+
+	template <typename Op>
+	MountedFileSystem::Result
+	MountedFileSystem::Resolve(std::string_view name, bool write, Op op)
+	{
+		for (const MountPoint& mount : _mounts)
+		{
+			std::string_view rest;
+			if (!MatchPrefix(name, mount.prefix, rest)
+				|| (write && mount.files->IsReadOnly()))
+			{
+				continue;
+			}
+
+			Result result = op(*mount.files, rest);
+			if (write || result != Result::INVALID_NO_SUCH_FILE)
+			{
+				return result;
+			}
+		}
+
+		return write ? Result::INVALID_CANT_CREATE_FILE : Result::INVALID_NO_SUCH_FILE;
+	}
+
+	MountedFileSystem::Result
+	MountedFileSystem::Stat(std::string_view name, VfsStat& stat)
+	{
+		return Resolve(name, false,
+			[&](VirtualFileSystem& files, std::string_view rest) {
+				return files.Stat(rest, stat);
+			});
+	}
+
+	MountedFileSystem::Result
+	MountedFileSystem::OpenReader(std::string_view name, bool netascii,
+		VfsStat& stat, std::unique_ptr<VfsReader>& reader)
+	{
+		return Resolve(name, false,
+			[&](VirtualFileSystem& files, std::string_view rest) {
+				return files.OpenReader(rest, netascii, stat, reader);
+			});
+	}
+
+	MountedFileSystem::Result
+	MountedFileSystem::OpenWriter(std::string_view name, bool netascii,
+		std::unique_ptr<VfsWriter>& writer)
+	{
+		return Resolve(name, true,
+			[&](VirtualFileSystem& files, std::string_view rest) {
+				return files.OpenWriter(rest, netascii, writer);
+			});
+	}
+
+	std::unique_ptr<VfsWriteTicket>
+	MountedFileSystem::QueueWriter(std::string_view name)
+	{
+		// Where OpenWriter went.
+		std::unique_ptr<VfsWriteTicket> ticket = nullptr;
+		Resolve(name, true,
+			[&](VirtualFileSystem& files, std::string_view rest) {
+				ticket = files.QueueWriter(rest);
+				return Result::VALID;
+			});
+		return ticket;
+	}
+}
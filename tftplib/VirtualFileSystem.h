@@ -0,0 +1,149 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "FileSecurityHandler.h"
+
+namespace tftplib {
+
+	// What a download reads from.
+	class VfsReader
+	{
+	public:
+		virtual ~VfsReader() = default;
+
+		// Short at the end of the file, -1 when it can't be read.
+		virtual size_t ReadBlock(uint8_t* buffer, size_t bufferSize) = 0;
+	};
+
+	// What an upload writes to. Dropped before Commit, nothing was
+	// written.
+	class VfsWriter
+	{
+	public:
+		virtual ~VfsWriter() = default;
+
+		// Make room for size bytes, false when they won't fit.
+		virtual bool Preallocate(uint64_t size) = 0;
+		virtual void WriteBlock(const uint8_t* buffer, size_t bufferSize) = 0;
+		virtual void Commit() = 0;
+	};
+
+	// An upload waiting its turn on a file in use. Downloads coming after
+	// it are turned away until it opens or is dropped.
+	class VfsWriteTicket
+	{
+	public:
+		virtual ~VfsWriteTicket() = default;
+
+		// INVALID_FILE_LOCKED : still in use, try again later.
+		virtual FileSecurityHandler::ValidationResult TryOpen(bool netascii,
+			std::unique_ptr<VfsWriter>& writer) = 0;
+	};
+
+	// Reads a file already in memory, kept alive by owner.
+	class BufferReader : public VfsReader
+	{
+	public:
+		BufferReader(const uint8_t* data, uint64_t size,
+			std::shared_ptr<const void> owner = nullptr)
+			: _data{ data }, _size{ size }, _owner{ std::move(owner) } {}
+
+		size_t ReadBlock(uint8_t* buffer, size_t bufferSize) override;
+
+	private:
+		const uint8_t* _data;
+		const uint64_t _size;
+		std::shared_ptr<const void> _owner;
+		uint64_t _offset{ 0 };
+	};
+
+	struct VfsStat {
+		uint64_t size{ 0 };
+		bool sizeKnown{ true };				// Files made as they're read
+		std::filesystem::file_time_type modified{};
+	};
+
+	// **********************************************************************
+	// Where transfers find their files. Names are the ones of the
+	//	requests, relative to wherever the file system is mounted.
+	//
+	//	A reader or writer holds whatever the file system locked for it
+	//	until it's dropped. Every call is thread safe.
+	//
+	//	netascii transfers are refused (INVALID_MODE) by file systems that
+	//	don't convert line endings.
+	// **********************************************************************
+	class VirtualFileSystem
+	{
+	public:
+		using Result = FileSecurityHandler::ValidationResult;
+
+		// Lower case, '/' separated, without leading separators : how
+		// names compare on Windows.
+		static std::string Normalize(std::string_view name);
+
+	public:
+		virtual ~VirtualFileSystem() = default;
+
+		virtual bool IsReadOnly() const { return false; }
+
+		virtual Result Stat(std::string_view name, VfsStat& stat) = 0;
+
+		virtual Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) = 0;
+
+		virtual Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) = 0;
+
+		// After OpenWriter found the file in use. nullptr where writers
+		// can't wait their turn.
+		virtual std::unique_ptr<VfsWriteTicket> QueueWriter(std::string_view /*name*/)
+		{
+			return nullptr;
+		}
+	};
+
+	// **********************************************************************
+	// File systems mounted at name prefixes. The longest prefix matching
+	//	a name serves it ; among mounts of the same prefix, the last one
+	//	goes first.
+	//
+	//	Reads fall through to the next match when a file system doesn't
+	//	have the file, writes skip read-only file systems : a pack mounted
+	//	over the root directory serves what it has, the directory the rest.
+	// **********************************************************************
+	class MountedFileSystem : public VirtualFileSystem
+	{
+	public:
+		// Setup, not thread safe : before serving.
+		void Mount(std::string_view prefix, std::shared_ptr<VirtualFileSystem> files);
+		void Clear();
+
+		Result Stat(std::string_view name, VfsStat& stat) override;
+
+		Result OpenReader(std::string_view name, bool netascii,
+			VfsStat& stat, std::unique_ptr<VfsReader>& reader) override;
+
+		Result OpenWriter(std::string_view name, bool netascii,
+			std::unique_ptr<VfsWriter>& writer) override;
+
+		std::unique_ptr<VfsWriteTicket> QueueWriter(std::string_view name) override;
+
+	private:
+		struct MountPoint {
+			std::string prefix;			// Normalized
+			std::shared_ptr<VirtualFileSystem> files;
+		};
+
+		template <typename Op>
+		Result Resolve(std::string_view name, bool write, Op op);
+
+	private:
+		std::vector<MountPoint> _mounts{};	// Longest prefix first
+	};
+}
@@ -0,0 +1,130 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+namespace tftplib
+{
+	// **********************************************************************
+	// Bounded Chase-Lev work stealing deque.
+	//	The owner thread pushes and pops at the bottom (LIFO), any other
+	//	thread steals from the top (FIFO). T must be trivially copyable,
+	//	typically a pointer.
+	// **********************************************************************
+	template <typename T>
+	class WorkStealingDeque
+	{
+
+	public:
+		WorkStealingDeque(size_t size);
+		~WorkStealingDeque();
+
+		WorkStealingDeque(const WorkStealingDeque&) = delete;
+		WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+		// Approximate when called from a thief.
+		size_t Size() const {
+			int64_t b = _bottom.load(std::memory_order_relaxed);
+			int64_t t = _top.load(std::memory_order_relaxed);
+			return b > t ? static_cast<size_t>(b - t) : 0;
+		}
+
+		bool IsEmpty() const {
+			return Size() == 0;
+		}
+
+		// Owner only.
+		bool Push(T v);
+		bool Pop(T& v);
+
+		// Any thread.
+		bool Steal(T& v);
+
+	private:
+		alignas(64) std::atomic<int64_t> _top{ 0 };
+		alignas(64) std::atomic<int64_t> _bottom{ 0 };
+
+		size_t _mask{ 0 };
+		std::atomic<T>* _buffer{ nullptr };
+	};
+}
+
+template <typename T>
+tftplib::WorkStealingDeque<T>::WorkStealingDeque(size_t size)
+{
+	if (size < 2) {
+		throw std::runtime_error("WorkStealingDeque size must be at least 2");
+	}
+
+	size_t capacity = 1;
+	while (capacity < size) {
+		capacity <<= 1;
+	}
+
+	_mask = capacity - 1;
+	_buffer = new std::atomic<T>[capacity];
+}
+
+template <typename T>
+tftplib::WorkStealingDeque<T>::~WorkStealingDeque()
+{
+	delete[] _buffer;
+}
+
+template <typename T>
+bool tftplib::WorkStealingDeque<T>::Push(T v)
+{
+	int64_t b = _bottom.load(std::memory_order_relaxed);
+	int64_t t = _top.load(std::memory_order_acquire);
+	if (b - t > static_cast<int64_t>(_mask)) {
+		return false;
+	}
+
+	_buffer[b & _mask].store(v, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	_bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+template <typename T>
+bool tftplib::WorkStealingDeque<T>::Pop(T& v)
+{
+	int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+	_bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = _top.load(std::memory_order_relaxed);
+
+	if (t > b) {
+		// Empty.
+		_bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+
+	v = _buffer[b & _mask].load(std::memory_order_relaxed);
+	if (t == b) {
+		// Last element : race against thieves for it.
+		bool won = _top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed);
+		_bottom.store(b + 1, std::memory_order_relaxed);
+		return won;
+	}
+
+	return true;
+}
+
+template <typename T>
+bool tftplib::WorkStealingDeque<T>::Steal(T& v)
+{
+	int64_t t = _top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = _bottom.load(std::memory_order_acquire);
+
+	if (t >= b) {
+		return false;
+	}
+
+	v = _buffer[t & _mask].load(std::memory_order_relaxed);
+	return _top.compare_exchange_strong(t, t + 1,
+		std::memory_order_seq_cst, std::memory_order_relaxed);
+}
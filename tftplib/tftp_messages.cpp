@@ -1,6 +1,8 @@
 ﻿#include "pch.h"
 
 #include "tftp_messages.h"
+#include <cctype>
+#include <cstdio>
 
 namespace tftplib {
 
@@ -53,28 +55,15 @@ namespace tftplib {
 			return nullptr;
 		}
 
-		const char* errorMessage = customErrorMessage;
-		if (errorMessage == nullptr) {
-			uint8_t* bytes = (uint8_t*)&errorCode;
-			uint8_t index = bytes[1];
-			errorMessage = DefaultErrorMessages[index];
-		}
-
-		if (errorMessage == nullptr) {
-			errorMessage = "";
-		}
-
-		size_t errorLen = strlen(errorMessage);
-		size_t messageLength = sizeof(MessageError) + errorLen;
-		MessageError* message = (MessageError*)allocator(messageLength);
+		size_t messageLength = sizeof(MessageError)
+			+ strlen(messageFor(errorCode, customErrorMessage));
+		void* message = allocator(messageLength);
 		if (message == nullptr) {
 			return nullptr;
 		}
 
-		message->opcode = OpCode::ERROR;
-		message->errorCode = errorCode;
-		strcpy_s(message->errorMessage, errorLen + 1, errorMessage);
-		return message;
+		encode(message, messageLength, errorCode, customErrorMessage);
+		return (MessageError*)message;
 	}
 
 	MessageError* 
@@ -94,24 +83,44 @@ namespace tftplib {
 			return nullptr;
 		}
 
-		size_t filenameLength = strlen(filename);
-		size_t modeLength = strlen(mode::NETASCII);
-		size_t messageLength = sizeof(MessageRequest)
-			+ filenameLength + 1
-			+ modeLength + 1;
+		const char* modeStr = mode::ModeStrings[static_cast<uint8_t>(mode)];
+		size_t messageLength = sizeof(OpCode)
+			+ strlen(filename) + 1
+			+ strlen(modeStr) + 1;
 
-		MessageRequest* message = (MessageRequest*)allocator(messageLength);
+		void* message = allocator(messageLength);
 		if( message == nullptr) {
 			return nullptr;
 		}
 
-		message->opcode = opCode;
-		strcpy_s(message->filenameAndMode, filenameLength + 1, filename);
+		encode(message, messageLength, opCode, filename, mode);
+		return (MessageRequest*)message;
+	}
+
+	size_t MessageRequest::encode(void* buf, size_t capacity, OpCode opCode,
+		const char* filename, mode::Mode mode)
+	{
+		if (mode == mode::Mode::UNDEFINED || mode > mode::Mode::LAST) {
+			return 0;
+		}
 
-		char* modePtr = message->filenameAndMode + filenameLength + 1;
 		const char* modeStr = mode::ModeStrings[static_cast<uint8_t>(mode)];
-		strcpy_s(modePtr, modeLength + 1, modeStr);
-		return message;
+		size_t filenameLength = strlen(filename);
+		size_t modeLength = strlen(modeStr);
+		size_t messageLength = sizeof(OpCode)
+			+ filenameLength + 1
+			+ modeLength + 1;
+
+		if (capacity < messageLength) {
+			return 0;
+		}
+
+		uint8_t* bytes = static_cast<uint8_t*>(buf);
+		PutCode(bytes, opCode);
+		memcpy(bytes + sizeof(OpCode), filename, filenameLength + 1);
+		memcpy(bytes + sizeof(OpCode) + filenameLength + 1,
+			modeStr, modeLength + 1);
+		return messageLength;
 	}
 
 	MessageRequest* MessageRequest::createReadRequest(const char* filename,
@@ -162,6 +171,85 @@ namespace tftplib {
 		return mode::StrToEnum(getModeStrS(messageSz));
 	}
 
+	size_t MessageRequest::getOptionsS(uint16_t messageSz,
+		RequestOption* out, size_t capacity) const
+	{
+		const char* modeStr = getModeStrS(messageSz);
+		if (modeStr == nullptr) {
+			return 0;
+		}
+
+		const char* end = reinterpret_cast<const char*>(this) + messageSz;
+		const char* cursor = modeStr + strlen(modeStr) + 1;
+
+		size_t count = 0;
+		while (count < capacity && cursor < end) {
+			const char* name = cursor;
+			const char* nameEnd = static_cast<const char*>(
+				memchr(name, '\0', end - name));
+			if (nameEnd == nullptr || nameEnd + 1 >= end) {
+				break;
+			}
+
+			const char* value = nameEnd + 1;
+			const char* valueEnd = static_cast<const char*>(
+				memchr(value, '\0', end - value));
+			if (valueEnd == nullptr) {
+				break;
+			}
+
+			out[count++] = RequestOption{ name, value };
+			cursor = valueEnd + 1;
+		}
+
+		return count;
+	}
+
+	bool options::Matches(const char* name, const char* option) {
+		for (; *name && *option; ++name, ++option) {
+			if (tolower(static_cast<unsigned char>(*name)) != *option) {
+				return false;
+			}
+		}
+
+		return *name == *option;
+	}
+
+	size_t MessageOack::encode(void* buf, size_t capacity,
+		const OptionValue* options, size_t count)
+	{
+		if (capacity < sizeof(OpCode)) {
+			return 0;
+		}
+
+		uint8_t* bytes = static_cast<uint8_t*>(buf);
+		PutCode(bytes, OpCode::OACK);
+		size_t size = sizeof(OpCode);
+
+		char number[24];
+		for (size_t i = 0; i < count; i++) {
+			size_t nameLength = strlen(options[i].name) + 1;
+			const char* value = options[i].text;
+			if (value == nullptr) {
+				snprintf(number, sizeof(number), "%llu",
+					static_cast<unsigned long long>(options[i].value));
+				value = number;
+			}
+			size_t valueLength = strlen(value) + 1;
+
+			if (size + nameLength + valueLength > capacity) {
+				return 0;
+			}
+
+			memcpy(bytes + size, options[i].name, nameLength);
+			size += nameLength;
+			memcpy(bytes + size, value, valueLength);
+			size += valueLength;
+		}
+
+		return size;
+	}
+
 	size_t MessageRequest::Size() const {
 		return sizeof(MessageRequest) + strlen(filenameAndMode)
 			+ strlen(getModeStr());
@@ -178,17 +266,14 @@ namespace tftplib {
 		uint16_t blockSize,
 		std::function<void* (size_t)> allocator)
 	{
-		size_t messageLength = sizeof(MessageData) - 1 + blockSize;
-		MessageData* message = (MessageData*)allocator(messageLength);
+		size_t messageLength = size_t{ HeaderSize() } + blockSize;
+		void* message = allocator(messageLength);
 		if (message == nullptr) {
 			return nullptr;
 		}
-		message->opcode = OpCode::DATA;
 
-		uint8_t* bytes = (uint8_t*)&message->blockNumber;
-		bytes[1] = (number >> 0) & 0xFF;
-		bytes[0] = (number >> 8) & 0xFF;
-		return message;
+		encode(message, messageLength, number, blockSize);
+		return (MessageData*)message;
 	}
 
 	uint16_t MessageData::getBlockNumber() const
@@ -200,18 +285,13 @@ namespace tftplib {
 	MessageAck* MessageAck::create(uint16_t number,
 		std::function<void* (size_t)> allocator)
 	{
-		size_t messageLength = sizeof(MessageAck);
-		MessageAck* message = (MessageAck*)allocator(messageLength);
+		void* message = allocator(EncodedSize);
 		if (message == nullptr) {
 			return nullptr;
 		}
 
-		message->opcode = OpCode::ACK;
-		uint8_t* bytes = (uint8_t*)&message->blockNumber;
-		bytes[1] = (number >> 0) & 0xFF;
-		bytes[0] = (number >> 8) & 0xFF;
-
-		return message;
+		encode(message, EncodedSize, number);
+		return (MessageAck*)message;
 	}
 
 	MessageAck* MessageAck::createFor(MessageData* og,
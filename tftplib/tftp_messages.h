@@ -1,6 +1,8 @@
 ﻿#pragma once
 
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
 #include <bit>
 #include <functional>
 
@@ -12,6 +14,32 @@ namespace tftplib
 	namespace defaults {
 		const uint16_t ServerPort = 69;	// Default TFTP port
 		const uint16_t BlockSize = 512;
+		const uint16_t WindowSize = 1;	// Lock-step, RFC 1350
+		const uint16_t MaxWindowSize = 64;
+	};
+
+	// Option names (RFC 2347), matched without regard to case.
+	namespace options {
+		inline constexpr const char* TransferSize = "tsize";		// RFC 2349
+		inline constexpr const char* Timeout = "timeout";			// RFC 2349
+		inline constexpr const char* WindowSize = "windowsize";	// RFC 7440
+		inline constexpr const char* Multicast = "multicast";		// RFC 2090
+
+		bool Matches(const char* name, const char* option);
+	};
+
+	// An option of a request, pointing into the request itself.
+	struct RequestOption {
+		const char* name;
+		const char* value;
+	};
+
+	// An option the server acknowledges, value in decimal unless text
+	// is given.
+	struct OptionValue {
+		const char* name;
+		uint64_t value;
+		const char* text{ nullptr };
 	};
 
 	enum class OpCode : uint16_t {
@@ -78,6 +106,19 @@ namespace tftplib
 		"No such user"							// NO_SUCH_USER
 	};
 
+	// Network order helpers for the encoders.
+	inline void PutU16(void* at, uint16_t value) {
+		uint8_t* bytes = static_cast<uint8_t*>(at);
+		bytes[0] = (value >> 8) & 0xFF;
+		bytes[1] = (value >> 0) & 0xFF;
+	}
+
+	// OpCode and ErrorCode values are already in network order.
+	template <typename E>
+	inline void PutCode(void* at, E code) {
+		memcpy(at, &code, sizeof(E));
+	}
+
 #pragma pack (push, 1)
 
 	class MessageHeader {
@@ -103,6 +144,10 @@ namespace tftplib
 			const char* customErrorMessage,
 			std::function<void* (size_t)> allocator );
 
+		// Encode into buf. Returns the message size, 0 if it doesn't fit.
+		static size_t encode(void* buf, size_t capacity, ErrorCode errorCode,
+			const char* customErrorMessage = nullptr);
+
 		OpCode getMessageCode() const {
 			return opcode;
 		}
@@ -118,6 +163,19 @@ namespace tftplib
 		size_t Size() const {
 			return sizeof(MessageError) + strlen(errorMessage);
 		}
+
+	private:
+		// Custom message, else the default one for errorCode.
+		static const char* messageFor(ErrorCode errorCode,
+			const char* customErrorMessage) {
+			if (customErrorMessage != nullptr) {
+				return customErrorMessage;
+			}
+
+			const char* message = DefaultErrorMessages[
+				reinterpret_cast<const uint8_t*>(&errorCode)[1]];
+			return message != nullptr ? message : "";
+		}
 	};
 
 	class MessageRequest {
@@ -138,6 +196,11 @@ namespace tftplib
 			mode::Mode mode,
 			std::function<void* (size_t)> allocator);
 
+		// Encode a RRQ or WRQ into buf.
+		//	Returns the message size, 0 if it doesn't fit or is invalid.
+		static size_t encode(void* buf, size_t capacity, OpCode opCode,
+			const char* filename, mode::Mode mode);
+
 		OpCode getMessageCode() const {
 			return opcode;
 		}
@@ -161,6 +224,12 @@ namespace tftplib
 
 		mode::Mode getModeS(uint16_t messageSz) const;
 
+		// Options following the mode, up to capacity of them. Stops at
+		// the first pair not terminated within messageSz. Returns the
+		// number written to out.
+		size_t getOptionsS(uint16_t messageSz, RequestOption* out,
+			size_t capacity) const;
+
 		// Return the buffer size required to acommodate this request.
 		size_t Size() const;
 
@@ -186,6 +255,11 @@ namespace tftplib
 			uint16_t blockSize,
 			std::function<void* (size_t)> allocator);
 
+		// Encode the header into buf, leaving room for blockSize bytes
+		// of data. Returns header + blockSize, 0 if it doesn't fit.
+		static size_t encode(void* buf, size_t capacity,
+			uint16_t number, uint16_t blockSize);
+
 		uint16_t getBlockNumber() const ;
 
 		const char* getData() const {
@@ -196,7 +270,7 @@ namespace tftplib
 			return data;
 		}
 
-		static uint16_t HeaderSize() { 
+		static constexpr uint16_t HeaderSize() { 
 			return sizeof(OpCode) + sizeof(uint16_t); 
 		}
 	};
@@ -212,6 +286,12 @@ namespace tftplib
 		static MessageAck* createFor(MessageData* og,
 			std::function<void* (size_t)> allocator);
 
+		static constexpr size_t EncodedSize =
+			sizeof(OpCode) + sizeof(uint16_t);
+
+		// Encode into buf. Returns EncodedSize, 0 if it doesn't fit.
+		static size_t encode(void* buf, size_t capacity, uint16_t number);
+
 		uint16_t getBlockNumber() const;
 
 		size_t Size() const {
@@ -219,6 +299,77 @@ namespace tftplib
 		}
 	};
 
+	class MessageOack {
+		OpCode opcode;
+		char options[2];
+
+	public:
+		// Encode an OACK carrying count options into buf.
+		//	Returns the message size, 0 if it doesn't fit.
+		static size_t encode(void* buf, size_t capacity,
+			const OptionValue* options, size_t count);
+	};
+
 #pragma pack (pop)
 
+	// **********************************************************************
+	// Typed encoders.
+	//	encode<T>(buf, capacity, args...) writes a T straight into buf,
+	//	typically a DatagramAssembly data buffer, and returns its size in
+	//	bytes, 0 when it doesn't fit. Fixed size messages compile down to
+	//	a bound check and a few stores.
+	// **********************************************************************
+	template <typename T, typename... Args>
+	inline size_t encode(void* buf, size_t capacity, Args... args) {
+		return T::encode(buf, capacity, args...);
+	}
+
+	inline size_t MessageAck::encode(void* buf, size_t capacity,
+		uint16_t number)
+	{
+		if (capacity < EncodedSize) {
+			return 0;
+		}
+
+		uint8_t* bytes = static_cast<uint8_t*>(buf);
+		PutCode(bytes, OpCode::ACK);
+		PutU16(bytes + sizeof(OpCode), number);
+		return EncodedSize;
+	}
+
+	inline size_t MessageData::encode(void* buf, size_t capacity,
+		uint16_t number, uint16_t blockSize)
+	{
+		size_t messageLength = size_t{ HeaderSize() } + blockSize;
+		if (capacity < messageLength) {
+			return 0;
+		}
+
+		uint8_t* bytes = static_cast<uint8_t*>(buf);
+		PutCode(bytes, OpCode::DATA);
+		PutU16(bytes + sizeof(OpCode), number);
+		return messageLength;
+	}
+
+	inline size_t MessageError::encode(void* buf, size_t capacity,
+		ErrorCode errorCode, const char* customErrorMessage)
+	{
+		if (errorCode > ErrorCode::LAST) {
+			return 0;
+		}
+
+		const char* errorMessage = messageFor(errorCode, customErrorMessage);
+		size_t errorLen = strlen(errorMessage);
+		size_t messageLength = sizeof(MessageError) + errorLen;
+		if (capacity < messageLength) {
+			return 0;
+		}
+
+		uint8_t* bytes = static_cast<uint8_t*>(buf);
+		PutCode(bytes, OpCode::ERROR);
+		PutCode(bytes + sizeof(OpCode), errorCode);
+		memcpy(bytes + sizeof(OpCode) + sizeof(ErrorCode),
+			errorMessage, errorLen + 1);
+		return messageLength;
+	}
 }
\ No newline at end of file